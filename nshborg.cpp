@@ -32,9 +32,43 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* Some GCC versions warn about the undefined vectors used inside the AVX-512 intrinsics */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#define NSHBORG_SIMD_X86
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define NSHBORG_IO_URING
+#endif
+#endif
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 #define MAX_BUFFER 1048576 /* 1 MB */
 #define MAX_PATH      2048
@@ -42,9 +76,813 @@
 #define READ 0
 #define WRITE 1
 
+#define TAR_BLOCK_SIZE       512
+#define TAR_USTAR_MAX_SIZE   077777777777ULL /* 8 GB - 1 */
+#define TAR_TYPE_FILE        '0'
+#define TAR_TYPE_PAX         'x'
+#define TAR_SPARSE_DIR       "GNUSparseFile.0"
+#define TAR_MANIFEST_NAME    ".nshborg/manifest"
+
+#define SPOOL_FILE_PREFIX    "nshborg-spool-"
+
+#define MAX_BORG_STREAMS     16
+#define ROUTING_HASH         0
+#define ROUTING_SIZE         1
+
+#define NSF_HEADER_SIZE      4096
+
+#define PREFETCH_MAX_FILES   64
+
+#define SHARD_LOCK_WAIT      "86400"
+
+#define NLO_INDEX_MAGIC      "NSHNLO01"
+#define NLO_MAX_ARCHIVS      65535
+#define NLO_BLOOM_HASHES     7
+
+#define JOURNAL_HEADER       "# archive: "
+#define JOURNAL_SYNC_MSEC    1000
+
+#define RATE_LIMIT_MAX_RULES 16
+#define RATE_CHECK_MSEC      1000
+#define THROTTLE_REPORT_MSEC 60000
+
+/* From linux/ioprio.h, which is not available everywhere */
+#define IOPRIO_CLASS_RT      1
+#define IOPRIO_CLASS_BE      2
+#define IOPRIO_CLASS_IDLE    3
+#define IOPRIO_CLASS_SHIFT   13
+#define IOPRIO_WHO_PROCESS   1
+
+#define PROBE_TYPE_NSF       0
+#define PROBE_TYPE_BOX       1
+#define PROBE_TYPE_NLO       2
+#define PROBE_TYPE_OTHER     3
+#define PROBE_TYPE_COUNT     4
+#define PROBE_BLOCK_SIZE     MAX_BUFFER
+#define PROBE_MAX_DEPTH      32
+#define PROBE_AUTO_RATIO     0.97 /* borg auto stores data uncompressed, which lz4 does not shrink below this */
+
+#define CHUNKER_BUZHASH      0
+#define CHUNKER_FIXED        1
+#define CHUNKER_MAX_CANDIDATES 16
+#define CHUNKER_MAX_SIZE     (64*MAX_BUFFER)
+#define CHUNKER_DEFAULT      "buzhash,19,23,21,4095"
+
+#define SKETCH_MAX_SAMPLES   4096
+#define SKETCH_MAX_WINDOW    16384
+#define SKETCH_MAX_DAYS      60
+#define SKETCH_RATE_HEADER   "# rate: "
+
+#define SOCK_MAX_CLIENTS     64
+#define SOCK_LINE_SIZE       (MAX_PATH+80)
+
+#define TAR_MODE_NATIVE      0
+#define TAR_MODE_EXTERNAL    1
+
+/* ustar header block (POSIX.1-1988) */
+typedef struct
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TAR_HEADER;
+
+#define RING_ALIGNMENT       4096
+
+typedef ssize_t (*RING_READ_FN)  (void *pCtx, unsigned char *pBuffer, size_t BufferSize);
+typedef int     (*RING_WRITE_FN) (void *pCtx, const unsigned char *pBuffer, size_t BufferSize);
+
+typedef struct
+{
+    unsigned char *pData;
+    size_t        Len;
+} RING_SLOT;
+
+/* Bounded single producer/single consumer ring. Head is only written by the reader, Tail only by the writer */
+typedef struct
+{
+    RING_SLOT *pSlots;
+    size_t    SlotCount;
+    size_t    SlotSize;
+    size_t    Head;
+    size_t    Tail;
+    int       bDone;
+    int       bAbort;
+} RING_BUFFER;
+
+typedef struct
+{
+    size_t BytesWritten;
+    long   Slots;       /* Slots passed through the ring */
+    long   FillSum;     /* Sum of the fill level in slots, sampled each time the writer takes a slot */
+    long   FullWaits;   /* Reader found the ring full: writer side is the bottleneck */
+    long   EmptyWaits;  /* Writer found the ring empty: reader side is the bottleneck */
+} RING_STATS;
+
+#define IO_ENGINE_PREAD      0
+#define IO_ENGINE_MMAP       1
+#define IO_ENGINE_DIRECT     2
+#define IO_ENGINE_IO_URING   3
+#define IO_ENGINE_COUNT      4
+
+#define IO_ALIGNMENT         4096
+#define IO_URING_MAX_DEPTH   64
+
+#ifdef NSHBORG_IO_URING
+typedef struct
+{
+    int      RingFD;
+    unsigned Entries;
+    void     *pSqRing;
+    void     *pCqRing;
+    size_t   SqRingSize;
+    size_t   CqRingSize;
+    size_t   SqesSize;
+    unsigned *pSqTail;
+    unsigned *pSqMask;
+    unsigned *pSqArray;
+    unsigned *pCqHead;
+    unsigned *pCqTail;
+    unsigned *pCqMask;
+    struct io_uring_sqe *pSqes;
+    struct io_uring_cqe *pCqes;
+} IO_URING;
+#endif
+
+/* File opened for one of the I/O engines */
+typedef struct
+{
+    int    FD;
+    int    Engine;
+    bool   bWrite;
+    off_t  Offset;
+    size_t FileSize;
+    unsigned char *pMap;     /* mmap engine */
+    unsigned char *pStage;   /* Aligned staging buffer for O_DIRECT writes */
+    size_t StageSize;
+    size_t StageLen;
+    bool   bSparse;          /* Write: zero blocks are skipped and become holes */
+    size_t BytesHoles;       /* Write: bytes skipped */
+#ifdef NSHBORG_IO_URING
+    IO_URING Uring;
+#endif
+} IO_FILE;
+
+/* Data region of a file. Everything between two extents is a hole */
+typedef struct
+{
+    off_t  Offset;
+    size_t Length;
+} SPARSE_EXTENT;
+
+typedef struct
+{
+    SPARSE_EXTENT *pExtents;
+    size_t Count;
+    size_t Alloc;
+    size_t FileSize;   /* Logical size including holes */
+    size_t DataSize;   /* Sum of all extents */
+} SPARSE_MAP;
+
+/* Page cache handling for one file read by the backup */
+typedef struct
+{
+    bool   bActive;
+    bool   bReadAhead;
+    int    FD;
+    unsigned char *pMap;       /* Mapping of the mmap engine */
+    size_t FileSize;
+    size_t PageSize;
+    size_t Window;             /* Read ahead window */
+    off_t  CheckedEnd;         /* Residency recorded up to this offset */
+    size_t ReleasedPages;      /* Pages handled after streaming */
+    unsigned char *pResident;  /* One bit per page cached before the backup read it */
+    unsigned char *pVec;       /* mincore() result for one window */
+    const SPARSE_MAP *pSparse; /* Data extents, pages in holes are skipped */
+    size_t Extent;             /* Extent of the page released last */
+    long   PagesDropped;
+    long   PagesPreserved;
+} PAGE_CACHE;
+
+#define HASH_TYPE_NONE       0
+#define HASH_TYPE_XXH3       1
+
+#define HASH_IMPL_SCALAR     0
+#define HASH_IMPL_AVX2       1
+#define HASH_IMPL_AVX512     2
+#define HASH_IMPL_COUNT      3
+
+#define XXH3_SECRET_SIZE     192
+#define XXH3_STRIPE_LEN      64
+#define XXH3_ACC_NB          8
+#define XXH3_BUFFER_SIZE     256
+#define XXH3_MIDSIZE_MAX     240
+
+/* Streaming XXH3 state for the data of one file */
+typedef struct
+{
+    int      Type;
+    uint64_t Acc[XXH3_ACC_NB];
+    unsigned char Buffer[XXH3_BUFFER_SIZE];
+    size_t   Buffered;
+    size_t   StripesInBlock;
+    unsigned long long TotalLen;
+    long long Nsec;         /* Time spent hashing */
+} HASH_STATE;
+
+/* Result of streaming one file into the backup stream */
+typedef struct
+{
+    size_t BytesTotal;  /* Bytes written to the stream including tar headers */
+    size_t BytesData;   /* File data bytes */
+    size_t BytesLogical; /* File size including holes not read */
+    size_t BytesSpliced; /* Bytes moved with splice() without passing user space */
+    RING_STATS Ring;
+    int    Engine;      /* I/O engine used for reading */
+    long   PagesDropped;    /* Pages removed from the file cache after streaming */
+    long   PagesPreserved;  /* Pages left in the file cache, because they were cached before */
+    int    HashType;
+    uint64_t Hash;          /* Hash of the logical file content as stored in the archive */
+    long long HashNsec;
+    bool   bSketch;
+    size_t SketchNewBytes;  /* Data not found in the sketch of the last backup */
+    long long LimitNsec;    /* Time waited for the rate limit. Not part of the I/O time */
+    int    Stream;          /* Borg stream with parallel repositories */
+    size_t FileSize;        /* Size and modification time of the file at backup time */
+    time_t FileMtime;
+    time_t tStart;
+    time_t tEnd;
+} BACKUP_STATS;
+
+/* One backed up file in the archive manifest */
+typedef struct
+{
+    char     *pszFileName;
+    int      Status;        /* 0 = OK */
+    size_t   FileSize;
+    time_t   FileMtime;
+    size_t   BytesTotal;
+    time_t   tStart;
+    time_t   tEnd;
+    time_t   tRequest;      /* Request file written. The database is in backup mode from here */
+    time_t   tAck;          /* Request file removed. Domino ends backup mode */
+    int      HashType;
+    uint64_t Hash;
+    const char *pszRepo;    /* Repository the database is stored in */
+    char     *pszRef;       /* Archive name holding the database. NULL if streamed into this archive */
+    bool     bRef;          /* Unchanged database of an earlier backup */
+} MANIFEST_ENTRY;
+
+typedef struct
+{
+    MANIFEST_ENTRY *pEntries;
+    size_t Count;
+    size_t Alloc;
+    size_t Pending;         /* First entry of the request file not acknowledged yet */
+    time_t tStart;
+} MANIFEST;
+
+/* Identity of a database file. A database with the same identity as in its last full backup is not streamed again */
+typedef struct
+{
+    unsigned long long Inode;
+    size_t   Size;
+    long long MtimeNsec;
+    long long CtimeNsec;
+    uint64_t HeaderHash;    /* XXH3 of the database header, which holds the replica ID and the database instance ID */
+} FILE_ID;
+
+/* Last full backup of one database */
+typedef struct
+{
+    char     *pszFileName;
+    FILE_ID  Id;
+    int      HashType;
+    uint64_t Hash;
+    time_t   tBackup;
+    char     *pszRepo;
+    char     *pszArchivName; /* Archive name without the repository */
+} STATE_ENTRY;
+
+typedef struct
+{
+    STATE_ENTRY *pEntries;
+    size_t Count;
+    size_t Alloc;
+    size_t Sorted;          /* Loaded entries are sorted by name. Databases new in this backup follow unsorted */
+    long   Updated;
+} STATE;
+
+/* Append-only journal of the files completed by the running backup. Lines have the format of the state file and are synced one by one.
+   Files completed by an interrupted backup are referenced by the next backup instead of being streamed again */
+typedef struct
+{
+    int    FD;
+    STATE  Done;            /* Files completed by the interrupted backup, which are in its archives */
+    long   Resumed;
+    time_t tSync;
+    char   szArchiv[MAX_PATH+1];    /* Archive of the interrupted backup */
+} JOURNAL;
+
+/* Archive holding NLOs of the index */
+typedef struct
+{
+    char     *pszArchiv;    /* Repository and archive name */
+    time_t   tBackup;
+} NLO_ARCHIV;
+
+/* DAOS NLOs already archived. NLO names are content hashes, so an NLO with a known name never needs to be read again.
+   Hash set of the name hashes with linear probing. The Bloom filter answers most lookups of new NLOs without touching the table */
+typedef struct
+{
+    uint64_t *pKeys;        /* 0 marks a free slot */
+    uint16_t *pArchivs;     /* Archive of each key */
+    size_t   Capacity;      /* Power of 2 */
+    size_t   Count;
+    uint64_t *pBloom;
+    size_t   BloomBits;     /* Power of 2 */
+    NLO_ARCHIV *pArchivTable;
+    size_t   ArchivCount;
+    long     Skipped;
+    long     Added;
+    long     Lookups;
+    long long LookupNsec;
+} NLO_INDEX;
+
+/* Result of a database streamed directly. Set by the stream thread under the spool mutex */
+typedef struct
+{
+    bool     bDone;
+    bool     bSpooled;      /* Set by SpoolAdd. The spool copy is streamed */
+    int      ret;
+    size_t   Bytes;
+} SPOOL_DONE;
+
+/* Database queued for a borg stream. Spooled databases are read from the spool copy */
+typedef struct SPOOL_ENTRY
+{
+    struct SPOOL_ENTRY *pNext;
+    char   *pszFileName;    /* Database name stored in the archive */
+    int    FD;              /* Unlinked spool copy. -1 streams the database itself */
+    size_t Size;            /* Bytes held in the spool */
+    size_t QueueBytes;      /* Database size counted for routing */
+    size_t ManifestIndex;
+    bool   bDirect;         /* The database itself is streamed and stays in backup mode */
+    SPOOL_DONE *pDone;      /* Completion of a socket request streamed directly */
+    FILE_ID Id;             /* Recorded in the incremental state when streamed successfully */
+    bool   bId;
+} SPOOL_ENTRY;
+
+struct SPOOL;
+struct TEE;
+
+/* Borg process of one archive part */
+typedef struct BORG_PART
+{
+    struct BORG_PART *pNext;
+    char     szArchiv[MAX_PATH+1];
+    pid_t    pid;
+    int      InputFD;
+    int      OutputFD;
+    int      ErrorFD;
+    size_t   Bytes;
+    long     Files;
+    size_t   ManifestFirst; /* Manifest entries of the files in this part */
+    size_t   ManifestEnd;
+} BORG_PART;
+
+/* One borg import-tar process and the thread feeding it */
+typedef struct
+{
+    struct SPOOL *pSpool;
+    int      Index;
+    char     szRepo[MAX_PATH+1];
+    char     szArchiv[MAX_PATH+1];
+    pid_t    pid;
+    int      InputFD;
+    int      OutputFD;
+    int      ErrorFD;
+    int      WriteFD;       /* Tar stream is written here. The tee pipe in tee mode */
+    struct TEE *pTee;
+    pthread_t Thread;
+    bool     bThread;
+    SPOOL_ENTRY *pHead;
+    SPOOL_ENTRY *pTail;
+    size_t   QueuedBytes;   /* Databases queued or streaming. Used for routing by size */
+    int      Part;          /* Archive part receiving data. Part 0 is the archive specified */
+    size_t   PartBytes;
+    long     PartFiles;
+    size_t   PartFirst;     /* Manifest index of the first file of the part */
+    time_t   tPartFirst;    /* Request time of the first file of the part */
+    char     szBaseArchiv[MAX_PATH+1];
+    BORG_PART Spare;        /* Borg process started ahead for the next part. Waits for the repository lock. Not used in translog mode */
+    BORG_PART *pParts;      /* Completed parts. Their output is logged when the backup ends */
+    long     CountOK;
+    long     CountErr;
+    size_t   BytesTotal;
+    time_t   BusyMsec;
+} BORG_STREAM;
+
+typedef struct SPOOL
+{
+    pthread_mutex_t Mutex;  /* Protects the queues, the counters and the manifest */
+    pthread_cond_t  Cond;
+    bool     bSpool;        /* Databases are copied into the spool directory */
+    bool     bThreads;      /* Streams are fed by their own threads */
+    bool     bStop;
+    bool     bShard;        /* Archives are split into parts */
+    MANIFEST *pManifest;
+    STATE    *pState;
+    NLO_INDEX *pNloIndex;
+    JOURNAL  *pJournal;
+    size_t   Bytes;         /* Spooled bytes not streamed yet */
+    size_t   Files;
+    long     Reflinked;
+    long     Copied;
+    long     Direct;
+    long     DirectPending; /* Databases streamed directly, which are still in backup mode */
+    time_t   WaitMsec;      /* Time requests waited for spool space */
+    int      StreamCount;
+    BORG_STREAM Streams[MAX_BORG_STREAMS+1];   /* The tee destination follows the streams */
+} SPOOL;
+
+/* Commits and latency of archived transaction log extents */
+typedef struct
+{
+    long     Commits;
+    long     Files;
+    long     Failed;
+    long     Unknown;       /* Extents of parts whose borg exit status is unknown. Not known to be committed */
+    time_t   LatencySum;    /* Request to commit of the archive holding the extent */
+    time_t   LatencyMax;
+} TRANSLOG;
+
+/* Bounded buffer of one tee destination. A slow destination only stalls the backup when its buffer is full */
+typedef struct
+{
+    struct TEE  *pTee;
+    BORG_STREAM *pStream;
+    const char  *pszName;
+    unsigned char *pBuffer;
+    size_t   Size;
+    unsigned long long In;  /* Bytes added to the buffer */
+    unsigned long long Out; /* Bytes written to borg */
+    size_t   MaxLag;
+    time_t   StallMsec;     /* Time the reader waited for room in this buffer */
+    time_t   tLast;         /* Last write to borg */
+    pthread_t Thread;
+    bool     bThread;
+    bool     bFailed;
+} TEE_DEST;
+
+/* Reads the tar stream once from a pipe and feeds a primary and a secondary borg process */
+typedef struct TEE
+{
+    pthread_mutex_t Mutex;
+    pthread_cond_t  Cond;
+    int      PipeFD[2];
+    pthread_t Thread;
+    bool     bThread;
+    bool     bEOF;
+    time_t   tStart;
+    TEE_DEST Dest[2];
+} TEE;
+
+/* Database read ahead for one line of the list */
+typedef struct
+{
+    int      FD;            /* Open files keep inode and metadata cached until they are streamed */
+    unsigned long long Line;
+    dev_t    Dev;
+    ino_t    Inode;
+    size_t   HeadSize;      /* Bytes read ahead from the start of the database */
+    unsigned char *pResident;  /* One bit per page of the head cached before it was read ahead */
+} PREFETCH_SLOT;
+
+/* Line of a request file queued for read ahead */
+typedef struct PREFETCH_NAME
+{
+    struct PREFETCH_NAME *pNext;
+    char     *pszFileName;
+} PREFETCH_NAME;
+
+/* Reads the head of the next databases of a file list or request file into the file cache while the current one streams */
+typedef struct
+{
+    pthread_mutex_t Mutex;
+    pthread_cond_t  Cond;
+    pthread_t Thread;
+    bool     bThread;
+    bool     bStop;
+    FILE     *fpList;       /* Own handle of the file list. Without a list the daemon queues the lines of each request file */
+    PREFETCH_NAME *pHead;
+    PREFETCH_NAME *pTail;
+    NLO_INDEX *pNloIndex;   /* NLOs already archived are skipped by the backup and not read ahead */
+    pthread_mutex_t *pIndexMutex;
+    int      Depth;         /* Databases read ahead plus the database streaming */
+    size_t   MaxBytes;      /* Heads read ahead and not streamed yet */
+    size_t   Bytes;
+    PREFETCH_SLOT Slots[PREFETCH_MAX_FILES+1];
+    unsigned long long Opened;    /* Lines prefetched */
+    unsigned long long Started;   /* Lines the backup started */
+    long     Files;
+    size_t   ReadBytes;
+    time_t   OpenMsec;
+    long     Hits;          /* Head completely cached when the database was streamed */
+    long     Partial;
+    long     Cold;
+    long     Late;          /* Reached by the backup before they were read ahead */
+} PREFETCH;
+
+/* Rate of the backup stream for a time of day. Ranges may wrap around midnight */
+typedef struct
+{
+    int      Start;         /* Minutes after midnight */
+    int      End;
+    size_t   Rate;          /* Bytes per second, 0 = unlimited */
+} RATE_RULE;
+
+/* Latency of the Domino data device and I/O pressure. The backup rate adapts to them */
+typedef struct
+{
+    bool     bActive;
+    bool     bPressure;
+    char     szDevice[64+1];    /* Name in /proc/diskstats */
+    unsigned long long Ios;     /* Reads and writes completed */
+    unsigned long long IoMsec;  /* Time spent on them */
+    unsigned long long StallUsec;
+    size_t   Rate;              /* Adaptive rate, 0 = not limited */
+    size_t   MinRate;           /* Lowest rate set */
+    size_t   Bytes;             /* Bytes read for borg since the last sample */
+    long     Decreases;
+    long     Samples;
+    double   AwaitSum;
+    double   AwaitMax;
+    double   PressureSum;
+    double   PressureMax;
+    long     ReportSamples;
+    double   ReportAwaitSum;
+    double   ReportAwaitMax;
+    double   ReportPressureSum;
+    time_t   tReport;
+} THROTTLE;
+
+/* Token bucket shared by all threads reading data for borg */
+typedef struct
+{
+    pthread_mutex_t Mutex;
+    size_t   Rate;          /* Current rate in bytes per second, 0 = unlimited */
+    size_t   Cap;           /* Rate of the schedule or the override. The throttle can only lower it */
+    bool     bOverride;     /* Rate set at run-time with -ratelimit */
+    double   Tokens;        /* Negative after a read took more than the bucket had. The reader sleeps off the debt */
+    long long tRefill;      /* Monotonic nsec */
+    time_t   tCheck;
+    long long tOverride;    /* Modification time of the override file in nsec */
+    long long WaitNsec;
+    long     Changes;
+    int      RuleCount;
+    RATE_RULE Rules[RATE_LIMIT_MAX_RULES];
+    THROTTLE Throttle;
+} RATE_LIMIT;
+
+/* Priority, CPUs and cgroup of tar and borg processes. Applied in the child before execv */
+typedef struct
+{
+    int      IoClass;       /* IOPRIO_CLASS_*, 0 = unchanged */
+    int      IoLevel;
+    bool     bNice;
+    int      Nice;
+    bool     bCpus;
+    cpu_set_t Cpus;
+    char     szCpus[256+1];
+    char     szCpuMax[64+1];    /* cpu.max like "200000 100000" */
+    char     szIoMax[256+1];    /* io.max like "8:0 rbps=104857600" */
+    char     szCgroupProcs[MAX_PATH+40];  /* cgroup.procs of the profile. Empty = not moved */
+} CHILD_PROFILE;
+
+/* borg --compression spec and the command line tool with the same algorithm, which the probe runs on the sample */
+typedef struct
+{
+    const char *pszSpec;
+    const char *pszTool;
+    const char *pszLevel;
+} PROBE_SPEC;
+
+typedef struct
+{
+    char     *pszName;
+    size_t   Size;
+    int      Type;          /* PROBE_TYPE_* */
+} PROBE_FILE;
+
+typedef struct
+{
+    PROBE_FILE *pFiles;
+    size_t   Count;
+    size_t   Alloc;
+    size_t   TotalBytes;
+} PROBE_FILES;
+
+/* Blocks sampled from all files of one type */
+typedef struct
+{
+    unsigned char *pData;
+    size_t   Size;
+    size_t   Alloc;
+    long     Files;
+    size_t   FileBytes;
+} PROBE_SAMPLE;
+
+typedef struct
+{
+    size_t   Compressed;
+    double   CpuSec;        /* User and system time of the tool */
+} PROBE_RESULT;
+
+/* borg --chunker-params replayed by the chunker probe */
+typedef struct
+{
+    int      Algorithm;     /* CHUNKER_BUZHASH, CHUNKER_FIXED */
+    size_t   MinSize;
+    size_t   MaxSize;
+    uint32_t Mask;
+    size_t   Window;
+    size_t   BlockSize;
+    size_t   HeaderSize;
+    char     szParams[80+1];
+} CHUNKER;
+
+/* Chunk IDs of the probe. 0 marks free slots */
+typedef struct
+{
+    uint64_t *pKeys;
+    size_t   Count;
+    size_t   Size;
+} CHUNK_SET;
+
+typedef struct
+{
+    long     Chunks;
+    long     NewChunks;
+    size_t   Bytes;
+    size_t   NewBytes;
+    long long ChunkNsec;
+} CHUNK_STATS;
+
+typedef struct
+{
+    uint64_t Fp;
+    uint32_t Len;
+} SKETCH_SAMPLE;
+
+/* Sample of the content defined chunks of a database from its last backup */
+typedef struct
+{
+    char     *pszFileName;
+    size_t   Size;
+    time_t   Mtime;
+    time_t   tBackup;
+    time_t   tPrev;         /* Backup the new data was measured against. 0 = first sketch */
+    double   NewFraction;   /* Share of the data not in the sketch of tPrev */
+    long     Chunks;
+    int      Count;
+    SKETCH_SAMPLE *pSamples;    /* Sorted by fingerprint */
+} SKETCH;
+
+typedef struct
+{
+    pthread_mutex_t Mutex;
+    SKETCH   *pSketches;
+    size_t   Count;
+    size_t   Alloc;
+    size_t   Sorted;
+    long     Updated;
+    size_t   Bytes;         /* Data read by this backup */
+    size_t   NewBytes;      /* Part of it not found in the last sketches */
+    long long BusyMsec;
+    double   Rate;          /* Bytes per second read by the last backup */
+} SKETCH_STORE;
+
+/* Chunks the data of one database while it streams. Runs in the reader thread next to the hash */
+typedef struct
+{
+    CHUNKER  Chunker;
+    size_t   Start;         /* First possible cut of a buzhash chunk */
+    uint32_t Hash;
+    size_t   ChunkLen;
+    size_t   RingPos;
+    HASH_STATE Fp;
+    long     Chunks;
+    int      Count;
+    SKETCH_SAMPLE Samples[SKETCH_MAX_SAMPLES];
+    unsigned char Ring[SKETCH_MAX_WINDOW];
+} SKETCH_BUILDER;
+
+/* Connection of a client to the request socket of the daemon */
+typedef struct
+{
+    int      FD;
+    unsigned Serial;        /* Replies of queued requests only go to the connection which sent them */
+    size_t   Len;
+    char     szLine[SOCK_LINE_SIZE+1];
+} SOCK_CLIENT;
+
+typedef struct
+{
+    int      Client;
+    unsigned Serial;
+    unsigned long Id;       /* Chosen by the client and returned with the reply */
+    time_t   tQueued;
+    time_t   tStart;
+    char     *pszFileName;
+    size_t   ManifestIndex;
+    bool     bManifest;
+    SPOOL_DONE *pDone;      /* Set by the stream of a database streamed directly */
+} SOCK_REQUEST;
+
+/* Requests of all clients are backed up in the order they arrive */
+typedef struct
+{
+    int      ListenFD;
+    unsigned Serial;
+    const char *pszArchiv;
+    char     szSocketFile[MAX_PATH+1];
+    SOCK_CLIENT  Clients[SOCK_MAX_CLIENTS];
+    SOCK_REQUEST *pQueue;
+    size_t   First;
+    size_t   Count;
+    size_t   Alloc;
+    SOCK_REQUEST Current;   /* Answered when the next request is taken */
+    bool     bCurrent;
+    SOCK_REQUEST *pFlight;  /* Streamed directly and answered when their stream is done */
+    size_t   FlightCount;
+    size_t   FlightAlloc;
+    pthread_mutex_t *pMutex; /* Spool mutex, which protects the results and the manifest */
+    MANIFEST *pManifest;
+    long     Served;
+    long     Failed;
+} SOCK_SERVER;
+
+/* Result of the current request set by the backup loop */
+typedef struct
+{
+    int      ret;
+    size_t   Bytes;
+    bool     bInFlight;
+    bool     bManifest;
+    size_t   ManifestIndex;
+    const char *pszStatus;
+    char     szError[255+1];
+} SOCK_RESULT;
+
+typedef struct
+{
+    bool     bOK;
+    size_t   Bytes;
+    long long Msec;
+    char     szText[SOCK_LINE_SIZE+1];
+} SOCK_REPLY;
+
 /* Global buffer used for all I/O */
 unsigned char  g_Buffer[MAX_BUFFER+1] = {0};
 
+/* Ring used by the reader/writer pipeline for backup and restore data. Each stream thread has its own ring */
+__thread RING_BUFFER g_Ring = {0};
+
+/* Read ahead of the running backup. The page cache of each database takes over the residency of its head */
+PREFETCH *g_pPrefetch = NULL;
+
+/* Rate limit of the running backup. Restore and benchmarks are not limited */
+RATE_LIMIT *g_pRateLimit = NULL;
+
+/* Chunk sketches updated by the running backup */
+SKETCH_STORE *g_pSketchStore = NULL;
+
+/* Serializes child process starts with the environment set for borg. Stream threads start borg for their next archive part.
+   Recursive, because borg starts include the ssh-add start. Initialized in main */
+pthread_mutex_t g_ChildMutex;
+
+/* Backup and restore processes use the backup profile. Passthru commands like compact and check have their own */
+CHILD_PROFILE g_BackupProfile   = {0};
+CHILD_PROFILE g_PassthruProfile = {0};
+CHILD_PROFILE *g_pChildProfile  = &g_BackupProfile;
+
+uint32_t g_BuzhashTable[256] = {0};
+
 char  g_szVersion[]          = "0.9.7";
 char  g_szBackupEndMarker[]  = "::BORG-BACKUP-END::";
 char  g_szSSH_AUTH_SOCK[]    = "SSH_AUTH_SOCK";
@@ -74,6 +912,24 @@ char  g_szPassphrase[256]              = {0};
 char  g_szSSHAuthSock[MAX_PATH+1]      = {0};
 char  g_szSSHKeyFile[MAX_PATH+1]       = {0};
 char  g_szSSHKey[8000]                 = {0};
+char  g_szSpoolDir[MAX_PATH+1]         = {0};
+char  g_szParallelRepos[4*MAX_PATH+1]  = {0};
+char  g_szTeeRepo[MAX_PATH+1]          = {0};
+char  g_szTranslogRepo[MAX_PATH+1]     = {0};
+char  g_szStateFile[MAX_PATH+1]        = {0};
+char  g_szNloIndexFile[MAX_PATH+1]     = {0};
+char  g_szJournalFile[MAX_PATH+1]      = {0};
+char  g_szRateFile[MAX_PATH+1]         = {0};
+char  g_szRateLimitSchedule[1024+1]    = {0};
+char  g_szThrottleDir[MAX_PATH+1]      = "/local/notesdata";
+char  g_szThrottlePressureFile[MAX_PATH+1] = "/proc/pressure/io";
+char  g_szCgroupDir[MAX_PATH+1]        = {0};
+char  g_szBorgCompression[80+1]        = {0};
+char  g_szChunkerParams[80+1]          = {0};
+char  g_szSketchFile[MAX_PATH+1]       = {0};
+char  g_szChunkerProbeCandidates[1024+1] = CHUNKER_DEFAULT " buzhash,18,23,20,4095 buzhash,17,23,19,4095 buzhash,16,23,18,4095 buzhash,20,23,22,4095 fixed,1048576 fixed,4194304";
+char  g_szProbeDir[MAX_PATH+1]         = "/local/notesdata";
+char  g_szProbeBinDir[MAX_PATH+1]      = "/usr/bin";
 
 pid_t g_SSHAgentPID         =   0;
 int   g_SSHKeyLife          =  20;
@@ -81,6 +937,44 @@ int   g_WaitTime            = 500;
 int   g_Verbose             =   0;
 int   g_BorgDeleteAllowed   =   0;
 int   g_BorgPassthruAllowed =   0;
+int   g_TarMode             = TAR_MODE_NATIVE;
+int   g_Splice              =   1;
+size_t g_PipeSize           = MAX_BUFFER;
+size_t g_RingSlots          =   8;
+size_t g_RingSlotSize       = MAX_BUFFER;
+int    g_IoEngine           = IO_ENGINE_PREAD;
+unsigned g_IoUringDepth     =   8;
+int    g_CacheDrop          =   1;
+size_t g_ReadAheadSize      = 8*MAX_BUFFER;
+int    g_Sparse             =   1;
+int    g_HashType           = HASH_TYPE_XXH3;
+int    g_Manifest           =   1;
+size_t g_SpoolMaxSize       = 10240ULL*MAX_BUFFER;
+size_t g_SpoolMaxFiles      = 256;
+int    g_Routing            = ROUTING_HASH;
+size_t g_TeeMaxLag          = 256*MAX_BUFFER;
+size_t g_ShardMaxSize       =   0;
+long   g_ShardMaxFiles      =   0;
+int    g_Incremental        =   0;
+long   g_IncrementalFullDays =  6;
+int    g_DaosDedup          =   0;
+long   g_DaosFullDays       =   6;
+int    g_Resume             =   0;
+long   g_ResumeMaxHours     =  24;
+long   g_CheckpointInterval =   0;
+long   g_TranslogCommitSec  =   5;
+int    g_PrefetchFiles      =   4;
+size_t g_PrefetchSize       = 64*MAX_BUFFER;
+size_t g_PrefetchMaxSize    = 1024*MAX_BUFFER;
+size_t g_RateLimit          =   0;
+long   g_ThrottleLatency    =   0;
+long   g_ThrottlePressure   =   0;
+size_t g_ThrottleMinRate    = 10*MAX_BUFFER;
+size_t g_ThrottleStep       = 10*MAX_BUFFER;
+size_t g_ProbeSize          = 256*MAX_BUFFER;
+int    g_Sketch             =   0;
+int    g_SketchSamples      = 256;
+size_t g_ProbeMinRate       = 100*MAX_BUFFER;
 long  g_MinPruneDays        =   7;
 
 uid_t g_uid  = getuid();
@@ -389,6 +1283,44 @@ void SetNonBlockFD (int fd)
 }
 
 
+void ChildApplyProfile (const CHILD_PROFILE *pProfile)
+{
+    /* Runs in the forked child before execv. Only system calls, because other threads of nshborg may hold locks.
+       Failures leave the child with the priority of nshborg */
+    int fd = -1;
+    ssize_t BytesWrite = 0;
+
+    if (NULL == pProfile)
+        return;
+
+    if (*pProfile->szCgroupProcs)
+    {
+        /* Writing 0 moves the writing process */
+        fd = open (pProfile->szCgroupProcs, O_WRONLY | O_CLOEXEC);
+
+        if (-1 != fd)
+        {
+            /* Retried when interrupted. The child cannot report other errors and stays in the cgroup of nshborg */
+            do
+            {
+                BytesWrite = write (fd, "0", 1);
+            } while ((-1 == BytesWrite) && (EINTR == errno));
+
+            close (fd);
+        }
+    }
+
+    if (pProfile->IoClass)
+        syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (pProfile->IoClass << IOPRIO_CLASS_SHIFT) | pProfile->IoLevel);
+
+    if (pProfile->bNice)
+        setpriority (PRIO_PROCESS, 0, pProfile->Nice);
+
+    if (pProfile->bCpus)
+        sched_setaffinity (0, sizeof (pProfile->Cpus), &pProfile->Cpus);
+}
+
+
 pid_t popen3 (int *retpInputFD, int *retpOutputFD, int *retpErrorFD, int NonBlock, const char *argv[])
 {
     int p_stdin[2]  = {0};
@@ -396,20 +1328,27 @@ pid_t popen3 (int *retpInputFD, int *retpOutputFD, int *retpErrorFD, int NonBloc
     int p_stderr[2] = {0};
     pid_t pid = 0;
 
-    if (pipe (p_stdin))
+    /* Close on exec, so other child processes don't keep the pipes open. dup2() clears the flag for the child's standard handles */
+    if (pipe2 (p_stdin, O_CLOEXEC))
         return -1;
 
-    if (pipe (p_stdout))
+    if (pipe2 (p_stdout, O_CLOEXEC))
         return -1;
 
-    if (pipe (p_stderr))
+    if (pipe2 (p_stderr, O_CLOEXEC))
         return -1;
 
     if (NULL == argv[0])
         return -1;
 
+    /* No other thread changes the environment while it is copied into the child. The child execs with the copy of the lock */
+    pthread_mutex_lock (&g_ChildMutex);
+
     pid = fork();
 
+    if (0 != pid)
+        pthread_mutex_unlock (&g_ChildMutex);
+
     if (pid < 0)
     {
         /* error forking process */
@@ -431,6 +1370,11 @@ pid_t popen3 (int *retpInputFD, int *retpOutputFD, int *retpErrorFD, int NonBloc
         close (p_stdout[WRITE]);
         close (p_stderr[WRITE]);
 
+        ChildApplyProfile (g_pChildProfile);
+
+        /* An ignored signal stays ignored across exec. The child gets the default handling back */
+        signal (SIGPIPE, SIG_DFL);
+
         /* switch child process to new binary */
         execv (argv[0], (char **) argv);
 
@@ -527,6 +1471,37 @@ void strdncpy (char *pszStr, const char *ct, size_t n)
 }
 
 
+size_t GetSizeValue (const char *pszValue)
+{
+    /* Number with optional K, M or G suffix */
+    char   *pEnd = NULL;
+    size_t Value = 0;
+
+    if (IsNullStr (pszValue))
+        return 0;
+
+    Value = strtoull (pszValue, &pEnd, 10);
+
+    if (NULL == pEnd)
+        return Value;
+
+    switch (toupper (*pEnd))
+    {
+        case 'G':
+            Value *= 1024;
+            /* fall through */
+        case 'M':
+            Value *= 1024;
+            /* fall through */
+        case 'K':
+            Value *= 1024;
+            break;
+    }
+
+    return Value;
+}
+
+
 size_t GetFileSize (const char *pszFilename)
 {
     int ret = 0;
@@ -1054,12 +2029,16 @@ int PushToSSHAgent()
         goto Done;
     }
 
+    pthread_mutex_lock (&g_ChildMutex);
+
     setenv (g_szSSH_AUTH_SOCK, g_szSSHAuthSock, 1);
 
     pid = popen3 (&InputFD, &OutputFD, &ErrorFD, 0, args);
 
     unsetenv (g_szSSH_AUTH_SOCK);
 
+    pthread_mutex_unlock (&g_ChildMutex);
+
     if (pid < 1)
     {
         perror ("Cannot add SSH key");
@@ -1127,478 +2106,9488 @@ Done:
 }
 
 
-int BackupFile (int WriteFD, const char *pszFileName)
+pid_t BorgPopen3 (int *retpInputFD, int *retpOutputFD, int *retpErrorFD, int NonBlock, const char *argv[])
 {
-    int ret = 0;
-    size_t  BytesRead  = 0;
-    size_t  BytesWrite = 0;
-    size_t  BytesTotal = 0;
-    size_t  BytesSize  = 0;
+    /* The borg environment only exists while the child is started. Other threads start their children before or after */
+    pid_t pid = 0;
 
-    pid_t  pid      =  0;
-    int    InputFD  = -1;
-    int    OutputFD = -1;
-    int    ErrorFD  = -1;
+    pthread_mutex_lock (&g_ChildMutex);
 
-    const char *args[] = { g_szTarBinary, "-cPf", "-", pszFileName, NULL };
+    PushToSSHAgent();
+    SetEnvironmentVars();
+    pid = popen3 (retpInputFD, retpOutputFD, retpErrorFD, NonBlock, argv);
+    UnsetEnvironmentVars();
 
-    if (-1 == WriteFD)
-    {
-        printf ("Backup ERROR: No write file descriptor\n");
-        ret = 1;
-        goto Done;
-    }
+    pthread_mutex_unlock (&g_ChildMutex);
 
-    if (IsNullStr (pszFileName))
-    {
-        printf ("Backup ERROR: No file specified\n");
-        ret = 1;
-        goto Done;
-    }
+    return pid;
+}
 
-    BytesSize = GetFileSize (pszFileName);
 
-    if (0 == BytesSize)
+ssize_t WriteBuffer (int fd, const void *pBuffer, size_t BufferSize)
+{
+    const unsigned char *p = (const unsigned char *) pBuffer;
+    size_t  BytesLeft  = BufferSize;
+    ssize_t BytesWrite = 0;
+
+    while (BytesLeft)
     {
-        printf ("Backup ERROR: Cannot backup empty files: %s\n", pszFileName);
-        ret = 1;
-        goto Done;
-    }
+        BytesWrite = write (fd, p, BytesLeft);
 
-    pid = popen3 (&InputFD, &OutputFD, &ErrorFD, 0, args);
+        if (BytesWrite < 0)
+        {
+            if (EINTR == errno)
+                continue;
 
-    if (pid < 1)
-    {
-        perror ("Backup ERROR: Cannot start tar process");
-        ret = 1;
-        goto Done;
-    }
+            return -1;
+        }
 
-    if (-1 == WriteFD)
-    {
-        perror ("Backup ERROR: No output file pointer returned");
-        ret = 1;
-        goto Done;
+        if (0 == BytesWrite)
+            return -1;
+
+        p         += BytesWrite;
+        BytesLeft -= BytesWrite;
     }
 
-    while ((BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer))))
-    {
-        BytesWrite = write (WriteFD, g_Buffer, BytesRead);
+    return BufferSize;
+}
 
-        if (BytesRead != BytesWrite)
-        {
-            printf ("Backup ERROR: Error writing buffer, Read: %lu, Written: %lu\n", BytesRead, BytesWrite);
-            ret = 1;
-            goto Done;
-        }
 
-        BytesTotal += BytesWrite;
-    }
+void TarSetOctal (char *pszField, size_t FieldSize, unsigned long long Value)
+{
+    /* Zero padded octal number terminated by a null byte like GNU tar writes it */
+    snprintf (pszField, FieldSize, "%0*llo", (int) FieldSize-1, Value);
+}
 
-    BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1);
-    if (BytesRead > 0)
-    {
-        g_Buffer[BytesRead] = '\0';
-        printf ("\nBackup ERROR: Returned from tar\n\n");
-        printf ("%s\n", g_Buffer);
-    }
 
-    printf ("Backup OK: [%s] %1.1f MB\n", pszFileName, BytesTotal/1024.0/1024.0);
+void TarSetBase256 (char *pszField, size_t FieldSize, unsigned long long Value)
+{
+    /* GNU base-256 encoding for values not fitting into the octal field. Leading byte 0x80 marks the encoding */
+    size_t i = 0;
 
-Done:
+    memset (pszField, 0, FieldSize);
 
-    if (-1 != InputFD)
+    for (i = FieldSize-1; i > 0; i--)
     {
-        close (InputFD);
-        InputFD = -1;
+        pszField[i] = (char) (Value & 0xFF);
+        Value >>= 8;
     }
 
-    if (-1 != OutputFD)
-    {
-        close (OutputFD);
-        OutputFD = -1;
-    }
+    pszField[0] = (char) 0x80;
+}
 
-    if (-1 != ErrorFD)
-    {
-        close (ErrorFD);
-        ErrorFD = -1;
-    }
 
-    if (pid > 0)
+size_t TarFormatPaxRecord (char *pszBuffer, size_t BufferSize, const char *pszKey, const char *pszValue)
+{
+    /* A PAX record is "<len> <key>=<value>\n" where <len> includes the digits of the length itself */
+    size_t len    = strlen (pszKey) + strlen (pszValue) + 3;
+    size_t total  = 0;
+    int    digits = 1;
+
+    while (1)
     {
-        pclose3 (pid);
-        pid = 0;
+        total = len + digits;
+
+        if (snprintf (NULL, 0, "%zu", total) == digits)
+            break;
+
+        digits++;
     }
 
-    return ret;
+    if (total >= BufferSize)
+        return 0;
+
+    snprintf (pszBuffer, BufferSize, "%zu %s=%s\n", total, pszKey, pszValue);
+    return total;
 }
 
 
-int BorgBackupPrune (long PruneDays)
+unsigned int TarChecksum (const TAR_HEADER *pHeader)
 {
-    int   ret       =  0;
-    pid_t pid       =  0;
-    int   InputFD   = -1;
-    int   OutputFD  = -1;
-    int   ErrorFD   = -1;
+    unsigned int  Checksum = 0;
+    size_t        i = 0;
+    const unsigned char *p = (const unsigned char *) pHeader;
 
-    ssize_t BytesRead     = 0;
-    ssize_t BytesWrite    = 0;
-    char  szPruneStr[255] = {0};
+    for (i=0; i < sizeof (TAR_HEADER); i++)
+        Checksum += p[i];
 
-    const char *args[] = { g_szBorgBackupBinary, "prune", "--stats", szPruneStr, NULL };
+    return Checksum;
+}
 
-    if (PruneDays < g_MinPruneDays)
-    {
-        printf ("\nBackup ERROR: Prune not allowed for specified interval: %ld\n\n", PruneDays);
+
+int TarWriteHeader (int WriteFD, TAR_HEADER *pHeader, size_t *retpBytesWritten)
+{
+    /* Checksum is calculated with the checksum field filled with blanks */
+    memset (pHeader->chksum, ' ', sizeof (pHeader->chksum));
+    snprintf (pHeader->chksum, sizeof (pHeader->chksum), "%06o", TarChecksum (pHeader));
+    pHeader->chksum[7] = ' ';
+
+    if (TAR_BLOCK_SIZE != WriteBuffer (WriteFD, pHeader, TAR_BLOCK_SIZE))
         return 1;
-    }
 
-    snprintf (szPruneStr, sizeof (szPruneStr), "--keep-within=%ld%s", PruneDays, "d");
+    if (retpBytesWritten)
+        *retpBytesWritten += TAR_BLOCK_SIZE;
 
-    PushToSSHAgent();
-    SetEnvironmentVars();
-    pid = popen3 (&InputFD, &OutputFD, &ErrorFD, 1, args);
-    UnsetEnvironmentVars();
+    return 0;
+}
 
-    if (pid < 1)
-    {
-        printf ("\nBackup ERROR: Cannot start Borg process\n\n");
-        perror ("Backup ERROR: Cannot start Borg process");
-        ret = 1;
-        goto Done;
-    }
 
-    /* Check if Borg process provides output */
-    if (-1 != OutputFD)
-    {
-        while ((BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer)-1)))
-        {
-            g_Buffer[BytesRead] = '\0';
-            BytesWrite = write (1, g_Buffer, BytesRead);
+int TarWritePadding (int WriteFD, size_t DataSize, size_t *retpBytesWritten)
+{
+    static const char ZeroBlock[TAR_BLOCK_SIZE] = {0};
+    size_t Padding = (TAR_BLOCK_SIZE - (DataSize % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
 
-            if (BytesRead != BytesWrite)
+    if (0 == Padding)
+        return 0;
+
+    if ((ssize_t) Padding != WriteBuffer (WriteFD, ZeroBlock, Padding))
+        return 1;
+
+    if (retpBytesWritten)
+        *retpBytesWritten += Padding;
+
+    return 0;
+}
+
+
+int TarWriteEnd (int WriteFD)
+{
+    /* End of archive are two zero blocks. borg import-tar runs with --ignore-zeros and continues reading after it */
+    static const char ZeroBlocks[2*TAR_BLOCK_SIZE] = {0};
+
+    if (-1 == WriteFD)
+        return 1;
+
+    if (sizeof (ZeroBlocks) != WriteBuffer (WriteFD, ZeroBlocks, sizeof (ZeroBlocks)))
+        return 1;
+
+    return 0;
+}
+
+
+bool TarSplitPath (const char *pszFileName, TAR_HEADER *pHeader)
+{
+    /* Try to fit the name into ustar name[100] and prefix[155] split at a slash */
+    size_t len = strlen (pszFileName);
+    size_t i   = 0;
+
+    if (len <= sizeof (pHeader->name))
+    {
+        memcpy (pHeader->name, pszFileName, len);
+        return true;
+    }
+
+    for (i = 1; (i < len) && (i <= sizeof (pHeader->prefix)); i++)
+    {
+        if ('/' != pszFileName[i])
+            continue;
+
+        if ((len-i-1) > sizeof (pHeader->name))
+            continue;
+
+        if (0 == (len-i-1))
+            break;
+
+        memcpy (pHeader->prefix, pszFileName, i);
+        memcpy (pHeader->name, pszFileName+i+1, len-i-1);
+        return true;
+    }
+
+    return false;
+}
+
+
+void SparseMapFree (SPARSE_MAP *pMap)
+{
+    if (pMap->pExtents)
+    {
+        free (pMap->pExtents);
+        pMap->pExtents = NULL;
+    }
+
+    pMap->Count = 0;
+    pMap->Alloc = 0;
+    pMap->DataSize = 0;
+}
+
+
+int SparseMapAdd (SPARSE_MAP *pMap, off_t Offset, size_t Length)
+{
+    SPARSE_EXTENT *pNew = NULL;
+    SPARSE_EXTENT *pLast = NULL;
+
+    /* Extents are aligned for O_DIRECT. Aligned extents can touch or overlap the previous one */
+    if (pMap->Count)
+    {
+        pLast = &pMap->pExtents[pMap->Count-1];
+
+        if (Offset <= (off_t) (pLast->Offset + pLast->Length))
+        {
+            if (Offset + Length > pLast->Offset + pLast->Length)
             {
-                perror ("Warning: Incomplete buffer write");
+                pMap->DataSize -= pLast->Length;
+                pLast->Length   = Offset + Length - pLast->Offset;
+                pMap->DataSize += pLast->Length;
             }
 
-            usleep (10*1000);
+            return 0;
         }
     }
 
-    if (-1 != ErrorFD)
+    if (pMap->Count == pMap->Alloc)
     {
-        while ((BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1)))
+        pNew = (SPARSE_EXTENT *) realloc (pMap->pExtents, (pMap->Alloc + 64) * sizeof (SPARSE_EXTENT));
+
+        if (NULL == pNew)
+            return 1;
+
+        pMap->pExtents = pNew;
+        pMap->Alloc   += 64;
+    }
+
+    pMap->pExtents[pMap->Count].Offset = Offset;
+    pMap->pExtents[pMap->Count].Length = Length;
+    pMap->Count++;
+    pMap->DataSize += Length;
+
+    return 0;
+}
+
+
+int SparseMapBuild (int FD, const struct stat *pStat, SPARSE_MAP *pMap)
+{
+    /* Find the data regions with SEEK_DATA/SEEK_HOLE. Files without holes get a single extent.
+       Only files with fewer allocated blocks than their size can contain holes */
+
+    off_t  Data = 0;
+    off_t  Hole = 0;
+    off_t  End  = 0;
+    off_t  FileSize = pStat->st_size;
+
+    memset (pMap, 0, sizeof (SPARSE_MAP));
+    pMap->FileSize = FileSize;
+
+    if (0 == FileSize)
+        return 0;
+
+    if (g_Sparse && (pStat->st_blocks * 512 < FileSize))
+    {
+        while (Data < FileSize)
         {
-            g_Buffer[BytesRead] = '\0';
-            BytesWrite = write (2, g_Buffer, BytesRead);
+            Data = lseek (FD, Data, SEEK_DATA);
 
-            if (BytesRead != BytesWrite)
+            if (-1 == Data)
             {
-                perror ("Warning: Incomplete buffer write");
+                /* No more data up to the end of the file */
+                if (ENXIO == errno)
+                    break;
+
+                goto Fallback;
             }
 
-            usleep (10*1000);
+            Hole = lseek (FD, Data, SEEK_HOLE);
+
+            if (-1 == Hole)
+                goto Fallback;
+
+            Data = Data & ~((off_t) IO_ALIGNMENT - 1);
+            End  = (Hole + IO_ALIGNMENT - 1) & ~((off_t) IO_ALIGNMENT - 1);
+
+            if (End > FileSize)
+                End = FileSize;
+
+            if (SparseMapAdd (pMap, Data, End - Data))
+                goto Fallback;
+
+            Data = End;
+        }
+
+        return 0;
+    }
+
+Fallback:
+
+    SparseMapFree (pMap);
+
+    if (SparseMapAdd (pMap, 0, FileSize))
+        return 1;
+
+    return 0;
+}
+
+
+bool SparseMapHasHoles (const SPARSE_MAP *pMap)
+{
+    return (pMap->DataSize < pMap->FileSize);
+}
+
+
+size_t TarSparseMapFormat (const SPARSE_MAP *pMap, char *pszBuffer, size_t BufferSize)
+{
+    /* GNU sparse 1.0 map in front of the data: number of extents followed by offset and size of each extent.
+       Each number is terminated by a new line. Returns the length without padding. Without a buffer only the length is calculated */
+
+    size_t Len = 0;
+    size_t i   = 0;
+    int    n   = 0;
+    bool   bTrailingHole = true;
+
+    /* GNU tar only extends a file ending with a hole, if an empty extent marks the end */
+    if (pMap->Count && (pMap->pExtents[pMap->Count-1].Offset + pMap->pExtents[pMap->Count-1].Length >= pMap->FileSize))
+        bTrailingHole = false;
+
+    n = snprintf (pszBuffer, BufferSize, "%zu\n", pMap->Count + (bTrailingHole ? 1 : 0));
+    Len += n;
+
+    for (i=0; i < pMap->Count; i++)
+    {
+        n = snprintf (pszBuffer ? pszBuffer+Len : NULL, pszBuffer ? BufferSize-Len : 0, "%llu\n%zu\n", (unsigned long long) pMap->pExtents[i].Offset, pMap->pExtents[i].Length);
+        Len += n;
+    }
+
+    if (bTrailingHole)
+    {
+        n = snprintf (pszBuffer ? pszBuffer+Len : NULL, pszBuffer ? BufferSize-Len : 0, "%zu\n0\n", pMap->FileSize);
+        Len += n;
+    }
+
+    return Len;
+}
+
+
+int TarWriteSparseMap (int WriteFD, const SPARSE_MAP *pMap, size_t *retpBytesWritten)
+{
+    int    ret = 0;
+    size_t Len = TarSparseMapFormat (pMap, NULL, 0);
+    char   *pszMap = (char *) malloc (Len+1);
+
+    if (NULL == pszMap)
+        return 1;
+
+    TarSparseMapFormat (pMap, pszMap, Len+1);
+
+    if ((ssize_t) Len != WriteBuffer (WriteFD, pszMap, Len))
+        ret = 1;
+    else if (retpBytesWritten)
+        *retpBytesWritten += Len;
+
+    free (pszMap);
+
+    if (ret)
+        return ret;
+
+    return TarWritePadding (WriteFD, Len, retpBytesWritten);
+}
+
+
+int TarWriteFileHeader (int WriteFD, const char *pszFileName, const struct stat *pStat, const SPARSE_MAP *pSparse, size_t *retpBytesWritten)
+{
+    /* pSparse is only passed for files with holes. The entry is written in GNU sparse 1.0 format */
+
+    int    ret = 0;
+    bool   bPaxPath = false;
+    bool   bPaxSize = false;
+    size_t PaxLen   = 0;
+    size_t BaseLen  = 0;
+    size_t MapLen   = 0;
+    unsigned long long StoredSize = pStat->st_size;
+    char   szNum[40] = {0};
+    char   szPax[2*MAX_PATH+TAR_BLOCK_SIZE] = {0};
+    char   szSparseName[MAX_PATH+sizeof (TAR_SPARSE_DIR)+2] = {0};
+
+    const char *pszBaseName = NULL;
+    const char *pszName     = pszFileName;
+
+    TAR_HEADER Header;
+    TAR_HEADER PaxHeader;
+
+    if (IsNullStr (pszFileName) || (NULL == pStat))
+        return 1;
+
+    memset (&Header, 0, sizeof (Header));
+
+    pszBaseName = strrchr (pszFileName, '/');
+    pszBaseName = pszBaseName ? pszBaseName+1 : pszFileName;
+
+    if (pSparse)
+    {
+        /* Stored data is the padded map followed by the data extents.
+           Readers without sparse support extract the stored data to GNUSparseFile.0/<name> */
+        MapLen = TarSparseMapFormat (pSparse, NULL, 0);
+        StoredSize = MapLen + (TAR_BLOCK_SIZE - (MapLen % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE + pSparse->DataSize;
+
+        snprintf (szSparseName, sizeof (szSparseName), "%.*s%s/%s", (int) (pszBaseName-pszFileName), pszFileName, TAR_SPARSE_DIR, pszBaseName);
+        pszName = szSparseName;
+        pszBaseName = strrchr (pszName, '/') + 1;
+    }
+
+    bPaxPath = !TarSplitPath (pszName, &Header);
+    bPaxSize = (StoredSize > TAR_USTAR_MAX_SIZE);
+
+    if (bPaxPath || bPaxSize || pSparse)
+    {
+        /* PAX extended header in front of the file header for long names, files of 8 GB and larger and sparse files */
+        if (bPaxPath)
+            PaxLen += TarFormatPaxRecord (szPax+PaxLen, sizeof (szPax)-PaxLen, "path", pszName);
+
+        /* Readers apply a size record to the logical size of a sparse file. The base-256 size field is used instead */
+        if (bPaxSize && (NULL == pSparse))
+        {
+            snprintf (szNum, sizeof (szNum), "%llu", StoredSize);
+            PaxLen += TarFormatPaxRecord (szPax+PaxLen, sizeof (szPax)-PaxLen, "size", szNum);
+        }
+
+        if (pSparse)
+        {
+            snprintf (szNum, sizeof (szNum), "%llu", (unsigned long long) pStat->st_size);
+            PaxLen += TarFormatPaxRecord (szPax+PaxLen, sizeof (szPax)-PaxLen, "GNU.sparse.major", "1");
+            PaxLen += TarFormatPaxRecord (szPax+PaxLen, sizeof (szPax)-PaxLen, "GNU.sparse.minor", "0");
+            PaxLen += TarFormatPaxRecord (szPax+PaxLen, sizeof (szPax)-PaxLen, "GNU.sparse.name", pszFileName);
+            PaxLen += TarFormatPaxRecord (szPax+PaxLen, sizeof (szPax)-PaxLen, "GNU.sparse.realsize", szNum);
+        }
+
+        if (0 == PaxLen)
+        {
+            printf ("Backup ERROR: Cannot create PAX header for: %s\n", pszFileName);
+            return 1;
         }
+
+        memset (&PaxHeader, 0, sizeof (PaxHeader));
+
+        /* Fixed name for the extended header keeps the stream stable between runs */
+        snprintf (PaxHeader.name, sizeof (PaxHeader.name), "%s", "././@PaxHeader");
+        TarSetOctal (PaxHeader.mode,  sizeof (PaxHeader.mode),  0644);
+        TarSetOctal (PaxHeader.uid,   sizeof (PaxHeader.uid),   0);
+        TarSetOctal (PaxHeader.gid,   sizeof (PaxHeader.gid),   0);
+        TarSetOctal (PaxHeader.size,  sizeof (PaxHeader.size),  PaxLen);
+        TarSetOctal (PaxHeader.mtime, sizeof (PaxHeader.mtime), pStat->st_mtime);
+        PaxHeader.typeflag = TAR_TYPE_PAX;
+        memcpy (PaxHeader.magic,   "ustar", 6);
+        memcpy (PaxHeader.version, "00", 2);
+
+        if (TarWriteHeader (WriteFD, &PaxHeader, retpBytesWritten))
+            return 1;
+
+        if ((ssize_t) PaxLen != WriteBuffer (WriteFD, szPax, PaxLen))
+            return 1;
+
+        if (retpBytesWritten)
+            *retpBytesWritten += PaxLen;
+
+        if (TarWritePadding (WriteFD, PaxLen, retpBytesWritten))
+            return 1;
+    }
+
+    if (bPaxPath)
+    {
+        /* Readers without PAX support see the truncated base name */
+        BaseLen = strlen (pszBaseName);
+
+        if (BaseLen > sizeof (Header.name))
+            BaseLen = sizeof (Header.name);
+
+        memcpy (Header.name, pszBaseName, BaseLen);
+    }
+
+    /* Numeric IDs only. No user and group name lookups to keep metadata stable and cheap */
+    TarSetOctal (Header.mode,  sizeof (Header.mode),  pStat->st_mode & 07777);
+    TarSetOctal (Header.uid,   sizeof (Header.uid),   pStat->st_uid & 07777777);
+    TarSetOctal (Header.gid,   sizeof (Header.gid),   pStat->st_gid & 07777777);
+    TarSetOctal (Header.mtime, sizeof (Header.mtime), pStat->st_mtime);
+
+    if (bPaxSize)
+        TarSetBase256 (Header.size, sizeof (Header.size), StoredSize);
+    else
+        TarSetOctal (Header.size, sizeof (Header.size), StoredSize);
+
+    Header.typeflag = TAR_TYPE_FILE;
+    memcpy (Header.magic,   "ustar", 6);
+    memcpy (Header.version, "00", 2);
+
+    ret = TarWriteHeader (WriteFD, &Header, retpBytesWritten);
+
+    return ret;
+}
+
+
+int SetPipeSize (int PipeFD, size_t PipeSize)
+{
+    /* Enlarge the pipe so borg does not starve between two writes. Unprivileged users are limited by fs/pipe-max-size */
+    int  ret = 0;
+    long MaxSize = 0;
+    char szNum[40] = {0};
+
+    if ((-1 == PipeFD) || (0 == PipeSize))
+        return -1;
+
+    ret = fcntl (PipeFD, F_SETPIPE_SZ, (int) PipeSize);
+
+    if ((ret < 0) && (EPERM == errno))
+    {
+        ReadFileIntoBuffer ("/proc/sys/fs/pipe-max-size", sizeof (szNum), szNum);
+        MaxSize = atol (szNum);
+
+        if (MaxSize > 0)
+            ret = fcntl (PipeFD, F_SETPIPE_SZ, (int) MaxSize);
+    }
+
+    if (ret < 0)
+        return -1;
+
+    return fcntl (PipeFD, F_GETPIPE_SZ);
+}
+
+
+const char *IoEngineName (int Engine)
+{
+    switch (Engine)
+    {
+        case IO_ENGINE_PREAD:    return "pread";
+        case IO_ENGINE_MMAP:     return "mmap";
+        case IO_ENGINE_DIRECT:   return "direct";
+        case IO_ENGINE_IO_URING: return "io_uring";
+    }
+
+    return "unknown";
+}
+
+
+int GetIoEngine (const char *pszName)
+{
+    int Engine = 0;
+
+    for (Engine = 0; Engine < IO_ENGINE_COUNT; Engine++)
+    {
+        if (0 == strcmp (pszName, IoEngineName (Engine)))
+            return Engine;
+    }
+
+    return -1;
+}
+
+
+#ifdef NSHBORG_IO_URING
+
+int IoUringSetup (IO_URING *pUring, unsigned Entries)
+{
+    struct io_uring_params Params;
+
+    memset (pUring, 0, sizeof (IO_URING));
+    memset (&Params, 0, sizeof (Params));
+
+    pUring->RingFD = syscall (__NR_io_uring_setup, Entries, &Params);
+
+    if (pUring->RingFD < 0)
+        return 1;
+
+    pUring->Entries    = Params.sq_entries;
+    pUring->SqRingSize = Params.sq_off.array + Params.sq_entries * sizeof (unsigned);
+    pUring->CqRingSize = Params.cq_off.cqes  + Params.cq_entries * sizeof (struct io_uring_cqe);
+    pUring->SqesSize   = Params.sq_entries * sizeof (struct io_uring_sqe);
+
+    pUring->pSqRing = mmap (NULL, pUring->SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pUring->RingFD, IORING_OFF_SQ_RING);
+    pUring->pCqRing = mmap (NULL, pUring->CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pUring->RingFD, IORING_OFF_CQ_RING);
+    pUring->pSqes   = (struct io_uring_sqe *) mmap (NULL, pUring->SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pUring->RingFD, IORING_OFF_SQES);
+
+    if ((MAP_FAILED == pUring->pSqRing) || (MAP_FAILED == pUring->pCqRing) || (MAP_FAILED == (void *) pUring->pSqes))
+        return 1;
+
+    pUring->pSqTail  = (unsigned *) ((char *) pUring->pSqRing + Params.sq_off.tail);
+    pUring->pSqMask  = (unsigned *) ((char *) pUring->pSqRing + Params.sq_off.ring_mask);
+    pUring->pSqArray = (unsigned *) ((char *) pUring->pSqRing + Params.sq_off.array);
+    pUring->pCqHead  = (unsigned *) ((char *) pUring->pCqRing + Params.cq_off.head);
+    pUring->pCqTail  = (unsigned *) ((char *) pUring->pCqRing + Params.cq_off.tail);
+    pUring->pCqMask  = (unsigned *) ((char *) pUring->pCqRing + Params.cq_off.ring_mask);
+    pUring->pCqes    = (struct io_uring_cqe *) ((char *) pUring->pCqRing + Params.cq_off.cqes);
+
+    return 0;
+}
+
+
+void IoUringFree (IO_URING *pUring)
+{
+    if (pUring->pSqes && (MAP_FAILED != (void *) pUring->pSqes))
+        munmap (pUring->pSqes, pUring->SqesSize);
+
+    if (pUring->pCqRing && (MAP_FAILED != pUring->pCqRing))
+        munmap (pUring->pCqRing, pUring->CqRingSize);
+
+    if (pUring->pSqRing && (MAP_FAILED != pUring->pSqRing))
+        munmap (pUring->pSqRing, pUring->SqRingSize);
+
+    if (pUring->RingFD > 0)
+        close (pUring->RingFD);
+
+    memset (pUring, 0, sizeof (IO_URING));
+}
+
+
+ssize_t IoUringTransfer (IO_FILE *pFile, int Opcode, unsigned char *pBuffer, size_t BufferSize, off_t Offset)
+{
+    /* Split the buffer into up to queue depth requests, submit them in one call and wait for all of them.
+       Returns the number of bytes transferred contiguously from the start of the buffer */
+
+    IO_URING *pUring = &pFile->Uring;
+    struct io_uring_sqe *pSqe = NULL;
+    struct io_uring_cqe *pCqe = NULL;
+
+    size_t   ChunkSize = 0;
+    size_t   Pos       = 0;
+    size_t   Len       = 0;
+    size_t   Contiguous = 0;
+    unsigned Count     = 0;
+    unsigned Submitted = 0;
+    unsigned i         = 0;
+    unsigned Tail      = 0;
+    unsigned Head      = 0;
+    int      ret       = 0;
+    int      Result[IO_URING_MAX_DEPTH] = {0};
+
+    ChunkSize = BufferSize / pUring->Entries;
+    ChunkSize = (ChunkSize + IO_ALIGNMENT - 1) & ~((size_t) IO_ALIGNMENT - 1);
+
+    if (0 == ChunkSize)
+        ChunkSize = IO_ALIGNMENT;
+
+    Tail = *pUring->pSqTail;
+
+    for (Pos = 0; (Pos < BufferSize) && (Count < pUring->Entries); Pos += ChunkSize)
+    {
+        Len = BufferSize - Pos;
+
+        if (Len > ChunkSize)
+            Len = ChunkSize;
+
+        pSqe = &pUring->pSqes[Tail & *pUring->pSqMask];
+        memset (pSqe, 0, sizeof (struct io_uring_sqe));
+
+        pSqe->opcode    = Opcode;
+        pSqe->fd        = pFile->FD;
+        pSqe->addr      = (unsigned long) (pBuffer + Pos);
+        pSqe->len       = Len;
+        pSqe->off       = Offset + Pos;
+        pSqe->user_data = Count;
+
+        pUring->pSqArray[Tail & *pUring->pSqMask] = Tail & *pUring->pSqMask;
+        Tail++;
+        Count++;
+    }
+
+    __atomic_store_n (pUring->pSqTail, Tail, __ATOMIC_RELEASE);
+
+    /* The kernel may take fewer requests than queued. Submit the rest */
+    while (Submitted < Count)
+    {
+        ret = syscall (__NR_io_uring_enter, pUring->RingFD, Count - Submitted, Count - Submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if ((ret < 0) && (EINTR == errno))
+            continue;
+
+        if (ret <= 0)
+            break;
+
+        Submitted += ret;
     }
 
-    printf ("\nBackup OK: Prune successful\n\n");
+    if (Submitted < Count)
+    {
+        /* Without SQPOLL the kernel only consumes requests in io_uring_enter. Withdraw the ones not taken */
+        __atomic_store_n (pUring->pSqTail, Tail - (Count - Submitted), __ATOMIC_RELEASE);
+
+        if (0 == Submitted)
+            return -1;
+
+        Count = Submitted;
+    }
+
+    i = 0;
+
+    while (i < Count)
+    {
+        Head = *pUring->pCqHead;
+
+        if (Head == __atomic_load_n (pUring->pCqTail, __ATOMIC_ACQUIRE))
+        {
+            ret = syscall (__NR_io_uring_enter, pUring->RingFD, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+            if ((ret < 0) && (EINTR != errno))
+                return -1;
+
+            continue;
+        }
+
+        pCqe = &pUring->pCqes[Head & *pUring->pCqMask];
+
+        if (pCqe->user_data < IO_URING_MAX_DEPTH)
+            Result[pCqe->user_data] = pCqe->res;
+
+        __atomic_store_n (pUring->pCqHead, Head+1, __ATOMIC_RELEASE);
+        i++;
+    }
+
+    for (i=0; i < Count; i++)
+    {
+        if (Result[i] < 0)
+        {
+            errno = -Result[i];
+            return Contiguous ? (ssize_t) Contiguous : -1;
+        }
+
+        Contiguous += Result[i];
+
+        /* Short transfer. Following chunks are not contiguous */
+        if ((size_t) Result[i] < ChunkSize)
+            break;
+    }
+
+    return Contiguous;
+}
+
+#endif
+
+
+int IoOpen (IO_FILE *pFile, const char *pszFileName, int Engine, bool bWrite)
+{
+    int Flags = bWrite ? (O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC);
+    struct stat Filestat = {0};
+
+    memset (pFile, 0, sizeof (IO_FILE));
+    pFile->FD     = -1;
+    pFile->Engine = Engine;
+    pFile->bWrite = bWrite;
+
+    if (IO_ENGINE_DIRECT == Engine)
+    {
+        pFile->FD = open (pszFileName, Flags | O_DIRECT, S_IRUSR | S_IWUSR);
+
+        /* File systems like tmpfs don't support O_DIRECT */
+        if ((-1 == pFile->FD) && (EINVAL == errno))
+        {
+            printf ("Info: O_DIRECT not supported for %s, using pread\n", pszFileName);
+            pFile->Engine = IO_ENGINE_PREAD;
+        }
+    }
+
+    if (-1 == pFile->FD)
+        pFile->FD = open (pszFileName, Flags, S_IRUSR | S_IWUSR);
+
+    if (-1 == pFile->FD)
+        return 1;
+
+    if (fstat (pFile->FD, &Filestat))
+        return 1;
+
+    pFile->FileSize = Filestat.st_size;
+
+    if (IO_ENGINE_MMAP == pFile->Engine)
+    {
+        /* Restore writes into a pipe sized stream of unknown length. mmap is only used for reading */
+        if (bWrite || (0 == pFile->FileSize))
+        {
+            pFile->Engine = IO_ENGINE_PREAD;
+        }
+        else
+        {
+            pFile->pMap = (unsigned char *) mmap (NULL, pFile->FileSize, PROT_READ, MAP_SHARED, pFile->FD, 0);
+
+            if (MAP_FAILED == pFile->pMap)
+            {
+                pFile->pMap   = NULL;
+                pFile->Engine = IO_ENGINE_PREAD;
+            }
+            else
+            {
+                madvise (pFile->pMap, pFile->FileSize, MADV_SEQUENTIAL);
+            }
+        }
+    }
+
+    if (IO_ENGINE_IO_URING == pFile->Engine)
+    {
+#ifdef NSHBORG_IO_URING
+        if (IoUringSetup (&pFile->Uring, g_IoUringDepth))
+        {
+            IoUringFree (&pFile->Uring);
+            printf ("Info: io_uring not available, using pread\n");
+            pFile->Engine = IO_ENGINE_PREAD;
+        }
+#else
+        printf ("Info: io_uring not supported in this build, using pread\n");
+        pFile->Engine = IO_ENGINE_PREAD;
+#endif
+    }
+
+    if (IO_ENGINE_DIRECT == pFile->Engine && bWrite)
+    {
+        /* O_DIRECT writes need aligned buffers, sizes and offsets. Data is staged until a full buffer is available */
+        if (posix_memalign ((void **) &pFile->pStage, IO_ALIGNMENT, g_RingSlotSize + IO_ALIGNMENT))
+        {
+            pFile->pStage = NULL;
+            return 1;
+        }
+
+        pFile->StageSize = (g_RingSlotSize + IO_ALIGNMENT - 1) & ~((size_t) IO_ALIGNMENT - 1);
+    }
+
+    return 0;
+}
+
+
+ssize_t IoRead (IO_FILE *pFile, unsigned char *pBuffer, size_t BufferSize)
+{
+    /* Sequential read at the current offset. The buffer must be aligned for O_DIRECT */
+    ssize_t BytesRead = 0;
+    size_t  BytesToRead = BufferSize;
+
+    switch (pFile->Engine)
+    {
+        case IO_ENGINE_MMAP:
+            if (pFile->Offset >= (off_t) pFile->FileSize)
+                return 0;
+
+            if ((pFile->Offset + BytesToRead) > pFile->FileSize)
+                BytesToRead = pFile->FileSize - pFile->Offset;
+
+            memcpy (pBuffer, pFile->pMap + pFile->Offset, BytesToRead);
+            BytesRead = BytesToRead;
+            break;
+
+        case IO_ENGINE_DIRECT:
+            /* Length must be a multiple of the alignment. Reading past the end of the file returns the remaining bytes */
+            BytesToRead = (BytesToRead + IO_ALIGNMENT - 1) & ~((size_t) IO_ALIGNMENT - 1);
+
+            do
+            {
+                BytesRead = pread (pFile->FD, pBuffer, BytesToRead, pFile->Offset);
+            } while ((BytesRead < 0) && (EINTR == errno));
+            break;
+
+#ifdef NSHBORG_IO_URING
+        case IO_ENGINE_IO_URING:
+            BytesRead = IoUringTransfer (pFile, IORING_OP_READ, pBuffer, BytesToRead, pFile->Offset);
+            break;
+#endif
+
+        default:
+            do
+            {
+                BytesRead = pread (pFile->FD, pBuffer, BytesToRead, pFile->Offset);
+            } while ((BytesRead < 0) && (EINTR == errno));
+            break;
+    }
+
+    if (BytesRead < 0)
+        return -1;
+
+    /* Never return more than requested, even if an aligned read returned more */
+    if ((size_t) BytesRead > BufferSize)
+        BytesRead = BufferSize;
+
+    pFile->Offset += BytesRead;
+    return BytesRead;
+}
+
+
+ssize_t IoWriteAt (IO_FILE *pFile, const unsigned char *pBuffer, size_t BufferSize, off_t Offset)
+{
+    ssize_t BytesWrite = 0;
+    size_t  BytesDone  = 0;
+
+    while (BytesDone < BufferSize)
+    {
+#ifdef NSHBORG_IO_URING
+        if (IO_ENGINE_IO_URING == pFile->Engine)
+            BytesWrite = IoUringTransfer (pFile, IORING_OP_WRITE, (unsigned char *) pBuffer + BytesDone, BufferSize - BytesDone, Offset + BytesDone);
+        else
+#endif
+            BytesWrite = pwrite (pFile->FD, pBuffer + BytesDone, BufferSize - BytesDone, Offset + BytesDone);
+
+        if (BytesWrite < 0)
+        {
+            if (EINTR == errno)
+                continue;
+
+            return -1;
+        }
+
+        if (0 == BytesWrite)
+            return -1;
+
+        BytesDone += BytesWrite;
+    }
+
+    return BytesDone;
+}
+
+
+bool IsZeroBlock (const unsigned char *pBuffer, size_t Len)
+{
+    if (0 == Len)
+        return true;
+
+    if (pBuffer[0])
+        return false;
+
+    return (0 == memcmp (pBuffer, pBuffer+1, Len-1));
+}
+
+
+int IoWriteSparse (IO_FILE *pFile, const unsigned char *pBuffer, size_t BufferSize, off_t Offset)
+{
+    /* Write a buffer, but skip aligned blocks containing only zeros. The file is new, skipped blocks become holes.
+       IoClose() sets the final size in case the file ends with a hole */
+
+    size_t Pos      = 0;
+    size_t Len      = 0;
+    size_t RunStart = 0;
+    size_t RunLen   = 0;
+
+    if (false == pFile->bSparse)
+    {
+        if ((ssize_t) BufferSize != IoWriteAt (pFile, pBuffer, BufferSize, Offset))
+            return 1;
+
+        return 0;
+    }
+
+    while (Pos < BufferSize)
+    {
+        /* Blocks are aligned to the file offset, not to the buffer */
+        Len = IO_ALIGNMENT - ((Offset + Pos) % IO_ALIGNMENT);
+
+        if (Len > BufferSize - Pos)
+            Len = BufferSize - Pos;
+
+        if (IsZeroBlock (pBuffer + Pos, Len))
+        {
+            if (RunLen && ((ssize_t) RunLen != IoWriteAt (pFile, pBuffer + RunStart, RunLen, Offset + RunStart)))
+                return 1;
+
+            RunLen = 0;
+            pFile->BytesHoles += Len;
+        }
+        else
+        {
+            if (0 == RunLen)
+                RunStart = Pos;
+
+            RunLen += Len;
+        }
+
+        Pos += Len;
+    }
+
+    if (RunLen && ((ssize_t) RunLen != IoWriteAt (pFile, pBuffer + RunStart, RunLen, Offset + RunStart)))
+        return 1;
+
+    return 0;
+}
+
+
+int IoWrite (IO_FILE *pFile, const unsigned char *pBuffer, size_t BufferSize)
+{
+    /* Sequential write at the current offset */
+    size_t Len = 0;
+
+    if (NULL == pFile->pStage)
+    {
+        if (IoWriteSparse (pFile, pBuffer, BufferSize, pFile->Offset))
+            return 1;
+
+        pFile->Offset += BufferSize;
+        return 0;
+    }
+
+    while (BufferSize)
+    {
+        Len = pFile->StageSize - pFile->StageLen;
+
+        if (Len > BufferSize)
+            Len = BufferSize;
+
+        memcpy (pFile->pStage + pFile->StageLen, pBuffer, Len);
+        pFile->StageLen += Len;
+        pBuffer         += Len;
+        BufferSize      -= Len;
+
+        if (pFile->StageLen == pFile->StageSize)
+        {
+            if (IoWriteSparse (pFile, pFile->pStage, pFile->StageLen, pFile->Offset))
+                return 1;
+
+            pFile->Offset  += pFile->StageLen;
+            pFile->StageLen = 0;
+        }
+    }
+
+    return 0;
+}
+
+
+int IoClose (IO_FILE *pFile)
+{
+    int    ret = 0;
+    size_t Aligned = 0;
+
+    if (pFile->pStage)
+    {
+        if (pFile->StageLen)
+        {
+            /* Last block is written aligned and the file is truncated to the real size afterwards */
+            Aligned = (pFile->StageLen + IO_ALIGNMENT - 1) & ~((size_t) IO_ALIGNMENT - 1);
+            memset (pFile->pStage + pFile->StageLen, 0, Aligned - pFile->StageLen);
+
+            if (IoWriteSparse (pFile, pFile->pStage, Aligned, pFile->Offset))
+                ret = 1;
+
+            pFile->Offset += pFile->StageLen;
+
+            if (ftruncate (pFile->FD, pFile->Offset))
+                ret = 1;
+        }
+
+        free (pFile->pStage);
+        pFile->pStage = NULL;
+    }
+
+    if (pFile->bSparse && pFile->BytesHoles && (-1 != pFile->FD))
+    {
+        /* Skipped zero blocks at the end don't extend the file */
+        if (ftruncate (pFile->FD, pFile->Offset))
+            ret = 1;
+    }
+
+    if (pFile->pMap)
+    {
+        munmap (pFile->pMap, pFile->FileSize);
+        pFile->pMap = NULL;
+    }
+
+#ifdef NSHBORG_IO_URING
+    if (IO_ENGINE_IO_URING == pFile->Engine)
+        IoUringFree (&pFile->Uring);
+#endif
+
+    if (-1 != pFile->FD)
+    {
+        if (close (pFile->FD))
+            ret = 1;
+
+        pFile->FD = -1;
+    }
+
+    return ret;
+}
+
+
+int CacheRecordResidency (PAGE_CACHE *pCache, off_t Offset, size_t Len)
+{
+    /* Remember which pages were cached before the backup touched them */
+    unsigned char *pMap  = NULL;
+    size_t Pages = (Len + pCache->PageSize - 1) / pCache->PageSize;
+    size_t Page  = Offset / pCache->PageSize;
+    size_t i     = 0;
+    int    ret   = 0;
+
+    if (pCache->pMap)
+    {
+        pMap = pCache->pMap + Offset;
+    }
+    else
+    {
+        pMap = (unsigned char *) mmap (NULL, Len, PROT_READ, MAP_SHARED, pCache->FD, Offset);
+
+        if (MAP_FAILED == pMap)
+            return 1;
+    }
+
+    if (mincore (pMap, Len, pCache->pVec))
+    {
+        ret = 1;
+    }
+    else
+    {
+        for (i=0; i < Pages; i++)
+        {
+            if (pCache->pVec[i] & 1)
+                pCache->pResident[(Page+i) / 8] |= (unsigned char) (1 << ((Page+i) % 8));
+        }
+    }
+
+    if (NULL == pCache->pMap)
+        munmap (pMap, Len);
+
+    return ret;
+}
+
+
+void CacheAdvance (PAGE_CACHE *pCache, off_t Pos)
+{
+    /* Residency is recorded two windows ahead of the read position, before the read ahead for that window is issued.
+       Otherwise pages read ahead by the backup itself would look like pages Domino had cached */
+
+    size_t Len = 0;
+
+    if (false == pCache->bActive)
+        return;
+
+    while ((pCache->CheckedEnd < (off_t) pCache->FileSize) && (pCache->CheckedEnd < Pos + (off_t) (2 * pCache->Window)))
+    {
+        Len = pCache->FileSize - pCache->CheckedEnd;
+
+        if (Len > pCache->Window)
+            Len = pCache->Window;
+
+        if (CacheRecordResidency (pCache, pCache->CheckedEnd, Len))
+        {
+            /* Without residency information nothing can be dropped safely */
+            pCache->bActive = false;
+            return;
+        }
+
+        if (pCache->bReadAhead)
+            posix_fadvise (pCache->FD, pCache->CheckedEnd, Len, POSIX_FADV_WILLNEED);
+
+        pCache->CheckedEnd += Len;
+    }
+}
+
+
+void CacheDropRange (PAGE_CACHE *pCache, size_t FirstPage, size_t Pages)
+{
+    off_t  Offset = FirstPage * pCache->PageSize;
+    size_t Len    = Pages * pCache->PageSize;
+
+    /* Pages mapped by the mmap engine are not dropped by the kernel while they are mapped */
+    if (pCache->pMap)
+    {
+        if ((size_t) Offset + Len > pCache->FileSize)
+            madvise (pCache->pMap + Offset, pCache->FileSize - Offset, MADV_DONTNEED);
+        else
+            madvise (pCache->pMap + Offset, Len, MADV_DONTNEED);
+    }
+
+    posix_fadvise (pCache->FD, Offset, Len, POSIX_FADV_DONTNEED);
+    pCache->PagesDropped += Pages;
+}
+
+
+bool CacheIsHole (PAGE_CACHE *pCache, size_t Page)
+{
+    /* Pages are checked in ascending order. The extent position only moves forward */
+    off_t Start = Page * pCache->PageSize;
+    const SPARSE_EXTENT *pExtent = NULL;
+
+    if (NULL == pCache->pSparse)
+        return false;
+
+    while (pCache->Extent < pCache->pSparse->Count)
+    {
+        pExtent = &pCache->pSparse->pExtents[pCache->Extent];
+
+        if (Start < (off_t) (pExtent->Offset + pExtent->Length))
+            return (Start + (off_t) pCache->PageSize <= pExtent->Offset);
+
+        pCache->Extent++;
+    }
+
+    return true;
+}
+
+
+void CacheRelease (PAGE_CACHE *pCache, off_t Pos)
+{
+    /* Drop streamed pages up to Pos, unless they were cached before the backup read them */
+    size_t Page     = 0;
+    size_t EndPage  = 0;
+    size_t RunStart = 0;
+    size_t RunLen   = 0;
+
+    if (false == pCache->bActive)
+        return;
+
+    if (Pos > pCache->CheckedEnd)
+        Pos = pCache->CheckedEnd;
+
+    if (Pos >= (off_t) pCache->FileSize)
+        EndPage = (pCache->FileSize + pCache->PageSize - 1) / pCache->PageSize;
+    else
+        EndPage = Pos / pCache->PageSize;
+
+    for (Page = pCache->ReleasedPages; Page < EndPage; Page++)
+    {
+        if (CacheIsHole (pCache, Page))
+        {
+            if (RunLen)
+                CacheDropRange (pCache, RunStart, RunLen);
+
+            RunLen = 0;
+            continue;
+        }
+
+        if (pCache->pResident[Page / 8] & (1 << (Page % 8)))
+        {
+            pCache->PagesPreserved++;
+
+            if (RunLen)
+                CacheDropRange (pCache, RunStart, RunLen);
+
+            RunLen = 0;
+            continue;
+        }
+
+        if (0 == RunLen)
+            RunStart = Page;
+
+        RunLen++;
+    }
+
+    if (RunLen)
+        CacheDropRange (pCache, RunStart, RunLen);
+
+    if (EndPage > pCache->ReleasedPages)
+        pCache->ReleasedPages = EndPage;
+}
+
+
+void CacheClose (PAGE_CACHE *pCache)
+{
+    if (pCache->bActive)
+        CacheRelease (pCache, pCache->FileSize);
+
+    if (pCache->pResident)
+    {
+        free (pCache->pResident);
+        pCache->pResident = NULL;
+    }
+
+    if (pCache->pVec)
+    {
+        free (pCache->pVec);
+        pCache->pVec = NULL;
+    }
+
+    pCache->bActive = false;
+}
+
+
+bool CacheResidencyVisible (int FD)
+{
+    /* mincore reports every page as resident for files the caller does not own and cannot write to.
+       Domino databases are owned by the server user. Other files are streamed without dropping pages */
+
+    struct stat Filestat = {0};
+    char szProcFD[100] = {0};
+
+    if (0 == geteuid())
+        return true;
+
+    if (fstat (FD, &Filestat))
+        return false;
+
+    if (Filestat.st_uid == geteuid())
+        return true;
+
+    snprintf (szProcFD, sizeof (szProcFD), "/proc/self/fd/%d", FD);
+
+    return (0 == access (szProcFD, W_OK));
+}
+
+
+long PrefetchResidentPages (int FD, size_t Len, unsigned char **retppResident)
+{
+    /* Returns the number of cached pages of the first Len bytes or -1. The bitmap is returned for the page cache of the backup */
+    size_t i     = 0;
+    size_t Pages = 0;
+    long   Count = -1;
+    PAGE_CACHE Cache;
+
+    if (0 == Len)
+        return -1;
+
+    memset (&Cache, 0, sizeof (Cache));
+    Cache.FD       = FD;
+    Cache.PageSize = sysconf (_SC_PAGESIZE);
+
+    Pages = (Len + Cache.PageSize - 1) / Cache.PageSize;
+
+    Cache.pResident = (unsigned char *) calloc (1, Pages/8 + 1);
+    Cache.pVec      = (unsigned char *) malloc (Pages + 1);
+
+    if (Cache.pResident && Cache.pVec && (0 == CacheRecordResidency (&Cache, 0, Len)))
+    {
+        Count = 0;
+
+        for (i=0; i < Pages; i++)
+        {
+            if (Cache.pResident[i/8] & (1 << (i%8)))
+                Count++;
+        }
+
+        if (retppResident)
+        {
+            *retppResident  = Cache.pResident;
+            Cache.pResident = NULL;
+        }
+    }
+
+    free (Cache.pResident);
+    free (Cache.pVec);
+
+    return Count;
+}
+
+
+void PrefetchCacheResidency (PAGE_CACHE *pCache)
+{
+    /* The head read ahead by the prefetch thread must not look like pages Domino had cached */
+    int    i = 0;
+    PREFETCH      *pPrefetch = g_pPrefetch;
+    PREFETCH_SLOT *pSlot     = NULL;
+
+    struct stat Filestat;
+
+    if ((NULL == pPrefetch) || fstat (pCache->FD, &Filestat))
+        return;
+
+    pthread_mutex_lock (&pPrefetch->Mutex);
+
+    for (i=0; i < pPrefetch->Depth; i++)
+    {
+        pSlot = &pPrefetch->Slots[i];
+
+        if ((NULL == pSlot->pResident) || (pSlot->Dev != Filestat.st_dev) || (pSlot->Inode != Filestat.st_ino) || (pSlot->HeadSize > pCache->FileSize))
+            continue;
+
+        memcpy (pCache->pResident, pSlot->pResident, (pSlot->HeadSize + pCache->PageSize - 1) / pCache->PageSize / 8 + 1);
+        pCache->CheckedEnd = pSlot->HeadSize;
+        break;
+    }
+
+    pthread_mutex_unlock (&pPrefetch->Mutex);
+}
+
+
+int CacheOpen (PAGE_CACHE *pCache, int FD, unsigned char *pMap, size_t FileSize, const SPARSE_MAP *pSparse, bool bReadAhead)
+{
+    size_t Pages = 0;
+
+    memset (pCache, 0, sizeof (PAGE_CACHE));
+
+    if (0 == g_CacheDrop)
+        return 0;
+
+    pCache->FD         = FD;
+    pCache->pMap       = pMap;
+    pCache->FileSize   = FileSize;
+    pCache->PageSize   = sysconf (_SC_PAGESIZE);
+    pCache->bReadAhead = bReadAhead;
+    pCache->pSparse    = pSparse;
+    pCache->Window     = (g_ReadAheadSize + pCache->PageSize - 1) & ~(pCache->PageSize - 1);
+
+    if (0 == pCache->Window)
+        pCache->Window = MAX_BUFFER;
+
+    Pages = (FileSize + pCache->PageSize - 1) / pCache->PageSize;
+
+    pCache->pResident = (unsigned char *) calloc (1, Pages/8 + 1);
+    pCache->pVec      = (unsigned char *) malloc (pCache->Window / pCache->PageSize + 1);
+
+    if ((NULL == pCache->pResident) || (NULL == pCache->pVec))
+    {
+        CacheClose (pCache);
+        return 1;
+    }
+
+    posix_fadvise (FD, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (false == CacheResidencyVisible (FD))
+    {
+        CacheClose (pCache);
+        return 0;
+    }
+
+    pCache->bActive = true;
+
+    PrefetchCacheResidency (pCache);
+    CacheAdvance (pCache, 0);
+    return 0;
+}
+
+
+const char *RateText (size_t Rate, char *retpszBuffer, size_t BufferSize)
+{
+    if (0 == Rate)
+        snprintf (retpszBuffer, BufferSize, "unlimited");
+    else
+        snprintf (retpszBuffer, BufferSize, "%1.1f MB/sec", Rate/1024.0/1024.0);
+
+    return retpszBuffer;
+}
+
+
+int RateScheduleParse (RATE_LIMIT *pLimit, const char *pszSchedule)
+{
+    /* Comma separated time ranges with a rate like 22:00-06:00=0,12:00-13:00=200M */
+    int  StartHour = 0;
+    int  StartMin  = 0;
+    int  EndHour   = 0;
+    int  EndMin    = 0;
+    int  len       = 0;
+    const char *p  = pszSchedule;
+    RATE_RULE  *pRule = NULL;
+
+    char szRate[20+1] = {0};
+
+    pLimit->RuleCount = 0;
+
+    while (p && *p)
+    {
+        while ((' ' == *p) || (',' == *p))
+            p++;
+
+        if ('\0' == *p)
+            break;
+
+        if (pLimit->RuleCount >= RATE_LIMIT_MAX_RULES)
+            return 1;
+
+        len = 0;
+
+        if (5 != sscanf (p, "%d:%d-%d:%d=%20[^, ]%n", &StartHour, &StartMin, &EndHour, &EndMin, szRate, &len))
+            return 1;
+
+        if ((StartHour < 0) || (StartHour > 24) || (EndHour < 0) || (EndHour > 24) || (StartMin < 0) || (StartMin > 59) || (EndMin < 0) || (EndMin > 59) || !isdigit (*szRate))
+            return 1;
+
+        pRule = &pLimit->Rules[pLimit->RuleCount++];
+        pRule->Start = StartHour*60 + StartMin;
+        pRule->End   = EndHour*60 + EndMin;
+        pRule->Rate  = GetSizeValue (szRate);
+
+        p += len;
+    }
+
+    return 0;
+}
+
+
+size_t RateScheduled (const RATE_LIMIT *pLimit)
+{
+    /* First matching range wins. Outside all ranges RATE_LIMIT applies */
+    int    i   = 0;
+    int    Min = 0;
+    time_t tNow = time (NULL);
+    struct tm Now = {0};
+    const RATE_RULE *pRule = NULL;
+
+    localtime_r (&tNow, &Now);
+    Min = Now.tm_hour*60 + Now.tm_min;
+
+    for (i=0; i < pLimit->RuleCount; i++)
+    {
+        pRule = &pLimit->Rules[i];
+
+        if (pRule->Start <= pRule->End)
+        {
+            if ((Min >= pRule->Start) && (Min < pRule->End))
+                return pRule->Rate;
+        }
+        else if ((Min >= pRule->Start) || (Min < pRule->End))
+        {
+            return pRule->Rate;
+        }
+    }
+
+    return g_RateLimit;
+}
+
+
+int ThrottleReadDisk (const char *pszDevice, unsigned int Major, unsigned int Minor, unsigned long long *retpIos, unsigned long long *retpIoMsec, char *retpszDevice, size_t DeviceSize)
+{
+    /* Finds a device in /proc/diskstats by name or by major/minor. Returns I/Os completed and the time spent on them */
+    int  ret = 1;
+    unsigned int DevMajor = 0;
+    unsigned int DevMinor = 0;
+    unsigned long long Reads = 0, ReadsMerged = 0, SectorsRead = 0, ReadMsec = 0;
+    unsigned long long Writes = 0, WritesMerged = 0, SectorsWritten = 0, WriteMsec = 0;
+    FILE *fp = NULL;
+
+    char szLine[1024] = {0};
+    char szName[64+1] = {0};
+
+    fp = fopen ("/proc/diskstats", "r");
+
+    if (NULL == fp)
+        return 1;
+
+    while (fgets (szLine, sizeof (szLine), fp))
+    {
+        if (11 != sscanf (szLine, "%u %u %64s %llu %llu %llu %llu %llu %llu %llu %llu", &DevMajor, &DevMinor, szName,
+                          &Reads, &ReadsMerged, &SectorsRead, &ReadMsec, &Writes, &WritesMerged, &SectorsWritten, &WriteMsec))
+            continue;
+
+        if (pszDevice ? strcmp (pszDevice, szName) : ((DevMajor != Major) || (DevMinor != Minor)))
+            continue;
+
+        *retpIos    = Reads + Writes;
+        *retpIoMsec = ReadMsec + WriteMsec;
+
+        if (retpszDevice)
+            strdncpy (retpszDevice, szName, DeviceSize);
+
+        ret = 0;
+        break;
+    }
+
+    fclose (fp);
+    return ret;
+}
+
+
+int ThrottleReadPressure (unsigned long long *retpStallUsec)
+{
+    /* Total time some tasks were stalled on I/O from a PSI file like /proc/pressure/io or io.pressure of a cgroup v2 */
+    int  ret = 1;
+    FILE *fp = NULL;
+    char *p  = NULL;
+
+    char szLine[256] = {0};
+
+    fp = fopen (g_szThrottlePressureFile, "r");
+
+    if (NULL == fp)
+        return 1;
+
+    while (fgets (szLine, sizeof (szLine), fp))
+    {
+        if (strncmp (szLine, "some ", 5))
+            continue;
+
+        p = strstr (szLine, "total=");
+
+        if (p)
+        {
+            *retpStallUsec = strtoull (p+6, NULL, 10);
+            ret = 0;
+        }
+
+        break;
+    }
+
+    fclose (fp);
+    return ret;
+}
+
+
+void ThrottleStart (THROTTLE *pThrottle)
+{
+    struct stat Filestat = {0};
+
+    if (g_ThrottleLatency)
+    {
+        if (stat (g_szThrottleDir, &Filestat) ||
+            ThrottleReadDisk (NULL, major (Filestat.st_dev), minor (Filestat.st_dev), &pThrottle->Ios, &pThrottle->IoMsec, pThrottle->szDevice, sizeof (pThrottle->szDevice)))
+        {
+            printf ("Info: Cannot find the block device of THROTTLE_DIR: %s. Latency is not checked\n", g_szThrottleDir);
+        }
+    }
+
+    if (g_ThrottlePressure)
+    {
+        if (ThrottleReadPressure (&pThrottle->StallUsec))
+            printf ("Info: Cannot read I/O pressure from: %s. Pressure is not checked\n", g_szThrottlePressureFile);
+        else
+            pThrottle->bPressure = true;
+    }
+
+    pThrottle->bActive = (*pThrottle->szDevice || pThrottle->bPressure);
+    pThrottle->tReport = GetOSTimer();
+
+    if (pThrottle->bActive)
+    {
+        printf ("Throttle: device: %s, await target: %ld ms, pressure: %s, target: %ld%%, min rate: %1.1f MB/sec, step: %1.1f MB/sec\n",
+                *pThrottle->szDevice ? pThrottle->szDevice : "none", g_ThrottleLatency,
+                pThrottle->bPressure ? g_szThrottlePressureFile : "none", g_ThrottlePressure,
+                g_ThrottleMinRate/1024.0/1024.0, g_ThrottleStep/1024.0/1024.0);
+    }
+}
+
+
+void ThrottleSample (THROTTLE *pThrottle, time_t Interval, size_t Cap)
+{
+    /* AIMD: halve the rate when device latency or I/O pressure is above target, add THROTTLE_STEP per second while below */
+    unsigned long long Ios = 0;
+    unsigned long long IoMsec = 0;
+    unsigned long long StallUsec = 0;
+    double Await    = 0.0;
+    double Pressure = 0.0;
+    double Observed = 0.0;
+    size_t Rate = pThrottle->Rate;
+    time_t tNow = GetOSTimer();
+    bool   bAbove = false;
+
+    char szOld[40+1] = {0};
+    char szNew[40+1] = {0};
+
+    if (Interval <= 0)
+        return;
+
+    if (*pThrottle->szDevice && (0 == ThrottleReadDisk (pThrottle->szDevice, 0, 0, &Ios, &IoMsec, NULL, 0)))
+    {
+        if (Ios > pThrottle->Ios)
+            Await = (double) (IoMsec - pThrottle->IoMsec) / (Ios - pThrottle->Ios);
+
+        pThrottle->Ios    = Ios;
+        pThrottle->IoMsec = IoMsec;
+    }
+
+    if (pThrottle->bPressure && (0 == ThrottleReadPressure (&StallUsec)))
+    {
+        Pressure = (StallUsec - pThrottle->StallUsec) / (Interval * 10.0);
+
+        if (Pressure > 100.0)
+            Pressure = 100.0;
+
+        pThrottle->StallUsec = StallUsec;
+    }
+
+    /* Bytes per second the backup actually read in this interval */
+    Observed = pThrottle->Bytes * 1000.0 / Interval;
+    pThrottle->Bytes = 0;
+
+    pThrottle->Samples++;
+    pThrottle->AwaitSum    += Await;
+    pThrottle->PressureSum += Pressure;
+    pThrottle->ReportSamples++;
+    pThrottle->ReportAwaitSum    += Await;
+    pThrottle->ReportPressureSum += Pressure;
+
+    if (Await > pThrottle->AwaitMax)
+        pThrottle->AwaitMax = Await;
+
+    if (Await > pThrottle->ReportAwaitMax)
+        pThrottle->ReportAwaitMax = Await;
+
+    if (Pressure > pThrottle->PressureMax)
+        pThrottle->PressureMax = Pressure;
+
+    bAbove = (g_ThrottleLatency && (Await > g_ThrottleLatency)) || (g_ThrottlePressure && (Pressure > g_ThrottlePressure));
+
+    if (bAbove)
+    {
+        /* Without an adaptive rate yet, start from what the backup read */
+        if (0 == Rate)
+            Rate = (size_t) Observed;
+
+        if (Cap && ((0 == Rate) || (Rate > Cap)))
+            Rate = Cap;
+
+        Rate /= 2;
+
+        if (Rate < g_ThrottleMinRate)
+            Rate = g_ThrottleMinRate;
+
+        if (Rate != pThrottle->Rate)
+        {
+            printf ("Throttle: await: %1.1f ms, pressure: %1.1f%%, backup: %1.1f MB/sec above target -> rate %s -> %s\n",
+                    Await, Pressure, Observed/1024.0/1024.0, RateText (pThrottle->Rate, szOld, sizeof (szOld)), RateText (Rate, szNew, sizeof (szNew)));
+
+            pThrottle->Decreases++;
+        }
+
+        if ((0 == pThrottle->MinRate) || (Rate < pThrottle->MinRate))
+            pThrottle->MinRate = Rate;
+    }
+    else if (Rate)
+    {
+        Rate += g_ThrottleStep * Interval / 1000;
+
+        /* Released at the configured rate or when the backup does not reach the adaptive rate any more */
+        if ((Cap && (Rate >= Cap)) || ((0 == Cap) && (Observed < Rate/2)))
+        {
+            printf ("Throttle: await: %1.1f ms, pressure: %1.1f%%, backup: %1.1f MB/sec below target -> rate %s -> %s\n",
+                    Await, Pressure, Observed/1024.0/1024.0, RateText (pThrottle->Rate, szOld, sizeof (szOld)), RateText (Cap, szNew, sizeof (szNew)));
+            Rate = 0;
+        }
+    }
+
+    pThrottle->Rate = Rate;
+
+    if (tNow - pThrottle->tReport < THROTTLE_REPORT_MSEC)
+        return;
+
+    printf ("Throttle: await avg: %1.1f ms, max: %1.1f ms, pressure avg: %1.1f%%, backup: %1.1f MB/sec, rate: %s\n",
+            pThrottle->ReportAwaitSum / pThrottle->ReportSamples, pThrottle->ReportAwaitMax, pThrottle->ReportPressureSum / pThrottle->ReportSamples,
+            Observed/1024.0/1024.0, RateText (Rate ? Rate : Cap, szNew, sizeof (szNew)));
+
+    pThrottle->tReport           = tNow;
+    pThrottle->ReportSamples     = 0;
+    pThrottle->ReportAwaitSum    = 0;
+    pThrottle->ReportAwaitMax    = 0;
+    pThrottle->ReportPressureSum = 0;
+}
+
+
+void RateLimitCheck (RATE_LIMIT *pLimit)
+{
+    /* Called with the mutex held. Schedule, override file and device latency are checked once per second */
+    size_t Rate = pLimit->Cap;
+    bool   bOverride = pLimit->bOverride;
+    time_t tNow = GetOSTimer();
+    time_t Interval = 0;
+    long long tModified = 0;
+    FILE   *fp = NULL;
+    struct stat Filestat = {0};
+
+    char szRate[40+1] = {0};
+    char szOld[40+1]  = {0};
+    char szNew[40+1]  = {0};
+
+    if (pLimit->tCheck && (tNow - pLimit->tCheck < RATE_CHECK_MSEC))
+        return;
+
+    Interval = tNow - pLimit->tCheck;
+    pLimit->tCheck = tNow;
+
+    if (0 == stat (g_szRateFile, &Filestat))
+    {
+        tModified = Filestat.st_mtim.tv_sec * 1000000000LL + Filestat.st_mtim.tv_nsec;
+
+        /* Only read the file again if it was changed */
+        if ((false == pLimit->bOverride) || (tModified != pLimit->tOverride))
+        {
+            fp = fopen (g_szRateFile, "r");
+
+            if (fp && fgets (szRate, sizeof (szRate), fp) && isdigit (*szRate))
+            {
+                Rate = GetSizeValue (szRate);
+                bOverride = true;
+                pLimit->tOverride = tModified;
+            }
+
+            if (fp)
+            {
+                fclose (fp);
+                fp = NULL;
+            }
+        }
+    }
+    else
+    {
+        bOverride = false;
+    }
+
+    if (false == bOverride)
+        Rate = RateScheduled (pLimit);
+
+    if ((Rate != pLimit->Cap) || (bOverride != pLimit->bOverride))
+    {
+        printf ("Rate limit: %s -> %s (%s)\n", RateText (pLimit->Cap, szOld, sizeof (szOld)), RateText (Rate, szNew, sizeof (szNew)), bOverride ? "override" : "schedule");
+
+        pLimit->Cap       = Rate;
+        pLimit->bOverride = bOverride;
+        pLimit->Changes++;
+    }
+
+    if (pLimit->Throttle.bActive)
+        ThrottleSample (&pLimit->Throttle, Interval, pLimit->Cap);
+
+    /* The lower of the configured and the adaptive rate applies */
+    pLimit->Rate = pLimit->Cap;
+
+    if (pLimit->Throttle.Rate && ((0 == pLimit->Rate) || (pLimit->Throttle.Rate < pLimit->Rate)))
+        pLimit->Rate = pLimit->Throttle.Rate;
+
+    fflush (stdout);
+}
+
+
+long long RateLimitTake (size_t Bytes)
+{
+    /* Charge bytes read for borg to the token bucket of the running backup.
+       A read may overdraw the bucket. The reader sleeps until the debt is paid, which keeps the average rate for all streams.
+       Returns the nsec waited */
+
+    RATE_LIMIT *pLimit = g_pRateLimit;
+    long long Now  = 0;
+    long long Nsec = 0;
+    struct timespec tNow   = {0};
+    struct timespec tSleep = {0};
+    struct timespec tEnd   = {0};
+
+    if ((NULL == pLimit) || (0 == Bytes))
+        return 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &tNow);
+    Now = tNow.tv_sec * 1000000000LL + tNow.tv_nsec;
+
+    pthread_mutex_lock (&pLimit->Mutex);
+
+    RateLimitCheck (pLimit);
+    pLimit->Throttle.Bytes += Bytes;
+
+    if (pLimit->Rate)
+    {
+        /* A full bucket holds one second of data */
+        pLimit->Tokens += (Now - pLimit->tRefill) / 1000000000.0 * pLimit->Rate;
+
+        if (pLimit->Tokens > pLimit->Rate)
+            pLimit->Tokens = pLimit->Rate;
+
+        pLimit->Tokens -= Bytes;
+
+        if (pLimit->Tokens < 0)
+            Nsec = (long long) (-pLimit->Tokens / pLimit->Rate * 1000000000.0);
+    }
+    else
+    {
+        pLimit->Tokens = 0;
+    }
+
+    pLimit->tRefill = Now;
+
+    pthread_mutex_unlock (&pLimit->Mutex);
+
+    if (0 == Nsec)
+        return 0;
+
+    tSleep.tv_sec  = Nsec / 1000000000LL;
+    tSleep.tv_nsec = Nsec % 1000000000LL;
+
+    while (nanosleep (&tSleep, &tSleep) && (EINTR == errno));
+
+    clock_gettime (CLOCK_MONOTONIC, &tEnd);
+    Nsec = (tEnd.tv_sec - tNow.tv_sec) * 1000000000LL + (tEnd.tv_nsec - tNow.tv_nsec);
+
+    pthread_mutex_lock (&pLimit->Mutex);
+    pLimit->WaitNsec += Nsec;
+    pthread_mutex_unlock (&pLimit->Mutex);
+
+    return Nsec;
+}
+
+
+int RateLimitStart (RATE_LIMIT *pLimit)
+{
+    /* An override left behind by an earlier backup does not apply */
+    int  ret = 0;
+    struct timespec tNow = {0};
+
+    char szRate[40+1] = {0};
+
+    remove (g_szRateFile);
+
+    if (RateScheduleParse (pLimit, g_szRateLimitSchedule))
+    {
+        printf ("Backup ERROR: Invalid RATE_LIMIT_SCHEDULE: [%s]\n", g_szRateLimitSchedule);
+        pLimit->RuleCount = 0;
+        ret = 1;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &tNow);
+    pLimit->tRefill = tNow.tv_sec * 1000000000LL + tNow.tv_nsec;
+    pLimit->Cap     = RateScheduled (pLimit);
+    pLimit->Rate    = pLimit->Cap;
+    pLimit->tCheck  = GetOSTimer();
+
+    if (pLimit->Rate || pLimit->RuleCount)
+        printf ("Rate limit: %s, schedule: %s\n", RateText (pLimit->Rate, szRate, sizeof (szRate)), pLimit->RuleCount ? g_szRateLimitSchedule : "none");
+
+    if (g_ThrottleLatency || g_ThrottlePressure)
+        ThrottleStart (&pLimit->Throttle);
+
+    g_pRateLimit = pLimit;
+    return ret;
+}
+
+
+void RateLimitStop (RATE_LIMIT *pLimit)
+{
+    char szRate[40+1] = {0};
+
+    g_pRateLimit = NULL;
+    remove (g_szRateFile);
+
+    if (pLimit->WaitNsec || pLimit->Changes)
+        printf ("Rate limit: waited %1.1f sec, rate changes: %ld\n", pLimit->WaitNsec / 1000000000.0, pLimit->Changes);
+
+    if (pLimit->Throttle.bActive && pLimit->Throttle.Samples)
+    {
+        printf ("Throttle: backed off %ld times, lowest rate: %s, await avg: %1.1f ms, max: %1.1f ms, pressure avg: %1.1f%%, max: %1.1f%%\n",
+                pLimit->Throttle.Decreases, RateText (pLimit->Throttle.MinRate, szRate, sizeof (szRate)),
+                pLimit->Throttle.AwaitSum / pLimit->Throttle.Samples, pLimit->Throttle.AwaitMax,
+                pLimit->Throttle.PressureSum / pLimit->Throttle.Samples, pLimit->Throttle.PressureMax);
+    }
+}
+
+
+int RateLimitOverride (const char *pszRate)
+{
+    /* Change the rate of a running backup. The daemon checks the override file once per second */
+    int  ret = 0;
+    FILE *fp = NULL;
+
+    char szTmpFile[MAX_PATH+10] = {0};
+    char szRate[40+1] = {0};
+
+    if (0 == strcmp (pszRate, "schedule"))
+    {
+        remove (g_szRateFile);
+        printf ("Rate limit override removed\n");
+        goto Done;
+    }
+
+    if (!isdigit (*pszRate))
+    {
+        printf ("Invalid rate limit: %s\n", pszRate);
+        ret = 1;
+        goto Done;
+    }
+
+    if (0 == CheckProcessRunning())
+    {
+        printf ("No backup running\n");
+        ret = 1;
+        goto Done;
+    }
+
+    /* Written to a temporary file first. The daemon never reads a partial value */
+    snprintf (szTmpFile, sizeof (szTmpFile), "%s.tmp", g_szRateFile);
+
+    fp = fopen (szTmpFile, "w");
+
+    if (NULL == fp)
+    {
+        perror ("Cannot create rate limit file");
+        ret = 1;
+        goto Done;
+    }
+
+    fprintf (fp, "%s\n", pszRate);
+    fclose (fp);
+    fp = NULL;
+
+    if (rename (szTmpFile, g_szRateFile))
+    {
+        perror ("Cannot update rate limit file");
+        remove (szTmpFile);
+        ret = 1;
+        goto Done;
+    }
+
+    printf ("Rate limit override: %s\n", RateText (GetSizeValue (pszRate), szRate, sizeof (szRate)));
+
+Done:
+
+    return ret;
+}
+
+
+int SpliceToPipe (int ReadFD, off_t *pReadOffset, int WriteFD, size_t *pBytesLeft, BACKUP_STATS *pStats, PAGE_CACHE *pCache)
+{
+    /* Move data from a file or pipe into the borg pipe without copying it through user space.
+       Files are read at *pReadOffset, pipes pass NULL.
+       Returns 0 when done, 1 on error, 2 if the pipe reader is gone and -1 if splice is not supported for this descriptor pair */
+
+    ssize_t BytesMoved = 0;
+    size_t  BytesToMove = 0;
+    bool    bLimit = (NULL != pBytesLeft);
+
+    while (1)
+    {
+        if (bLimit && (0 == *pBytesLeft))
+            break;
+
+        BytesToMove = g_PipeSize ? g_PipeSize : MAX_BUFFER;
+
+        if (bLimit && (*pBytesLeft < BytesToMove))
+            BytesToMove = *pBytesLeft;
+
+        if (pCache && pReadOffset)
+            CacheAdvance (pCache, *pReadOffset);
+
+        BytesMoved = splice (ReadFD, pReadOffset, WriteFD, NULL, BytesToMove, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (BytesMoved < 0)
+        {
+            if (EINTR == errno)
+                continue;
+
+            /* Not supported for this file system or descriptor. Caller falls back to read/write */
+            if ((EINVAL == errno) || (ENOSYS == errno))
+                return -1;
+
+            perror ("Backup ERROR: splice failed");
+            return (EPIPE == errno) ? 2 : 1;
+        }
+
+        /* End of file. A limited caller handles the missing data */
+        if (0 == BytesMoved)
+            break;
+
+        pStats->BytesSpliced += BytesMoved;
+        pStats->LimitNsec    += RateLimitTake (BytesMoved);
+
+        if (bLimit)
+            *pBytesLeft -= BytesMoved;
+
+        /* Pages still referenced by the pipe can't be dropped. Stay one pipe size behind */
+        if (pCache && pReadOffset && (*pReadOffset > (off_t) g_PipeSize))
+            CacheRelease (pCache, *pReadOffset - g_PipeSize);
+    }
+
+    return 0;
+}
+
+
+/* XXH3 64 bit hash (xxHash by Yann Collet, BSD 2-Clause) with the default secret and seed 0.
+   Results are identical to xxhsum -H3 and other XXH3 implementations.
+   The stripe accumulation runs with AVX-512 or AVX2 if the CPU supports it */
+
+static const unsigned char g_Xxh3Secret[XXH3_SECRET_SIZE] =
+{
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+#define XXH_PRIME32_1  0x9E3779B1U
+#define XXH_PRIME32_2  0x85EBCA77U
+#define XXH_PRIME32_3  0xC2B2AE3DU
+#define XXH_PRIME64_1  0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3  0x165667B19E3779F9ULL
+#define XXH_PRIME64_4  0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5  0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1  0x165667919E3779F9ULL
+#define XXH_PRIME_MX2  0x9FB21C651E98DF25ULL
+
+#define XXH3_STRIPES_PER_BLOCK  ((XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / 8)
+
+typedef void (*XXH3_ACCUMULATE_FN) (uint64_t *pAcc, const unsigned char *pInput, const unsigned char *pSecret, size_t Stripes);
+typedef void (*XXH3_SCRAMBLE_FN)   (uint64_t *pAcc, const unsigned char *pSecret);
+
+
+static inline uint64_t XxhRead64 (const unsigned char *p)
+{
+    uint64_t Value = 0;
+    memcpy (&Value, p, sizeof (Value));
+    return Value;
+}
+
+
+static inline uint32_t XxhRead32 (const unsigned char *p)
+{
+    uint32_t Value = 0;
+    memcpy (&Value, p, sizeof (Value));
+    return Value;
+}
+
+
+static inline uint64_t XxhRotl64 (uint64_t Value, int Bits)
+{
+    return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+
+static inline uint64_t XxhMulFold64 (uint64_t a, uint64_t b)
+{
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 Product = (uint128) a * b;
+
+    return (uint64_t) Product ^ (uint64_t) (Product >> 64);
+}
+
+
+static inline uint64_t Xxh64Avalanche (uint64_t h)
+{
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+static inline uint64_t Xxh3Avalanche (uint64_t h)
+{
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+
+static inline uint64_t Xxh3Mix16 (const unsigned char *pInput, const unsigned char *pSecret)
+{
+    return XxhMulFold64 (XxhRead64 (pInput) ^ XxhRead64 (pSecret), XxhRead64 (pInput+8) ^ XxhRead64 (pSecret+8));
+}
+
+
+uint64_t Xxh3HashShort (const unsigned char *pInput, size_t Len)
+{
+    /* Inputs up to 240 bytes are hashed in one step */
+    const unsigned char *pSecret = g_Xxh3Secret;
+    uint64_t Acc = 0;
+    uint64_t Lo  = 0;
+    uint64_t Hi  = 0;
+    uint32_t Combined = 0;
+    size_t   i = 0;
+
+    if (0 == Len)
+        return Xxh64Avalanche (XxhRead64 (pSecret+56) ^ XxhRead64 (pSecret+64));
+
+    if (Len <= 3)
+    {
+        Combined = ((uint32_t) pInput[0] << 16) | ((uint32_t) pInput[Len >> 1] << 24) | (uint32_t) pInput[Len-1] | ((uint32_t) Len << 8);
+        return Xxh64Avalanche ((uint64_t) Combined ^ (uint64_t) (XxhRead32 (pSecret) ^ XxhRead32 (pSecret+4)));
+    }
+
+    if (Len <= 8)
+    {
+        Acc = ((uint64_t) XxhRead32 (pInput) << 32) + XxhRead32 (pInput+Len-4);
+        Acc ^= XxhRead64 (pSecret+8) ^ XxhRead64 (pSecret+16);
+        Acc ^= XxhRotl64 (Acc, 49) ^ XxhRotl64 (Acc, 24);
+        Acc *= XXH_PRIME_MX2;
+        Acc ^= (Acc >> 35) + Len;
+        Acc *= XXH_PRIME_MX2;
+        return Acc ^ (Acc >> 28);
+    }
+
+    if (Len <= 16)
+    {
+        Lo  = XxhRead64 (pInput) ^ (XxhRead64 (pSecret+24) ^ XxhRead64 (pSecret+32));
+        Hi  = XxhRead64 (pInput+Len-8) ^ (XxhRead64 (pSecret+40) ^ XxhRead64 (pSecret+48));
+        Acc = Len + __builtin_bswap64 (Lo) + Hi + XxhMulFold64 (Lo, Hi);
+        return Xxh3Avalanche (Acc);
+    }
+
+    Acc = Len * XXH_PRIME64_1;
+
+    if (Len <= 128)
+    {
+        if (Len > 32)
+        {
+            if (Len > 64)
+            {
+                if (Len > 96)
+                {
+                    Acc += Xxh3Mix16 (pInput+48, pSecret+96);
+                    Acc += Xxh3Mix16 (pInput+Len-64, pSecret+112);
+                }
+
+                Acc += Xxh3Mix16 (pInput+32, pSecret+64);
+                Acc += Xxh3Mix16 (pInput+Len-48, pSecret+80);
+            }
+
+            Acc += Xxh3Mix16 (pInput+16, pSecret+32);
+            Acc += Xxh3Mix16 (pInput+Len-32, pSecret+48);
+        }
+
+        Acc += Xxh3Mix16 (pInput, pSecret);
+        Acc += Xxh3Mix16 (pInput+Len-16, pSecret+16);
+        return Xxh3Avalanche (Acc);
+    }
+
+    for (i=0; i < 8; i++)
+        Acc += Xxh3Mix16 (pInput + 16*i, pSecret + 16*i);
+
+    Acc = Xxh3Avalanche (Acc);
+
+    for (i=8; i < Len/16; i++)
+        Acc += Xxh3Mix16 (pInput + 16*i, pSecret + 16*(i-8) + 3);
+
+    Acc += Xxh3Mix16 (pInput+Len-16, pSecret + 136 - 17);
+
+    return Xxh3Avalanche (Acc);
+}
+
+
+void Xxh3AccumulateScalar (uint64_t *pAcc, const unsigned char *pInput, const unsigned char *pSecret, size_t Stripes)
+{
+    uint64_t Data = 0;
+    uint64_t Key  = 0;
+    size_t   s = 0;
+    size_t   i = 0;
+
+    for (s=0; s < Stripes; s++)
+    {
+        for (i=0; i < XXH3_ACC_NB; i++)
+        {
+            Data = XxhRead64 (pInput + 8*i);
+            Key  = Data ^ XxhRead64 (pSecret + 8*i);
+            pAcc[i ^ 1] += Data;
+            pAcc[i]     += (Key & 0xFFFFFFFF) * (Key >> 32);
+        }
+
+        pInput  += XXH3_STRIPE_LEN;
+        pSecret += 8;
+    }
+}
+
+
+void Xxh3ScrambleScalar (uint64_t *pAcc, const unsigned char *pSecret)
+{
+    size_t i = 0;
+
+    for (i=0; i < XXH3_ACC_NB; i++)
+    {
+        pAcc[i] ^= pAcc[i] >> 47;
+        pAcc[i] ^= XxhRead64 (pSecret + 8*i);
+        pAcc[i] *= XXH_PRIME32_1;
+    }
+}
+
+
+#ifdef NSHBORG_SIMD_X86
+
+__attribute__ ((target ("avx2")))
+void Xxh3AccumulateAvx2 (uint64_t *pAcc, const unsigned char *pInput, const unsigned char *pSecret, size_t Stripes)
+{
+    __m256i Acc0 = _mm256_loadu_si256 ((const __m256i *) pAcc);
+    __m256i Acc1 = _mm256_loadu_si256 ((const __m256i *) (pAcc+4));
+    __m256i Data, Key, Product;
+    size_t  s = 0;
+
+    for (s=0; s < Stripes; s++)
+    {
+        Data    = _mm256_loadu_si256 ((const __m256i *) pInput);
+        Key     = _mm256_xor_si256 (Data, _mm256_loadu_si256 ((const __m256i *) pSecret));
+        Product = _mm256_mul_epu32 (Key, _mm256_srli_epi64 (Key, 32));
+        Acc0    = _mm256_add_epi64 (Acc0, _mm256_add_epi64 (Product, _mm256_shuffle_epi32 (Data, _MM_SHUFFLE (1, 0, 3, 2))));
+
+        Data    = _mm256_loadu_si256 ((const __m256i *) (pInput+32));
+        Key     = _mm256_xor_si256 (Data, _mm256_loadu_si256 ((const __m256i *) (pSecret+32)));
+        Product = _mm256_mul_epu32 (Key, _mm256_srli_epi64 (Key, 32));
+        Acc1    = _mm256_add_epi64 (Acc1, _mm256_add_epi64 (Product, _mm256_shuffle_epi32 (Data, _MM_SHUFFLE (1, 0, 3, 2))));
+
+        pInput  += XXH3_STRIPE_LEN;
+        pSecret += 8;
+    }
+
+    _mm256_storeu_si256 ((__m256i *) pAcc, Acc0);
+    _mm256_storeu_si256 ((__m256i *) (pAcc+4), Acc1);
+}
+
+
+__attribute__ ((target ("avx2")))
+void Xxh3ScrambleAvx2 (uint64_t *pAcc, const unsigned char *pSecret)
+{
+    const __m256i Prime = _mm256_set1_epi32 ((int) XXH_PRIME32_1);
+    __m256i Acc, Key;
+    size_t  i = 0;
+
+    for (i=0; i < 2; i++)
+    {
+        Acc = _mm256_loadu_si256 ((const __m256i *) (pAcc + 4*i));
+        Key = _mm256_loadu_si256 ((const __m256i *) (pSecret + 32*i));
+        Acc = _mm256_xor_si256 (_mm256_xor_si256 (Acc, _mm256_srli_epi64 (Acc, 47)), Key);
+        Acc = _mm256_add_epi64 (_mm256_mul_epu32 (Acc, Prime), _mm256_slli_epi64 (_mm256_mul_epu32 (_mm256_srli_epi64 (Acc, 32), Prime), 32));
+        _mm256_storeu_si256 ((__m256i *) (pAcc + 4*i), Acc);
+    }
+}
+
+
+__attribute__ ((target ("avx512f")))
+void Xxh3AccumulateAvx512 (uint64_t *pAcc, const unsigned char *pInput, const unsigned char *pSecret, size_t Stripes)
+{
+    __m512i Acc = _mm512_loadu_si512 ((const void *) pAcc);
+    __m512i Data, Key, Product;
+    size_t  s = 0;
+
+    for (s=0; s < Stripes; s++)
+    {
+        Data    = _mm512_loadu_si512 ((const void *) pInput);
+        Key     = _mm512_xor_si512 (Data, _mm512_loadu_si512 ((const void *) pSecret));
+        Product = _mm512_mul_epu32 (Key, _mm512_srli_epi64 (Key, 32));
+        Acc     = _mm512_add_epi64 (Acc, _mm512_add_epi64 (Product, _mm512_shuffle_epi32 (Data, (_MM_PERM_ENUM) _MM_SHUFFLE (1, 0, 3, 2))));
+
+        pInput  += XXH3_STRIPE_LEN;
+        pSecret += 8;
+    }
+
+    _mm512_storeu_si512 ((void *) pAcc, Acc);
+}
+
+
+__attribute__ ((target ("avx512f")))
+void Xxh3ScrambleAvx512 (uint64_t *pAcc, const unsigned char *pSecret)
+{
+    const __m512i Prime = _mm512_set1_epi32 ((int) XXH_PRIME32_1);
+    __m512i Acc = _mm512_loadu_si512 ((const void *) pAcc);
+
+    Acc = _mm512_xor_si512 (_mm512_xor_si512 (Acc, _mm512_srli_epi64 (Acc, 47)), _mm512_loadu_si512 ((const void *) pSecret));
+    Acc = _mm512_add_epi64 (_mm512_mul_epu32 (Acc, Prime), _mm512_slli_epi64 (_mm512_mul_epu32 (_mm512_srli_epi64 (Acc, 32), Prime), 32));
+
+    _mm512_storeu_si512 ((void *) pAcc, Acc);
+}
+
+#endif
+
+/* Implementation selected at runtime */
+XXH3_ACCUMULATE_FN g_pXxh3Accumulate = Xxh3AccumulateScalar;
+XXH3_SCRAMBLE_FN   g_pXxh3Scramble   = Xxh3ScrambleScalar;
+int                g_HashImpl        = -1;
+
+
+const char *HashImplName (int Impl)
+{
+    switch (Impl)
+    {
+        case HASH_IMPL_SCALAR: return "scalar";
+        case HASH_IMPL_AVX2:   return "avx2";
+        case HASH_IMPL_AVX512: return "avx512";
+        default:               return "unknown";
+    }
+}
+
+
+int GetHashImpl (const char *pszName)
+{
+    /* Returns -1 for auto and -2 for an unknown name */
+    int Impl = 0;
+
+    if (0 == strcmp (pszName, "auto"))
+        return -1;
+
+    for (Impl = 0; Impl < HASH_IMPL_COUNT; Impl++)
+    {
+        if (0 == strcmp (pszName, HashImplName (Impl)))
+            return Impl;
+    }
+
+    return -2;
+}
+
+
+bool HashImplSupported (int Impl)
+{
+    switch (Impl)
+    {
+        case HASH_IMPL_SCALAR:
+            return true;
+
+#ifdef NSHBORG_SIMD_X86
+        case HASH_IMPL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports ("avx2");
+
+        case HASH_IMPL_AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports ("avx512f");
+#endif
+
+        default:
+            return false;
+    }
+}
+
+
+int HashSetImpl (int Impl)
+{
+    /* Select an implementation. -1 selects the fastest one supported by the CPU */
+
+    if (Impl < 0)
+    {
+        for (Impl = HASH_IMPL_COUNT-1; Impl > HASH_IMPL_SCALAR; Impl--)
+        {
+            if (HashImplSupported (Impl))
+                break;
+        }
+    }
+
+    if (false == HashImplSupported (Impl))
+        return 1;
+
+    switch (Impl)
+    {
+#ifdef NSHBORG_SIMD_X86
+        case HASH_IMPL_AVX2:
+            g_pXxh3Accumulate = Xxh3AccumulateAvx2;
+            g_pXxh3Scramble   = Xxh3ScrambleAvx2;
+            break;
+
+        case HASH_IMPL_AVX512:
+            g_pXxh3Accumulate = Xxh3AccumulateAvx512;
+            g_pXxh3Scramble   = Xxh3ScrambleAvx512;
+            break;
+#endif
+
+        default:
+            g_pXxh3Accumulate = Xxh3AccumulateScalar;
+            g_pXxh3Scramble   = Xxh3ScrambleScalar;
+            break;
+    }
+
+    g_HashImpl = Impl;
+    return 0;
+}
+
+
+void Xxh3ConsumeStripes (HASH_STATE *pState, const unsigned char *pInput, size_t Stripes)
+{
+    /* The accumulators are scrambled after each block of 16 stripes */
+    size_t StripesToEnd = 0;
+
+    while (Stripes)
+    {
+        StripesToEnd = XXH3_STRIPES_PER_BLOCK - pState->StripesInBlock;
+
+        if (StripesToEnd > Stripes)
+        {
+            g_pXxh3Accumulate (pState->Acc, pInput, g_Xxh3Secret + 8*pState->StripesInBlock, Stripes);
+            pState->StripesInBlock += Stripes;
+            break;
+        }
+
+        g_pXxh3Accumulate (pState->Acc, pInput, g_Xxh3Secret + 8*pState->StripesInBlock, StripesToEnd);
+        g_pXxh3Scramble (pState->Acc, g_Xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+        pState->StripesInBlock = 0;
+
+        pInput  += StripesToEnd * XXH3_STRIPE_LEN;
+        Stripes -= StripesToEnd;
+    }
+}
+
+
+void HashInit (HASH_STATE *pState, int Type)
+{
+    static const uint64_t InitAcc[XXH3_ACC_NB] = { XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3, XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1 };
+
+    memset (pState, 0, sizeof (HASH_STATE));
+    pState->Type = Type;
+
+    if (HASH_TYPE_NONE == Type)
+        return;
+
+    if (g_HashImpl < 0)
+        HashSetImpl (-1);
+
+    memcpy (pState->Acc, InitAcc, sizeof (InitAcc));
+}
+
+
+void HashUpdate (HASH_STATE *pState, const unsigned char *pInput, size_t Len)
+{
+    /* Full blocks are consumed directly from the input. At least one byte stays buffered for the final stripe */
+    const unsigned char *pEnd = pInput + Len;
+    size_t Load = 0;
+    size_t Stripes = 0;
+    struct timespec tStart = {0};
+    struct timespec tEnd   = {0};
+
+    if ((HASH_TYPE_NONE == pState->Type) || (0 == Len))
+        return;
+
+    clock_gettime (CLOCK_MONOTONIC, &tStart);
+
+    pState->TotalLen += Len;
+
+    if (pState->Buffered + Len <= XXH3_BUFFER_SIZE)
+    {
+        memcpy (pState->Buffer + pState->Buffered, pInput, Len);
+        pState->Buffered += Len;
+        goto Done;
+    }
+
+    if (pState->Buffered)
+    {
+        Load = XXH3_BUFFER_SIZE - pState->Buffered;
+        memcpy (pState->Buffer + pState->Buffered, pInput, Load);
+        pInput += Load;
+
+        Xxh3ConsumeStripes (pState, pState->Buffer, XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN);
+        pState->Buffered = 0;
+    }
+
+    if ((size_t) (pEnd - pInput) > XXH3_BUFFER_SIZE)
+    {
+        /* Leave between 1 and XXH3_STRIPE_LEN bytes for the buffer */
+        Stripes = ((pEnd - pInput) - 1) / XXH3_STRIPE_LEN;
+
+        Xxh3ConsumeStripes (pState, pInput, Stripes);
+        pInput += Stripes * XXH3_STRIPE_LEN;
+
+        /* The last consumed stripe might be needed for the final stripe in the digest */
+        memcpy (pState->Buffer + XXH3_BUFFER_SIZE - XXH3_STRIPE_LEN, pInput - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+    }
+
+    memcpy (pState->Buffer, pInput, pEnd - pInput);
+    pState->Buffered = pEnd - pInput;
+
+Done:
+
+    clock_gettime (CLOCK_MONOTONIC, &tEnd);
+    pState->Nsec += (tEnd.tv_sec - tStart.tv_sec) * 1000000000LL + (tEnd.tv_nsec - tStart.tv_nsec);
+}
+
+
+void HashUpdateZeros (HASH_STATE *pState, size_t Len)
+{
+    /* Holes are hashed as the zeros they read as */
+    static const unsigned char Zeros[64*1024] = {0};
+    size_t Chunk = 0;
+
+    if (HASH_TYPE_NONE == pState->Type)
+        return;
+
+    while (Len)
+    {
+        Chunk = (Len < sizeof (Zeros)) ? Len : sizeof (Zeros);
+        HashUpdate (pState, Zeros, Chunk);
+        Len -= Chunk;
+    }
+}
+
+
+uint64_t HashDigest (const HASH_STATE *pState)
+{
+    /* The state is not modified, hashing could continue */
+    uint64_t Acc[XXH3_ACC_NB];
+    uint64_t Result = 0;
+    unsigned char LastStripe[XXH3_STRIPE_LEN];
+    const unsigned char *pLastStripe = NULL;
+    const unsigned char *pSecret = g_Xxh3Secret;
+    HASH_STATE Copy;
+    size_t Stripes = 0;
+    size_t CatchUp = 0;
+    size_t i = 0;
+
+    if (HASH_TYPE_NONE == pState->Type)
+        return 0;
+
+    if (pState->TotalLen <= XXH3_MIDSIZE_MAX)
+        return Xxh3HashShort (pState->Buffer, pState->TotalLen);
+
+    memcpy (&Copy, pState, sizeof (Copy));
+
+    if (Copy.Buffered >= XXH3_STRIPE_LEN)
+    {
+        Stripes = (Copy.Buffered - 1) / XXH3_STRIPE_LEN;
+        Xxh3ConsumeStripes (&Copy, Copy.Buffer, Stripes);
+        pLastStripe = Copy.Buffer + Copy.Buffered - XXH3_STRIPE_LEN;
+    }
+    else
+    {
+        /* Last stripe is completed with the end of the previously consumed data */
+        CatchUp = XXH3_STRIPE_LEN - Copy.Buffered;
+        memcpy (LastStripe, Copy.Buffer + XXH3_BUFFER_SIZE - CatchUp, CatchUp);
+        memcpy (LastStripe + CatchUp, Copy.Buffer, Copy.Buffered);
+        pLastStripe = LastStripe;
+    }
+
+    memcpy (Acc, Copy.Acc, sizeof (Acc));
+    g_pXxh3Accumulate (Acc, pLastStripe, pSecret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - 7, 1);
+
+    Result = Copy.TotalLen * XXH_PRIME64_1;
+
+    for (i=0; i < 4; i++)
+        Result += XxhMulFold64 (Acc[2*i] ^ XxhRead64 (pSecret + 11 + 16*i), Acc[2*i+1] ^ XxhRead64 (pSecret + 11 + 16*i + 8));
+
+    return Xxh3Avalanche (Result);
+}
+
+
+const char *HashTypeName (int Type)
+{
+    return (HASH_TYPE_XXH3 == Type) ? "xxh3" : "none";
+}
+
+
+int ChunkerParse (const char *pszParams, CHUNKER *retpChunker)
+{
+    /* borg --chunker-params: buzhash,MIN_EXP,MAX_EXP,MASK_BITS,WINDOW (the prefix is optional), fixed,BLOCK_SIZE[,HEADER_SIZE] or default */
+    int  MinExp  = 0;
+    int  MaxExp  = 0;
+    int  MaskBits = 0;
+    long Window  = 0;
+    long Block   = 0;
+    long Header  = 0;
+    int  Fields  = 0;
+    char szEnd[2] = {0};
+
+    memset (retpChunker, 0, sizeof (CHUNKER));
+
+    if (IsNullStr (pszParams))
+        return 1;
+
+    snprintf (retpChunker->szParams, sizeof (retpChunker->szParams), "%s", pszParams);
+
+    if (0 == strcmp (pszParams, "default"))
+        pszParams = CHUNKER_DEFAULT;
+
+    if (0 == strncmp (pszParams, "fixed,", 6))
+    {
+        /* Nothing may follow the block size or the header size */
+        Fields = sscanf (pszParams+6, "%ld%1s", &Block, szEnd);
+
+        if (2 == Fields)
+            Fields = (2 == sscanf (pszParams+6, "%ld,%ld%1s", &Block, &Header, szEnd)) ? 2 : 0;
+
+        if ((Fields < 1) || (Block < 64) || (Header < 0) || (Block > CHUNKER_MAX_SIZE) || (Header > CHUNKER_MAX_SIZE))
+            return 1;
+
+        retpChunker->Algorithm  = CHUNKER_FIXED;
+        retpChunker->BlockSize  = Block;
+        retpChunker->HeaderSize = Header;
+        retpChunker->MaxSize    = (Block > Header) ? Block : Header;
+        return 0;
+    }
+
+    if (0 == strncmp (pszParams, "buzhash,", 8))
+        pszParams += 8;
+
+    if (4 != sscanf (pszParams, "%d,%d,%d,%ld%1s", &MinExp, &MaxExp, &MaskBits, &Window, szEnd))
+        return 1;
+
+    /* Limits and odd window size checked by borg */
+    if ((MinExp < 6) || (MinExp > MaskBits) || (MaskBits > MaxExp) || (MaxExp > 23) || (Window < 1) || (0 == (Window & 1)))
+        return 1;
+
+    retpChunker->Algorithm = CHUNKER_BUZHASH;
+    retpChunker->MinSize   = 1UL << MinExp;
+    retpChunker->MaxSize   = 1UL << MaxExp;
+    retpChunker->Mask      = (1U << MaskBits) - 1;
+    retpChunker->Window    = Window;
+
+    return 0;
+}
+
+
+static inline uint32_t Rotl32 (uint32_t Value, unsigned Bits)
+{
+    Bits &= 31;
+    return Bits ? (Value << Bits) | (Value >> (32 - Bits)) : Value;
+}
+
+
+void BuzhashInitTable()
+{
+    /* borg seeds the table with a key of the repository. Any random table cuts at the same rate */
+    uint64_t State = 0x9e3779b97f4a7c15ULL;
+    uint64_t z = 0;
+    int i = 0;
+
+    for (i=0; i < 256; i++)
+    {
+        State += 0x9e3779b97f4a7c15ULL;
+        z = State;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g_BuzhashTable[i] = (uint32_t) (z ^ (z >> 31));
+    }
+}
+
+
+void SketchBuilderInit (SKETCH_BUILDER *pBuilder)
+{
+    /* Chunks are cut like borg cuts them with CHUNKER_PARAMS, so the sketch sees the data borg deduplicates */
+    memset (pBuilder, 0, sizeof (SKETCH_BUILDER));
+
+    if (ChunkerParse (*g_szChunkerParams ? g_szChunkerParams : CHUNKER_DEFAULT, &pBuilder->Chunker) ||
+        ((CHUNKER_BUZHASH == pBuilder->Chunker.Algorithm) && (pBuilder->Chunker.Window > SKETCH_MAX_WINDOW)))
+    {
+        ChunkerParse (CHUNKER_DEFAULT, &pBuilder->Chunker);
+    }
+
+    pBuilder->Start = (pBuilder->Chunker.MinSize > pBuilder->Chunker.Window) ? pBuilder->Chunker.MinSize : pBuilder->Chunker.Window;
+    HashInit (&pBuilder->Fp, HASH_TYPE_XXH3);
+}
+
+
+void SketchAddChunk (SKETCH_BUILDER *pBuilder)
+{
+    /* Bottom-k sample: the k smallest fingerprints. The same chunk is sampled in every version of the database */
+    uint64_t Fp = HashDigest (&pBuilder->Fp) ^ pBuilder->ChunkLen;
+    int      Pos = pBuilder->Count;
+
+    pBuilder->Chunks++;
+
+    if ((pBuilder->Count == g_SketchSamples) && (Fp >= pBuilder->Samples[pBuilder->Count-1].Fp))
+        goto Done;
+
+    while ((Pos > 0) && (pBuilder->Samples[Pos-1].Fp > Fp))
+        Pos--;
+
+    /* Repeated chunks are stored once by borg */
+    if ((Pos > 0) && (pBuilder->Samples[Pos-1].Fp == Fp))
+        goto Done;
+
+    if (pBuilder->Count < g_SketchSamples)
+        pBuilder->Count++;
+
+    memmove (&pBuilder->Samples[Pos+1], &pBuilder->Samples[Pos], (pBuilder->Count - 1 - Pos) * sizeof (SKETCH_SAMPLE));
+    pBuilder->Samples[Pos].Fp  = Fp;
+    pBuilder->Samples[Pos].Len = pBuilder->ChunkLen;
+
+Done:
+
+    pBuilder->Hash     = 0;
+    pBuilder->ChunkLen = 0;
+    pBuilder->RingPos  = 0;
+    HashInit (&pBuilder->Fp, HASH_TYPE_XXH3);
+}
+
+
+void SketchUpdate (SKETCH_BUILDER *pBuilder, const unsigned char *pData, size_t Len)
+{
+    /* Rolling buzhash over the window of the current chunk. Same cut points as ChunkerCut() on contiguous data */
+    const CHUNKER *pChunker = &pBuilder->Chunker;
+    unsigned char Out = 0;
+    size_t i    = 0;
+    size_t Span = 0;
+    bool   bCut = false;
+
+    for (i=0; i < Len; i++)
+    {
+        if (CHUNKER_BUZHASH == pChunker->Algorithm)
+        {
+            Out = pBuilder->Ring[pBuilder->RingPos];
+            pBuilder->Ring[pBuilder->RingPos] = pData[i];
+
+            if (++pBuilder->RingPos == pChunker->Window)
+                pBuilder->RingPos = 0;
+
+            pBuilder->Hash = Rotl32 (pBuilder->Hash, 1) ^ g_BuzhashTable[pData[i]];
+
+            if (pBuilder->ChunkLen >= pChunker->Window)
+                pBuilder->Hash ^= Rotl32 (g_BuzhashTable[Out], pChunker->Window);
+
+            pBuilder->ChunkLen++;
+
+            bCut = ((pBuilder->ChunkLen >= pBuilder->Start) && (0 == (pBuilder->Hash & pChunker->Mask))) || (pBuilder->ChunkLen == pChunker->MaxSize);
+        }
+        else
+        {
+            pBuilder->ChunkLen++;
+
+            bCut = (pBuilder->ChunkLen == (((0 == pBuilder->Chunks) && pChunker->HeaderSize) ? pChunker->HeaderSize : pChunker->BlockSize));
+        }
+
+        if (bCut)
+        {
+            HashUpdate (&pBuilder->Fp, pData + Span, i + 1 - Span);
+            SketchAddChunk (pBuilder);
+            Span = i + 1;
+        }
+    }
+
+    if (Span < Len)
+        HashUpdate (&pBuilder->Fp, pData + Span, Len - Span);
+}
+
+
+double SketchNewFraction (const SKETCH_SAMPLE *pOld, int OldCount, const SKETCH_SAMPLE *pNew, int NewCount, int Samples)
+{
+    /* Share of the new data in chunks the old version did not have. Only fingerprints below the limit of both samples are comparable */
+    uint64_t Limit = UINT64_MAX;
+    size_t   Bytes = 0;
+    size_t   NewBytes = 0;
+    int      i = 0;
+    int      j = 0;
+
+    if (OldCount >= Samples)
+        Limit = pOld[OldCount-1].Fp;
+
+    if ((NewCount >= Samples) && (pNew[NewCount-1].Fp < Limit))
+        Limit = pNew[NewCount-1].Fp;
+
+    for (i=0; (i < NewCount) && (pNew[i].Fp <= Limit); i++)
+    {
+        while ((j < OldCount) && (pOld[j].Fp < pNew[i].Fp))
+            j++;
+
+        Bytes += pNew[i].Len;
+
+        if ((j >= OldCount) || (pOld[j].Fp != pNew[i].Fp))
+            NewBytes += pNew[i].Len;
+    }
+
+    return Bytes ? (double) NewBytes / Bytes : 0.0;
+}
+
+
+void SketchStoreFree (SKETCH_STORE *pStore)
+{
+    size_t i = 0;
+
+    for (i=0; i < pStore->Count; i++)
+    {
+        free (pStore->pSketches[i].pszFileName);
+        free (pStore->pSketches[i].pSamples);
+    }
+
+    free (pStore->pSketches);
+    pStore->pSketches = NULL;
+    pStore->Count = 0;
+    pStore->Alloc = 0;
+    pStore->Sorted = 0;
+}
+
+
+int SketchCompare (const void *p1, const void *p2)
+{
+    return strcmp (((const SKETCH *) p1)->pszFileName, ((const SKETCH *) p2)->pszFileName);
+}
+
+
+SKETCH *SketchFind (SKETCH_STORE *pStore, const char *pszFileName)
+{
+    size_t i = 0;
+    SKETCH Key;
+    SKETCH *pSketch = NULL;
+
+    Key.pszFileName = (char *) pszFileName;
+
+    if (pStore->Sorted)
+    {
+        pSketch = (SKETCH *) bsearch (&Key, pStore->pSketches, pStore->Sorted, sizeof (SKETCH), SketchCompare);
+
+        if (pSketch)
+            return pSketch;
+    }
+
+    for (i=pStore->Sorted; i < pStore->Count; i++)
+    {
+        if (0 == strcmp (pStore->pSketches[i].pszFileName, pszFileName))
+            return &pStore->pSketches[i];
+    }
+
+    return NULL;
+}
+
+
+SKETCH *SketchAdd (SKETCH_STORE *pStore, const char *pszFileName)
+{
+    SKETCH *pNew    = NULL;
+    SKETCH *pSketch = NULL;
+
+    if (pStore->Count == pStore->Alloc)
+    {
+        pNew = (SKETCH *) realloc (pStore->pSketches, (pStore->Alloc + 1024) * sizeof (SKETCH));
+
+        if (NULL == pNew)
+            return NULL;
+
+        pStore->pSketches = pNew;
+        pStore->Alloc    += 1024;
+    }
+
+    pSketch = &pStore->pSketches[pStore->Count];
+    memset (pSketch, 0, sizeof (SKETCH));
+
+    pSketch->pszFileName = strdup (pszFileName);
+
+    if (NULL == pSketch->pszFileName)
+        return NULL;
+
+    pStore->Count++;
+
+    return pSketch;
+}
+
+
+int SketchStoreLoad (SKETCH_STORE *pStore, const char *pszSketchFile, time_t tMin)
+{
+    /* One tab separated line per database with the name last. Samples are fingerprint:length pairs. Databases not backed up since tMin are dropped */
+    int     Field  = 0;
+    char    *pFields[7] = {0};
+    char    *p     = NULL;
+    char    *pLine = NULL;
+    size_t  LineSize = 0;
+    FILE    *fp    = NULL;
+    SKETCH  *pSketch = NULL;
+
+    fp = fopen (pszSketchFile, "r");
+
+    if (NULL == fp)
+        return 1;
+
+    while (getline (&pLine, &LineSize, fp) > 0)
+    {
+        p = strchr (pLine, '\n');
+
+        if (p)
+            *p = '\0';
+
+        if (0 == strncmp (pLine, SKETCH_RATE_HEADER, strlen (SKETCH_RATE_HEADER)))
+            pStore->Rate = atof (pLine + strlen (SKETCH_RATE_HEADER));
+
+        if ('#' == *pLine)
+            continue;
+
+        p = pLine;
+
+        for (Field=0; Field < 7; Field++)
+        {
+            pFields[Field] = p;
+            p = strchr (p, '\t');
+
+            if (NULL == p)
+                break;
+
+            *p++ = '\0';
+        }
+
+        if ((Field < 7) || ('\0' == *p))
+            continue;
+
+        if (strtoll (pFields[2], NULL, 10) < tMin)
+            continue;
+
+        pSketch = SketchAdd (pStore, p);
+
+        if (NULL == pSketch)
+            break;
+
+        pSketch->Size        = strtoull (pFields[0], NULL, 10);
+        pSketch->Mtime       = strtoll  (pFields[1], NULL, 10);
+        pSketch->tBackup     = strtoll  (pFields[2], NULL, 10);
+        pSketch->tPrev       = strtoll  (pFields[3], NULL, 10);
+        pSketch->NewFraction = atof     (pFields[4]);
+        pSketch->Chunks      = atol     (pFields[5]);
+        pSketch->pSamples    = (SKETCH_SAMPLE *) malloc (SKETCH_MAX_SAMPLES * sizeof (SKETCH_SAMPLE));
+
+        if (NULL == pSketch->pSamples)
+            break;
+
+        for (p = pFields[6]; *p && (pSketch->Count < SKETCH_MAX_SAMPLES); )
+        {
+            pSketch->pSamples[pSketch->Count].Fp  = strtoull (p, &p, 16);
+
+            if (':' != *p)
+                break;
+
+            pSketch->pSamples[pSketch->Count].Len = strtoul (p+1, &p, 10);
+            pSketch->Count++;
+
+            if (',' == *p)
+                p++;
+        }
+    }
+
+    free (pLine);
+    fclose (fp);
+
+    qsort (pStore->pSketches, pStore->Count, sizeof (SKETCH), SketchCompare);
+    pStore->Sorted = pStore->Count;
+
+    return 0;
+}
+
+
+int SketchStoreSave (SKETCH_STORE *pStore, const char *pszSketchFile)
+{
+    /* Written to a new file which replaces the old one */
+    int    ret = 0;
+    int    j   = 0;
+    size_t i   = 0;
+    FILE   *fp = NULL;
+    SKETCH *pSketch = NULL;
+
+    char   szTmpFile[MAX_PATH+10] = {0};
+
+    snprintf (szTmpFile, sizeof (szTmpFile), "%s.tmp", pszSketchFile);
+
+    fp = fopen (szTmpFile, "w");
+
+    if (NULL == fp)
+    {
+        perror ("Backup ERROR: Cannot create sketch file");
+        return 1;
+    }
+
+    fprintf (fp, "%s%1.0f\n", SKETCH_RATE_HEADER, pStore->Rate);
+    fprintf (fp, "# size\tmtime\tbackup_msec\tprev_backup_msec\tnew_fraction\tchunks\tsamples\tname\n");
+
+    for (i=0; i < pStore->Count; i++)
+    {
+        pSketch = &pStore->pSketches[i];
+
+        fprintf (fp, "%zu\t%lld\t%lld\t%lld\t%1.4f\t%ld\t", pSketch->Size, (long long) pSketch->Mtime,
+                 (long long) pSketch->tBackup, (long long) pSketch->tPrev, pSketch->NewFraction, pSketch->Chunks);
+
+        for (j=0; j < pSketch->Count; j++)
+            fprintf (fp, "%s%llx:%u", j ? "," : "", (unsigned long long) pSketch->pSamples[j].Fp, pSketch->pSamples[j].Len);
+
+        fprintf (fp, "\t%s\n", pSketch->pszFileName);
+    }
+
+    if (fflush (fp) || fsync (fileno (fp)))
+        ret = 1;
+
+    if (fclose (fp))
+        ret = 1;
+
+    if (ret)
+    {
+        perror ("Backup ERROR: Cannot write sketch file");
+        remove (szTmpFile);
+        return 1;
+    }
+
+    if (rename (szTmpFile, pszSketchFile))
+    {
+        perror ("Backup ERROR: Cannot replace sketch file");
+        remove (szTmpFile);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void SketchRecord (SKETCH_STORE *pStore, const char *pszFileName, const SKETCH_BUILDER *pBuilder, BACKUP_STATS *pStats, time_t tStart)
+{
+    /* Called by the stream threads for each database read completely. The new data is estimated against the sketch of the last backup */
+    SKETCH *pSketch = NULL;
+    double Fraction = 1.0;
+    time_t tNow     = GetOSTimer();
+
+    pthread_mutex_lock (&pStore->Mutex);
+
+    pSketch = SketchFind (pStore, pszFileName);
+
+    if (pSketch)
+    {
+        Fraction = SketchNewFraction (pSketch->pSamples, pSketch->Count, pBuilder->Samples, pBuilder->Count, g_SketchSamples);
+        pSketch->tPrev       = pSketch->tBackup;
+        pSketch->NewFraction = Fraction;
+    }
+    else
+    {
+        pSketch = SketchAdd (pStore, pszFileName);
+
+        if (pSketch)
+            pSketch->pSamples = (SKETCH_SAMPLE *) malloc (SKETCH_MAX_SAMPLES * sizeof (SKETCH_SAMPLE));
+    }
+
+    if (pSketch && pSketch->pSamples)
+    {
+        pSketch->Size    = pStats->FileSize;
+        pSketch->Mtime   = pStats->FileMtime;
+        pSketch->tBackup = tNow;
+        pSketch->Chunks  = pBuilder->Chunks;
+        pSketch->Count   = pBuilder->Count;
+        memcpy (pSketch->pSamples, pBuilder->Samples, pBuilder->Count * sizeof (SKETCH_SAMPLE));
+        pStore->Updated++;
+    }
+
+    pStats->bSketch        = true;
+    pStats->SketchNewBytes = Fraction * pStats->BytesData;
+
+    pStore->Bytes    += pStats->BytesData;
+    pStore->NewBytes += pStats->SketchNewBytes;
+    pStore->BusyMsec += tNow - tStart;
+
+    pthread_mutex_unlock (&pStore->Mutex);
+}
+
+
+int RingAlloc (RING_BUFFER *pRing)
+{
+    size_t i = 0;
+
+    if (pRing->pSlots)
+        return 0;
+
+    if (g_RingSlots < 2)
+        g_RingSlots = 2;
+
+    /* Slots are page aligned and a multiple of the page size */
+    pRing->SlotCount = g_RingSlots;
+    pRing->SlotSize  = (g_RingSlotSize + RING_ALIGNMENT - 1) & ~((size_t) RING_ALIGNMENT - 1);
+
+    if (0 == pRing->SlotSize)
+        pRing->SlotSize = MAX_BUFFER;
+
+    pRing->pSlots = (RING_SLOT *) calloc (pRing->SlotCount, sizeof (RING_SLOT));
+
+    if (NULL == pRing->pSlots)
+        goto Error;
+
+    for (i=0; i < pRing->SlotCount; i++)
+    {
+        if (posix_memalign ((void **) &pRing->pSlots[i].pData, RING_ALIGNMENT, pRing->SlotSize))
+        {
+            pRing->pSlots[i].pData = NULL;
+            goto Error;
+        }
+    }
+
+    return 0;
+
+Error:
+
+    printf ("ERROR: Cannot allocate ring buffer: %lu x %lu bytes\n", pRing->SlotCount, pRing->SlotSize);
+
+    if (pRing->pSlots)
+    {
+        for (i=0; i < pRing->SlotCount; i++)
+        {
+            if (pRing->pSlots[i].pData)
+                free (pRing->pSlots[i].pData);
+        }
+
+        free (pRing->pSlots);
+        pRing->pSlots = NULL;
+    }
+
+    return 1;
+}
+
+
+void RingWait (int Spins)
+{
+    /* Yield first, then back off to short sleeps while the other side catches up */
+    if (Spins < 64)
+        sched_yield();
+    else
+        usleep (100);
+}
+
+
+typedef struct
+{
+    RING_BUFFER  *pRing;
+    RING_READ_FN ReadFn;
+    void         *pReadCtx;
+    RING_STATS   *pStats;
+    int          ret;
+} RING_READER_ARGS;
+
+
+void *RingReaderThread (void *pArgs)
+{
+    RING_READER_ARGS *pReader = (RING_READER_ARGS *) pArgs;
+    RING_BUFFER *pRing = pReader->pRing;
+    RING_SLOT   *pSlot = NULL;
+    ssize_t BytesRead  = 0;
+    size_t  Head       = 0;
+    int     Spins      = 0;
+
+    while (1)
+    {
+        Head  = pRing->Head;
+        Spins = 0;
+
+        while ((Head - __atomic_load_n (&pRing->Tail, __ATOMIC_ACQUIRE)) >= pRing->SlotCount)
+        {
+            if (__atomic_load_n (&pRing->bAbort, __ATOMIC_ACQUIRE))
+                goto Done;
+
+            if (0 == Spins)
+                pReader->pStats->FullWaits++;
+
+            RingWait (Spins++);
+        }
+
+        pSlot = &pRing->pSlots[Head % pRing->SlotCount];
+        BytesRead = pReader->ReadFn (pReader->pReadCtx, pSlot->pData, pRing->SlotSize);
+
+        if (BytesRead < 0)
+        {
+            pReader->ret = 1;
+            break;
+        }
+
+        if (0 == BytesRead)
+            break;
+
+        pSlot->Len = BytesRead;
+        __atomic_store_n (&pRing->Head, Head+1, __ATOMIC_RELEASE);
+    }
+
+Done:
+
+    __atomic_store_n (&pRing->bDone, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+int RingPipeline (RING_READ_FN ReadFn, void *pReadCtx, RING_WRITE_FN WriteFn, void *pWriteCtx, RING_STATS *pStats)
+{
+    /* Reader thread fills the ring while the calling thread drains it, so reads and writes overlap.
+       Returns 1 if reading failed and 2 if writing failed */
+    int       ret   = 0;
+    int       Spins = 0;
+    size_t    Tail  = 0;
+    size_t    Head  = 0;
+    pthread_t ReaderThread;
+
+    RING_BUFFER *pRing = &g_Ring;
+    RING_SLOT   *pSlot = NULL;
+    RING_READER_ARGS Reader;
+
+    if (RingAlloc (pRing))
+        return 1;
+
+    pRing->Head   = 0;
+    pRing->Tail   = 0;
+    pRing->bDone  = 0;
+    pRing->bAbort = 0;
+
+    memset (&Reader, 0, sizeof (Reader));
+    Reader.pRing    = pRing;
+    Reader.ReadFn   = ReadFn;
+    Reader.pReadCtx = pReadCtx;
+    Reader.pStats   = pStats;
+
+    if (pthread_create (&ReaderThread, NULL, RingReaderThread, &Reader))
+    {
+        perror ("ERROR: Cannot start reader thread");
+        return 1;
+    }
+
+    while (1)
+    {
+        Tail  = pRing->Tail;
+        Head  = __atomic_load_n (&pRing->Head, __ATOMIC_ACQUIRE);
+        Spins = 0;
+
+        while (Head == Tail)
+        {
+            if (__atomic_load_n (&pRing->bDone, __ATOMIC_ACQUIRE))
+            {
+                /* Reader might have published a last slot before it finished */
+                Head = __atomic_load_n (&pRing->Head, __ATOMIC_ACQUIRE);
+
+                if (Head == Tail)
+                    goto Done;
+
+                break;
+            }
+
+            if (0 == Spins)
+                pStats->EmptyWaits++;
+
+            RingWait (Spins++);
+            Head = __atomic_load_n (&pRing->Head, __ATOMIC_ACQUIRE);
+        }
+
+        pStats->Slots++;
+        pStats->FillSum += Head - Tail;
+
+        pSlot = &pRing->pSlots[Tail % pRing->SlotCount];
+
+        if (WriteFn (pWriteCtx, pSlot->pData, pSlot->Len))
+        {
+            __atomic_store_n (&pRing->bAbort, 1, __ATOMIC_RELEASE);
+            ret = 2;
+            goto Done;
+        }
+
+        pStats->BytesWritten += pSlot->Len;
+        __atomic_store_n (&pRing->Tail, Tail+1, __ATOMIC_RELEASE);
+    }
+
+Done:
+
+    pthread_join (ReaderThread, NULL);
+
+    if (Reader.ret && (0 == ret))
+        ret = 1;
+
+    return ret;
+}
+
+
+void PrintRingStats (const RING_STATS *pStats)
+{
+    /* A mostly full ring means the writer can't keep up, a mostly empty ring means the reader is the bottleneck */
+    double FillPct = 0.0;
+
+    if ((NULL == pStats) || (0 == pStats->Slots) || (0 == g_Ring.SlotCount))
+        return;
+
+    FillPct = 100.0 * pStats->FillSum / pStats->Slots / g_Ring.SlotCount;
+
+    printf (", ring: %1.0f%% full (reader waits: %ld, writer waits: %ld, bottleneck: %s)",
+            FillPct, pStats->FullWaits, pStats->EmptyWaits, (FillPct >= 50.0) ? "write" : "read");
+}
+
+
+typedef struct
+{
+    IO_FILE    *pFile;
+    PAGE_CACHE *pCache;
+    const SPARSE_MAP *pSparse;
+    HASH_STATE *pHash;
+    SKETCH_BUILDER *pSketch;
+    size_t     Extent;     /* Extent read at the moment */
+    size_t     BytesLeft;  /* Bytes left in the current extent */
+    long long  LimitNsec;  /* Time waited for the rate limit */
+} RING_FILE_READ;
+
+
+ssize_t RingReadFile (void *pCtx, unsigned char *pBuffer, size_t BufferSize)
+{
+    /* Fill a whole slot from the data extents of a file, but never read beyond the size recorded in the tar header */
+    RING_FILE_READ *pRead = (RING_FILE_READ *) pCtx;
+    size_t  BytesTotal = 0;
+    size_t  BytesToRead = 0;
+    ssize_t BytesRead = 0;
+
+    while (BytesTotal < BufferSize)
+    {
+        if (0 == pRead->BytesLeft)
+        {
+            /* Holes between extents are skipped */
+            if (pRead->Extent+1 >= pRead->pSparse->Count)
+                break;
+
+            pRead->Extent++;
+
+            if (pRead->pHash)
+                HashUpdateZeros (pRead->pHash, pRead->pSparse->pExtents[pRead->Extent].Offset - pRead->pFile->Offset);
+
+            pRead->pFile->Offset = pRead->pSparse->pExtents[pRead->Extent].Offset;
+            pRead->BytesLeft     = pRead->pSparse->pExtents[pRead->Extent].Length;
+            continue;
+        }
+
+        BytesToRead = BufferSize - BytesTotal;
+
+        if (pRead->BytesLeft < BytesToRead)
+            BytesToRead = pRead->BytesLeft;
+
+        if (pRead->pCache)
+            CacheAdvance (pRead->pCache, pRead->pFile->Offset);
+
+        BytesRead = IoRead (pRead->pFile, pBuffer + BytesTotal, BytesToRead);
+
+        if (BytesRead < 0)
+        {
+            perror ("Backup ERROR: Cannot read file");
+            return -1;
+        }
+
+        /* Data is in the ring now. Pages are not needed any more */
+        if (pRead->pCache)
+            CacheRelease (pRead->pCache, pRead->pFile->Offset);
+
+        if (0 == BytesRead)
+            break;
+
+        /* Hashed while the data is still in the CPU cache */
+        if (pRead->pHash)
+            HashUpdate (pRead->pHash, pBuffer + BytesTotal, BytesRead);
+
+        if (pRead->pSketch)
+            SketchUpdate (pRead->pSketch, pBuffer + BytesTotal, BytesRead);
+
+        BytesTotal       += BytesRead;
+        pRead->BytesLeft -= BytesRead;
+        pRead->LimitNsec += RateLimitTake (BytesRead);
+    }
+
+    return BytesTotal;
+}
+
+
+ssize_t RingReadPipe (void *pCtx, unsigned char *pBuffer, size_t BufferSize)
+{
+    int     fd = *((int *) pCtx);
+    ssize_t BytesRead = 0;
+
+    while (1)
+    {
+        BytesRead = read (fd, pBuffer, BufferSize);
+
+        if ((BytesRead < 0) && (EINTR == errno))
+            continue;
+
+        return BytesRead;
+    }
+}
+
+
+int RingWriteFD (void *pCtx, const unsigned char *pBuffer, size_t BufferSize)
+{
+    int fd = *((int *) pCtx);
+
+    if ((ssize_t) BufferSize != WriteBuffer (fd, pBuffer, BufferSize))
+    {
+        printf ("ERROR: Error writing buffer: %lu bytes\n", BufferSize);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int RingWriteIo (void *pCtx, const unsigned char *pBuffer, size_t BufferSize)
+{
+    if (IoWrite ((IO_FILE *) pCtx, pBuffer, BufferSize))
+    {
+        perror ("ERROR: Cannot write buffer");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int BackupFileTar (int WriteFD, const char *pszFileName, BACKUP_STATS *pStats)
+{
+    int ret = 0;
+    size_t  BytesRead  = 0;
+    size_t  BytesWrite = 0;
+    size_t  BytesTotal = 0;
+
+    pid_t  pid      =  0;
+    int    InputFD  = -1;
+    int    OutputFD = -1;
+    int    ErrorFD  = -1;
+    int    FileFD   = -1;
+
+    struct stat Filestat = {0};
+    PAGE_CACHE  Cache;
+
+    const char *args[] = { g_szTarBinary, g_Sparse ? "-cSPf" : "-cPf", "-", pszFileName, NULL };
+
+    memset (&Cache, 0, sizeof (Cache));
+
+    /* tar reads the file on its own. Record which pages are cached before, to drop the others when tar is done */
+    FileFD = open (pszFileName, O_RDONLY | O_CLOEXEC);
+
+    if ((-1 != FileFD) && (0 == fstat (FileFD, &Filestat)))
+    {
+        pStats->FileSize  = Filestat.st_size;
+        pStats->FileMtime = Filestat.st_mtime;
+
+        CacheOpen (&Cache, FileFD, NULL, Filestat.st_size, NULL, false);
+        CacheAdvance (&Cache, Filestat.st_size);
+    }
+
+    pid = popen3 (&InputFD, &OutputFD, &ErrorFD, 0, args);
+
+    if (pid < 1)
+    {
+        perror ("Backup ERROR: Cannot start tar process");
+        ret = 1;
+        goto Done;
+    }
+
+    if (g_Splice)
+    {
+        ret = SpliceToPipe (OutputFD, NULL, WriteFD, NULL, pStats, NULL);
+        BytesTotal = pStats->BytesSpliced;
+
+        if (ret > 0)
+            goto Done;
+
+        /* Fall back to the copy loop for the remaining data */
+        ret = 0;
+    }
+
+    while ((BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer))))
+    {
+        BytesWrite = write (WriteFD, g_Buffer, BytesRead);
+
+        if (BytesRead != BytesWrite)
+        {
+            printf ("Backup ERROR: Error writing buffer, Read: %lu, Written: %lu\n", BytesRead, BytesWrite);
+            ret = 1;
+            goto Done;
+        }
+
+        BytesTotal += BytesWrite;
+        pStats->LimitNsec += RateLimitTake (BytesWrite);
+    }
+
+    BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1);
+    if (BytesRead > 0)
+    {
+        g_Buffer[BytesRead] = '\0';
+        printf ("\nBackup ERROR: Returned from tar\n\n");
+        printf ("%s\n", g_Buffer);
+    }
+
+Done:
+
+    pStats->BytesTotal = BytesTotal;
+
+    if (-1 != InputFD)
+    {
+        close (InputFD);
+        InputFD = -1;
+    }
+
+    if (-1 != OutputFD)
+    {
+        close (OutputFD);
+        OutputFD = -1;
+    }
+
+    if (-1 != ErrorFD)
+    {
+        close (ErrorFD);
+        ErrorFD = -1;
+    }
+
+    if (pid > 0)
+    {
+        pclose3 (pid);
+        pid = 0;
+    }
+
+    CacheClose (&Cache);
+    pStats->PagesDropped   = Cache.PagesDropped;
+    pStats->PagesPreserved = Cache.PagesPreserved;
+
+    if (-1 != FileFD)
+    {
+        close (FileFD);
+        FileFD = -1;
+    }
+
+    return ret;
+}
+
+
+int BackupFileNative (int WriteFD, const char *pszFileName, const char *pszReadName, BACKUP_STATS *pStats)
+{
+    /* pszFileName is the name in the archive. Data and metadata are read from pszReadName, which is a spool copy in spool mode */
+
+    int     ret        =  0;
+    size_t  BytesTotal =  0;
+    size_t  BytesData  =  0;
+    size_t  BytesLeft  =  0;
+    size_t  BytesToWrite = 0;
+    size_t  ExtentLeft = 0;
+    size_t  Extent     = 0;
+    off_t   Offset     = 0;
+    bool    bReadError = false;
+    time_t  tStart     = GetOSTimer();
+
+    struct stat Filestat = {0};
+
+    RING_FILE_READ FileRead = {0};
+    IO_FILE        File;
+    PAGE_CACHE     Cache;
+    SPARSE_MAP     Sparse;
+    HASH_STATE     Hash;
+    SKETCH_BUILDER *pSketch = NULL;
+
+    memset (&Cache, 0, sizeof (Cache));
+    memset (&Sparse, 0, sizeof (Sparse));
+    HashInit (&Hash, g_HashType);
+
+    /* Without memory the database is backed up without updating its sketch */
+    if (g_pSketchStore && (pSketch = (SKETCH_BUILDER *) malloc (sizeof (SKETCH_BUILDER))))
+        SketchBuilderInit (pSketch);
+
+    if (IoOpen (&File, pszReadName, g_IoEngine, false))
+    {
+        perror ("Backup ERROR: Cannot open file");
+        printf ("Backup ERROR: Cannot open file: %s\n", pszFileName);
+        ret = 1;
+        goto Done;
+    }
+
+    /* Engine might have fallen back to pread */
+    pStats->Engine = File.Engine;
+
+    /* Take the metadata from the open file so header and data always belong to the same file */
+    if (fstat (File.FD, &Filestat))
+    {
+        perror ("Backup ERROR: Cannot stat file");
+        ret = 1;
+        goto Done;
+    }
+
+    pStats->FileSize  = Filestat.st_size;
+    pStats->FileMtime = Filestat.st_mtime;
+
+    if (!S_ISREG (Filestat.st_mode))
+    {
+        printf ("Backup ERROR: Not a regular file: %s\n", pszFileName);
+        ret = 1;
+        goto Done;
+    }
+
+    if (SparseMapBuild (File.FD, &Filestat, &Sparse))
+    {
+        printf ("Backup ERROR: Cannot get data regions of: %s\n", pszFileName);
+        ret = 1;
+        goto Done;
+    }
+
+    if (TarWriteFileHeader (WriteFD, pszFileName, &Filestat, SparseMapHasHoles (&Sparse) ? &Sparse : NULL, &BytesTotal))
+    {
+        printf ("Backup ERROR: Cannot write tar header for: %s\n", pszFileName);
+        ret = 1;
+        goto Done;
+    }
+
+    if (SparseMapHasHoles (&Sparse) && TarWriteSparseMap (WriteFD, &Sparse, &BytesTotal))
+    {
+        printf ("Backup ERROR: Cannot write sparse map for: %s\n", pszFileName);
+        ret = 1;
+        goto Done;
+    }
+
+    /* Only the data extents are read. Holes are neither read nor sent to borg */
+    pStats->BytesLogical = Filestat.st_size;
+    BytesLeft = Sparse.DataSize;
+
+    /* O_DIRECT does not use the file cache */
+    if (IO_ENGINE_DIRECT != File.Engine)
+        CacheOpen (&Cache, File.FD, File.pMap, Filestat.st_size, &Sparse, true);
+
+    /* Splice moves page cache pages. Other engines read the data on their own */
+    if (Sparse.Count)
+    {
+        File.Offset = Sparse.pExtents[0].Offset;
+        ExtentLeft  = Sparse.pExtents[0].Length;
+        HashUpdateZeros (&Hash, File.Offset);
+    }
+
+    /* Splice moves page cache pages. Other engines read the data on their own.
+       Data spliced into the pipe never passes nshborg and can't be hashed or sketched */
+    if (g_Splice && (IO_ENGINE_PREAD == File.Engine) && (HASH_TYPE_NONE == Hash.Type) && (NULL == pSketch))
+    {
+        while (Extent < Sparse.Count)
+        {
+            Offset = File.Offset;
+            ret = SpliceToPipe (File.FD, &Offset, WriteFD, &ExtentLeft, pStats, &Cache);
+
+            BytesLeft  -= Offset - File.Offset;
+            BytesData  += Offset - File.Offset;
+            BytesTotal += Offset - File.Offset;
+            File.Offset = Offset;
+
+            /* Only a failed write into the borg pipe breaks the stream */
+            if (ret > 1)
+                goto Done;
+
+            if (ret > 0)
+            {
+                bReadError = true;
+                break;
+            }
+
+            /* Not supported or file shrunk. The copy path continues at the current file position */
+            if (ret || ExtentLeft)
+                break;
+
+            if (++Extent < Sparse.Count)
+            {
+                File.Offset = Sparse.pExtents[Extent].Offset;
+                ExtentLeft  = Sparse.pExtents[Extent].Length;
+            }
+        }
+
+        ret = 0;
+    }
+
+    if (BytesLeft && (false == bReadError))
+    {
+        /* Reader thread reads the file into the ring while this thread writes into the borg pipe */
+        FileRead.pFile     = &File;
+        FileRead.pCache    = &Cache;
+        FileRead.pSparse   = &Sparse;
+        FileRead.pHash     = (HASH_TYPE_NONE == Hash.Type) ? NULL : &Hash;
+        FileRead.pSketch   = pSketch;
+        FileRead.Extent    = Extent;
+        FileRead.BytesLeft = ExtentLeft;
+
+        ret = RingPipeline (RingReadFile, &FileRead, RingWriteFD, &WriteFD, &pStats->Ring);
+        pStats->LimitNsec += FileRead.LimitNsec;
+
+        BytesLeft  -= pStats->Ring.BytesWritten;
+        BytesData  += pStats->Ring.BytesWritten;
+        BytesTotal += pStats->Ring.BytesWritten;
+
+        if (ret > 1)
+            goto Done;
+
+        bReadError = (0 != ret);
+    }
+
+    if (BytesLeft)
+    {
+        /* File shrunk or could not be read. The stream must still match the size in the header */
+        if (bReadError)
+            printf ("Backup ERROR: Cannot read file: %s\n", pszFileName);
+        else
+            printf ("Backup ERROR: File changed while reading: %s\n", pszFileName);
+
+        memset (g_Buffer, 0, sizeof (g_Buffer));
+        ret = 1;
+
+        while (BytesLeft)
+        {
+            BytesToWrite = (BytesLeft < MAX_BUFFER) ? BytesLeft : MAX_BUFFER;
+
+            if ((ssize_t) BytesToWrite != WriteBuffer (WriteFD, g_Buffer, BytesToWrite))
+                goto Done;
+
+            HashUpdate (&Hash, g_Buffer, BytesToWrite);
+            BytesLeft  -= BytesToWrite;
+            BytesData  += BytesToWrite;
+            BytesTotal += BytesToWrite;
+        }
+    }
+
+    if (TarWritePadding (WriteFD, BytesData, &BytesTotal))
+    {
+        printf ("Backup ERROR: Cannot write tar padding for: %s\n", pszFileName);
+        ret = 1;
+        goto Done;
+    }
+
+    /* A trailing hole and everything after a file shrunk reads as zeros from the archive */
+    if ((unsigned long long) Filestat.st_size > Hash.TotalLen)
+        HashUpdateZeros (&Hash, Filestat.st_size - Hash.TotalLen);
+
+    pStats->HashType = Hash.Type;
+    pStats->Hash     = HashDigest (&Hash);
+    pStats->HashNsec = Hash.Nsec;
+
+    pStats->BytesTotal = BytesTotal;
+    pStats->BytesData  = BytesData;
+
+    if (pSketch && (0 == ret))
+    {
+        if (pSketch->ChunkLen)
+            SketchAddChunk (pSketch);
+
+        SketchRecord (g_pSketchStore, pszFileName, pSketch, pStats, tStart);
+    }
+
+Done:
+
+    pStats->BytesTotal = BytesTotal;
+    pStats->BytesData  = BytesData;
+
+    free (pSketch);
+
+    CacheClose (&Cache);
+    pStats->PagesDropped   = Cache.PagesDropped;
+    pStats->PagesPreserved = Cache.PagesPreserved;
+
+    SparseMapFree (&Sparse);
+    IoClose (&File);
+
+    return ret;
+}
+
+
+int BackupFileFrom (int WriteFD, const char *pszFileName, const char *pszReadName, BACKUP_STATS *retpStats)
+{
+    int ret = 0;
+    size_t BytesSize = 0;
+
+    BACKUP_STATS Stats;
+
+    memset (&Stats, 0, sizeof (Stats));
+    Stats.tStart = GetOSTimer();
+
+    if (-1 == WriteFD)
+    {
+        printf ("Backup ERROR: No write file descriptor\n");
+        ret = 1;
+        goto Done;
+    }
+
+    if (IsNullStr (pszFileName))
+    {
+        printf ("Backup ERROR: No file specified\n");
+        ret = 1;
+        goto Done;
+    }
+
+    BytesSize = GetFileSize (pszReadName);
+
+    if (0 == BytesSize)
+    {
+        printf ("Backup ERROR: Cannot backup empty files: %s\n", pszFileName);
+        ret = 1;
+        goto Done;
+    }
+
+    /* The tar binary always stores the name it reads from */
+    if (TAR_MODE_EXTERNAL == g_TarMode)
+        ret = BackupFileTar (WriteFD, pszReadName, &Stats);
+    else
+        ret = BackupFileNative (WriteFD, pszFileName, pszReadName, &Stats);
+
+Done:
+
+    Stats.tEnd = GetOSTimer();
+
+    if (retpStats)
+        memcpy (retpStats, &Stats, sizeof (Stats));
+
+    return ret;
+}
+
+
+int BackupFile (int WriteFD, const char *pszFileName, BACKUP_STATS *retpStats)
+{
+    return BackupFileFrom (WriteFD, pszFileName, pszFileName, retpStats);
+}
+
+
+void LogBackupResult (const char *pszFileName, const BACKUP_STATS *pStats)
+{
+    double sec = 0.0;
+    double mb  = 0.0;
+
+    if ((NULL == pszFileName) || (NULL == pStats))
+        return;
+
+    sec = (pStats->tEnd - pStats->tStart)/1000.0;
+    mb  = pStats->BytesTotal/1024.0/1024.0;
+
+    printf ("Backup OK: [%s] %1.1f MB", pszFileName, mb);
+
+    if (sec)
+        printf (" (%1.1f MB/sec)", mb/sec);
+
+    /* Every spliced byte saves the copy into user space and the copy back into the pipe */
+    if (pStats->BytesSpliced)
+        printf (", zero-copy: %1.1f MB, copies avoided: %1.1f MB", pStats->BytesSpliced/1024.0/1024.0, 2.0*pStats->BytesSpliced/1024.0/1024.0);
+
+    /* Holes are neither read nor sent to borg */
+    if (pStats->BytesLogical > pStats->BytesData)
+        printf (", logical: %1.1f MB, data read: %1.1f MB", pStats->BytesLogical/1024.0/1024.0, pStats->BytesData/1024.0/1024.0);
+
+    if (*g_szParallelRepos)
+        printf (", stream: %d", pStats->Stream);
+
+    if (pStats->Ring.Slots)
+        printf (", engine: %s", IoEngineName (pStats->Engine));
+
+    if (pStats->PagesDropped || pStats->PagesPreserved)
+        printf (", cache pages dropped: %ld, preserved: %ld", pStats->PagesDropped, pStats->PagesPreserved);
+
+    /* Waiting for the rate limit is included in the MB/sec above */
+    if (pStats->LimitNsec)
+        printf (", rate limit wait: %1.1f sec", pStats->LimitNsec / 1000000000.0);
+
+    if (pStats->bSketch)
+        printf (", new data: %1.1f MB", pStats->SketchNewBytes/1024.0/1024.0);
+
+    PrintRingStats (&pStats->Ring);
+
+    /* Hash of the logical file content with its size. Hash speed shows if hashing could slow down the backup */
+    if (HASH_TYPE_NONE != pStats->HashType)
+    {
+        printf (", size: %llu, %s: %016llx", (unsigned long long) (pStats->BytesLogical), HashTypeName (pStats->HashType), (unsigned long long) pStats->Hash);
+
+        if (pStats->HashNsec > 0)
+            printf (" (%s %1.1f MB/sec)", HashImplName (g_HashImpl), pStats->BytesLogical / 1024.0 / 1024.0 / (pStats->HashNsec / 1000000000.0));
+    }
+
+    printf ("\n");
+}
+
+
+pid_t StartDrainProcess (int *retpWriteFD)
+{
+    /* Child process reading and discarding a pipe. Stands in for the borg process in benchmarks */
+    int   fds[2] = {0};
+    pid_t pid    = 0;
+
+    if (NULL == retpWriteFD)
+        return -1;
+
+    if (pipe (fds))
+        return -1;
+
+    pid = fork();
+
+    if (pid < 0)
+    {
+        close (fds[READ]);
+        close (fds[WRITE]);
+        return pid;
+    }
+
+    if (0 == pid)
+    {
+        close (fds[WRITE]);
+
+        while (read (fds[READ], g_Buffer, sizeof (g_Buffer)) > 0);
+
+        _exit (0);
+    }
+
+    close (fds[READ]);
+    *retpWriteFD = fds[WRITE];
+
+    SetPipeSize (fds[WRITE], g_PipeSize);
+
+    return pid;
+}
+
+
+void DropFileCache (const char *pszFileName)
+{
+    int fd = open (pszFileName, O_RDONLY | O_CLOEXEC);
+
+    if (-1 == fd)
+        return;
+
+    posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+    close (fd);
+}
+
+
+int BenchmarkRun (const char *pszLabel, int FileCount, char *ppFiles[], int Iterations, bool bDropCache, double *retpMsecPerFile)
+{
+    /* Streams all files into a drain process and prints one result line */
+    int    ret     = 0;
+    int    i       = 0;
+    int    iter    = 0;
+    int    WriteFD = -1;
+    long   Files   = 0;
+    pid_t  pid     = 0;
+    size_t Bytes   = 0;
+    time_t tStart  = 0;
+    double sec     = 0.0;
+    double mb      = 0.0;
+    double MsecPerFile = 0.0;
+
+    BACKUP_STATS Stats;
+
+    pid = StartDrainProcess (&WriteFD);
+
+    if (pid < 1)
+    {
+        perror ("Cannot start benchmark drain process");
+        return 1;
+    }
+
+    tStart = GetOSTimer();
+
+    for (iter=0; iter < Iterations; iter++)
+    {
+        for (i=0; i<FileCount; i++)
+        {
+            if (bDropCache)
+                DropFileCache (ppFiles[i]);
+
+            if (BackupFile (WriteFD, ppFiles[i], &Stats))
+            {
+                ret = 1;
+                continue;
+            }
+
+            Files++;
+            Bytes += Stats.BytesTotal;
+        }
+    }
+
+    if (TAR_MODE_NATIVE == g_TarMode)
+        TarWriteEnd (WriteFD);
+
+    close (WriteFD);
+    WriteFD = -1;
+    pclose3 (pid);
+
+    sec = (GetOSTimer() - tStart)/1000.0;
+    mb  = Bytes/1024.0/1024.0;
+
+    MsecPerFile = Files ? (sec*1000.0/Files) : 0;
+
+    if (retpMsecPerFile)
+        *retpMsecPerFile = MsecPerFile;
+
+    printf ("%-10s files: %6ld  %10.1f MB  %8.3f sec  %8.1f MB/sec  %8.3f ms/file\n",
+            pszLabel, Files, mb, sec, sec ? mb/sec : 0.0, MsecPerFile);
+
+    return ret;
+}
+
+
+int BenchmarkHash()
+{
+    /* Hash throughput of all implementations supported by the CPU on the same memory buffer */
+    int      ret  = 0;
+    int      Impl = 0;
+    int      iter = 0;
+    size_t   i    = 0;
+    uint64_t Digest = 0;
+    uint64_t FirstDigest = 0;
+    bool     bFirst = true;
+    double   sec = 0.0;
+    unsigned char *pBuffer = NULL;
+    struct timespec tStart = {0};
+    struct timespec tEnd   = {0};
+
+    HASH_STATE State;
+
+    const int    Iterations = 8;
+    const size_t BufferSize = 64*MAX_BUFFER;
+    const int    SaveImpl   = g_HashImpl;
+
+    if (posix_memalign ((void **) &pBuffer, RING_ALIGNMENT, BufferSize))
+    {
+        printf ("Cannot allocate hash benchmark buffer\n");
+        return 1;
+    }
+
+    for (i=0; i < BufferSize; i++)
+        pBuffer[i] = (unsigned char) (i * 2654435761U >> 13);
+
+    printf ("\nHash benchmark: %s, %d x %1.0f MB in memory\n\n", HashTypeName (HASH_TYPE_XXH3), Iterations, BufferSize/1024.0/1024.0);
+
+    for (Impl = 0; Impl < HASH_IMPL_COUNT; Impl++)
+    {
+        if (HashSetImpl (Impl))
+        {
+            printf ("%-10s not supported by this CPU\n", HashImplName (Impl));
+            continue;
+        }
+
+        clock_gettime (CLOCK_MONOTONIC, &tStart);
+
+        for (iter=0; iter < Iterations; iter++)
+        {
+            HashInit (&State, HASH_TYPE_XXH3);
+            HashUpdate (&State, pBuffer, BufferSize);
+            Digest = HashDigest (&State);
+        }
+
+        clock_gettime (CLOCK_MONOTONIC, &tEnd);
+        sec = (tEnd.tv_sec - tStart.tv_sec) + (tEnd.tv_nsec - tStart.tv_nsec) / 1000000000.0;
+
+        /* All implementations must return the same hash */
+        if (bFirst)
+        {
+            FirstDigest = Digest;
+            bFirst = false;
+        }
+        else if (Digest != FirstDigest)
+        {
+            printf ("ERROR: %s hash differs: %016llx\n", HashImplName (Impl), (unsigned long long) Digest);
+            ret = 1;
+        }
+
+        printf ("%-10s %8.1f MB/sec  %016llx\n", HashImplName (Impl), sec ? Iterations*BufferSize/1024.0/1024.0/sec : 0.0, (unsigned long long) Digest);
+    }
+
+    HashSetImpl (SaveImpl);
+    free (pBuffer);
+
+    return ret;
+}
+
+
+int BenchmarkBackup (int FileCount, char *ppFiles[])
+{
+    int    ret    = 0;
+    int    i      = 0;
+    int    WriteFD = -1;
+    int    Engine = 0;
+    pid_t  pid    = 0;
+    double MsecNative = 0.0;
+    double MsecTar    = 0.0;
+
+    const int SaveTarMode  = g_TarMode;
+    const int SaveSplice   = g_Splice;
+    const int SaveIoEngine = g_IoEngine;
+    const int SaveHashType = g_HashType;
+    const int Iterations   = 3;
+
+    if (FileCount < 1)
+    {
+        printf ("No files specified for benchmark\n");
+        return 1;
+    }
+
+    printf ("\nBackup stream benchmark: %d file(s), %d iterations\n\n", FileCount, Iterations);
+
+    /* Warm up the file system cache, so both modes compare on the same conditions */
+    pid = StartDrainProcess (&WriteFD);
+
+    if (pid < 1)
+    {
+        perror ("Cannot start benchmark drain process");
+        ret = 1;
+        goto Done;
+    }
+
+    for (i=0; i<FileCount; i++)
+    {
+        BackupFile (WriteFD, ppFiles[i], NULL);
+    }
+
+    close (WriteFD);
+    WriteFD = -1;
+    pclose3 (pid);
+
+    g_TarMode = TAR_MODE_NATIVE;
+    ret |= BenchmarkRun ("native", FileCount, ppFiles, Iterations, false, &MsecNative);
+
+    g_TarMode = TAR_MODE_EXTERNAL;
+    ret |= BenchmarkRun ("tar", FileCount, ppFiles, Iterations, false, &MsecTar);
+
+    printf ("\nPer-file overhead tar vs. native: %1.3f ms\n", MsecTar - MsecNative);
+
+    /* Engines read from disk. The file cache is dropped before each file */
+    printf ("\nI/O engines (native tar, no splice, file cache dropped before each file)\n\n");
+
+    g_TarMode = TAR_MODE_NATIVE;
+    g_Splice  = 0;
+
+    for (Engine = 0; Engine < IO_ENGINE_COUNT; Engine++)
+    {
+        g_IoEngine = Engine;
+        ret |= BenchmarkRun (IoEngineName (Engine), FileCount, ppFiles, Iterations, true, NULL);
+    }
+
+    g_IoEngine = IO_ENGINE_PREAD;
+    g_Splice   = 1;
+    g_HashType = HASH_TYPE_NONE;
+    ret |= BenchmarkRun ("splice", FileCount, ppFiles, Iterations, true, NULL);
+
+    /* Same stream with and without hashing from the file cache. The difference is the hash cost per file */
+    printf ("\nHashing (pread, no splice, file cache warm)\n\n");
+
+    g_Splice = 0;
+    ret |= BenchmarkRun ("no hash", FileCount, ppFiles, Iterations, false, NULL);
+
+    g_HashType = HASH_TYPE_XXH3;
+    ret |= BenchmarkRun (HashTypeName (g_HashType), FileCount, ppFiles, Iterations, false, NULL);
+
+    ret |= BenchmarkHash();
+
+    printf ("\n");
+
+Done:
+
+    g_TarMode  = SaveTarMode;
+    g_Splice   = SaveSplice;
+    g_IoEngine = SaveIoEngine;
+    g_HashType = SaveHashType;
+
+    if (-1 != WriteFD)
+    {
+        close (WriteFD);
+        WriteFD = -1;
+    }
+
+    return ret;
+}
+
+
+bool CompressionSpecValid (const char *pszSpec)
+{
+    /* Algorithm names of borg --compression. Levels and the algorithm of auto and obfuscate are checked by borg */
+    const char *Names[] = { "none", "lz4", "zstd", "zlib", "lzma", "auto", "obfuscate", NULL };
+    size_t Len = 0;
+    int    i   = 0;
+
+    if (IsNullStr (pszSpec))
+        return true;
+
+    Len = strcspn (pszSpec, ",");
+
+    for (i=0; Names[i]; i++)
+    {
+        if ((Len == strlen (Names[i])) && (0 == strncmp (pszSpec, Names[i], Len)))
+            return true;
+    }
+
+    return false;
+}
+
+
+const char *ProbeTypeName (int Type)
+{
+    switch (Type)
+    {
+        case PROBE_TYPE_NSF:
+            return "nsf";
+        case PROBE_TYPE_BOX:
+            return "box";
+        case PROBE_TYPE_NLO:
+            return "nlo";
+    }
+
+    return "other";
+}
+
+
+int ProbeFileType (const char *pszFileName)
+{
+    const char *pszExt = strrchr (pszFileName, '.');
+
+    if (NULL == pszExt)
+        return PROBE_TYPE_OTHER;
+
+    if ((0 == strcasecmp (pszExt, ".nsf")) || (0 == strcasecmp (pszExt, ".ntf")))
+        return PROBE_TYPE_NSF;
+
+    if (0 == strcasecmp (pszExt, ".box"))
+        return PROBE_TYPE_BOX;
+
+    if (0 == strcasecmp (pszExt, ".nlo"))
+        return PROBE_TYPE_NLO;
+
+    return PROBE_TYPE_OTHER;
+}
+
+
+int ProbeAddFile (PROBE_FILES *pList, const char *pszFileName, size_t Size)
+{
+    PROBE_FILE *pNew = NULL;
+
+    if (pList->Count == pList->Alloc)
+    {
+        pNew = (PROBE_FILE *) realloc (pList->pFiles, (pList->Alloc ? 2*pList->Alloc : 1024) * sizeof (PROBE_FILE));
+
+        if (NULL == pNew)
+            return 1;
+
+        pList->pFiles = pNew;
+        pList->Alloc  = pList->Alloc ? 2*pList->Alloc : 1024;
+    }
+
+    pList->pFiles[pList->Count].pszName = strdup (pszFileName);
+
+    if (NULL == pList->pFiles[pList->Count].pszName)
+        return 1;
+
+    pList->pFiles[pList->Count].Size = Size;
+    pList->pFiles[pList->Count].Type = ProbeFileType (pszFileName);
+    pList->Count++;
+    pList->TotalBytes += Size;
+
+    return 0;
+}
+
+
+int ProbeScanDir (PROBE_FILES *pList, const char *pszDir, int Depth)
+{
+    /* Databases, mail boxes and NLOs below the directory. Links are not followed */
+    int    ret    = 0;
+    DIR    *pDir  = NULL;
+    struct dirent *pEntry = NULL;
+    struct stat Filestat  = {0};
+    char   szPath[MAX_PATH+1] = {0};
+
+    if (Depth > PROBE_MAX_DEPTH)
+        return 0;
+
+    pDir = opendir (pszDir);
+
+    if (NULL == pDir)
+    {
+        printf ("Info: Cannot read directory: %s (%s)\n", pszDir, strerror (errno));
+        return 0;
+    }
+
+    while ((pEntry = readdir (pDir)))
+    {
+        if ((0 == strcmp (pEntry->d_name, ".")) || (0 == strcmp (pEntry->d_name, "..")))
+            continue;
+
+        snprintf (szPath, sizeof (szPath), "%s/%s", pszDir, pEntry->d_name);
+
+        if (lstat (szPath, &Filestat))
+            continue;
+
+        if (S_ISDIR (Filestat.st_mode))
+            ret |= ProbeScanDir (pList, szPath, Depth+1);
+
+        else if (S_ISREG (Filestat.st_mode) && Filestat.st_size && (PROBE_TYPE_OTHER != ProbeFileType (szPath)))
+            ret |= ProbeAddFile (pList, szPath, Filestat.st_size);
+    }
+
+    closedir (pDir);
+
+    return ret;
+}
+
+
+int ProbeSampleAppend (PROBE_SAMPLE *pSample, int FD, off_t Offset, size_t Size)
+{
+    unsigned char *pNew = NULL;
+    ssize_t BytesRead = 0;
+
+    if (pSample->Size + Size > pSample->Alloc)
+    {
+        pNew = (unsigned char *) realloc (pSample->pData, pSample->Alloc + 64*PROBE_BLOCK_SIZE);
+
+        if (NULL == pNew)
+            return 1;
+
+        pSample->pData  = pNew;
+        pSample->Alloc += 64*PROBE_BLOCK_SIZE;
+    }
+
+    BytesRead = pread (FD, pSample->pData + pSample->Size, Size, Offset);
+
+    if (BytesRead < 0)
+        return 1;
+
+    pSample->Size += BytesRead;
+
+    return 0;
+}
+
+
+int ProbeSampleFiles (PROBE_FILES *pList, PROBE_SAMPLE Samples[])
+{
+    /* Blocks evenly spaced over all files, so each type is sampled by its share of the data */
+    int    FD     = -1;
+    size_t i      = 0;
+    size_t Base   = 0;
+    size_t Next   = 0;
+    size_t Stride = PROBE_BLOCK_SIZE;
+    size_t Offset = 0;
+    size_t Blocks = g_ProbeSize / PROBE_BLOCK_SIZE;
+    PROBE_FILE   *pFile   = NULL;
+    PROBE_SAMPLE *pSample = NULL;
+
+    if (0 == Blocks)
+        Blocks = 1;
+
+    /* Files smaller than the sample size are read completely */
+    if (pList->TotalBytes > Blocks * PROBE_BLOCK_SIZE)
+        Stride = pList->TotalBytes / Blocks;
+
+    for (i=0; i < pList->Count; i++)
+    {
+        pFile   = &pList->pFiles[i];
+        pSample = &Samples[pFile->Type];
+
+        pSample->Files++;
+        pSample->FileBytes += pFile->Size;
+
+        if (Next < Base + pFile->Size)
+        {
+            FD = open (pFile->pszName, O_RDONLY | O_CLOEXEC);
+
+            if (-1 == FD)
+            {
+                printf ("Info: Cannot open file: %s (%s)\n", pFile->pszName, strerror (errno));
+            }
+            else
+            {
+                for (; Next < Base + pFile->Size; Next += Stride)
+                {
+                    Offset = Next - Base;
+
+                    if (ProbeSampleAppend (pSample, FD, Offset, (pFile->Size - Offset < PROBE_BLOCK_SIZE) ? pFile->Size - Offset : PROBE_BLOCK_SIZE))
+                    {
+                        printf ("Info: Cannot read file: %s (%s)\n", pFile->pszName, strerror (errno));
+                        break;
+                    }
+                }
+
+                close (FD);
+            }
+
+            /* Blocks of a file which cannot be read are skipped. The next file continues on the same spacing */
+            while (Next < Base + pFile->Size)
+                Next += Stride;
+        }
+
+        Base += pFile->Size;
+
+        /* Next block of a file read completely starts at the next file */
+        if (Stride == PROBE_BLOCK_SIZE)
+            Next = Base;
+    }
+
+    return 0;
+}
+
+
+int ProbeCompress (const char *pszTool, const char *pszLevel, const PROBE_SAMPLE *pSample, PROBE_RESULT *retpResult)
+{
+    /* Streams the sample through the tool and counts its output. CPU time of the tool is its single core throughput */
+    int    ret      = 0;
+    int    Status   = 0;
+    int    InputFD  = -1;
+    int    OutputFD = -1;
+    pid_t  pid      = 0;
+    size_t Written  = 0;
+    ssize_t Bytes   = 0;
+    char   szBinary[MAX_PATH+40] = {0};
+    struct pollfd Poll[2];
+    struct rusage Usage = {0};
+
+    const char *args[] = { szBinary, pszLevel, "-c", "-q", NULL };
+
+    retpResult->Compressed = 0;
+    retpResult->CpuSec     = 0.0;
+
+    if (0 == pSample->Size)
+        return 0;
+
+    snprintf (szBinary, sizeof (szBinary), "%s/%s", g_szProbeBinDir, pszTool);
+
+    pid = popen3 (&InputFD, &OutputFD, NULL, 1, args);
+
+    if (pid < 1)
+        return 1;
+
+    SetNonBlockFD (InputFD);
+
+    while (-1 != OutputFD)
+    {
+        Poll[0].fd      = InputFD;
+        Poll[0].events  = POLLOUT;
+        Poll[0].revents = 0;
+        Poll[1].fd      = OutputFD;
+        Poll[1].events  = POLLIN;
+        Poll[1].revents = 0;
+
+        /* A negative fd is ignored by poll */
+        if (poll (Poll, 2, -1) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+
+            ret = 1;
+            break;
+        }
+
+        if ((-1 != InputFD) && Poll[0].revents)
+        {
+            Bytes = write (InputFD, pSample->pData + Written, (pSample->Size - Written < MAX_BUFFER) ? pSample->Size - Written : MAX_BUFFER);
+
+            if ((Bytes < 0) && (EAGAIN != errno))
+            {
+                ret = 1;
+                Written = pSample->Size;
+            }
+            else if (Bytes > 0)
+            {
+                Written += Bytes;
+            }
+
+            if (Written >= pSample->Size)
+            {
+                close (InputFD);
+                InputFD = -1;
+            }
+        }
+
+        if (Poll[1].revents)
+        {
+            Bytes = read (OutputFD, g_Buffer, MAX_BUFFER);
+
+            if (Bytes > 0)
+            {
+                retpResult->Compressed += Bytes;
+            }
+            else if ((0 == Bytes) || (EAGAIN != errno))
+            {
+                close (OutputFD);
+                OutputFD = -1;
+            }
+        }
+    }
+
+    if (-1 != InputFD)
+    {
+        close (InputFD);
+        InputFD = -1;
+    }
+
+    wait4 (pid, &Status, 0, &Usage);
+
+    if ((0 == WIFEXITED (Status)) || WEXITSTATUS (Status))
+        ret = 1;
+
+    retpResult->CpuSec = Usage.ru_utime.tv_sec + Usage.ru_stime.tv_sec + (Usage.ru_utime.tv_usec + Usage.ru_stime.tv_usec) / 1000000.0;
+
+    return ret;
+}
+
+
+void ProbePrintResult (const char *pszSpec, const PROBE_SAMPLE Samples[], const PROBE_RESULT Results[], size_t SampleBytes)
+{
+    int    Type = 0;
+    size_t Compressed = 0;
+    double CpuSec = 0.0;
+
+    for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+    {
+        Compressed += Results[Type].Compressed;
+        CpuSec     += Results[Type].CpuSec;
+    }
+
+    printf ("%-12s %6.1f%%  %8.1f MB/sec ", pszSpec, 100.0 * Compressed / SampleBytes, CpuSec ? SampleBytes/1024.0/1024.0/CpuSec : 0.0);
+
+    for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+    {
+        if (Samples[Type].Size)
+            printf ("  %s %5.1f%%", ProbeTypeName (Type), 100.0 * Results[Type].Compressed / Samples[Type].Size);
+    }
+
+    printf ("\n");
+}
+
+
+int CompressionProbe (int Count, char *ppNames[])
+{
+    /* Samples the databases and runs each borg compression algorithm on the sample. Recommends BORG_COMPRESSION */
+    int    ret    = 0;
+    int    i      = 0;
+    int    s      = 0;
+    int    Type   = 0;
+    size_t SampleBytes = 0;
+    size_t Compressed  = 0;
+    double CpuSec      = 0.0;
+    double Ratio       = 0.0;
+    double Rate        = 0.0;
+    double BestRatio   = 0.0;
+    double BestRate    = 0.0;
+    bool   bLz4   = false;
+    bool   bIncompressible = false;
+    char   szBinary[MAX_PATH+40] = {0};
+    char   szAuto[80+1]         = {0};
+    char   szBest[80+1]         = {0};
+    struct stat Filestat = {0};
+
+    PROBE_FILES  List = {0};
+    PROBE_SAMPLE Samples[PROBE_TYPE_COUNT];
+    PROBE_RESULT Lz4[PROBE_TYPE_COUNT];
+    PROBE_RESULT Results[PROBE_TYPE_COUNT];
+    PROBE_RESULT Auto[PROBE_TYPE_COUNT];
+    const PROBE_RESULT *pResult = NULL;
+
+    /* lz4 first, because auto uses it to detect data not worth compressing */
+    const PROBE_SPEC Specs[] =
+    {
+        { "lz4",     "lz4",  "-1"  },
+        { "zstd,1",  "zstd", "-1"  },
+        { "zstd,3",  "zstd", "-3"  },
+        { "zstd,6",  "zstd", "-6"  },
+        { "zstd,10", "zstd", "-10" },
+        { "zlib,6",  "gzip", "-6"  },
+        { "lzma,6",  "xz",   "-6"  },
+        { NULL,      NULL,   NULL  }
+    };
+
+    memset (Samples, 0, sizeof (Samples));
+    memset (Lz4,     0, sizeof (Lz4));
+
+    /* Without files on the command line the data directory is sampled */
+    if (0 == Count)
+    {
+        ret = ProbeScanDir (&List, g_szProbeDir, 0);
+    }
+
+    for (i=0; i < Count; i++)
+    {
+        if (stat (ppNames[i], &Filestat))
+        {
+            printf ("Info: Cannot find: %s (%s)\n", ppNames[i], strerror (errno));
+            continue;
+        }
+
+        if (S_ISDIR (Filestat.st_mode))
+            ret |= ProbeScanDir (&List, ppNames[i], 0);
+        else if (S_ISREG (Filestat.st_mode) && Filestat.st_size)
+            ret |= ProbeAddFile (&List, ppNames[i], Filestat.st_size);
+    }
+
+    if (ret)
+    {
+        printf ("Cannot allocate file list\n");
+        goto Done;
+    }
+
+    if (0 == List.Count)
+    {
+        printf ("No files found for the compression probe\n");
+        ret = 1;
+        goto Done;
+    }
+
+    ProbeSampleFiles (&List, Samples);
+
+    for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+        SampleBytes += Samples[Type].Size;
+
+    if (0 == SampleBytes)
+    {
+        printf ("Cannot read any data for the compression probe\n");
+        ret = 1;
+        goto Done;
+    }
+
+    printf ("\nCompression probe: %zu files, %1.1f MB, sample: %1.1f MB in blocks of %1.1f MB\n\n",
+            List.Count, List.TotalBytes/1024.0/1024.0, SampleBytes/1024.0/1024.0, PROBE_BLOCK_SIZE/1024.0/1024.0);
+
+    for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+    {
+        if (Samples[Type].Files)
+            printf ("%-6s files: %8ld  %12.1f MB  sample: %10.1f MB\n", ProbeTypeName (Type), Samples[Type].Files, Samples[Type].FileBytes/1024.0/1024.0, Samples[Type].Size/1024.0/1024.0);
+    }
+
+    printf ("\nSize after compression and single core throughput\n\n");
+
+    signal (SIGPIPE, SIG_IGN);
+
+    for (s=0; Specs[s].pszSpec; s++)
+    {
+        snprintf (szBinary, sizeof (szBinary), "%s/%s", g_szProbeBinDir, Specs[s].pszTool);
+
+        if (access (szBinary, X_OK))
+        {
+            printf ("%-12s not probed, cannot find: %s\n", Specs[s].pszSpec, szBinary);
+            continue;
+        }
+
+        memset (Results, 0, sizeof (Results));
+
+        for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+        {
+            if (ProbeCompress (Specs[s].pszTool, Specs[s].pszLevel, &Samples[Type], &Results[Type]))
+                break;
+        }
+
+        if (Type < PROBE_TYPE_COUNT)
+        {
+            printf ("%-12s not probed, failed to run: %s\n", Specs[s].pszSpec, szBinary);
+            continue;
+        }
+
+        ProbePrintResult (Specs[s].pszSpec, Samples, Results, SampleBytes);
+
+        if (0 == s)
+        {
+            bLz4 = true;
+            memcpy (Lz4, Results, sizeof (Lz4));
+
+            for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+            {
+                if (Samples[Type].Size && (Lz4[Type].Compressed >= PROBE_AUTO_RATIO * Samples[Type].Size))
+                    bIncompressible = true;
+            }
+        }
+
+        /* auto compresses data lz4 shrinks with the algorithm. Estimated per type from the lz4 result */
+        memset (Auto, 0, sizeof (Auto));
+        *szAuto = '\0';
+
+        if (s && bLz4)
+        {
+            snprintf (szAuto, sizeof (szAuto), "auto,%s", Specs[s].pszSpec);
+
+            for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+            {
+                Auto[Type].CpuSec = Lz4[Type].CpuSec;
+
+                if (Lz4[Type].Compressed >= PROBE_AUTO_RATIO * Samples[Type].Size)
+                {
+                    Auto[Type].Compressed = Samples[Type].Size;
+                }
+                else
+                {
+                    Auto[Type].Compressed = Results[Type].Compressed;
+                    Auto[Type].CpuSec    += Results[Type].CpuSec;
+                }
+            }
+
+            if (bIncompressible)
+                ProbePrintResult (szAuto, Samples, Auto, SampleBytes);
+        }
+
+        /* The smallest result fast enough. Within half a percent the faster one wins */
+        for (i=0; i < 2; i++)
+        {
+            if (i && ((0 == *szAuto) || (false == bIncompressible)))
+                break;
+
+            pResult = i ? Auto : Results;
+
+            Compressed = 0;
+            CpuSec     = 0.0;
+
+            for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+            {
+                Compressed += pResult[Type].Compressed;
+                CpuSec     += pResult[Type].CpuSec;
+            }
+
+            Ratio = (double) Compressed / SampleBytes;
+            Rate  = CpuSec ? SampleBytes / CpuSec : 1e18;
+
+            if ((Rate < g_ProbeMinRate) && *szBest)
+                continue;
+
+            if ((0 == *szBest) || (BestRate < g_ProbeMinRate) ||
+                (Ratio < BestRatio - 0.005) || ((Ratio < BestRatio + 0.005) && (Rate > BestRate)))
+            {
+                snprintf (szBest, sizeof (szBest), "%s", i ? szAuto : Specs[s].pszSpec);
+                BestRatio = Ratio;
+                BestRate  = Rate;
+            }
+        }
+    }
+
+    printf ("\n");
+
+    if (0 == *szBest)
+    {
+        printf ("No compression tool could be run from: %s\n", g_szProbeBinDir);
+        ret = 1;
+        goto Done;
+    }
+
+    if (BestRate < g_ProbeMinRate)
+        printf ("Info: No compression reaches %1.1f MB/sec per core (COMPRESSION_PROBE_MIN_RATE)\n", g_ProbeMinRate/1024.0/1024.0);
+
+    printf ("Recommended: BORG_COMPRESSION=%s (size: %1.1f%%, %1.1f MB/sec per core)\n", szBest, 100.0 * BestRatio, BestRate/1024.0/1024.0);
+    printf ("Configured : BORG_COMPRESSION=%s\n\n", *g_szBorgCompression ? g_szBorgCompression : "(borg default: lz4)");
+
+Done:
+
+    for (Type=0; Type < PROBE_TYPE_COUNT; Type++)
+        free (Samples[Type].pData);
+
+    for (i=0; i < (int) List.Count; i++)
+        free (List.pFiles[i].pszName);
+
+    free (List.pFiles);
+
+    return ret;
+}
+
+
+size_t ChunkerCut (const CHUNKER *pChunker, const unsigned char *pData, size_t Len, size_t FileOffset)
+{
+    /* Length of the next chunk. Len covers the maximum chunk size unless the file ends before */
+    uint32_t Hash  = 0;
+    size_t   Limit = (Len < pChunker->MaxSize) ? Len : pChunker->MaxSize;
+    size_t   Start = (pChunker->MinSize > pChunker->Window) ? pChunker->MinSize : pChunker->Window;
+    size_t   i     = 0;
+
+    if (CHUNKER_FIXED == pChunker->Algorithm)
+    {
+        Limit = ((0 == FileOffset) && pChunker->HeaderSize) ? pChunker->HeaderSize : pChunker->BlockSize;
+        return (Len < Limit) ? Len : Limit;
+    }
+
+    if (Limit <= Start)
+        return Limit;
+
+    for (i = Start - pChunker->Window; i < Start; i++)
+        Hash = Rotl32 (Hash, 1) ^ g_BuzhashTable[pData[i]];
+
+    for (i = Start; i < Limit; i++)
+    {
+        if (0 == (Hash & pChunker->Mask))
+            return i;
+
+        Hash = Rotl32 (Hash, 1) ^ Rotl32 (g_BuzhashTable[pData[i - pChunker->Window]], pChunker->Window) ^ g_BuzhashTable[pData[i]];
+    }
+
+    return Limit;
+}
+
+
+int ChunkSetAdd (CHUNK_SET *pSet, uint64_t Key)
+{
+    /* Open addressing with linear probing. Returns 1 for a new chunk, 0 for a known one and -1 without memory */
+    uint64_t *pNew = NULL;
+    size_t   NewSize = 0;
+    size_t   i = 0;
+    size_t   Slot = 0;
+
+    Key = Key ? Key : 1;
+
+    if (2 * (pSet->Count+1) > pSet->Size)
+    {
+        NewSize = pSet->Size ? 2*pSet->Size : 65536;
+        pNew = (uint64_t *) calloc (NewSize, sizeof (uint64_t));
+
+        if (NULL == pNew)
+            return -1;
+
+        for (i=0; i < pSet->Size; i++)
+        {
+            if (0 == pSet->pKeys[i])
+                continue;
+
+            for (Slot = pSet->pKeys[i] & (NewSize-1); pNew[Slot]; Slot = (Slot+1) & (NewSize-1));
+            pNew[Slot] = pSet->pKeys[i];
+        }
+
+        free (pSet->pKeys);
+        pSet->pKeys = pNew;
+        pSet->Size  = NewSize;
+    }
+
+    for (Slot = Key & (pSet->Size-1); pSet->pKeys[Slot]; Slot = (Slot+1) & (pSet->Size-1))
+    {
+        if (Key == pSet->pKeys[Slot])
+            return 0;
+    }
+
+    pSet->pKeys[Slot] = Key;
+    pSet->Count++;
+
+    return 1;
+}
+
+
+int ChunkerProbeFile (const CHUNKER *pChunker, const char *pszFileName, unsigned char *pBuffer, size_t BufferSize, CHUNK_SET *pSet, CHUNK_STATS *pStats)
+{
+    /* Chunks one file like borg and looks up each chunk. The buffer holds at least the maximum chunk size and one read */
+    int     ret    = 0;
+    int     FD     = -1;
+    int     Added  = 0;
+    size_t  Pos    = 0;
+    size_t  Fill   = 0;
+    size_t  Cut    = 0;
+    size_t  Offset = 0;
+    ssize_t BytesRead = 0;
+    bool    bEof   = false;
+    HASH_STATE Hash;
+    struct timespec tStart = {0};
+    struct timespec tEnd   = {0};
+
+    FD = open (pszFileName, O_RDONLY | O_CLOEXEC);
+
+    if (-1 == FD)
+    {
+        printf ("Cannot open file: %s (%s)\n", pszFileName, strerror (errno));
+        return 1;
+    }
+
+    posix_fadvise (FD, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (1)
+    {
+        /* Keep the maximum chunk size in the buffer */
+        while ((false == bEof) && (Fill - Pos < pChunker->MaxSize))
+        {
+            if (Pos)
+            {
+                memmove (pBuffer, pBuffer + Pos, Fill - Pos);
+                Fill -= Pos;
+                Pos   = 0;
+            }
+
+            BytesRead = read (FD, pBuffer + Fill, BufferSize - Fill);
+
+            if (BytesRead < 0)
+            {
+                printf ("Cannot read file: %s (%s)\n", pszFileName, strerror (errno));
+                ret = 1;
+                goto Done;
+            }
+
+            if (0 == BytesRead)
+                bEof = true;
+
+            Fill += BytesRead;
+        }
+
+        if (Pos == Fill)
+            break;
+
+        clock_gettime (CLOCK_MONOTONIC, &tStart);
+        Cut = ChunkerCut (pChunker, pBuffer + Pos, Fill - Pos, Offset);
+        clock_gettime (CLOCK_MONOTONIC, &tEnd);
+
+        pStats->ChunkNsec += (tEnd.tv_sec - tStart.tv_sec) * 1000000000LL + (tEnd.tv_nsec - tStart.tv_nsec);
+
+        HashInit (&Hash, HASH_TYPE_XXH3);
+        HashUpdate (&Hash, pBuffer + Pos, Cut);
+        Added = ChunkSetAdd (pSet, HashDigest (&Hash) ^ Cut);
+
+        if (Added < 0)
+        {
+            printf ("Cannot allocate chunk index\n");
+            ret = 1;
+            goto Done;
+        }
+
+        pStats->Chunks++;
+        pStats->Bytes += Cut;
+
+        if (Added)
+        {
+            pStats->NewChunks++;
+            pStats->NewBytes += Cut;
+        }
+
+        Pos    += Cut;
+        Offset += Cut;
+    }
+
+Done:
+
+    close (FD);
+
+    return ret;
+}
+
+
+int ChunkerProbeAddPair (PROBE_FILES *pOld, PROBE_FILES *pNew, const char *pszOld, const char *pszNew)
+{
+    struct stat OldStat = {0};
+    struct stat NewStat = {0};
+
+    if (stat (pszOld, &OldStat) || stat (pszNew, &NewStat) || (0 == S_ISREG (OldStat.st_mode)) || (0 == S_ISREG (NewStat.st_mode)))
+        return 0;
+
+    if (ProbeAddFile (pOld, pszOld, OldStat.st_size) || ProbeAddFile (pNew, pszNew, NewStat.st_size))
+        return 1;
+
+    return 0;
+}
+
+
+int ChunkerProbe (int Count, char *ppNames[])
+{
+    /* Replays an old and a new version of the same databases through each candidate.
+       The chunks of the new version not found in the old one are the data a second backup adds to the repository */
+    int    ret    = 0;
+    int    c      = 0;
+    int    CandidateCount = 0;
+    size_t i      = 0;
+    size_t Len    = 0;
+    size_t BufferSize  = 0;
+    size_t BestNew     = 0;
+    long   BestChunks  = 0;
+    const char *p = NULL;
+    char   szParams[80+1]    = {0};
+    char   szOld[MAX_PATH+1] = {0};
+    char   szBest[80+1]      = {0};
+    double sec = 0.0;
+    struct stat Filestat = {0};
+    unsigned char *pBuffer = NULL;
+
+    PROBE_FILES New = {0};
+    PROBE_FILES Old = {0};
+    PROBE_FILES Scan = {0};
+    CHUNK_SET   Set = {0};
+    CHUNK_STATS OldStats;
+    CHUNK_STATS NewStats;
+    CHUNKER     Candidates[CHUNKER_MAX_CANDIDATES];
+
+    if (2 != Count)
+    {
+        printf ("Specify the old and the new version of a database or a directory\n");
+        return 1;
+    }
+
+    /* Configured setting first, so it is the baseline of the candidates */
+    if (*g_szChunkerParams && (0 == ChunkerParse (g_szChunkerParams, &Candidates[0])))
+        CandidateCount++;
+
+    for (p = g_szChunkerProbeCandidates; *p && (CandidateCount < CHUNKER_MAX_CANDIDATES); p += Len)
+    {
+        while (' ' == *p)
+            p++;
+
+        Len = strcspn (p, " ");
+
+        if (0 == Len)
+            break;
+
+        snprintf (szParams, sizeof (szParams), "%.*s", (int) Len, p);
+
+        if (ChunkerParse (szParams, &Candidates[CandidateCount]))
+            printf ("Info: Invalid chunker params skipped: %s\n", szParams);
+        else if ((0 == CandidateCount) || strcmp (szParams, g_szChunkerParams))
+            CandidateCount++;
+    }
+
+    if (0 == CandidateCount)
+    {
+        printf ("No valid chunker params in CHUNKER_PROBE_CANDIDATES\n");
+        return 1;
+    }
+
+    /* Databases of the new directory are paired with the same relative name in the old directory */
+    if ((0 == stat (ppNames[1], &Filestat)) && S_ISDIR (Filestat.st_mode))
+    {
+        ret = ProbeScanDir (&Scan, ppNames[1], 0);
+
+        for (i=0; (0 == ret) && (i < Scan.Count); i++)
+        {
+            snprintf (szOld, sizeof (szOld), "%s%s", ppNames[0], Scan.pFiles[i].pszName + strlen (ppNames[1]));
+            ret = ChunkerProbeAddPair (&Old, &New, szOld, Scan.pFiles[i].pszName);
+        }
+    }
+    else
+    {
+        ret = ChunkerProbeAddPair (&Old, &New, ppNames[0], ppNames[1]);
+    }
+
+    if (ret)
+    {
+        printf ("Cannot allocate file list\n");
+        goto Done;
+    }
+
+    if (0 == New.Count)
+    {
+        printf ("No databases found in both versions\n");
+        ret = 1;
+        goto Done;
+    }
+
+    for (c=0; c < CandidateCount; c++)
+    {
+        if (Candidates[c].MaxSize > BufferSize)
+            BufferSize = Candidates[c].MaxSize;
+    }
+
+    BufferSize += 8*MAX_BUFFER;
+    pBuffer = (unsigned char *) malloc (BufferSize);
+
+    if (NULL == pBuffer)
+    {
+        printf ("Cannot allocate chunker buffer\n");
+        ret = 1;
+        goto Done;
+    }
+
+    BuzhashInitTable();
+
+    printf ("\nChunker probe: %zu databases, old version: %1.1f MB, new version: %1.1f MB\n\n", New.Count, Old.TotalBytes/1024.0/1024.0, New.TotalBytes/1024.0/1024.0);
+    printf ("%-26s %10s %10s %12s %8s %10s\n", "Chunker params", "Chunks", "Avg size", "New data", "Dedup", "Chunking");
+
+    for (c=0; c < CandidateCount; c++)
+    {
+        memset (&OldStats, 0, sizeof (OldStats));
+        memset (&NewStats, 0, sizeof (NewStats));
+
+        for (i=0; (0 == ret) && (i < Old.Count); i++)
+            ret = ChunkerProbeFile (&Candidates[c], Old.pFiles[i].pszName, pBuffer, BufferSize, &Set, &OldStats);
+
+        for (i=0; (0 == ret) && (i < New.Count); i++)
+            ret = ChunkerProbeFile (&Candidates[c], New.pFiles[i].pszName, pBuffer, BufferSize, &Set, &NewStats);
+
+        free (Set.pKeys);
+        memset (&Set, 0, sizeof (Set));
+
+        if (ret)
+            goto Done;
+
+        sec = (OldStats.ChunkNsec + NewStats.ChunkNsec) / 1000000000.0;
+
+        printf ("%-26s %10ld %7.1f KB %9.1f MB %7.1f%%",
+                Candidates[c].szParams, NewStats.Chunks, NewStats.Chunks ? NewStats.Bytes/1024.0/NewStats.Chunks : 0.0, NewStats.NewBytes/1024.0/1024.0,
+                NewStats.Bytes ? 100.0 - 100.0 * NewStats.NewBytes / NewStats.Bytes : 0.0);
+
+        /* The fixed chunker does not look at the data */
+        if (CHUNKER_FIXED == Candidates[c].Algorithm)
+            printf ("    no scan\n");
+        else
+            printf (" %5.0f MB/sec\n", sec ? (OldStats.Bytes + NewStats.Bytes)/1024.0/1024.0/sec : 0.0);
+
+        /* Least new data. Within one percent fewer chunks win, because each chunk costs index memory and borg CPU */
+        if ((0 == *szBest) || (NewStats.NewBytes + New.TotalBytes/100 < BestNew) ||
+            ((NewStats.NewBytes < BestNew + New.TotalBytes/100) && (NewStats.Chunks < BestChunks)))
+        {
+            snprintf (szBest, sizeof (szBest), "%s", Candidates[c].szParams);
+            BestNew    = NewStats.NewBytes;
+            BestChunks = NewStats.Chunks;
+        }
+    }
+
+    printf ("\nRecommended: CHUNKER_PARAMS=%s\n", szBest);
+    printf ("Configured : CHUNKER_PARAMS=%s\n\n", *g_szChunkerParams ? g_szChunkerParams : "(borg default: " CHUNKER_DEFAULT ")");
+
+Done:
+
+    free (pBuffer);
+    free (Set.pKeys);
+
+    for (i=0; i < Scan.Count; i++)
+        free (Scan.pFiles[i].pszName);
+
+    for (i=0; i < Old.Count; i++)
+        free (Old.pFiles[i].pszName);
+
+    for (i=0; i < New.Count; i++)
+        free (New.pFiles[i].pszName);
+
+    free (Scan.pFiles);
+    free (Old.pFiles);
+    free (New.pFiles);
+
+    return ret;
+}
+
+
+int BorgBackupPrune (long PruneDays)
+{
+    int   ret       =  0;
+    pid_t pid       =  0;
+    int   InputFD   = -1;
+    int   OutputFD  = -1;
+    int   ErrorFD   = -1;
+
+    ssize_t BytesRead     = 0;
+    ssize_t BytesWrite    = 0;
+    char  szPruneStr[255] = {0};
+
+    const char *args[] = { g_szBorgBackupBinary, "prune", "--stats", szPruneStr, NULL };
+
+    if (PruneDays < g_MinPruneDays)
+    {
+        printf ("\nBackup ERROR: Prune not allowed for specified interval: %ld\n\n", PruneDays);
+        return 1;
+    }
+
+    /* Archives referenced by the manifests of incremental backups must be kept */
+    if (g_Incremental && (PruneDays <= g_IncrementalFullDays))
+    {
+        printf ("\nBackup ERROR: Prune interval must be longer than INCREMENTAL_FULL_DAYS (%ld): %ld\n\n", g_IncrementalFullDays, PruneDays);
+        return 1;
+    }
+
+    if (g_DaosDedup && (PruneDays <= g_DaosFullDays))
+    {
+        printf ("\nBackup ERROR: Prune interval must be longer than DAOS_FULL_DAYS (%ld): %ld\n\n", g_DaosFullDays, PruneDays);
+        return 1;
+    }
+
+    if (g_Resume && (PruneDays * 24 <= g_ResumeMaxHours))
+    {
+        printf ("\nBackup ERROR: Prune interval must be longer than RESUME_MAX_HOURS (%ld): %ld days\n\n", g_ResumeMaxHours, PruneDays);
+        return 1;
+    }
+
+    snprintf (szPruneStr, sizeof (szPruneStr), "--keep-within=%ld%s", PruneDays, "d");
+
+    pid = BorgPopen3 (&InputFD, &OutputFD, &ErrorFD, 1, args);
+
+    if (pid < 1)
+    {
+        printf ("\nBackup ERROR: Cannot start Borg process\n\n");
+        perror ("Backup ERROR: Cannot start Borg process");
+        ret = 1;
+        goto Done;
+    }
+
+    /* Check if Borg process provides output */
+    if (-1 != OutputFD)
+    {
+        while ((BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer)-1)))
+        {
+            g_Buffer[BytesRead] = '\0';
+            BytesWrite = write (1, g_Buffer, BytesRead);
+
+            if (BytesRead != BytesWrite)
+            {
+                perror ("Warning: Incomplete buffer write");
+            }
+
+            usleep (10*1000);
+        }
+    }
+
+    if (-1 != ErrorFD)
+    {
+        while ((BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1)))
+        {
+            g_Buffer[BytesRead] = '\0';
+            BytesWrite = write (2, g_Buffer, BytesRead);
+
+            if (BytesRead != BytesWrite)
+            {
+                perror ("Warning: Incomplete buffer write");
+            }
+
+            usleep (10*1000);
+        }
+    }
+
+    printf ("\nBackup OK: Prune successful\n\n");
+
+Done:
+
+    if (-1 != InputFD)
+    {
+        close (InputFD);
+        InputFD = -1;
+    }
+
+    if (-1 != OutputFD)
+    {
+        close (OutputFD);
+        OutputFD = -1;
+    }
+
+    if (-1 != ErrorFD)
+    {
+        close (ErrorFD);
+        ErrorFD = -1;
+    }
+
+    if (pid > 0)
+    {
+        pclose3 (pid);
+        pid = 0;
+    }
+
+    return ret;
+}
+
+
+int InvokeBorgCommand (const char *pArgs[])
+{
+    int   ret       =  0;
+    int   InputFD   = -1;
+    int   OutputFD  = -1;
+    int   ErrorFD   = -1;
+    pid_t pid       =  0;
+
+    ssize_t BytesRead  = 0;
+    ssize_t BytesWrite = 0;
+
+
+    if (NULL == pArgs)
+    {
+        return -1;
+    }
+
+    pid = BorgPopen3 (&InputFD, &OutputFD, &ErrorFD, 1, pArgs);
+
+    if (pid < 1)
+    {
+        printf ("\nBackup ERROR: Cannot start Borg process\n\n");
+        perror ("Backup ERROR: Cannot start Borg process");
+        ret = 1;
+        goto Done;
+    }
+
+    /* Check if Borg process provides output */
+    if (-1 != OutputFD)
+    {
+        while ((BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer)-1)))
+        {
+            g_Buffer[BytesRead] = '\0';
+            BytesWrite = write (1, g_Buffer, BytesRead);
+
+            if (BytesRead != BytesWrite)
+            {
+                perror ("Warning: Incomplete buffer write");
+            }
+
+            usleep (10*1000);
+        }
+    }
+
+    if (-1 != ErrorFD)
+    {
+        while ((BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1)))
+        {
+            g_Buffer[BytesRead] = '\0';
+            BytesWrite = write (2, g_Buffer, BytesRead);
+
+            if (BytesRead != BytesWrite)
+            {
+                perror ("Warning: Incomplete buffer write");
+            }
+
+            usleep (10*1000);
+
+            if (strstr ((char *)g_Buffer, "not found"))
+            {
+                printf ("\nBackup ERROR: Cannot find archive to delete\n\n");
+                ret = -1;
+            }
+        }
+    }
+
+Done:
+
+    if (-1 != InputFD)
+    {
+        close (InputFD);
+        InputFD = -1;
+    }
+
+    if (-1 != OutputFD)
+    {
+        close (OutputFD);
+        OutputFD = -1;
+    }
+
+    if (-1 != ErrorFD)
+    {
+        close (ErrorFD);
+        ErrorFD = -1;
+    }
+
+    if (pid > 0)
+    {
+        pclose3 (pid);
+        pid = 0;
+    }
+
+    return ret;
+}
+
+
+
+char *BorgReadOutput (const char *args[])
+{
+    /* Returns the output of a borg command as a null terminated string. The caller frees the buffer */
+    int     InputFD  = -1;
+    int     OutputFD = -1;
+    int     ErrorFD  = -1;
+    pid_t   pid      =  0;
+    size_t  Len      =  0;
+    size_t  Alloc    =  0;
+    ssize_t BytesRead = 0;
+    char    *pBuffer = NULL;
+    char    *pNew    = NULL;
+
+    pid = BorgPopen3 (&InputFD, &OutputFD, &ErrorFD, 0, args);
+
+    if (pid < 1)
+        return NULL;
+
+    close (InputFD);
+
+    while (1)
+    {
+        if (Len + MAX_BUFFER + 1 > Alloc)
+        {
+            pNew = (char *) realloc (pBuffer, Alloc + MAX_BUFFER + 1);
+
+            if (NULL == pNew)
+                break;
+
+            pBuffer = pNew;
+            Alloc  += MAX_BUFFER + 1;
+        }
+
+        BytesRead = read (OutputFD, pBuffer + Len, MAX_BUFFER);
+
+        if ((BytesRead < 0) && (EINTR == errno))
+            continue;
+
+        if (BytesRead < 1)
+            break;
+
+        Len += BytesRead;
+    }
+
+    close (OutputFD);
+    close (ErrorFD);
+    pclose3 (pid);
+
+    if (pBuffer && Len)
+    {
+        pBuffer[Len] = '\0';
+        return pBuffer;
+    }
+
+    free (pBuffer);
+    return NULL;
+}
+
+
+int BorgBackupDelete (const char *pszArchiv)
+{
+    int  ret = 0;
+
+    const char *args[] = { g_szBorgBackupBinary, "delete", "--stats", pszArchiv, NULL };
+
+    if (0 == g_BorgDeleteAllowed)
+    {
+        printf ("\nBackup ERROR: Archive delete is not allowed\n\n");
+        return 1;
+    }
+
+    if (IsNullStr (pszArchiv))
+    {
+        printf ("\nBackup ERROR: No archive to delete specified\n\n");
+        ret = 1;
+        goto Done;
+    }
+
+
+    ret = InvokeBorgCommand (args);
+
+Done:
+
+    if (ret)
+        printf ("ERROR deleting archive\n");
+    else
+        printf ("\nBackup OK: Delete successful\n\n");
+
+    return ret;
+}
+
+
+bool IsBorgBackupPassthruCommand (int argc, char *argv[])
+{
+    size_t i = 0;
+
+    if (argc < 2)
+        return false;
+
+    for (i=0; i<g_PassthruCommandCount; i++)
+    {
+        if (0 == strcmp (argv[1], g_szPassthruCommands[i]))
+            return true;
+    }
+
+    return false;
+}
+
+
+int BorgBackupPassthru (int argc, char *argv[])
+{
+    int    i         =  0;
+    int    ret       =  0;
+    int    ArgCount  =  argc+1;
+    size_t ArgSize   =  ArgCount * sizeof (char *);
+    const char **ppArgs = NULL;
+
+    /* Allocate variable argument list pointer */
+    ppArgs = (const char **) malloc (ArgSize);
+
+    if (NULL == ppArgs)
+    {
+        printf ("\nBackup ERROR: Cannot allocate memory for argument list\n\n");
+        ret = -1;
+        goto Done;
+    }
+
+    memset (ppArgs, 0, ArgSize);
+
+    /* Replace the program name with Borg Backup binary */
+    ppArgs[0] = g_szBorgBackupBinary;
+
+    /* Copy all parameters beside the first one (which is the program name) */
+    for (i=1; i<argc; i++)
+    {
+        ppArgs[i] = argv[i];
+    }
+
+    ret = InvokeBorgCommand ((const char **) ppArgs);
+
+Done:
+
+    if (ppArgs)
+    {
+        free (ppArgs);
+        ppArgs = NULL;
+    }
+
+    return ret;
+}
+
+
+void ManifestFree (MANIFEST *pManifest)
+{
+    size_t i = 0;
+
+    for (i=0; i < pManifest->Count; i++)
+    {
+        free (pManifest->pEntries[i].pszFileName);
+        free (pManifest->pEntries[i].pszRef);
+    }
+
+    free (pManifest->pEntries);
+    memset (pManifest, 0, sizeof (MANIFEST));
+}
+
+
+int ManifestAdd (MANIFEST *pManifest, const char *pszFileName, time_t tRequest, size_t *retpIndex)
+{
+    /* Entries are added in request order. The result is set when the file is streamed */
+    MANIFEST_ENTRY *pNew   = NULL;
+    MANIFEST_ENTRY *pEntry = NULL;
+    time_t tNow = GetOSTimer();
+
+    if (pManifest->Count == pManifest->Alloc)
+    {
+        pNew = (MANIFEST_ENTRY *) realloc (pManifest->pEntries, (pManifest->Alloc + 1024) * sizeof (MANIFEST_ENTRY));
+
+        if (NULL == pNew)
+            return 1;
+
+        pManifest->pEntries = pNew;
+        pManifest->Alloc   += 1024;
+    }
+
+    pEntry = &pManifest->pEntries[pManifest->Count];
+    memset (pEntry, 0, sizeof (MANIFEST_ENTRY));
+
+    pEntry->pszFileName = strdup (pszFileName);
+
+    if (NULL == pEntry->pszFileName)
+        return 1;
+
+    /* The request file is written right before nshborg is invoked */
+    pEntry->tRequest = (tRequest && (tRequest < tNow)) ? tRequest : tNow;
+
+    if (retpIndex)
+        *retpIndex = pManifest->Count;
+
+    pManifest->Count++;
+
+    return 0;
+}
+
+
+void ManifestSetResult (MANIFEST *pManifest, size_t Index, int Status, const BACKUP_STATS *pStats, const char *pszRepo, const char *pszPart)
+{
+    MANIFEST_ENTRY *pEntry = NULL;
+
+    if (Index >= pManifest->Count)
+        return;
+
+    pEntry = &pManifest->pEntries[Index];
+
+    pEntry->Status     = Status;
+    pEntry->FileSize   = pStats->FileSize;
+    pEntry->FileMtime  = pStats->FileMtime;
+    pEntry->BytesTotal = pStats->BytesTotal;
+    pEntry->tStart     = pStats->tStart;
+    pEntry->tEnd       = pStats->tEnd;
+    pEntry->HashType   = pStats->HashType;
+    pEntry->Hash       = pStats->Hash;
+    pEntry->pszRepo    = pszRepo;
+    pEntry->pszRef     = pszPart ? strdup (pszPart) : NULL;
+}
+
+
+void ManifestSetRef (MANIFEST *pManifest, size_t Index, const STATE_ENTRY *pState, const char *pszRepo)
+{
+    /* Unchanged database. Size, time and hash are the ones of the referenced archive */
+    MANIFEST_ENTRY *pEntry = NULL;
+    time_t tNow = GetOSTimer();
+
+    if (Index >= pManifest->Count)
+        return;
+
+    pEntry = &pManifest->pEntries[Index];
+
+    pEntry->Status     = 0;
+    pEntry->FileSize   = pState->Id.Size;
+    pEntry->FileMtime  = pState->Id.MtimeNsec / 1000000000LL;
+    pEntry->BytesTotal = 0;
+    pEntry->tStart     = tNow;
+    pEntry->tEnd       = tNow;
+    pEntry->HashType   = pState->HashType;
+    pEntry->Hash       = pState->Hash;
+    pEntry->pszRepo    = pszRepo;
+    pEntry->pszRef     = strdup (pState->pszArchivName);
+    pEntry->bRef       = true;
+}
+
+
+void ManifestAck (MANIFEST *pManifest, time_t tAck)
+{
+    /* All files of a request file leave backup mode when the request file is removed */
+    size_t i = 0;
+
+    /* Socket requests are acknowledged when they are answered */
+    for (i=pManifest->Pending; i < pManifest->Count; i++)
+    {
+        if (0 == pManifest->pEntries[i].tAck)
+            pManifest->pEntries[i].tAck = tAck;
+    }
+
+    pManifest->Pending = pManifest->Count;
+}
+
+
+size_t ManifestFormatTime (time_t t, char *pszBuffer, size_t BufferSize)
+{
+    struct tm TimeTM = {0};
+
+    gmtime_r (&t, &TimeTM);
+
+    return strftime (pszBuffer, BufferSize, "%Y-%m-%dT%H:%M:%SZ", &TimeTM);
+}
+
+
+size_t ManifestFormat (const MANIFEST *pManifest, const char *pszArchiv, time_t tEnd, char *pszBuffer, size_t BufferSize)
+{
+    /* Header lines start with '#'. One tab separated line per file with the name last, because only the name can contain blanks.
+       Returns the length. Without a buffer only the length is calculated */
+
+    size_t Len     = 0;
+    size_t i       = 0;
+    size_t CountOK = 0;
+    size_t CountRef = 0;
+    int    n       = 0;
+    double sec     = 0.0;
+    char   szTime[40]  = {0};
+    char   szMtime[40] = {0};
+    char   szHash[40]  = {0};
+
+    const MANIFEST_ENTRY *pEntry = NULL;
+
+    for (i=0; i < pManifest->Count; i++)
+    {
+        if (pManifest->pEntries[i].bRef)
+            CountRef++;
+        else if (0 == pManifest->pEntries[i].Status)
+            CountOK++;
+    }
+
+    ManifestFormatTime (pManifest->tStart/1000, szTime, sizeof (szTime));
+    ManifestFormatTime (tEnd/1000, szMtime, sizeof (szMtime));
+
+    n = snprintf (pszBuffer, BufferSize,
+                  "# nshborg manifest 1\n# version: %s\n# archive: %s\n# started: %s\n# completed: %s\n# files: %zu\n# referenced: %zu\n# failed: %zu\n"
+                  "# status\tsize\tmtime\tbackup_mode_msec\tmb_per_sec\thash\trepo\tref\tname\n",
+                  g_szVersion, pszArchiv, szTime, szMtime, CountOK, CountRef, pManifest->Count - CountOK - CountRef);
+    Len += n;
+
+    for (i=0; i < pManifest->Count; i++)
+    {
+        pEntry = &pManifest->pEntries[i];
+
+        sec = (pEntry->tEnd - pEntry->tStart)/1000.0;
+
+        ManifestFormatTime (pEntry->FileMtime, szMtime, sizeof (szMtime));
+
+        if (pEntry->Status || (HASH_TYPE_NONE == pEntry->HashType))
+            snprintf (szHash, sizeof (szHash), "-");
+        else
+            snprintf (szHash, sizeof (szHash), "%s:%016llx", HashTypeName (pEntry->HashType), (unsigned long long) pEntry->Hash);
+
+        n = snprintf (pszBuffer ? pszBuffer+Len : NULL, pszBuffer ? BufferSize-Len : 0, "%s\t%zu\t%s\t%lld\t%1.1f\t%s\t%s\t%s\t%s\n",
+                      pEntry->Status ? "ERROR" : (pEntry->bRef ? "REF" : "OK"),
+                      pEntry->FileSize,
+                      pEntry->FileMtime ? szMtime : "-",
+                      (long long) (pEntry->tAck ? pEntry->tAck - pEntry->tRequest : 0),
+                      sec ? pEntry->BytesTotal/1024.0/1024.0/sec : 0.0,
+                      szHash,
+                      IsNullStr (pEntry->pszRepo) ? "-" : pEntry->pszRepo,
+                      pEntry->pszRef ? pEntry->pszRef : "-",
+                      pEntry->pszFileName);
+        Len += n;
+    }
+
+    return Len;
+}
+
+
+int TarWriteManifest (int WriteFD, const MANIFEST *pManifest, const char *pszArchiv, size_t *retpBytesWritten)
+{
+    /* Last regular entry of the archive, so restore and audit tools can read it without listing the archive */
+    int    ret  = 0;
+    size_t Len  = 0;
+    time_t tNow = GetOSTimer();
+    char   *pszManifest = NULL;
+
+    struct stat Filestat;
+
+    Len = ManifestFormat (pManifest, pszArchiv, tNow, NULL, 0);
+    pszManifest = (char *) malloc (Len+1);
+
+    if (NULL == pszManifest)
+        return 1;
+
+    ManifestFormat (pManifest, pszArchiv, tNow, pszManifest, Len+1);
+
+    memset (&Filestat, 0, sizeof (Filestat));
+    Filestat.st_mode  = S_IFREG | S_IRUSR | S_IWUSR;
+    Filestat.st_uid   = geteuid();
+    Filestat.st_gid   = getegid();
+    Filestat.st_size  = Len;
+    Filestat.st_mtime = tNow/1000;
+
+    if (TarWriteFileHeader (WriteFD, TAR_MANIFEST_NAME, &Filestat, NULL, retpBytesWritten))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    if ((ssize_t) Len != WriteBuffer (WriteFD, pszManifest, Len))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    if (retpBytesWritten)
+        *retpBytesWritten += Len;
+
+    ret = TarWritePadding (WriteFD, Len, retpBytesWritten);
+
+Done:
+
+    free (pszManifest);
+
+    return ret;
+}
+
+
+int FileIdGet (const char *pszFileName, FILE_ID *retpId)
+{
+    /* Metadata alone misses a database replaced by a copy with the same size and time. The header identifies the database itself */
+    int     ret = 0;
+    int     FD  = -1;
+    ssize_t BytesRead = 0;
+    unsigned char Header[NSF_HEADER_SIZE];
+
+    struct stat Filestat;
+    HASH_STATE  Hash;
+
+    memset (retpId, 0, sizeof (FILE_ID));
+
+    FD = open (pszFileName, O_RDONLY | O_CLOEXEC);
+
+    if (-1 == FD)
+        return 1;
+
+    if (fstat (FD, &Filestat) || !S_ISREG (Filestat.st_mode))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    BytesRead = pread (FD, Header, sizeof (Header), 0);
+
+    if (BytesRead < 0)
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    HashInit (&Hash, HASH_TYPE_XXH3);
+    HashUpdate (&Hash, Header, BytesRead);
+
+    retpId->Inode      = Filestat.st_ino;
+    retpId->Size       = Filestat.st_size;
+    retpId->MtimeNsec  = Filestat.st_mtim.tv_sec * 1000000000LL + Filestat.st_mtim.tv_nsec;
+    retpId->CtimeNsec  = Filestat.st_ctim.tv_sec * 1000000000LL + Filestat.st_ctim.tv_nsec;
+    retpId->HeaderHash = HashDigest (&Hash);
+
+Done:
+
+    close (FD);
+
+    return ret;
+}
+
+
+void StateFree (STATE *pState)
+{
+    size_t i = 0;
+
+    for (i=0; i < pState->Count; i++)
+    {
+        free (pState->pEntries[i].pszFileName);
+        free (pState->pEntries[i].pszRepo);
+        free (pState->pEntries[i].pszArchivName);
+    }
+
+    free (pState->pEntries);
+    memset (pState, 0, sizeof (STATE));
+}
+
+
+int StateCompare (const void *p1, const void *p2)
+{
+    return strcmp (((const STATE_ENTRY *) p1)->pszFileName, ((const STATE_ENTRY *) p2)->pszFileName);
+}
+
+
+STATE_ENTRY *StateFind (STATE *pState, const char *pszFileName)
+{
+    size_t i = 0;
+    STATE_ENTRY Key;
+    STATE_ENTRY *pEntry = NULL;
+
+    Key.pszFileName = (char *) pszFileName;
+
+    if (pState->Sorted)
+    {
+        pEntry = (STATE_ENTRY *) bsearch (&Key, pState->pEntries, pState->Sorted, sizeof (STATE_ENTRY), StateCompare);
+
+        if (pEntry)
+            return pEntry;
+    }
+
+    for (i=pState->Sorted; i < pState->Count; i++)
+    {
+        if (0 == strcmp (pState->pEntries[i].pszFileName, pszFileName))
+            return &pState->pEntries[i];
+    }
+
+    return NULL;
+}
+
+
+STATE_ENTRY *StateAdd (STATE *pState, const char *pszFileName)
+{
+    STATE_ENTRY *pNew   = NULL;
+    STATE_ENTRY *pEntry = NULL;
+
+    if (pState->Count == pState->Alloc)
+    {
+        pNew = (STATE_ENTRY *) realloc (pState->pEntries, (pState->Alloc + 1024) * sizeof (STATE_ENTRY));
+
+        if (NULL == pNew)
+            return NULL;
+
+        pState->pEntries = pNew;
+        pState->Alloc   += 1024;
+    }
+
+    pEntry = &pState->pEntries[pState->Count];
+    memset (pEntry, 0, sizeof (STATE_ENTRY));
+
+    pEntry->pszFileName = strdup (pszFileName);
+
+    if (NULL == pEntry->pszFileName)
+        return NULL;
+
+    pState->Count++;
+
+    return pEntry;
+}
+
+
+int StateLoad (STATE *pState, const char *pszStateFile, time_t tMin)
+{
+    /* One tab separated line per database with the name last. Entries backed up before tMin are dropped */
+    int    Field  = 0;
+    char   *pFields[10] = {0};
+    char   *p     = NULL;
+    FILE   *fp    = NULL;
+    STATE_ENTRY *pEntry = NULL;
+
+    char   szLine[4*MAX_PATH+256] = {0};
+
+    fp = fopen (pszStateFile, "r");
+
+    if (NULL == fp)
+        return 0;
+
+    while (fgets (szLine, sizeof (szLine), fp))
+    {
+        p = strchr (szLine, '\n');
+
+        if (p)
+            *p = '\0';
+
+        if ('#' == *szLine)
+            continue;
+
+        p = szLine;
+
+        for (Field=0; Field < 10; Field++)
+        {
+            pFields[Field] = p;
+            p = strchr (p, '\t');
+
+            if (NULL == p)
+                break;
+
+            *p++ = '\0';
+        }
+
+        if ((Field < 10) || ('\0' == *p))
+            continue;
+
+        if (strtoll (pFields[7], NULL, 10) < tMin)
+            continue;
+
+        pEntry = StateAdd (pState, p);
+
+        if (NULL == pEntry)
+            break;
+
+        pEntry->Id.Inode      = strtoull (pFields[0], NULL, 10);
+        pEntry->Id.Size       = strtoull (pFields[1], NULL, 10);
+        pEntry->Id.MtimeNsec  = strtoll  (pFields[2], NULL, 10);
+        pEntry->Id.CtimeNsec  = strtoll  (pFields[3], NULL, 10);
+        pEntry->Id.HeaderHash = strtoull (pFields[4], NULL, 16);
+        pEntry->HashType      = atoi     (pFields[5]);
+        pEntry->Hash          = strtoull (pFields[6], NULL, 16);
+        pEntry->tBackup       = strtoll  (pFields[7], NULL, 10);
+        pEntry->pszRepo       = strdup   (pFields[8]);
+        pEntry->pszArchivName = strdup   (pFields[9]);
+    }
+
+    fclose (fp);
+
+    qsort (pState->pEntries, pState->Count, sizeof (STATE_ENTRY), StateCompare);
+    pState->Sorted = pState->Count;
+
+    return 0;
+}
+
+
+int StateSave (STATE *pState, const char *pszStateFile, const char *pszHeader)
+{
+    /* Written to a new file which replaces the old one. A crash leaves the old state, which only references complete archives */
+    int    ret = 0;
+    size_t i   = 0;
+    FILE   *fp = NULL;
+    STATE_ENTRY *pEntry = NULL;
+
+    char   szTmpFile[MAX_PATH+10] = {0};
+
+    snprintf (szTmpFile, sizeof (szTmpFile), "%s.tmp", pszStateFile);
+
+    fp = fopen (szTmpFile, "w");
+
+    if (NULL == fp)
+    {
+        perror ("Backup ERROR: Cannot create state file");
+        return 1;
+    }
+
+    if (pszHeader)
+        fprintf (fp, "%s\n", pszHeader);
+
+    fprintf (fp, "# inode\tsize\tmtime_nsec\tctime_nsec\theader_xxh3\thash_type\thash\tbackup_msec\trepo\tarchive\tname\n");
+
+    for (i=0; i < pState->Count; i++)
+    {
+        pEntry = &pState->pEntries[i];
+
+        if ((NULL == pEntry->pszRepo) || (NULL == pEntry->pszArchivName))
+            continue;
+
+        fprintf (fp, "%llu\t%zu\t%lld\t%lld\t%016llx\t%d\t%016llx\t%lld\t%s\t%s\t%s\n",
+                 pEntry->Id.Inode, pEntry->Id.Size, pEntry->Id.MtimeNsec, pEntry->Id.CtimeNsec,
+                 (unsigned long long) pEntry->Id.HeaderHash, pEntry->HashType, (unsigned long long) pEntry->Hash,
+                 (long long) pEntry->tBackup, pEntry->pszRepo, pEntry->pszArchivName, pEntry->pszFileName);
+    }
+
+    if (fflush (fp) || fsync (fileno (fp)))
+        ret = 1;
+
+    if (fclose (fp))
+        ret = 1;
+
+    if (ret)
+    {
+        perror ("Backup ERROR: Cannot write state file");
+        remove (szTmpFile);
+        return 1;
+    }
+
+    if (rename (szTmpFile, pszStateFile))
+    {
+        perror ("Backup ERROR: Cannot replace state file");
+        remove (szTmpFile);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+STATE_ENTRY *StateFindUnchanged (STATE *pState, const char *pszFileName, const FILE_ID *pId)
+{
+    /* Same file, same size, same times and same database header as in the last full backup */
+    STATE_ENTRY *pEntry = StateFind (pState, pszFileName);
+
+    if ((NULL == pEntry) || (NULL == pEntry->pszRepo) || (NULL == pEntry->pszArchivName))
+        return NULL;
+
+    if ((pEntry->Id.Inode      != pId->Inode)     ||
+        (pEntry->Id.Size       != pId->Size)      ||
+        (pEntry->Id.MtimeNsec  != pId->MtimeNsec) ||
+        (pEntry->Id.CtimeNsec  != pId->CtimeNsec) ||
+        (pEntry->Id.HeaderHash != pId->HeaderHash))
+        return NULL;
+
+    return pEntry;
+}
+
+
+void StateRecord (STATE *pState, const char *pszFileName, const FILE_ID *pId, const BACKUP_STATS *pStats, const char *pszRepo, const char *pszArchiv)
+{
+    /* Called for each database streamed completely. A database modified while it was streamed is backed up again next time */
+    const char  *pszArchivName = strstr (pszArchiv, "::");
+    STATE_ENTRY *pEntry = NULL;
+
+    if ((pStats->FileSize != pId->Size) || (pStats->FileMtime != pId->MtimeNsec / 1000000000LL))
+        return;
+
+    pEntry = StateFind (pState, pszFileName);
+
+    if (NULL == pEntry)
+        pEntry = StateAdd (pState, pszFileName);
+
+    if (NULL == pEntry)
+        return;
+
+    free (pEntry->pszRepo);
+    free (pEntry->pszArchivName);
+
+    memcpy (&pEntry->Id, pId, sizeof (FILE_ID));
+    pEntry->HashType      = pStats->HashType;
+    pEntry->Hash          = pStats->Hash;
+    pEntry->tBackup       = pStats->tStart;
+    pEntry->pszRepo       = strdup (pszRepo);
+    pEntry->pszArchivName = strdup (pszArchivName ? pszArchivName+2 : pszArchiv);
+
+    pState->Updated++;
+}
+
+
+void JournalFree (JOURNAL *pJournal)
+{
+    if (-1 != pJournal->FD)
+        close (pJournal->FD);
+
+    StateFree (&pJournal->Done);
+    memset (pJournal, 0, sizeof (JOURNAL));
+    pJournal->FD = -1;
+}
+
+
+int JournalLoad (JOURNAL *pJournal, const char *pszJournalFile)
+{
+    /* A journal is only left behind by a backup which did not complete. Files completed more than RESUME_MAX_HOURS ago are backed up again */
+    char *p  = NULL;
+    FILE *fp = NULL;
+    char szLine[MAX_PATH+1] = {0};
+
+    fp = fopen (pszJournalFile, "r");
+
+    if (NULL == fp)
+        return 0;
+
+    if (fgets (szLine, sizeof (szLine), fp) && (0 == strncmp (szLine, JOURNAL_HEADER, strlen (JOURNAL_HEADER))))
+    {
+        p = strchr (szLine, '\n');
+
+        if (p)
+            *p = '\0';
+
+        snprintf (pJournal->szArchiv, sizeof (pJournal->szArchiv), "%.*s", (int) (sizeof (pJournal->szArchiv)-1), szLine + strlen (JOURNAL_HEADER));
+    }
+
+    fclose (fp);
+
+    if ('\0' == *pJournal->szArchiv)
+    {
+        printf ("Info: Invalid backup journal ignored: %s\n", pszJournalFile);
+        return 1;
+    }
+
+    return StateLoad (&pJournal->Done, pszJournalFile, GetOSTimer() - g_ResumeMaxHours * 3600LL * 1000LL);
+}
+
+
+char *JournalNextLine (char **ppNext)
+{
+    /* Splits borg list output into lines without trailing blanks */
+    char *pLine = *ppNext;
+    char *p     = NULL;
+
+    if ((NULL == pLine) || ('\0' == *pLine))
+        return NULL;
+
+    *ppNext = strchr (pLine, '\n');
+
+    if (*ppNext)
+        *(*ppNext)++ = '\0';
+
+    p = pLine + strlen (pLine);
+
+    while ((p > pLine) && ((' ' == p[-1]) || ('\r' == p[-1])))
+        *--p = '\0';
+
+    return pLine;
+}
+
+
+long JournalCheckpointNumber (const char *pszSuffix)
+{
+    /* .checkpoint is the first checkpoint, .checkpoint.N the following ones. -1 for other names */
+    char *pEnd = NULL;
+    long Number = 0;
+
+    if (strncmp (pszSuffix, ".checkpoint", 11))
+        return -1;
+
+    pszSuffix += 11;
+
+    if ('\0' == *pszSuffix)
+        return 0;
+
+    if (('.' != *pszSuffix) || !isdigit (pszSuffix[1]))
+        return -1;
+
+    Number = strtol (pszSuffix+1, &pEnd, 10);
+
+    return *pEnd ? -1 : Number;
+}
+
+
+void JournalVerifyArchiv (JOURNAL *pJournal, const char *pszRepo, const char *pszArchivName)
+{
+    /* Borg only commits an archive when import-tar completes. A killed borg leaves the checkpoint archive it wrote last,
+       which holds the files completed before the checkpoint. Journal entries found in neither are backed up again */
+    size_t i     = 0;
+    size_t Len   = strlen (pszArchivName);
+    long   Found = 0;
+    long   Lost  = 0;
+    long   Number     = 0;
+    long   Checkpoint = -1;
+    bool   bComplete = false;
+    char   *pszList  = NULL;
+    char   *pLine    = NULL;
+    char   *pNext    = NULL;
+    STATE_ENTRY *pEntry = NULL;
+
+    char   szPattern[MAX_PATH+1]    = {0};
+    char   szCheckpoint[MAX_PATH+1] = {0};
+    char   szArchiv[3*MAX_PATH+20]  = {0};
+    char   szPartial[MAX_PATH+20]   = {0};
+    char   szFileName[MAX_PATH+2]   = {0};
+
+    const char *argsArchivs[] = { g_szBorgBackupBinary, "list", "--short", "--glob-archives", szPattern, pszRepo, NULL };
+    const char *argsRename[]  = { g_szBorgBackupBinary, "rename", szArchiv, szPartial, NULL };
+    const char *argsFiles[]   = { g_szBorgBackupBinary, "list", "--short", szArchiv, NULL };
+
+    snprintf (szPattern, sizeof (szPattern), "%s*", pszArchivName);
+
+    pszList = BorgReadOutput (argsArchivs);
+    pNext   = pszList;
+
+    while ((pLine = JournalNextLine (&pNext)))
+    {
+        if (0 == strcmp (pLine, pszArchivName))
+        {
+            bComplete = true;
+            continue;
+        }
+
+        /* The checkpoint with the highest number is the last one. .checkpoint.10 follows .checkpoint.9 */
+        if (strncmp (pLine, pszArchivName, Len))
+            continue;
+
+        Number = JournalCheckpointNumber (pLine + Len);
+
+        if (Number > Checkpoint)
+        {
+            Checkpoint = Number;
+            snprintf (szCheckpoint, sizeof (szCheckpoint), "%s", pLine);
+        }
+    }
+
+    free (pszList);
+    pszList = NULL;
+
+    if (bComplete)
+    {
+        printf ("Resume: [%s::%s] archive complete\n", pszRepo, pszArchivName);
+        return;
+    }
+
+    if (*szCheckpoint)
+    {
+        /* Prune removes checkpoint archives. Renamed it is kept as long as the archive of the resumed backup */
+        snprintf (szArchiv,  sizeof (szArchiv),  "%s::%s", pszRepo, szCheckpoint);
+        snprintf (szPartial, sizeof (szPartial), "%s.partial", pszArchivName);
+
+        InvokeBorgCommand (argsRename);
+
+        snprintf (szArchiv, sizeof (szArchiv), "%s::%s", pszRepo, szPartial);
+
+        /* Borg stores names without the leading slash. Parts of files cut by the checkpoint have a suffix and are not found */
+        pszList = BorgReadOutput (argsFiles);
+        pNext   = pszList;
+
+        while ((pLine = JournalNextLine (&pNext)))
+        {
+            snprintf (szFileName, sizeof (szFileName), "/%s", pLine);
+
+            pEntry = StateFind (&pJournal->Done, szFileName);
+
+            if (NULL == pEntry)
+                pEntry = StateFind (&pJournal->Done, pLine);
+
+            if ((NULL == pEntry) || (NULL == pEntry->pszRepo) || strcmp (pEntry->pszRepo, pszRepo) || strcmp (pEntry->pszArchivName, pszArchivName))
+                continue;
+
+            free (pEntry->pszArchivName);
+            pEntry->pszArchivName = strdup (szPartial);
+            Found++;
+        }
+
+        free (pszList);
+        pszList = NULL;
+    }
+
+    /* Entries still referencing the archive are not in the repository */
+    for (i=0; i < pJournal->Done.Count; i++)
+    {
+        pEntry = &pJournal->Done.pEntries[i];
+
+        if ((NULL == pEntry->pszRepo) || strcmp (pEntry->pszRepo, pszRepo) || strcmp (pEntry->pszArchivName, pszArchivName))
+            continue;
+
+        free (pEntry->pszRepo);
+        free (pEntry->pszArchivName);
+        pEntry->pszRepo = NULL;
+        pEntry->pszArchivName = NULL;
+        Lost++;
+    }
+
+    if (*szCheckpoint)
+        printf ("Resume: [%s::%s] checkpoint renamed to %s, files: %ld, backed up again: %ld\n", pszRepo, szCheckpoint, szPartial, Found, Lost);
+    else
+        printf ("Resume: [%s::%s] archive not found, files backed up again: %ld\n", pszRepo, pszArchivName, Lost);
+}
+
+
+void JournalVerify (JOURNAL *pJournal)
+{
+    /* Each archive of the interrupted backup is checked once. There are only a few, one per stream and archive part */
+    size_t i = 0;
+    size_t k = 0;
+    size_t Count = 0;
+    STATE_ENTRY *pEntry = NULL;
+    char   **ppDone = NULL;
+    char   **ppNew  = NULL;
+
+    char   szRepo[MAX_PATH+1]      = {0};
+    char   szName[MAX_PATH+1]      = {0};
+    char   szArchiv[2*MAX_PATH+20] = {0};
+
+    for (i=0; i < pJournal->Done.Count; i++)
+    {
+        pEntry = &pJournal->Done.pEntries[i];
+
+        if (NULL == pEntry->pszRepo)
+            continue;
+
+        /* Verifying the archive frees the names of entries not found */
+        snprintf (szRepo, sizeof (szRepo), "%s", pEntry->pszRepo);
+        snprintf (szName, sizeof (szName), "%s", pEntry->pszArchivName);
+        snprintf (szArchiv, sizeof (szArchiv), "%s::%s", szRepo, szName);
+
+        for (k=0; k < Count; k++)
+        {
+            if (0 == strcmp (ppDone[k], szArchiv))
+                break;
+        }
+
+        if (k < Count)
+            continue;
+
+        ppNew = (char **) realloc (ppDone, (Count+2) * sizeof (char *));
+
+        if (NULL == ppNew)
+            break;
+
+        ppDone = ppNew;
+        ppDone[Count++] = strdup (szArchiv);
+
+        /* Renamed checkpoints are verified with their archive */
+        snprintf (szArchiv, sizeof (szArchiv), "%s::%s.partial", szRepo, szName);
+        ppDone[Count++] = strdup (szArchiv);
+
+        JournalVerifyArchiv (pJournal, szRepo, szName);
+    }
+
+    for (k=0; k < Count; k++)
+        free (ppDone[k]);
+
+    free (ppDone);
+}
+
+
+int JournalStart (JOURNAL *pJournal, const char *pszJournalFile, const char *pszArchiv)
+{
+    /* The new journal starts with the files of the interrupted backup, so they are resumed again if this backup is interrupted too */
+    char szHeader[MAX_PATH+20] = {0};
+
+    snprintf (szHeader, sizeof (szHeader), "%s%s", JOURNAL_HEADER, pszArchiv);
+
+    if (StateSave (&pJournal->Done, pszJournalFile, szHeader))
+        return 1;
+
+    pJournal->FD = open (pszJournalFile, O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    if (-1 == pJournal->FD)
+    {
+        perror ("Backup ERROR: Cannot open backup journal");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+STATE_ENTRY *JournalFind (JOURNAL *pJournal, const char *pszFileName, const FILE_ID *pId)
+{
+    /* Only entries verified in their archive have a repository. A database changed since the interrupted backup is backed up again */
+    if ((0 == pJournal->Done.Count) || (NULL == pId))
+        return NULL;
+
+    return StateFindUnchanged (&pJournal->Done, pszFileName, pId);
+}
+
+
+void JournalRecord (JOURNAL *pJournal, const char *pszFileName, const FILE_ID *pId, const BACKUP_STATS *pStats, const char *pszRepo, const char *pszArchiv)
+{
+    /* Called with the database completely written to borg and without holding the spool mutex. Each line is written at once and synced,
+       at most once per JOURNAL_SYNC_MSEC by one of the streams. Lines lost by a power failure only cause files to be backed up again */
+    int    Len   = 0;
+    time_t tNow  = 0;
+    time_t tSync = 0;
+    const char *pszArchivName = strstr (pszArchiv, "::");
+
+    char   szLine[4*MAX_PATH+256] = {0};
+
+    if (-1 == pJournal->FD)
+        return;
+
+    /* Modified while it was streamed. Resuming would reference data which no longer matches */
+    if (pId && ((pStats->FileSize != pId->Size) || (pStats->FileMtime != pId->MtimeNsec / 1000000000LL)))
+        return;
+
+    Len = snprintf (szLine, sizeof (szLine), "%llu\t%zu\t%lld\t%lld\t%016llx\t%d\t%016llx\t%lld\t%s\t%s\t%s\n",
+                    pId ? pId->Inode : 0, pStats->FileSize,
+                    pId ? pId->MtimeNsec : pStats->FileMtime * 1000000000LL,
+                    pId ? pId->CtimeNsec : 0,
+                    pId ? (unsigned long long) pId->HeaderHash : 0ULL,
+                    pStats->HashType, (unsigned long long) pStats->Hash,
+                    (long long) pStats->tStart, pszRepo, pszArchivName ? pszArchivName+2 : pszArchiv, pszFileName);
+
+    if ((Len < 1) || (Len >= (int) sizeof (szLine)))
+        return;
+
+    if (Len != write (pJournal->FD, szLine, Len))
+    {
+        perror ("Backup ERROR: Cannot write backup journal");
+        return;
+    }
+
+    tNow  = GetOSTimer();
+    tSync = __atomic_load_n (&pJournal->tSync, __ATOMIC_RELAXED);
+
+    if (tNow - tSync < JOURNAL_SYNC_MSEC)
+        return;
+
+    /* Another stream syncs the lines written so far */
+    if (false == __atomic_compare_exchange_n (&pJournal->tSync, &tSync, tNow, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    if (fdatasync (pJournal->FD))
+        perror ("Backup ERROR: Cannot sync backup journal");
+}
+
+
+bool IsNloFile (const char *pszFileName)
+{
+    size_t Len = strlen (pszFileName);
+
+    if (Len < 4)
+        return false;
+
+    return (('.' == pszFileName[Len-4]) && ('n' == tolower (pszFileName[Len-3])) && ('l' == tolower (pszFileName[Len-2])) && ('o' == tolower (pszFileName[Len-1])));
+}
+
+
+uint64_t NloKey (const char *pszFileName)
+{
+    /* The name without the DAOS sub directory is the content hash. 0 marks free slots */
+    const char *pszName = strrchr (pszFileName, '/');
+    uint64_t Key = 0;
+    HASH_STATE Hash;
+
+    pszName = pszName ? pszName+1 : pszFileName;
+
+    HashInit (&Hash, HASH_TYPE_XXH3);
+    HashUpdate (&Hash, (const unsigned char *) pszName, strlen (pszName));
+    Key = HashDigest (&Hash);
+
+    return Key ? Key : 1;
+}
+
+
+static inline uint64_t *NloBloomBlock (const NLO_INDEX *pIndex, uint64_t Key)
+{
+    /* Blocked Bloom filter: all bits of a key are in one 64 byte cache line, so a lookup costs one cache miss */
+    return &pIndex->pBloom[((Key >> 32) & (pIndex->BloomBits/512 - 1)) * 8];
+}
+
+
+static inline uint64_t NloBloomStep (uint64_t Key)
+{
+    /* Second hash for double hashing. Odd, so all bit positions of the block are reached */
+    return ((Key >> 32) | (Key << 32)) * 0x9E3779B97F4A7C15ULL | 1;
+}
+
+
+void NloBloomAdd (NLO_INDEX *pIndex, uint64_t Key)
+{
+    int i = 0;
+    uint64_t Step   = NloBloomStep (Key);
+    uint64_t Bit    = 0;
+    uint64_t *pBlock = NloBloomBlock (pIndex, Key);
+
+    for (i=0; i < NLO_BLOOM_HASHES; i++)
+    {
+        Bit = (Key + i*Step) & 511;
+        pBlock[Bit >> 6] |= 1ULL << (Bit & 63);
+    }
+}
+
+
+bool NloBloomTest (const NLO_INDEX *pIndex, uint64_t Key)
+{
+    int i = 0;
+    uint64_t Step   = NloBloomStep (Key);
+    uint64_t Bit    = 0;
+    const uint64_t *pBlock = NloBloomBlock (pIndex, Key);
+
+    for (i=0; i < NLO_BLOOM_HASHES; i++)
+    {
+        Bit = (Key + i*Step) & 511;
+
+        if (0 == (pBlock[Bit >> 6] & (1ULL << (Bit & 63))))
+            return false;
+    }
+
+    return true;
+}
+
+
+size_t NloIndexSlot (const NLO_INDEX *pIndex, uint64_t Key)
+{
+    /* Slot of the key or the free slot where it belongs */
+    size_t Slot = ((Key * 0x9E3779B97F4A7C15ULL) >> 16) & (pIndex->Capacity - 1);
+
+    while (pIndex->pKeys[Slot] && (pIndex->pKeys[Slot] != Key))
+        Slot = (Slot + 1) & (pIndex->Capacity - 1);
+
+    return Slot;
+}
+
+
+int NloIndexResize (NLO_INDEX *pIndex, size_t Capacity)
+{
+    /* Rebuilds table and Bloom filter. 8 filter bits per slot give 11 to 22 bits per key and less than 1% false positives */
+    size_t   i    = 0;
+    size_t   Slot = 0;
+    uint64_t *pKeys    = NULL;
+    uint16_t *pArchivs = NULL;
+    uint64_t *pBloom   = NULL;
+
+    NLO_INDEX Old;
+
+    pKeys    = (uint64_t *) calloc (Capacity, sizeof (uint64_t));
+    pArchivs = (uint16_t *) calloc (Capacity, sizeof (uint16_t));
+    pBloom   = (uint64_t *) aligned_alloc (64, Capacity);
+
+    if (pBloom)
+        memset (pBloom, 0, Capacity);
+
+    if ((NULL == pKeys) || (NULL == pArchivs) || (NULL == pBloom))
+    {
+        free (pKeys);
+        free (pArchivs);
+        free (pBloom);
+        return 1;
+    }
+
+    memcpy (&Old, pIndex, sizeof (Old));
+
+    pIndex->pKeys     = pKeys;
+    pIndex->pArchivs  = pArchivs;
+    pIndex->pBloom    = pBloom;
+    pIndex->Capacity  = Capacity;
+    pIndex->BloomBits = Capacity*8;
+
+    for (i=0; i < Old.Capacity; i++)
+    {
+        if (0 == Old.pKeys[i])
+            continue;
+
+        Slot = NloIndexSlot (pIndex, Old.pKeys[i]);
+        pIndex->pKeys[Slot]    = Old.pKeys[i];
+        pIndex->pArchivs[Slot] = Old.pArchivs[i];
+        NloBloomAdd (pIndex, Old.pKeys[i]);
+    }
+
+    free (Old.pKeys);
+    free (Old.pArchivs);
+    free (Old.pBloom);
+
+    return 0;
+}
+
+
+int NloIndexInsert (NLO_INDEX *pIndex, uint64_t Key, uint16_t Archiv)
+{
+    /* Load factor stays below 70% */
+    size_t Slot     = 0;
+    size_t Capacity = pIndex->Capacity ? pIndex->Capacity : 1024;
+
+    while ((pIndex->Count + 1) * 10 > Capacity * 7)
+        Capacity *= 2;
+
+    if ((Capacity != pIndex->Capacity) && NloIndexResize (pIndex, Capacity))
+        return 1;
+
+    Slot = NloIndexSlot (pIndex, Key);
+
+    if (0 == pIndex->pKeys[Slot])
+        pIndex->Count++;
+
+    pIndex->pKeys[Slot]    = Key;
+    pIndex->pArchivs[Slot] = Archiv;
+    NloBloomAdd (pIndex, Key);
+
+    return 0;
+}
+
+
+const NLO_ARCHIV *NloIndexLookup (NLO_INDEX *pIndex, const char *pszFileName)
+{
+    /* Returns the archive holding the NLO or NULL */
+    size_t   Slot = 0;
+    uint64_t Key  = NloKey (pszFileName);
+    const NLO_ARCHIV *pArchiv = NULL;
+    struct timespec tStart = {0};
+    struct timespec tEnd   = {0};
+
+    clock_gettime (CLOCK_MONOTONIC, &tStart);
+
+    if (pIndex->Count && NloBloomTest (pIndex, Key))
+    {
+        Slot = NloIndexSlot (pIndex, Key);
+
+        if (pIndex->pKeys[Slot])
+            pArchiv = &pIndex->pArchivTable[pIndex->pArchivs[Slot]];
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &tEnd);
+
+    pIndex->Lookups++;
+    pIndex->LookupNsec += (tEnd.tv_sec - tStart.tv_sec) * 1000000000LL + (tEnd.tv_nsec - tStart.tv_nsec);
+
+    return pArchiv;
+}
+
+
+bool NloIndexHas (const NLO_INDEX *pIndex, const char *pszFileName)
+{
+    /* Lookup for read ahead, which does not count in the lookup statistics */
+    uint64_t Key = NloKey (pszFileName);
+
+    if ((0 == pIndex->Count) || (false == NloBloomTest (pIndex, Key)))
+        return false;
+
+    return (0 != pIndex->pKeys[NloIndexSlot (pIndex, Key)]);
+}
+
+
+int NloIndexArchiv (NLO_INDEX *pIndex, const char *pszArchiv, time_t tBackup)
+{
+    /* Returns the number of the archive in the archive table. Adds the archive if needed */
+    size_t i = 0;
+    NLO_ARCHIV *pNew = NULL;
+
+    for (i=0; i < pIndex->ArchivCount; i++)
+    {
+        if (0 == strcmp (pIndex->pArchivTable[i].pszArchiv, pszArchiv))
+            return i;
+    }
+
+    if (pIndex->ArchivCount >= NLO_MAX_ARCHIVS)
+        return -1;
+
+    pNew = (NLO_ARCHIV *) realloc (pIndex->pArchivTable, (pIndex->ArchivCount + 1) * sizeof (NLO_ARCHIV));
+
+    if (NULL == pNew)
+        return -1;
+
+    pIndex->pArchivTable = pNew;
+    pNew[pIndex->ArchivCount].pszArchiv = strdup (pszArchiv);
+    pNew[pIndex->ArchivCount].tBackup   = tBackup;
+
+    if (NULL == pNew[pIndex->ArchivCount].pszArchiv)
+        return -1;
+
+    return pIndex->ArchivCount++;
+}
+
+
+void NloIndexAdd (NLO_INDEX *pIndex, const char *pszFileName, const char *pszArchiv, time_t tBackup)
+{
+    /* Called for each NLO streamed completely */
+    int Archiv = NloIndexArchiv (pIndex, pszArchiv, tBackup);
+
+    if (Archiv < 0)
+        return;
+
+    if (0 == NloIndexInsert (pIndex, NloKey (pszFileName), (uint16_t) Archiv))
+        pIndex->Added++;
+}
+
+
+void NloIndexFree (NLO_INDEX *pIndex)
+{
+    size_t i = 0;
+
+    for (i=0; i < pIndex->ArchivCount; i++)
+        free (pIndex->pArchivTable[i].pszArchiv);
+
+    free (pIndex->pArchivTable);
+    free (pIndex->pKeys);
+    free (pIndex->pArchivs);
+    free (pIndex->pBloom);
+    memset (pIndex, 0, sizeof (NLO_INDEX));
+}
+
+
+int NloIndexLoad (NLO_INDEX *pIndex, const char *pszIndexFile, time_t tMin)
+{
+    /* Header, archive table and one key with its archive number per NLO. NLOs of archives older than tMin are dropped,
+       so they are archived again before prune removes the archives holding them */
+    int      ret      = 0;
+    size_t   i        = 0;
+    size_t   Capacity = 0;
+    uint64_t Count    = 0;
+    uint64_t ArchivCount = 0;
+    int64_t  tBackup  = 0;
+    uint32_t Len      = 0;
+    uint64_t Key      = 0;
+    uint16_t Archiv   = 0;
+    int      *pMap    = NULL;
+    FILE     *fp      = NULL;
+    char     szMagic[8] = {0};
+    char     szArchiv[MAX_PATH+1] = {0};
+
+    fp = fopen (pszIndexFile, "r");
+
+    if (NULL == fp)
+        return 0;
+
+    if ((1 != fread (szMagic, sizeof (szMagic), 1, fp)) || memcmp (szMagic, NLO_INDEX_MAGIC, sizeof (szMagic)) ||
+        (1 != fread (&Count, sizeof (Count), 1, fp)) || (1 != fread (&ArchivCount, sizeof (ArchivCount), 1, fp)) ||
+        (ArchivCount > NLO_MAX_ARCHIVS))
+    {
+        printf ("Backup ERROR: Invalid NLO index: %s\n", pszIndexFile);
+        ret = 1;
+        goto Done;
+    }
+
+    pMap = (int *) malloc ((ArchivCount+1) * sizeof (int));
+
+    if (NULL == pMap)
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    for (i=0; i < ArchivCount; i++)
+    {
+        if ((1 != fread (&tBackup, sizeof (tBackup), 1, fp)) || (1 != fread (&Len, sizeof (Len), 1, fp)) ||
+            (Len > MAX_PATH) || (Len != fread (szArchiv, 1, Len, fp)))
+        {
+            printf ("Backup ERROR: Invalid NLO index: %s\n", pszIndexFile);
+            ret = 1;
+            goto Done;
+        }
+
+        szArchiv[Len] = '\0';
+        pMap[i] = (tBackup < tMin) ? -1 : NloIndexArchiv (pIndex, szArchiv, tBackup);
+    }
+
+    /* Size the table once for all keys */
+    for (Capacity = 1024; Count * 10 > Capacity * 7; Capacity *= 2);
+
+    if (Count && NloIndexResize (pIndex, Capacity))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    for (i=0; i < Count; i++)
+    {
+        if ((1 != fread (&Key, sizeof (Key), 1, fp)) || (1 != fread (&Archiv, sizeof (Archiv), 1, fp)) || (Archiv >= ArchivCount))
+        {
+            printf ("Backup ERROR: Invalid NLO index: %s\n", pszIndexFile);
+            ret = 1;
+            goto Done;
+        }
+
+        if (pMap[Archiv] < 0)
+            continue;
+
+        if (NloIndexInsert (pIndex, Key, (uint16_t) pMap[Archiv]))
+        {
+            ret = 1;
+            goto Done;
+        }
+    }
+
+Done:
+
+    free (pMap);
+    fclose (fp);
+
+    return ret;
+}
+
+
+int NloIndexSave (NLO_INDEX *pIndex, const char *pszIndexFile)
+{
+    /* Written to a new file which replaces the old one. Only the keys are stored, the table and the Bloom filter are built on load */
+    int      ret   = 0;
+    size_t   i     = 0;
+    uint64_t Count = pIndex->Count;
+    uint64_t ArchivCount = pIndex->ArchivCount;
+    int64_t  tBackup = 0;
+    uint32_t Len   = 0;
+    FILE     *fp   = NULL;
+
+    char     szTmpFile[MAX_PATH+10] = {0};
+
+    snprintf (szTmpFile, sizeof (szTmpFile), "%s.tmp", pszIndexFile);
+
+    fp = fopen (szTmpFile, "w");
+
+    if (NULL == fp)
+    {
+        perror ("Backup ERROR: Cannot create NLO index");
+        return 1;
+    }
+
+    fwrite (NLO_INDEX_MAGIC, 8, 1, fp);
+    fwrite (&Count, sizeof (Count), 1, fp);
+    fwrite (&ArchivCount, sizeof (ArchivCount), 1, fp);
+
+    for (i=0; i < pIndex->ArchivCount; i++)
+    {
+        tBackup = pIndex->pArchivTable[i].tBackup;
+        Len     = strlen (pIndex->pArchivTable[i].pszArchiv);
+
+        fwrite (&tBackup, sizeof (tBackup), 1, fp);
+        fwrite (&Len, sizeof (Len), 1, fp);
+        fwrite (pIndex->pArchivTable[i].pszArchiv, 1, Len, fp);
+    }
+
+    for (i=0; i < pIndex->Capacity; i++)
+    {
+        if (0 == pIndex->pKeys[i])
+            continue;
+
+        fwrite (&pIndex->pKeys[i], sizeof (uint64_t), 1, fp);
+        fwrite (&pIndex->pArchivs[i], sizeof (uint16_t), 1, fp);
+    }
+
+    if (ferror (fp) || fflush (fp) || fsync (fileno (fp)))
+        ret = 1;
+
+    if (fclose (fp))
+        ret = 1;
+
+    if (ret)
+    {
+        perror ("Backup ERROR: Cannot write NLO index");
+        remove (szTmpFile);
+        return 1;
+    }
+
+    if (rename (szTmpFile, pszIndexFile))
+    {
+        perror ("Backup ERROR: Cannot replace NLO index");
+        remove (szTmpFile);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void SpoolCleanup (const char *pszSpoolDir)
+{
+    /* Spool copies are unlinked right after they are created. Only a crash between create and unlink leaves a file behind */
+    DIR    *pDir   = NULL;
+    struct dirent *pEntry = NULL;
+    char   szPath[MAX_PATH+1] = {0};
+
+    pDir = opendir (pszSpoolDir);
+
+    if (NULL == pDir)
+        return;
+
+    while ((pEntry = readdir (pDir)))
+    {
+        if (strncmp (pEntry->d_name, SPOOL_FILE_PREFIX, strlen (SPOOL_FILE_PREFIX)))
+            continue;
+
+        snprintf (szPath, sizeof (szPath), "%s/%s", pszSpoolDir, pEntry->d_name);
+
+        if (0 == remove (szPath))
+            printf ("Info: Removed stale spool file: %s\n", szPath);
+    }
+
+    closedir (pDir);
+}
+
+
+int SpoolCreateFile (const char *pszSpoolDir)
+{
+    /* Unnamed file in the spool directory. The data is freed by the kernel when the file is closed, even after a crash */
+    int  FD = -1;
+    char szPath[MAX_PATH+1] = {0};
+
+    FD = open (pszSpoolDir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (-1 != FD)
+        return FD;
+
+    /* File systems without O_TMPFILE support */
+    snprintf (szPath, sizeof (szPath), "%s/%sXXXXXX", pszSpoolDir, SPOOL_FILE_PREFIX);
+
+    FD = mkostemp (szPath, O_CLOEXEC);
+
+    if (-1 != FD)
+        unlink (szPath);
+
+    return FD;
+}
+
+
+int SpoolCopyData (int SrcFD, int DstFD, const struct stat *pStat)
+{
+    /* Copy the data extents with copy_file_range(). Holes stay holes in the spool copy */
+    int     ret       = 0;
+    size_t  i         = 0;
+    size_t  BytesLeft = 0;
+    ssize_t BytesRead = 0;
+    off_t   OffsetIn  = 0;
+    off_t   OffsetOut = 0;
+    bool    bCopyRange = true;
+    unsigned char *pBuffer = NULL;
+    struct statvfs FsStat = {0};
+
+    SPARSE_MAP Sparse;
+
+    memset (&Sparse, 0, sizeof (Sparse));
+
+    if (SparseMapBuild (SrcFD, pStat, &Sparse))
+        return 1;
+
+    /* Fail early instead of filling up the spool file system */
+    if ((0 == fstatvfs (DstFD, &FsStat)) && ((unsigned long long) FsStat.f_bavail * FsStat.f_frsize < Sparse.DataSize))
+    {
+        errno = ENOSPC;
+        ret = 1;
+        goto Done;
+    }
+
+    for (i=0; i < Sparse.Count; i++)
+    {
+        OffsetIn  = Sparse.pExtents[i].Offset;
+        OffsetOut = Sparse.pExtents[i].Offset;
+        BytesLeft = Sparse.pExtents[i].Length;
+
+        while (BytesLeft && bCopyRange)
+        {
+            BytesRead = copy_file_range (SrcFD, &OffsetIn, DstFD, &OffsetOut, BytesLeft, 0);
+
+            if (BytesRead > 0)
+            {
+                BytesLeft -= BytesRead;
+                continue;
+            }
+
+            /* End of file. The last extent is aligned and can end behind the file size */
+            if (0 == BytesRead)
+            {
+                BytesLeft = 0;
+                break;
+            }
+
+            if (EINTR == errno)
+                continue;
+
+            /* Older kernels don't copy between file systems */
+            if ((EXDEV == errno) || (ENOSYS == errno) || (EINVAL == errno) || (EOPNOTSUPP == errno))
+            {
+                bCopyRange = false;
+                break;
+            }
+
+            ret = 1;
+            goto Done;
+        }
+
+        if (0 == BytesLeft)
+            continue;
+
+        if ((NULL == pBuffer) && (NULL == (pBuffer = (unsigned char *) malloc (MAX_BUFFER))))
+        {
+            ret = 1;
+            goto Done;
+        }
+
+        while (BytesLeft)
+        {
+            BytesRead = pread (SrcFD, pBuffer, (BytesLeft < MAX_BUFFER) ? BytesLeft : MAX_BUFFER, OffsetIn);
+
+            if ((BytesRead < 0) && (EINTR == errno))
+                continue;
+
+            if (BytesRead < 0)
+            {
+                ret = 1;
+                goto Done;
+            }
+
+            if (0 == BytesRead)
+                break;
+
+            if (BytesRead != pwrite (DstFD, pBuffer, BytesRead, OffsetOut))
+            {
+                ret = 1;
+                goto Done;
+            }
+
+            OffsetIn  += BytesRead;
+            OffsetOut += BytesRead;
+            BytesLeft -= BytesRead;
+        }
+    }
+
+    /* Restores a trailing hole */
+    if (ftruncate (DstFD, pStat->st_size))
+        ret = 1;
+
+Done:
+
+    free (pBuffer);
+    SparseMapFree (&Sparse);
+
+    return ret;
+}
+
+
+int SpoolCloneFile (const char *pszFileName, int *retpFD, size_t *retpSize, bool *retpReflink)
+{
+    /* Point in time copy of the database. A reflink shares the data blocks and takes no time and no space up front */
+    int    ret    =  0;
+    int    SrcFD  = -1;
+    int    DstFD  = -1;
+    struct stat Filestat = {0};
+    struct timespec Times[2];
+
+    *retpFD      = -1;
+    *retpReflink = false;
+
+    SrcFD = open (pszFileName, O_RDONLY | O_CLOEXEC);
+
+    if (-1 == SrcFD)
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    if (fstat (SrcFD, &Filestat) || !S_ISREG (Filestat.st_mode))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    *retpSize = Filestat.st_size;
+
+    DstFD = SpoolCreateFile (g_szSpoolDir);
+
+    if (-1 == DstFD)
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    if (0 == ioctl (DstFD, FICLONE, SrcFD))
+        *retpReflink = true;
+    else if (SpoolCopyData (SrcFD, DstFD, &Filestat))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    /* The archive gets the metadata of the database */
+    Times[0] = Filestat.st_atim;
+    Times[1] = Filestat.st_mtim;
+
+    if (fchmod (DstFD, Filestat.st_mode & 07777) || futimens (DstFD, Times))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    *retpFD = DstFD;
+    DstFD = -1;
+
+Done:
+
+    if (-1 != DstFD)
+        close (DstFD);
+
+    if (-1 != SrcFD)
+        close (SrcFD);
+
+    return ret;
+}
+
+
+void *TeeDestThread (void *pArg)
+{
+    /* Writes the buffered stream of one destination into its borg process */
+    size_t Pos = 0;
+    size_t Len = 0;
+    TEE_DEST *pDest = (TEE_DEST *) pArg;
+    TEE      *pTee  = pDest->pTee;
+
+    pthread_mutex_lock (&pTee->Mutex);
+
+    while (1)
+    {
+        while ((pDest->In == pDest->Out) && (false == pTee->bEOF))
+            pthread_cond_wait (&pTee->Cond, &pTee->Mutex);
+
+        if (pDest->In == pDest->Out)
+            break;
+
+        Pos = pDest->Out % pDest->Size;
+        Len = pDest->In - pDest->Out;
+
+        if (Len > pDest->Size - Pos)
+            Len = pDest->Size - Pos;
+
+        if (Len > MAX_BUFFER)
+            Len = MAX_BUFFER;
+
+        /* The reader only fills free space, so the data can be written without the lock */
+        pthread_mutex_unlock (&pTee->Mutex);
+
+        if ((ssize_t) Len != WriteBuffer (pDest->pStream->InputFD, pDest->pBuffer + Pos, Len))
+        {
+            if (EPIPE == errno)
+                printf ("Backup ERROR: Borg process ended\n");
+            else
+                perror ("Backup ERROR: Cannot write to Borg process");
+
+            printf ("Backup ERROR: Tee %s [%s] failed. The archive is incomplete\n", pDest->pszName, pDest->pStream->szArchiv);
+
+            pthread_mutex_lock (&pTee->Mutex);
+            pDest->bFailed = true;
+            pDest->Out = pDest->In;
+            pthread_cond_broadcast (&pTee->Cond);
+            break;
+        }
+
+        pthread_mutex_lock (&pTee->Mutex);
+
+        pDest->Out  += Len;
+        pDest->tLast = GetOSTimer();
+
+        pthread_cond_broadcast (&pTee->Cond);
+    }
+
+    pthread_mutex_unlock (&pTee->Mutex);
+
+    return NULL;
+}
+
+
+void *TeeReaderThread (void *pArg)
+{
+    /* Reads the tar stream once and copies it into the buffer of each destination */
+    int     i      = 0;
+    size_t  Done   = 0;
+    size_t  Pos    = 0;
+    size_t  Len    = 0;
+    ssize_t BytesRead = 0;
+    time_t  tWait  = 0;
+    unsigned char *pBuffer = NULL;
+    TEE      *pTee  = (TEE *) pArg;
+    TEE_DEST *pDest = NULL;
+
+    pBuffer = (unsigned char *) malloc (MAX_BUFFER);
+
+    while (pBuffer)
+    {
+        BytesRead = read (pTee->PipeFD[READ], pBuffer, MAX_BUFFER);
+
+        if ((BytesRead < 0) && (EINTR == errno))
+            continue;
+
+        if (BytesRead < 1)
+            break;
+
+        for (i=0; i < 2; i++)
+        {
+            pDest = &pTee->Dest[i];
+            Done  = 0;
+
+            while (Done < (size_t) BytesRead)
+            {
+                pthread_mutex_lock (&pTee->Mutex);
+
+                if (pDest->In - pDest->Out == pDest->Size)
+                {
+                    tWait = GetOSTimer();
+
+                    while ((pDest->In - pDest->Out == pDest->Size) && (false == pDest->bFailed))
+                        pthread_cond_wait (&pTee->Cond, &pTee->Mutex);
+
+                    pDest->StallMsec += GetOSTimer() - tWait;
+                }
+
+                /* A failed destination is skipped, so the other destination still gets a complete archive */
+                if (pDest->bFailed)
+                {
+                    pthread_mutex_unlock (&pTee->Mutex);
+                    break;
+                }
+
+                Pos = pDest->In % pDest->Size;
+                Len = pDest->Size - (pDest->In - pDest->Out);
+
+                if (Len > pDest->Size - Pos)
+                    Len = pDest->Size - Pos;
+
+                if (Len > BytesRead - Done)
+                    Len = BytesRead - Done;
+
+                pthread_mutex_unlock (&pTee->Mutex);
+
+                memcpy (pDest->pBuffer + Pos, pBuffer + Done, Len);
+                Done += Len;
+
+                pthread_mutex_lock (&pTee->Mutex);
+
+                pDest->In += Len;
+
+                if (pDest->In - pDest->Out > pDest->MaxLag)
+                    pDest->MaxLag = pDest->In - pDest->Out;
+
+                pthread_cond_broadcast (&pTee->Cond);
+                pthread_mutex_unlock (&pTee->Mutex);
+            }
+        }
+    }
+
+    free (pBuffer);
+
+    pthread_mutex_lock (&pTee->Mutex);
+    pTee->bEOF = true;
+    pthread_cond_broadcast (&pTee->Cond);
+    pthread_mutex_unlock (&pTee->Mutex);
+
+    return NULL;
+}
+
+
+int TeeStart (TEE *pTee, BORG_STREAM *pPrimary, BORG_STREAM *pSecondary)
+{
+    /* The primary stream writes into a pipe. The tee reader feeds both borg processes from it */
+    int i = 0;
+
+    pTee->Dest[0].pStream = pPrimary;
+    pTee->Dest[0].pszName = "primary";
+    pTee->Dest[1].pStream = pSecondary;
+    pTee->Dest[1].pszName = "secondary";
+
+    if (pipe2 (pTee->PipeFD, O_CLOEXEC))
+    {
+        perror ("Backup ERROR: Cannot create tee pipe");
+        return 1;
+    }
+
+    SetPipeSize (pTee->PipeFD[WRITE], g_PipeSize);
+
+    for (i=0; i < 2; i++)
+    {
+        pTee->Dest[i].pTee = pTee;
+        pTee->Dest[i].Size = g_TeeMaxLag ? g_TeeMaxLag : MAX_BUFFER;
+        pTee->Dest[i].pBuffer = (unsigned char *) malloc (pTee->Dest[i].Size);
+
+        if (NULL == pTee->Dest[i].pBuffer)
+        {
+            printf ("Backup ERROR: Cannot allocate tee buffer: %zu bytes\n", pTee->Dest[i].Size);
+            return 1;
+        }
+    }
+
+    pTee->tStart = GetOSTimer();
+
+    for (i=0; i < 2; i++)
+    {
+        if (pthread_create (&pTee->Dest[i].Thread, NULL, TeeDestThread, &pTee->Dest[i]))
+        {
+            perror ("Backup ERROR: Cannot start tee writer thread");
+            return 1;
+        }
+
+        pTee->Dest[i].bThread = true;
+    }
+
+    if (pthread_create (&pTee->Thread, NULL, TeeReaderThread, pTee))
+    {
+        perror ("Backup ERROR: Cannot start tee reader thread");
+        return 1;
+    }
+
+    pTee->bThread = true;
+
+    pPrimary->WriteFD = pTee->PipeFD[WRITE];
+    pPrimary->pTee    = pTee;
+
+    printf ("Tee: [%s] and [%s], max lag: %1.1f MB\n", pPrimary->szArchiv, pSecondary->szArchiv, g_TeeMaxLag/1024.0/1024.0);
+
+    return 0;
+}
+
+
+void TeePrintLag (TEE *pTee)
+{
+    /* Data read but not yet written to each destination */
+    size_t Lag[2] = {0};
+    int    i = 0;
+
+    pthread_mutex_lock (&pTee->Mutex);
+
+    for (i=0; i < 2; i++)
+        Lag[i] = pTee->Dest[i].In - pTee->Dest[i].Out;
+
+    pthread_mutex_unlock (&pTee->Mutex);
+
+    printf ("Tee lag: primary %1.1f MB, secondary %1.1f MB\n", Lag[0]/1024.0/1024.0, Lag[1]/1024.0/1024.0);
+}
+
+
+int TeeStop (TEE *pTee)
+{
+    /* Ends the stream and waits until both destinations have written all buffered data. Returns the number of failed destinations */
+    int      i     = 0;
+    int      Count = 0;
+    double   sec   = 0.0;
+    TEE_DEST *pDest = NULL;
+
+    if (-1 != pTee->PipeFD[WRITE])
+    {
+        close (pTee->PipeFD[WRITE]);
+        pTee->PipeFD[WRITE] = -1;
+    }
+
+    if (pTee->bThread)
+        pthread_join (pTee->Thread, NULL);
+
+    /* Without reader the writers must not wait for data */
+    pthread_mutex_lock (&pTee->Mutex);
+    pTee->bEOF = true;
+    pthread_cond_broadcast (&pTee->Cond);
+    pthread_mutex_unlock (&pTee->Mutex);
+
+    for (i=0; i < 2; i++)
+    {
+        pDest = &pTee->Dest[i];
+
+        if (pDest->bThread)
+            pthread_join (pDest->Thread, NULL);
+
+        if (NULL == pDest->pStream)
+            continue;
+
+        sec = (pDest->tLast > pTee->tStart) ? (pDest->tLast - pTee->tStart)/1000.0 : 0.0;
+
+        printf ("Tee %s [%s]: %1.1f MB (%1.1f MB/sec), max lag: %1.1f MB, stalled: %1.1f sec%s\n",
+                pDest->pszName, pDest->pStream->szArchiv, pDest->Out/1024.0/1024.0, sec ? pDest->Out/1024.0/1024.0/sec : 0.0,
+                pDest->MaxLag/1024.0/1024.0, pDest->StallMsec/1000.0, pDest->bFailed ? ", FAILED" : "");
+
+        if (pDest->bFailed)
+            Count++;
+
+        free (pDest->pBuffer);
+        pDest->pBuffer = NULL;
+    }
+
+    if (-1 != pTee->PipeFD[READ])
+    {
+        close (pTee->PipeFD[READ]);
+        pTee->PipeFD[READ] = -1;
+    }
+
+    return Count;
+}
+
+
+pid_t BorgImportStart (const char *pszArchiv, int *retpInputFD, int *retpOutputFD, int *retpErrorFD)
+{
+    /* Parts started ahead wait for the repository lock held by the borg process of the part before.
+       The first part waits for a translog part written to the same repository */
+    pid_t pid = 0;
+    int   PipeSize = 0;
+    int   n = 4;
+    char  szCheckpoint[40] = {0};
+
+    const char *args[14] = { g_szBorgBackupBinary, "import-tar", "--ignore-zeros", "--stats", NULL };
+
+    if (*g_szBorgCompression)
+    {
+        args[n++] = "--compression";
+        args[n++] = g_szBorgCompression;
+    }
+
+    if (*g_szChunkerParams)
+    {
+        args[n++] = "--chunker-params";
+        args[n++] = g_szChunkerParams;
+    }
+
+    args[n++] = "--lock-wait";
+    args[n++] = SHARD_LOCK_WAIT;
+
+    /* A killed borg leaves the last checkpoint archive, from which an interrupted backup is resumed */
+    if (g_CheckpointInterval)
+    {
+        snprintf (szCheckpoint, sizeof (szCheckpoint), "--checkpoint-interval=%ld", g_CheckpointInterval);
+        args[n++] = szCheckpoint;
+    }
+
+    args[n++] = pszArchiv;
+    args[n++] = "-";
+    args[n]   = NULL;
+
+    pid = BorgPopen3 (retpInputFD, retpOutputFD, retpErrorFD, 1, args);
+
+    if (pid < 1)
+    {
+        printf ("\nBackup ERROR: Cannot start Borg process\n\n");
+        perror ("Backup ERROR: Cannot start Borg process");
+        return pid;
+    }
+
+    printf ("Borg PID: %u\n", pid);
+
+    PipeSize = SetPipeSize (*retpInputFD, g_PipeSize);
+
+    if (PipeSize > 0)
+        printf ("Borg pipe size: %d KB\n", PipeSize/1024);
+    else
+        perror ("Info: Cannot set Borg pipe size");
+
+    return pid;
+}
+
+
+int BorgStreamStart (BORG_STREAM *pStream)
+{
+    snprintf (pStream->szBaseArchiv, sizeof (pStream->szBaseArchiv), "%s", pStream->szArchiv);
+
+    pStream->pid = BorgImportStart (pStream->szArchiv, &pStream->InputFD, &pStream->OutputFD, &pStream->ErrorFD);
+
+    if (pStream->pid < 1)
+        return 1;
+
+    pStream->WriteFD = pStream->InputFD;
+
+    return 0;
+}
+
+
+int ShardStartSpare (BORG_STREAM *pStream)
+{
+    BORG_PART *pSpare = &pStream->Spare;
+
+    memset (pSpare, 0, sizeof (BORG_PART));
+    pSpare->InputFD  = -1;
+    pSpare->OutputFD = -1;
+    pSpare->ErrorFD  = -1;
+
+    snprintf (pSpare->szArchiv, sizeof (pSpare->szArchiv), "%.*s.part-%04u", (int) (sizeof (pSpare->szArchiv) - 17), pStream->szBaseArchiv, (unsigned) (pStream->Part+1));
+
+    pSpare->pid = BorgImportStart (pSpare->szArchiv, &pSpare->InputFD, &pSpare->OutputFD, &pSpare->ErrorFD);
+
+    if (pSpare->pid < 1)
+    {
+        pSpare->pid = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void ShardStopSpare (BORG_STREAM *pStream)
+{
+    /* The spare still waits for the repository lock. Terminated before it can create an empty archive */
+    BORG_PART *pSpare = &pStream->Spare;
+
+    if (pSpare->pid < 1)
+        return;
+
+    kill (pSpare->pid, SIGTERM);
+
+    close (pSpare->InputFD);
+    close (pSpare->OutputFD);
+    close (pSpare->ErrorFD);
+    pclose3 (pSpare->pid);
+
+    memset (pSpare, 0, sizeof (BORG_PART));
+}
+
+
+int ShardCompletePart (BORG_STREAM *pStream)
+{
+    /* Ends the stream of the current part. borg commits the part and is waited for later */
+    BORG_PART *pPart  = NULL;
+    BORG_PART **ppLast = &pStream->pParts;
+
+    pPart = (BORG_PART *) malloc (sizeof (BORG_PART));
+
+    if (NULL == pPart)
+        return 1;
+
+    memset (pPart, 0, sizeof (BORG_PART));
+
+    /* The parts before don't get a manifest. The last part gets the manifest of all parts */
+    TarWriteEnd (pStream->WriteFD);
+    close (pStream->InputFD);
+
+    snprintf (pPart->szArchiv, sizeof (pPart->szArchiv), "%s", pStream->szArchiv);
+    pPart->pid      = pStream->pid;
+    pPart->InputFD  = -1;
+    pPart->OutputFD = pStream->OutputFD;
+    pPart->ErrorFD  = pStream->ErrorFD;
+    pPart->Bytes    = pStream->PartBytes;
+    pPart->Files    = pStream->PartFiles;
+    pPart->ManifestFirst = pStream->PartFirst;
+    pPart->ManifestEnd   = pStream->PartFirst + pStream->PartFiles;
+
+    while (*ppLast)
+        ppLast = &(*ppLast)->pNext;
+
+    *ppLast = pPart;
+
+    printf ("Backup OK: Archive part completed: %s, files: %ld, %1.1f MB\n", pPart->szArchiv, pPart->Files, pPart->Bytes/1024.0/1024.0);
+
+    pStream->pid       = 0;
+    pStream->InputFD   = -1;
+    pStream->OutputFD  = -1;
+    pStream->ErrorFD   = -1;
+    pStream->WriteFD   = -1;
+    pStream->PartBytes = 0;
+    pStream->PartFiles = 0;
+    pStream->Part++;
+
+    return 0;
+}
+
+
+int ShardNextPart (BORG_STREAM *pStream)
+{
+    /* Completes the current part and continues with the spare. Every file is completely in one part */
+    if ((pStream->Spare.pid < 1) && ShardStartSpare (pStream))
+    {
+        printf ("Backup ERROR: Cannot start next archive part. Continuing with: %s\n", pStream->szArchiv);
+        return 1;
+    }
+
+    if (ShardCompletePart (pStream))
+        return 1;
+
+    snprintf (pStream->szArchiv, sizeof (pStream->szArchiv), "%s", pStream->Spare.szArchiv);
+    pStream->pid       = pStream->Spare.pid;
+    pStream->InputFD   = pStream->Spare.InputFD;
+    pStream->OutputFD  = pStream->Spare.OutputFD;
+    pStream->ErrorFD   = pStream->Spare.ErrorFD;
+    pStream->WriteFD   = pStream->InputFD;
+
+    memset (&pStream->Spare, 0, sizeof (BORG_PART));
+
+    printf ("Backup OK: Archive part started: %s\n", pStream->szArchiv);
+
+    /* The next spare takes over without a gap when this part is full */
+    ShardStartSpare (pStream);
+
+    return 0;
+}
+
+
+int ShardRollover (BORG_STREAM *pStream)
+{
+    /* Called between two files when the part reached SHARD_MAX_SIZE or SHARD_MAX_FILES */
+    bool bFull = (g_ShardMaxSize && (pStream->PartBytes >= g_ShardMaxSize)) || (g_ShardMaxFiles && (pStream->PartFiles >= g_ShardMaxFiles));
+
+    if (false == bFull)
+        return 0;
+
+    return ShardNextPart (pStream);
+}
+
+
+const char *ShardPartName (const BORG_STREAM *pStream)
+{
+    /* Archive name of the current part for the manifest. NULL for part 0, which is the archive specified */
+    const char *pszName = strstr (pStream->szArchiv, "::");
+
+    if (0 == pStream->Part)
+        return NULL;
+
+    return pszName ? pszName+2 : pStream->szArchiv;
+}
+
+
+void *StreamThread (void *pArg)
+{
+    /* Streams the databases routed to one borg process in request order */
+    int    ret    = 0;
+    char   szReadName[64] = {0};
+    BORG_STREAM *pStream = (BORG_STREAM *) pArg;
+    SPOOL  *pSpool = pStream->pSpool;
+    SPOOL_ENTRY *pEntry = NULL;
+
+    BACKUP_STATS Stats;
+
+    pthread_mutex_lock (&pSpool->Mutex);
+
+    while (1)
+    {
+        while ((NULL == pStream->pHead) && (false == pSpool->bStop))
+            pthread_cond_wait (&pSpool->Cond, &pSpool->Mutex);
+
+        if (NULL == pStream->pHead)
+            break;
+
+        /* The entry stays in the queue while it is streamed, so its size still counts against the spool limit */
+        pEntry = pStream->pHead;
+        pthread_mutex_unlock (&pSpool->Mutex);
+
+        if (pSpool->bShard)
+            ShardRollover (pStream);
+
+        if (-1 == pEntry->FD)
+        {
+            ret = BackupFile (pStream->WriteFD, pEntry->pszFileName, &Stats);
+        }
+        else
+        {
+            snprintf (szReadName, sizeof (szReadName), "/proc/self/fd/%d", pEntry->FD);
+            ret = BackupFileFrom (pStream->WriteFD, pEntry->pszFileName, szReadName, &Stats);
+
+            close (pEntry->FD);
+            pEntry->FD = -1;
+        }
+
+        Stats.Stream = pStream->Index;
+        pStream->PartBytes += Stats.BytesTotal;
+        pStream->PartFiles++;
+
+        if (0 == ret)
+            LogBackupResult (pEntry->pszFileName, &Stats);
+
+        if (pStream->pTee)
+            TeePrintLag (pStream->pTee);
+
+        /* Synced outside the spool mutex, so the other streams and the daemon do not wait for the disk */
+        if (pSpool->pJournal && (0 == ret))
+            JournalRecord (pSpool->pJournal, pEntry->pszFileName, pEntry->bId ? &pEntry->Id : NULL, &Stats, pStream->szRepo, pStream->szArchiv);
+
+        pthread_mutex_lock (&pSpool->Mutex);
+
+        if (ret)
+            pStream->CountErr++;
+        else
+            pStream->CountOK++;
+
+        pStream->BytesTotal += Stats.BytesTotal;
+        pStream->BusyMsec   += Stats.tEnd - Stats.tStart;
+
+        if (pSpool->pManifest)
+            ManifestSetResult (pSpool->pManifest, pEntry->ManifestIndex, ret, &Stats, pStream->szRepo, ShardPartName (pStream));
+
+        if (pSpool->pState && pEntry->bId && (0 == ret))
+            StateRecord (pSpool->pState, pEntry->pszFileName, &pEntry->Id, &Stats, pStream->szRepo, pStream->szArchiv);
+
+        if (pSpool->pNloIndex && (0 == ret) && IsNloFile (pEntry->pszFileName))
+            NloIndexAdd (pSpool->pNloIndex, pEntry->pszFileName, pStream->szArchiv, Stats.tStart);
+
+        pStream->pHead = pEntry->pNext;
+
+        if (NULL == pStream->pHead)
+            pStream->pTail = NULL;
+
+        pStream->QueuedBytes -= pEntry->QueueBytes;
+
+        /* The database itself was streamed and can leave backup mode */
+        if (pEntry->bDirect)
+        {
+            pSpool->DirectPending--;
+
+            if (pEntry->pDone)
+            {
+                pEntry->pDone->ret   = ret;
+                pEntry->pDone->Bytes = Stats.BytesData;
+                pEntry->pDone->bDone = true;
+            }
+        }
+
+        if (pEntry->Size)
+        {
+            pSpool->Bytes -= pEntry->Size;
+            pSpool->Files--;
+        }
+
+        free (pEntry->pszFileName);
+        free (pEntry);
+        pEntry = NULL;
+
+        pthread_cond_broadcast (&pSpool->Cond);
+    }
+
+    pthread_mutex_unlock (&pSpool->Mutex);
+
+    return NULL;
+}
+
+
+int GetBorgStreamArchiv (int Index, const char *pszArchiv, char *retpszRepo, size_t RepoSize, char *retpszArchiv, size_t ArchivSize)
+{
+    /* Stream 0 uses the archive specified. Other streams use the same archive name in the next repository of PARALLEL_REPOS */
+    int    i    = 0;
+    size_t Len  = 0;
+    const char *pszName = strstr (pszArchiv, "::");
+    const char *pszRepo = g_szParallelRepos;
+    const char *pszEnd  = NULL;
+
+    if (0 == Index)
+    {
+        if (pszName && (pszName > pszArchiv))
+            snprintf (retpszRepo, RepoSize, "%.*s", (int) (pszName-pszArchiv), pszArchiv);
+        else
+            snprintf (retpszRepo, RepoSize, "%s", g_szBorgRepo);
+
+        snprintf (retpszArchiv, ArchivSize, "%s", pszArchiv);
+        return 0;
+    }
+
+    for (i=1; i < Index; i++)
+    {
+        pszRepo = strchr (pszRepo, ',');
+
+        if (NULL == pszRepo)
+            return 1;
+
+        pszRepo++;
+    }
+
+    while (' ' == *pszRepo)
+        pszRepo++;
+
+    pszEnd = strchr (pszRepo, ',');
+    Len    = pszEnd ? (size_t) (pszEnd-pszRepo) : strlen (pszRepo);
+
+    while (Len && (' ' == pszRepo[Len-1]))
+        Len--;
+
+    if (0 == Len)
+        return 1;
+
+    snprintf (retpszRepo, RepoSize, "%.*s", (int) Len, pszRepo);
+    snprintf (retpszArchiv, ArchivSize, "%.*s::%s", (int) Len, pszRepo, pszName ? pszName+2 : pszArchiv);
+
+    return 0;
+}
+
+
+int GetBorgStreamCount()
+{
+    int Count = 1;
+    const char *p = g_szParallelRepos;
+
+    if (IsNullStr (g_szParallelRepos))
+        return 1;
+
+    for (Count = 2; (p = strchr (p, ',')); p++)
+        Count++;
+
+    return (Count > MAX_BORG_STREAMS) ? MAX_BORG_STREAMS : Count;
+}
+
+
+int RouteByHash (const char *pszFileName, int StreamCount)
+{
+    /* Same database always goes into the same repository, so borg can deduplicate it against the last backup */
+    HASH_STATE Hash;
+
+    HashInit (&Hash, HASH_TYPE_XXH3);
+    HashUpdate (&Hash, (const unsigned char *) pszFileName, strlen (pszFileName));
+
+    return (int) (HashDigest (&Hash) % StreamCount);
+}
+
+
+int SpoolStart (SPOOL *pSpool, MANIFEST *pManifest, STATE *pState, NLO_INDEX *pNloIndex, JOURNAL *pJournal)
+{
+    /* Without spool and with a single stream the daemon streams each database itself */
+    int i = 0;
+
+    pSpool->pManifest = pManifest;
+    pSpool->pState    = pState;
+    pSpool->pNloIndex = pNloIndex;
+    pSpool->pJournal  = pJournal;
+    pSpool->bSpool    = !IsNullStr (g_szSpoolDir);
+
+    /* Spool copies are opened by name to stream them. The tar binary would store that name.
+       Parallel streams use one ring buffer per thread, the tar mode shares one buffer */
+    if ((TAR_MODE_EXTERNAL == g_TarMode) && (pSpool->bSpool || (pSpool->StreamCount > 1)))
+    {
+        printf ("Info: Spool mode and parallel repositories require native tar mode. Using a single stream without spool\n");
+        pSpool->bSpool = false;
+        return 0;
+    }
+
+    if (pSpool->bSpool)
+    {
+        CreateDirectoryTree (g_szSpoolDir, S_IRWXU);
+        SpoolCleanup (g_szSpoolDir);
+
+        printf ("Spool directory: %s, max size: %1.1f MB, max files: %zu\n", g_szSpoolDir, g_SpoolMaxSize/1024.0/1024.0, g_SpoolMaxFiles);
+    }
+
+    if ((false == pSpool->bSpool) && (pSpool->StreamCount < 2))
+        return 0;
+
+    for (i=0; i < pSpool->StreamCount; i++)
+    {
+        if (pthread_create (&pSpool->Streams[i].Thread, NULL, StreamThread, &pSpool->Streams[i]))
+        {
+            perror ("Backup ERROR: Cannot start stream thread");
+            return 1;
+        }
+
+        pSpool->Streams[i].bThread = true;
+    }
+
+    pSpool->bThreads = true;
+
+    return 0;
+}
+
+
+int SpoolAdd (SPOOL *pSpool, const char *pszFileName, size_t ManifestIndex, const FILE_ID *pId, SPOOL_DONE *pDone)
+{
+    /* Returns after the database is queued. A spooled database can leave backup mode right away.
+       A database streamed directly stays in backup mode until its stream sets pDone */
+    int    i        = 0;
+    int    FD       = -1;
+    size_t Size     = 0;
+    size_t FileSize = 0;
+    bool   bReflink = false;
+    bool   bFits    = false;
+    time_t tStart   = 0;
+    time_t tWait    = 0;
+    BORG_STREAM *pStream = &pSpool->Streams[0];
+    SPOOL_ENTRY *pEntry  = NULL;
+
+    FileSize = GetFileSize (pszFileName);
+    Size     = FileSize;
+    bFits    = pSpool->bSpool && Size && (Size <= g_SpoolMaxSize);
+
+    pEntry = (SPOOL_ENTRY *) malloc (sizeof (SPOOL_ENTRY));
+
+    if (NULL == pEntry)
+        return 1;
+
+    memset (pEntry, 0, sizeof (SPOOL_ENTRY));
+    pEntry->FD = -1;
+    pEntry->ManifestIndex = ManifestIndex;
+    pEntry->pszFileName = strdup (pszFileName);
+
+    if (pId)
+    {
+        memcpy (&pEntry->Id, pId, sizeof (FILE_ID));
+        pEntry->bId = true;
+    }
+
+    if (NULL == pEntry->pszFileName)
+    {
+        free (pEntry);
+        return 1;
+    }
+
+    if (bFits)
+    {
+        tStart = GetOSTimer();
+
+        pthread_mutex_lock (&pSpool->Mutex);
+
+        /* Backpressure: the database stays in backup mode until the spool has room for it */
+        while (pSpool->Files && ((pSpool->Bytes + Size > g_SpoolMaxSize) || (pSpool->Files >= g_SpoolMaxFiles)))
+            pthread_cond_wait (&pSpool->Cond, &pSpool->Mutex);
+
+        tWait = GetOSTimer() - tStart;
+        pSpool->WaitMsec += tWait;
+
+        pthread_mutex_unlock (&pSpool->Mutex);
+
+        tStart = GetOSTimer();
+
+        if (SpoolCloneFile (pszFileName, &FD, &Size, &bReflink))
+        {
+            perror ("Info: Cannot copy file into spool");
+            printf ("Info: Cannot copy file into spool, streaming directly: %s\n", pszFileName);
+        }
+        else
+        {
+            printf ("Backup OK: Spooled [%s] %1.1f MB (%s, %1.3f sec, waited %1.3f sec)\n", pszFileName, Size/1024.0/1024.0,
+                    bReflink ? "reflink" : "copy", (GetOSTimer() - tStart)/1000.0, tWait/1000.0);
+        }
+    }
+
+    pEntry->FD         = FD;
+    pEntry->Size       = (-1 == FD) ? 0 : Size;
+    pEntry->QueueBytes = FileSize;
+
+    pthread_mutex_lock (&pSpool->Mutex);
+
+    if (pSpool->StreamCount > 1)
+    {
+        if (ROUTING_SIZE == g_Routing)
+        {
+            /* Least queued bytes. With empty queues the stream with the least data so far */
+            for (i=1; i < pSpool->StreamCount; i++)
+            {
+                if ((pSpool->Streams[i].QueuedBytes < pStream->QueuedBytes) ||
+                    ((pSpool->Streams[i].QueuedBytes == pStream->QueuedBytes) && (pSpool->Streams[i].BytesTotal < pStream->BytesTotal)))
+                    pStream = &pSpool->Streams[i];
+            }
+        }
+        else
+        {
+            pStream = &pSpool->Streams[RouteByHash (pszFileName, pSpool->StreamCount)];
+        }
+    }
+
+    if (-1 != FD)
+    {
+        if (bReflink)
+            pSpool->Reflinked++;
+        else
+            pSpool->Copied++;
+
+        pSpool->Bytes += pEntry->Size;
+        pSpool->Files++;
+    }
+    else
+    {
+        if (pSpool->bSpool)
+            pSpool->Direct++;
+
+        pSpool->DirectPending++;
+        pEntry->bDirect = true;
+        pEntry->pDone   = pDone;
+    }
+
+    if (pDone)
+    {
+        pDone->bDone    = (-1 != FD);
+        pDone->bSpooled = (-1 != FD);
+        pDone->ret      = 0;
+        pDone->Bytes = 0;
+    }
+
+    if (pStream->pTail)
+        pStream->pTail->pNext = pEntry;
+    else
+        pStream->pHead = pEntry;
+
+    pStream->pTail = pEntry;
+    pStream->QueuedBytes += pEntry->QueueBytes;
+
+    pthread_cond_broadcast (&pSpool->Cond);
+    pthread_mutex_unlock (&pSpool->Mutex);
+
+    return 0;
+}
+
+
+void SpoolWaitDirect (SPOOL *pSpool)
+{
+    /* Waits until all databases streamed directly are done and can leave backup mode */
+    pthread_mutex_lock (&pSpool->Mutex);
+
+    while (pSpool->DirectPending)
+        pthread_cond_wait (&pSpool->Cond, &pSpool->Mutex);
+
+    pthread_mutex_unlock (&pSpool->Mutex);
+}
+
+
+void SpoolStop (SPOOL *pSpool)
+{
+    /* Streams all queued databases before the archives are closed */
+    int    i   = 0;
+    double sec = 0.0;
+    BORG_STREAM *pStream = NULL;
+
+    if (false == pSpool->bThreads)
+        return;
+
+    pthread_mutex_lock (&pSpool->Mutex);
+    pSpool->bStop = true;
+    pthread_cond_broadcast (&pSpool->Cond);
+    pthread_mutex_unlock (&pSpool->Mutex);
+
+    for (i=0; i < pSpool->StreamCount; i++)
+    {
+        if (pSpool->Streams[i].bThread)
+            pthread_join (pSpool->Streams[i].Thread, NULL);
+
+        pSpool->Streams[i].bThread = false;
+    }
+
+    pSpool->bThreads = false;
+
+    if (pSpool->bSpool)
+    {
+        printf ("Spool: reflinked: %ld, copied: %ld, direct: %ld, waited for space: %1.1f sec\n",
+                pSpool->Reflinked, pSpool->Copied, pSpool->Direct, pSpool->WaitMsec/1000.0);
+    }
+
+    if (pSpool->StreamCount < 2)
+        return;
+
+    /* Balanced streams show similar busy times */
+    for (i=0; i < pSpool->StreamCount; i++)
+    {
+        pStream = &pSpool->Streams[i];
+        sec = pStream->BusyMsec/1000.0;
+
+        printf ("Stream %d: [%s] files: %ld, errors: %ld, %1.1f MB, busy: %1.1f sec (%1.1f MB/sec)\n",
+                i, pStream->szArchiv, pStream->CountOK, pStream->CountErr, pStream->BytesTotal/1024.0/1024.0,
+                sec, sec ? pStream->BytesTotal/1024.0/1024.0/sec : 0.0);
+    }
+}
+
+
+void PrefetchSlotFree (PREFETCH_SLOT *pSlot)
+{
+    if (-1 != pSlot->FD)
+        close (pSlot->FD);
+
+    free (pSlot->pResident);
+    memset (pSlot, 0, sizeof (PREFETCH_SLOT));
+    pSlot->FD = -1;
+}
+
+
+void *PrefetchThread (void *pArg)
+{
+    int    FD   = -1;
+    char   *p   = NULL;
+    bool   bSkip = false;
+    size_t Head = 0;
+    size_t PageSize = sysconf (_SC_PAGESIZE);
+    time_t tStart = 0;
+    unsigned char *pResident = NULL;
+    PREFETCH      *pPrefetch = (PREFETCH *) pArg;
+    PREFETCH_SLOT *pSlot = NULL;
+    PREFETCH_NAME *pName = NULL;
+
+    struct stat Filestat;
+
+    char   szFileName[MAX_PATH+1] = {0};
+
+    pthread_mutex_lock (&pPrefetch->Mutex);
+
+    while (false == pPrefetch->bStop)
+    {
+        /* The slot of the database streaming is kept until the backup reads the next line */
+        if ((pPrefetch->Opened + 1 >= pPrefetch->Started + pPrefetch->Depth) || ((NULL == pPrefetch->fpList) && (NULL == pPrefetch->pHead)))
+        {
+            pthread_cond_wait (&pPrefetch->Cond, &pPrefetch->Mutex);
+            continue;
+        }
+
+        pName = pPrefetch->pHead;
+
+        if (pName)
+        {
+            pPrefetch->pHead = pName->pNext;
+
+            if (NULL == pPrefetch->pHead)
+                pPrefetch->pTail = NULL;
+        }
+
+        pthread_mutex_unlock (&pPrefetch->Mutex);
+
+        if (pName)
+        {
+            snprintf (szFileName, sizeof (szFileName), "%s", pName->pszFileName);
+            free (pName->pszFileName);
+            free (pName);
+            pName = NULL;
+        }
+        else if (NULL == fgets (szFileName, sizeof (szFileName)-1, pPrefetch->fpList))
+        {
+            pthread_mutex_lock (&pPrefetch->Mutex);
+            break;
+        }
+
+        p = strpbrk (szFileName, "\r\n");
+
+        if (p)
+            *p = '\0';
+
+        FD    = -1;
+        Head  = 0;
+        bSkip = false;
+        pResident = NULL;
+        tStart = GetOSTimer();
+
+        if (pPrefetch->pNloIndex && IsNloFile (szFileName))
+        {
+            pthread_mutex_lock (pPrefetch->pIndexMutex);
+            bSkip = NloIndexHas (pPrefetch->pNloIndex, szFileName);
+            pthread_mutex_unlock (pPrefetch->pIndexMutex);
+        }
+
+        if (*szFileName && (false == bSkip))
+        {
+            FD = open (szFileName, O_RDONLY | O_CLOEXEC);
+
+            if ((-1 != FD) && (fstat (FD, &Filestat) || !S_ISREG (Filestat.st_mode)))
+            {
+                close (FD);
+                FD = -1;
+            }
+        }
+
+        /* A head shorter than the database ends on a page boundary, where the page cache of the backup continues */
+        if (-1 != FD)
+        {
+            Head = Filestat.st_size;
+
+            if (Head > g_PrefetchSize)
+                Head = g_PrefetchSize & ~(PageSize - 1);
+        }
+
+        pthread_mutex_lock (&pPrefetch->Mutex);
+
+        /* The heads read ahead stay below PREFETCH_MAX_SIZE. The next one waits for databases to be streamed */
+        while (Head && pPrefetch->Bytes && (pPrefetch->Bytes + Head > pPrefetch->MaxBytes) && (pPrefetch->Opened > pPrefetch->Started) && (false == pPrefetch->bStop))
+            pthread_cond_wait (&pPrefetch->Cond, &pPrefetch->Mutex);
+
+        /* The backup may start a database any time. Reading its head at the same time only competes with the backup */
+        if (pPrefetch->Opened <= pPrefetch->Started)
+        {
+            if (pPrefetch->Opened)
+                pPrefetch->Late++;
+
+            Head = 0;
+        }
+
+        pSlot = &pPrefetch->Slots[pPrefetch->Opened % pPrefetch->Depth];
+        PrefetchSlotFree (pSlot);
+
+        pSlot->FD       = FD;
+        pSlot->Line     = pPrefetch->Opened;
+        pSlot->HeadSize = Head;
+
+        if (-1 != FD)
+        {
+            pSlot->Dev   = Filestat.st_dev;
+            pSlot->Inode = Filestat.st_ino;
+        }
+
+        pPrefetch->Bytes += Head;
+        pPrefetch->Opened++;
+
+        if (0 == Head)
+            continue;
+
+        pthread_mutex_unlock (&pPrefetch->Mutex);
+
+        /* Pages cached before are recorded before the read ahead is issued. The backup drops the pages read ahead after streaming */
+        if (g_CacheDrop && CacheResidencyVisible (FD))
+            PrefetchResidentPages (FD, Head, &pResident);
+
+        pthread_mutex_lock (&pPrefetch->Mutex);
+        pSlot->pResident = pResident;
+        pthread_mutex_unlock (&pPrefetch->Mutex);
+
+        posix_fadvise (FD, 0, Head, POSIX_FADV_WILLNEED);
+
+        pthread_mutex_lock (&pPrefetch->Mutex);
+
+        pPrefetch->Files++;
+        pPrefetch->ReadBytes += Head;
+        pPrefetch->OpenMsec  += GetOSTimer() - tStart;
+    }
+
+    pthread_mutex_unlock (&pPrefetch->Mutex);
+
+    return NULL;
+}
+
+
+size_t GetMemAvailable()
+{
+    unsigned long long AvailableKB = 0;
+    FILE *fp = NULL;
+    char szLine[256] = {0};
+
+    fp = fopen ("/proc/meminfo", "r");
+
+    if (NULL == fp)
+        return 0;
+
+    while (fgets (szLine, sizeof (szLine), fp))
+    {
+        if (1 == sscanf (szLine, "MemAvailable: %llu kB", &AvailableKB))
+            break;
+    }
+
+    fclose (fp);
+
+    return AvailableKB * 1024;
+}
+
+
+int PrefetchStart (PREFETCH *pPrefetch, const char *pszFileList, NLO_INDEX *pNloIndex, pthread_mutex_t *pIndexMutex)
+{
+    /* Without a file list the daemon queues the lines of each request file */
+    int    i = 0;
+    size_t MemAvailable = GetMemAvailable();
+
+    pPrefetch->Depth       = g_PrefetchFiles + 1;
+    pPrefetch->MaxBytes    = g_PrefetchMaxSize;
+    pPrefetch->pNloIndex   = pNloIndex;
+    pPrefetch->pIndexMutex = pIndexMutex;
+
+    /* Pages read ahead must not push the working set of Domino out of the cache before they are streamed */
+    if (MemAvailable && (pPrefetch->MaxBytes > MemAvailable / 4))
+        pPrefetch->MaxBytes = MemAvailable / 4;
+
+    for (i=0; i < pPrefetch->Depth; i++)
+        pPrefetch->Slots[i].FD = -1;
+
+    if (pszFileList)
+    {
+        pPrefetch->fpList = fopen (pszFileList, "r");
+
+        if (NULL == pPrefetch->fpList)
+            return 1;
+    }
+
+    if (pthread_create (&pPrefetch->Thread, NULL, PrefetchThread, pPrefetch))
+    {
+        perror ("Info: Cannot start prefetch thread");
+
+        if (pPrefetch->fpList)
+            fclose (pPrefetch->fpList);
+
+        pPrefetch->fpList = NULL;
+        return 1;
+    }
+
+    pPrefetch->bThread = true;
+    g_pPrefetch = pPrefetch;
+
+    printf ("Prefetch: %d databases ahead, %1.1f MB each, max %1.1f MB\n", g_PrefetchFiles, g_PrefetchSize/1024.0/1024.0, pPrefetch->MaxBytes/1024.0/1024.0);
+
+    return 0;
+}
+
+
+void PrefetchAdd (PREFETCH *pPrefetch, const char *pszFileName)
+{
+    /* Lines of a request file in the order the backup reads them */
+    PREFETCH_NAME *pName = NULL;
+
+    if ((false == pPrefetch->bThread) || pPrefetch->fpList)
+        return;
+
+    pName = (PREFETCH_NAME *) malloc (sizeof (PREFETCH_NAME));
+
+    if (NULL == pName)
+        return;
+
+    pName->pNext = NULL;
+    pName->pszFileName = strdup (pszFileName);
+
+    if (NULL == pName->pszFileName)
+    {
+        free (pName);
+        return;
+    }
+
+    pthread_mutex_lock (&pPrefetch->Mutex);
+
+    if (pPrefetch->pTail)
+        pPrefetch->pTail->pNext = pName;
+    else
+        pPrefetch->pHead = pName;
+
+    pPrefetch->pTail = pName;
+
+    pthread_cond_broadcast (&pPrefetch->Cond);
+    pthread_mutex_unlock (&pPrefetch->Mutex);
+}
+
+
+void PrefetchNext (PREFETCH *pPrefetch)
+{
+    /* Called for every line the backup reads. Records how much of the head read ahead is cached when the database is streamed */
+    long   Resident = 0;
+    size_t PageSize = sysconf (_SC_PAGESIZE);
+    PREFETCH_SLOT *pSlot = NULL;
+
+    if (false == pPrefetch->bThread)
+        return;
+
+    pthread_mutex_lock (&pPrefetch->Mutex);
+
+    pSlot = &pPrefetch->Slots[pPrefetch->Started % pPrefetch->Depth];
+
+    if ((pPrefetch->Opened > pPrefetch->Started) && (pSlot->Line == pPrefetch->Started) && pSlot->HeadSize)
+    {
+        pPrefetch->Bytes -= pSlot->HeadSize;
+
+        Resident = CacheResidencyVisible (pSlot->FD) ? PrefetchResidentPages (pSlot->FD, pSlot->HeadSize, NULL) : -1;
+
+        if (Resident >= (long) ((pSlot->HeadSize + PageSize - 1) / PageSize))
+            pPrefetch->Hits++;
+        else if (Resident > 0)
+            pPrefetch->Partial++;
+        else if (0 == Resident)
+            pPrefetch->Cold++;
+    }
+
+    pPrefetch->Started++;
+    pthread_cond_broadcast (&pPrefetch->Cond);
+
+    pthread_mutex_unlock (&pPrefetch->Mutex);
+}
+
+
+void PrefetchStop (PREFETCH *pPrefetch)
+{
+    /* Called when the streams are stopped, because their page caches take over residency from the slots */
+    int  i = 0;
+    long Count = 0;
+    PREFETCH_NAME *pName = NULL;
+
+    g_pPrefetch = NULL;
+
+    if (pPrefetch->bThread)
+    {
+        pthread_mutex_lock (&pPrefetch->Mutex);
+        pPrefetch->bStop = true;
+        pthread_cond_broadcast (&pPrefetch->Cond);
+        pthread_mutex_unlock (&pPrefetch->Mutex);
+
+        pthread_join (pPrefetch->Thread, NULL);
+        pPrefetch->bThread = false;
+
+        Count = pPrefetch->Hits + pPrefetch->Partial + pPrefetch->Cold;
+
+        printf ("Prefetch: %ld databases read ahead, %1.1f MB, %1.3f sec, cached when streamed: %ld, partly: %ld, not: %ld, hit rate: %1.0f%%, too late: %ld\n",
+                pPrefetch->Files, pPrefetch->ReadBytes/1024.0/1024.0, pPrefetch->OpenMsec/1000.0,
+                pPrefetch->Hits, pPrefetch->Partial, pPrefetch->Cold, Count ? pPrefetch->Hits * 100.0 / Count : 0.0, pPrefetch->Late);
+    }
+
+    for (i=0; i < pPrefetch->Depth; i++)
+        PrefetchSlotFree (&pPrefetch->Slots[i]);
+
+    while (pPrefetch->pHead)
+    {
+        pName = pPrefetch->pHead;
+        pPrefetch->pHead = pName->pNext;
+
+        free (pName->pszFileName);
+        free (pName);
+    }
+
+    pPrefetch->pTail = NULL;
+
+    if (pPrefetch->fpList)
+    {
+        fclose (pPrefetch->fpList);
+        pPrefetch->fpList = NULL;
+    }
+}
+
+
+bool LogBorgOutput (FILE *fpLog, int ErrorFD, int OutputFD)
+{
+    /* Returns true if borg reported an error */
+    bool    bError    = false;
+    ssize_t BytesRead = 0;
+
+    if (-1 != ErrorFD)
+    {
+        while (1)
+        {
+            BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1);
+            if (BytesRead < 1)
+                break;
+
+            g_Buffer[BytesRead] = '\0';
+            fprintf (fpLog, "%s", g_Buffer);
+
+            if (strstr ((char *) g_Buffer, "Error") || strstr ((char *) g_Buffer, "Exception") || strstr ((char *) g_Buffer, "Failed"))
+                bError = true;
+        }
+    }
+
+    if (-1 != OutputFD)
+    {
+        while (1)
+        {
+            BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer)-1);
+            if (BytesRead < 1)
+                break;
+
+            g_Buffer[BytesRead] = '\0';
+            fprintf (fpLog, "%s", g_Buffer);
+        }
+    }
+
+    return bError;
+}
+
+
+void TranslogArchivName (const char *pszArchiv, char *retpszArchiv, size_t Size)
+{
+    /* Translog archives go into TRANSLOG_REPO with the archive name specified */
+    const char *pszName = strstr (pszArchiv, "::");
+
+    snprintf (retpszArchiv, Size, "%s::%s", g_szTranslogRepo, pszName ? pszName+2 : pszArchiv);
+}
+
+
+int TranslogStartPart (BORG_STREAM *pStream)
+{
+    /* borg is started with the first extent of a part. An idle daemon does not hold the repository lock */
+    if (pStream->pid > 0)
+        return 0;
+
+    if (pStream->Part)
+        snprintf (pStream->szArchiv, sizeof (pStream->szArchiv), "%.*s.part-%04u", (int) (sizeof (pStream->szArchiv) - 17), pStream->szBaseArchiv, (unsigned) pStream->Part);
+
+    pStream->pid = BorgImportStart (pStream->szArchiv, &pStream->InputFD, &pStream->OutputFD, &pStream->ErrorFD);
+
+    if (pStream->pid < 1)
+    {
+        pStream->pid = 0;
+        return 1;
+    }
+
+    pStream->WriteFD = pStream->InputFD;
+
+    printf ("Backup OK: Archive part started: %s\n", pStream->szArchiv);
+    return 0;
+}
+
+
+void TranslogCommit (BORG_STREAM *pStream, const MANIFEST *pManifest)
+{
+    /* Closes the part TRANSLOG_COMMIT_SEC after its first extent was requested. borg commits the archive when its stream ends.
+       The next part is started by the next extent. Each part gets the manifest of all extents so far, so they can be restored while the daemon runs */
+    size_t BytesManifest = 0;
+
+    if ((0 == pStream->PartFiles) || (GetOSTimer() - pStream->tPartFirst < g_TranslogCommitSec*1000))
+        return;
+
+    if (pManifest && TarWriteManifest (pStream->WriteFD, pManifest, pStream->szArchiv, &BytesManifest))
+        printf ("Backup ERROR: Cannot write manifest to archive part: %s\n", pStream->szArchiv);
+
+    ShardCompletePart (pStream);
+}
+
+
+void TranslogReport (TRANSLOG *pTranslog, const MANIFEST *pManifest, size_t First, size_t End, const char *pszArchiv, time_t tCommit)
+{
+    /* Latency from the request of each extent to the commit of the archive holding it */
+    size_t i = 0;
+    time_t Latency = 0;
+    const MANIFEST_ENTRY *pEntry = NULL;
+
+    for (i = First; (i < End) && (i < pManifest->Count); i++)
+    {
+        pEntry  = &pManifest->pEntries[i];
+        Latency = pEntry->tRequest ? tCommit - pEntry->tRequest : 0;
+
+        if (pEntry->Status)
+            continue;
+
+        printf ("Backup OK: [%s] committed: %s, latency: %1.1f sec\n", pEntry->pszFileName, pszArchiv, Latency/1000.0);
+
+        pTranslog->Files++;
+        pTranslog->LatencySum += Latency;
+
+        if (Latency > pTranslog->LatencyMax)
+            pTranslog->LatencyMax = Latency;
+    }
+
+    pTranslog->Commits++;
+}
+
+
+void TranslogReap (BORG_STREAM *pStream, const MANIFEST *pManifest, TRANSLOG *pTranslog)
+{
+    /* Parts are checked while the daemon waits for requests. An extent is safe when borg completed the part holding it */
+    int    Status = 0;
+    pid_t  pid    = 0;
+    bool   bKnown = true;
+    bool   bError = false;
+    struct pollfd Poll = {0};
+    BORG_PART *pPart = NULL;
+
+    for (pPart = pStream->pParts; pPart; pPart = pPart->pNext)
+    {
+        if (pPart->pid < 1)
+            continue;
+
+        pid = waitpid (pPart->pid, &Status, WNOHANG);
+
+        if (0 == pid)
+            continue;
+
+        /* Not a child of the daemon. borg closes its output when it ends, but its exit status is lost */
+        bKnown = (pid > 0);
+
+        if (false == bKnown)
+        {
+            if (ECHILD != errno)
+                continue;
+
+            Poll.fd      = pPart->ErrorFD;
+            Poll.events  = POLLIN;
+            Poll.revents = 0;
+
+            if ((poll (&Poll, 1, 0) < 1) || (0 == (Poll.revents & POLLHUP)))
+                continue;
+        }
+
+        pPart->pid = 0;
+
+        printf ("\n[%s]\n", pPart->szArchiv);
+        bError = LogBorgOutput (stdout, pPart->ErrorFD, pPart->OutputFD);
+
+        close (pPart->OutputFD);
+        close (pPart->ErrorFD);
+        pPart->OutputFD = -1;
+        pPart->ErrorFD  = -1;
+
+        /* Without an exit status the extents are not known to be committed. Only an error message tells the part failed */
+        if ((false == bKnown) && (false == bError))
+        {
+            printf ("Backup ERROR: Borg exit status unknown for archive part: %s, files: %ld\n", pPart->szArchiv, pPart->Files);
+            pTranslog->Unknown += pPart->Files;
+            continue;
+        }
+
+        if ((false == bKnown) || !WIFEXITED (Status) || WEXITSTATUS (Status))
+        {
+            printf ("Backup ERROR: Borg failed for archive part: %s, files: %ld\n", pPart->szArchiv, pPart->Files);
+            pTranslog->Failed += pPart->Files;
+            continue;
+        }
+
+        TranslogReport (pTranslog, pManifest, pPart->ManifestFirst, pPart->ManifestEnd, pPart->szArchiv, GetOSTimer());
+    }
+}
+
+
+int SketchEstimate (int Count, char *ppNames[])
+{
+    /* Predicts the new data of the next backup from the sketches and the new data measured by the last backups.
+       Without files the databases of the sketch file are estimated */
+    int    ret    = 0;
+    int    i      = 0;
+    int    Streams = GetBorgStreamCount();
+    size_t f      = 0;
+    size_t Size   = 0;
+    size_t New    = 0;
+    size_t StreamBytes = 0;
+    size_t NewBytes    = 0;
+    long   Measured = 0;
+    long   Databases = 0;
+    double Fraction = 0.0;
+    double AvgFraction = 0.0;
+    double Scale  = 0.0;
+    double sec    = 0.0;
+    time_t tNow   = GetOSTimer();
+    struct stat Filestat = {0};
+    char   szInfo[80] = {0};
+
+    SKETCH_STORE Store;
+    PROBE_FILES  List = {0};
+    SKETCH       *pSketch = NULL;
+
+    memset (&Store, 0, sizeof (Store));
+
+    if (SketchStoreLoad (&Store, g_szSketchFile, tNow - SKETCH_MAX_DAYS * 86400LL * 1000LL))
+    {
+        printf ("No sketch found: %s. Backups with SKETCH=1 create it\n", g_szSketchFile);
+        return 1;
+    }
+
+    for (i=0; i < Count; i++)
+    {
+        if (stat (ppNames[i], &Filestat))
+            printf ("Info: Cannot find: %s (%s)\n", ppNames[i], strerror (errno));
+        else if (S_ISDIR (Filestat.st_mode))
+            ret |= ProbeScanDir (&List, ppNames[i], 0);
+        else if (S_ISREG (Filestat.st_mode))
+            ret |= ProbeAddFile (&List, ppNames[i], Filestat.st_size);
+    }
+
+    for (f=0; (0 == Count) && (0 == ret) && (f < Store.Count); f++)
+    {
+        if ((0 == stat (Store.pSketches[f].pszFileName, &Filestat)) && S_ISREG (Filestat.st_mode))
+            ret = ProbeAddFile (&List, Store.pSketches[f].pszFileName, Filestat.st_size);
+    }
+
+    if (ret)
+    {
+        printf ("Cannot allocate file list\n");
+        goto Done;
+    }
+
+    /* Databases with a first sketch only change like the average database. Without any measurement all data counts as new */
+    for (f=0; f < Store.Count; f++)
+    {
+        if (Store.pSketches[f].tPrev)
+        {
+            AvgFraction += Store.pSketches[f].NewFraction;
+            Measured++;
+        }
+    }
+
+    if (Measured)
+        AvgFraction /= Measured;
+    else
+        AvgFraction = 1.0;
+
+    printf ("\n");
+
+    for (f=0; f < List.Count; f++)
+    {
+        if (stat (List.pFiles[f].pszName, &Filestat))
+            continue;
+
+        Size    = Filestat.st_size;
+        pSketch = SketchFind (&Store, List.pFiles[f].pszName);
+
+        if (NULL == pSketch)
+        {
+            New = Size;
+            snprintf (szInfo, sizeof (szInfo), "no sketch");
+        }
+        else if ((Size == pSketch->Size) && (Filestat.st_mtime == pSketch->Mtime))
+        {
+            New = 0;
+            snprintf (szInfo, sizeof (szInfo), "unchanged");
+
+            /* Incremental backups don't read unchanged databases */
+            if (g_Incremental)
+                Size = 0;
+        }
+        else
+        {
+            /* New data grows with the time since the last backup, measured against the interval of the last measurement */
+            Fraction = pSketch->tPrev ? pSketch->NewFraction : AvgFraction;
+            Scale    = (pSketch->tPrev && (pSketch->tBackup > pSketch->tPrev)) ? (double) (tNow - pSketch->tBackup) / (pSketch->tBackup - pSketch->tPrev) : 1.0;
+
+            if (Fraction * Scale < 1.0)
+                Fraction *= Scale;
+            else
+                Fraction = 1.0;
+
+            New = Fraction * ((Size < pSketch->Size) ? Size : pSketch->Size);
+
+            /* Data appended since the last backup is new */
+            if (Size > pSketch->Size)
+                New += Size - pSketch->Size;
+
+            snprintf (szInfo, sizeof (szInfo), "%s%1.1f%% in %1.1f hours", pSketch->tPrev ? "last backup: " : "average: ",
+                      100.0 * (pSketch->tPrev ? pSketch->NewFraction : AvgFraction), (tNow - pSketch->tBackup) / 3600000.0);
+        }
+
+        printf ("Estimate: [%s] %1.1f MB, new data: %1.1f MB (%s)\n", List.pFiles[f].pszName, Filestat.st_size/1024.0/1024.0, New/1024.0/1024.0, szInfo);
+
+        StreamBytes += Size;
+        NewBytes    += New;
+        Databases++;
+    }
+
+    sec = (Store.Rate > 0) ? StreamBytes / Store.Rate / Streams : 0.0;
+
+    printf ("\nEstimate: %ld databases, data read: %1.1f MB, new data: %1.1f MB", Databases, StreamBytes/1024.0/1024.0, NewBytes/1024.0/1024.0);
+
+    if (sec)
+        printf (", duration: %ld:%02ld:%02ld at %1.1f MB/sec per stream\n\n", (long) sec / 3600, ((long) sec / 60) % 60, (long) sec % 60, Store.Rate/1024.0/1024.0);
+    else
+        printf (", duration: unknown\n\n");
+
+Done:
+
+    for (f=0; f < List.Count; f++)
+        free (List.pFiles[f].pszName);
+
+    free (List.pFiles);
+    SketchStoreFree (&Store);
+
+    return ret;
+}
+
+
+int GetSocketFile (const char *pszReqFile, char *retpszSocketFile, size_t Size)
+{
+    /* The socket is next to the request file: .nshborg.reg -> .nshborg.sock */
+    struct sockaddr_un Addr;
+    size_t Len = strlen (pszReqFile);
+
+    if ((Len > 4) && (0 == strcmp (pszReqFile + Len - 4, ".reg")))
+        snprintf (retpszSocketFile, Size, "%.*s.sock", (int) (Len - 4), pszReqFile);
+    else
+        snprintf (retpszSocketFile, Size, "%s.sock", pszReqFile);
+
+    if (strlen (retpszSocketFile) >= sizeof (Addr.sun_path))
+        return 1;
+
+    return 0;
+}
+
+
+int SockSend (int FD, const char *pszLine)
+{
+    /* Replies are short. A client which does not read them within a second is dropped */
+    size_t  Len  = strlen (pszLine);
+    ssize_t Sent = 0;
+    struct pollfd Pfd = {0};
+
+    while (Len)
+    {
+        Sent = send (FD, pszLine, Len, MSG_NOSIGNAL);
+
+        if (Sent > 0)
+        {
+            pszLine += Sent;
+            Len     -= Sent;
+            continue;
+        }
+
+        if ((Sent < 0) && (EINTR == errno))
+            continue;
+
+        if ((Sent < 0) && (EAGAIN == errno))
+        {
+            Pfd.fd     = FD;
+            Pfd.events = POLLOUT;
+
+            if (poll (&Pfd, 1, 1000) > 0)
+                continue;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void SockServerInit (SOCK_SERVER *pSock)
+{
+    int i = 0;
+
+    memset (pSock, 0, sizeof (SOCK_SERVER));
+    pSock->ListenFD = -1;
+
+    for (i=0; i < SOCK_MAX_CLIENTS; i++)
+        pSock->Clients[i].FD = -1;
+}
+
+
+int SockServerStart (SOCK_SERVER *pSock, const char *pszReqFile, const char *pszArchiv)
+{
+    int  ret    = 0;
+    bool bBound = false;
+    struct sockaddr_un Addr;
+
+    pSock->pszArchiv = pszArchiv;
+
+    if (GetSocketFile (pszReqFile, pSock->szSocketFile, sizeof (pSock->szSocketFile)))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    memset (&Addr, 0, sizeof (Addr));
+    Addr.sun_family = AF_UNIX;
+    memcpy (Addr.sun_path, pSock->szSocketFile, strlen (pSock->szSocketFile) + 1);
+
+    pSock->ListenFD = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (-1 == pSock->ListenFD)
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    /* Left over by a daemon which did not end. The PID check made sure it is gone */
+    unlink (pSock->szSocketFile);
+
+    if (bind (pSock->ListenFD, (struct sockaddr *) &Addr, sizeof (Addr)))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    bBound = true;
+
+    /* Only the Domino user submits backups */
+    chmod (pSock->szSocketFile, S_IRUSR | S_IWUSR);
+
+    if (listen (pSock->ListenFD, SOMAXCONN))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+Done:
+
+    if (ret && (-1 != pSock->ListenFD))
+    {
+        perror ("Cannot create request socket");
+        close (pSock->ListenFD);
+        pSock->ListenFD = -1;
+    }
+
+    if (ret && bBound)
+        unlink (pSock->szSocketFile);
+
+    return ret;
+}
+
+
+size_t SockQueued (const SOCK_SERVER *pSock)
+{
+    return pSock->Count - pSock->First;
+}
+
+
+void SockClientClose (SOCK_SERVER *pSock, int Client)
+{
+    SOCK_CLIENT *pClient = &pSock->Clients[Client];
+
+    if (-1 == pClient->FD)
+        return;
+
+    close (pClient->FD);
+    pClient->FD  = -1;
+    pClient->Len = 0;
+}
+
+
+void SockReply (SOCK_SERVER *pSock, const SOCK_REQUEST *pReq, bool bOK, size_t Bytes, long long Msec, const char *pszText)
+{
+    /* Frame: <id> OK|ERROR <bytes> <msec> <text> */
+    SOCK_CLIENT *pClient = &pSock->Clients[pReq->Client];
+    char szLine[SOCK_LINE_SIZE+1] = {0};
+
+    /* The client is gone. Its requests are still backed up */
+    if ((-1 == pClient->FD) || (pClient->Serial != pReq->Serial))
+        return;
+
+    snprintf (szLine, sizeof (szLine), "%lu %s %zu %lld %s\n", pReq->Id, bOK ? "OK" : "ERROR", Bytes, Msec, pszText);
+
+    if (SockSend (pClient->FD, szLine))
+        SockClientClose (pSock, pReq->Client);
+}
+
+
+int SockQueue (SOCK_SERVER *pSock, int Client, unsigned long Id, const char *pszFileName)
+{
+    size_t       Alloc = 0;
+    SOCK_REQUEST *pNew = NULL;
+    SOCK_REQUEST *pReq = NULL;
+
+    if (pSock->Count == pSock->Alloc)
+    {
+        if (pSock->First)
+        {
+            memmove (pSock->pQueue, pSock->pQueue + pSock->First, SockQueued (pSock) * sizeof (SOCK_REQUEST));
+            pSock->Count -= pSock->First;
+            pSock->First  = 0;
+        }
+        else
+        {
+            Alloc = pSock->Alloc ? pSock->Alloc * 2 : 64;
+            pNew  = (SOCK_REQUEST *) realloc (pSock->pQueue, Alloc * sizeof (SOCK_REQUEST));
+
+            if (NULL == pNew)
+                return 1;
+
+            pSock->pQueue = pNew;
+            pSock->Alloc  = Alloc;
+        }
+    }
+
+    pReq = &pSock->pQueue[pSock->Count];
+    pReq->pszFileName = strdup (pszFileName);
+
+    if (NULL == pReq->pszFileName)
+        return 1;
+
+    pReq->Client  = Client;
+    pReq->Serial  = pSock->Clients[Client].Serial;
+    pReq->Id      = Id;
+    pReq->tQueued = GetOSTimer();
+    pReq->tStart  = 0;
+
+    pSock->Count++;
+    return 0;
+}
+
+
+void SockHandleLine (SOCK_SERVER *pSock, int Client, char *pszLine, PREFETCH *pPrefetch)
+{
+    /* Request frame: <id> BACKUP <file> | <id> QUIT | <id> STATUS */
+    char *pszCommand = NULL;
+    char *pszArg = NULL;
+    char *p = NULL;
+    char szText[SOCK_LINE_SIZE+1] = {0};
+    SOCK_REQUEST Req;
+
+    memset (&Req, 0, sizeof (Req));
+    Req.Client = Client;
+    Req.Serial = pSock->Clients[Client].Serial;
 
-Done:
+    p = strchr (pszLine, '\r');
 
-    if (-1 != InputFD)
+    if (p)
+        *p = '\0';
+
+    Req.Id = strtoul (pszLine, &pszCommand, 10);
+
+    if ((pszCommand == pszLine) || (' ' != *pszCommand))
     {
-        close (InputFD);
-        InputFD = -1;
+        Req.Id = 0;
+        SockReply (pSock, &Req, false, 0, 0, "Invalid request");
+        return;
     }
 
-    if (-1 != OutputFD)
+    pszCommand++;
+    pszArg = strchr (pszCommand, ' ');
+
+    if (pszArg)
+        *pszArg++ = '\0';
+
+    if ((0 == strcmp (pszCommand, "BACKUP")) && pszArg && *pszArg)
     {
-        close (OutputFD);
-        OutputFD = -1;
+        if (SockQueue (pSock, Client, Req.Id, pszArg))
+            SockReply (pSock, &Req, false, 0, 0, "Cannot queue request");
+        else
+            PrefetchAdd (pPrefetch, pszArg);
     }
-
-    if (-1 != ErrorFD)
+    else if (0 == strcmp (pszCommand, "QUIT"))
     {
-        close (ErrorFD);
-        ErrorFD = -1;
+        if (SockQueue (pSock, Client, Req.Id, g_szBackupEndMarker))
+            SockReply (pSock, &Req, false, 0, 0, "Cannot queue request");
+        else
+            PrefetchAdd (pPrefetch, g_szBackupEndMarker);
     }
+    else if (0 == strcmp (pszCommand, "STATUS"))
+    {
+        snprintf (szText, sizeof (szText), "running, archive: %s, PID: %u, requests: %ld, failed: %ld, queued: %zu, streaming: %zu",
+                  pSock->pszArchiv, getpid(), pSock->Served, pSock->Failed, SockQueued (pSock), pSock->FlightCount);
 
-    if (pid > 0)
+        SockReply (pSock, &Req, true, 0, 0, szText);
+    }
+    else
     {
-        pclose3 (pid);
-        pid = 0;
+        SockReply (pSock, &Req, false, 0, 0, "Invalid request");
     }
-
-    return ret;
 }
 
 
-int InvokeBorgCommand (const char *pArgs[])
+void SockFinish (SOCK_SERVER *pSock, SOCK_REQUEST *pReq, int ret, size_t Bytes, const char *pszText)
 {
-    int   ret       =  0;
-    int   InputFD   = -1;
-    int   OutputFD  = -1;
-    int   ErrorFD   = -1;
-    pid_t pid       =  0;
+    /* Answers a request. Its database is out of backup mode */
+    MANIFEST_ENTRY *pEntry = NULL;
 
-    ssize_t BytesRead  = 0;
-    ssize_t BytesWrite = 0;
+    pSock->Served++;
 
+    if (ret)
+        pSock->Failed++;
 
-    if (NULL == pArgs)
+    SockReply (pSock, pReq, 0 == ret, Bytes, GetOSTimer() - pReq->tStart, pszText);
+
+    if (pSock->pManifest && pReq->bManifest)
     {
-        return -1;
-    }
+        pthread_mutex_lock (pSock->pMutex);
 
-    PushToSSHAgent();
-    SetEnvironmentVars();
-    pid = popen3 (&InputFD, &OutputFD, &ErrorFD, 1, pArgs);
-    UnsetEnvironmentVars();
+        pEntry = &pSock->pManifest->pEntries[pReq->ManifestIndex];
 
-    if (pid < 1)
-    {
-        printf ("\nBackup ERROR: Cannot start Borg process\n\n");
-        perror ("Backup ERROR: Cannot start Borg process");
-        ret = 1;
-        goto Done;
+        if (0 == pEntry->tAck)
+            pEntry->tAck = GetOSTimer();
+
+        pthread_mutex_unlock (pSock->pMutex);
     }
 
-    /* Check if Borg process provides output */
-    if (-1 != OutputFD)
-    {
-        while ((BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer)-1)))
-        {
-            g_Buffer[BytesRead] = '\0';
-            BytesWrite = write (1, g_Buffer, BytesRead);
+    free (pReq->pszFileName);
+    free (pReq->pDone);
+    pReq->pszFileName = NULL;
+    pReq->pDone = NULL;
+}
 
-            if (BytesRead != BytesWrite)
-            {
-                perror ("Warning: Incomplete buffer write");
-            }
 
-            usleep (10*1000);
-        }
-    }
+SPOOL_DONE *SockReserve (SOCK_SERVER *pSock)
+{
+    /* Room to keep the current request until its stream is done */
+    size_t       Alloc = 0;
+    SOCK_REQUEST *pNew = NULL;
 
-    if (-1 != ErrorFD)
-    {
-        while ((BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1)))
-        {
-            g_Buffer[BytesRead] = '\0';
-            BytesWrite = write (2, g_Buffer, BytesRead);
+    if (false == pSock->bCurrent)
+        return NULL;
 
-            if (BytesRead != BytesWrite)
-            {
-                perror ("Warning: Incomplete buffer write");
-            }
+    if (pSock->FlightCount == pSock->FlightAlloc)
+    {
+        Alloc = pSock->FlightAlloc ? pSock->FlightAlloc * 2 : 16;
+        pNew  = (SOCK_REQUEST *) realloc (pSock->pFlight, Alloc * sizeof (SOCK_REQUEST));
 
-            usleep (10*1000);
+        if (NULL == pNew)
+            return NULL;
 
-            if (strstr ((char *)g_Buffer, "not found"))
-            {
-                printf ("\nBackup ERROR: Cannot find archive to delete\n\n");
-                ret = -1;
-            }
-        }
+        pSock->pFlight     = pNew;
+        pSock->FlightAlloc = Alloc;
     }
 
-Done:
+    if (NULL == pSock->Current.pDone)
+        pSock->Current.pDone = (SPOOL_DONE *) calloc (1, sizeof (SPOOL_DONE));
 
-    if (-1 != InputFD)
+    return pSock->Current.pDone;
+}
+
+
+void SockReap (SOCK_SERVER *pSock)
+{
+    /* Answers the requests whose stream is done */
+    size_t i     = 0;
+    size_t Keep  = 0;
+    bool   bDone = false;
+    SOCK_REQUEST *pReq = NULL;
+
+    for (i=0; i < pSock->FlightCount; i++)
     {
-        close (InputFD);
-        InputFD = -1;
+        pReq = &pSock->pFlight[i];
+
+        pthread_mutex_lock (pSock->pMutex);
+        bDone = pReq->pDone->bDone;
+        pthread_mutex_unlock (pSock->pMutex);
+
+        if (bDone)
+            SockFinish (pSock, pReq, pReq->pDone->ret, pReq->pDone->Bytes, pReq->pDone->ret ? "Backup failed" : "backed up");
+        else
+            pSock->pFlight[Keep++] = *pReq;
     }
 
-    if (-1 != OutputFD)
+    pSock->FlightCount = Keep;
+}
+
+
+void SockPoll (SOCK_SERVER *pSock, int TimeoutMsec, PREFETCH *pPrefetch)
+{
+    /* Accepts clients and queues their requests. Waits up to the timeout for the first event */
+    int     i     = 0;
+    int     c     = 0;
+    int     FD    = -1;
+    int     Count = 0;
+    ssize_t BytesRead = 0;
+    char    *pLine = NULL;
+    char    *pEnd  = NULL;
+    SOCK_CLIENT   *pClient = NULL;
+    struct pollfd Fds[SOCK_MAX_CLIENTS+1];
+    int           Slots[SOCK_MAX_CLIENTS+1];
+
+    SockReap (pSock);
+
+    if (-1 == pSock->ListenFD)
     {
-        close (OutputFD);
-        OutputFD = -1;
+        if (TimeoutMsec)
+            usleep (TimeoutMsec*1000);
+
+        return;
     }
 
-    if (-1 != ErrorFD)
+    Fds[0].fd      = pSock->ListenFD;
+    Fds[0].events  = POLLIN;
+    Fds[0].revents = 0;
+    Count = 1;
+
+    for (c=0; c < SOCK_MAX_CLIENTS; c++)
     {
-        close (ErrorFD);
-        ErrorFD = -1;
+        if (-1 == pSock->Clients[c].FD)
+            continue;
+
+        Fds[Count].fd      = pSock->Clients[c].FD;
+        Fds[Count].events  = POLLIN;
+        Fds[Count].revents = 0;
+        Slots[Count] = c;
+        Count++;
     }
 
-    if (pid > 0)
+    if (poll (Fds, Count, TimeoutMsec) <= 0)
+        return;
+
+    for (i=1; i < Count; i++)
     {
-        pclose3 (pid);
-        pid = 0;
-    }
+        if (0 == Fds[i].revents)
+            continue;
 
-    return ret;
-}
+        pClient = &pSock->Clients[Slots[i]];
 
+        if (-1 == pClient->FD)
+            continue;
 
+        BytesRead = read (pClient->FD, pClient->szLine + pClient->Len, SOCK_LINE_SIZE - pClient->Len);
 
-int BorgBackupDelete (const char *pszArchiv)
-{
-    int  ret = 0;
+        if ((BytesRead < 0) && ((EAGAIN == errno) || (EINTR == errno)))
+            continue;
 
-    const char *args[] = { g_szBorgBackupBinary, "delete", "--stats", pszArchiv, NULL };
+        if (BytesRead <= 0)
+        {
+            SockClientClose (pSock, Slots[i]);
+            continue;
+        }
 
-    if (0 == g_BorgDeleteAllowed)
-    {
-        printf ("\nBackup ERROR: Archive delete is not allowed\n\n");
-        return 1;
+        pClient->Len += BytesRead;
+        pLine = pClient->szLine;
+
+        while ((pEnd = (char *) memchr (pLine, '\n', pClient->Len - (pLine - pClient->szLine))))
+        {
+            *pEnd = '\0';
+            SockHandleLine (pSock, Slots[i], pLine, pPrefetch);
+            pLine = pEnd + 1;
+
+            if (-1 == pClient->FD)
+                break;
+        }
+
+        if (-1 == pClient->FD)
+            continue;
+
+        pClient->Len -= pLine - pClient->szLine;
+        memmove (pClient->szLine, pLine, pClient->Len);
+
+        /* No file name is that long */
+        if (SOCK_LINE_SIZE == pClient->Len)
+        {
+            SockSend (pClient->FD, "0 ERROR 0 0 Request too long\n");
+            SockClientClose (pSock, Slots[i]);
+        }
     }
 
-    if (IsNullStr (pszArchiv))
+    if (0 == (Fds[0].revents & POLLIN))
+        return;
+
+    while (-1 != (FD = accept4 (pSock->ListenFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)))
     {
-        printf ("\nBackup ERROR: No archive to delete specified\n\n");
-        ret = 1;
-        goto Done;
+        for (c=0; c < SOCK_MAX_CLIENTS; c++)
+        {
+            if (-1 == pSock->Clients[c].FD)
+                break;
+        }
+
+        if (SOCK_MAX_CLIENTS == c)
+        {
+            SockSend (FD, "0 ERROR 0 0 Too many clients\n");
+            close (FD);
+            continue;
+        }
+
+        pSock->Clients[c].FD     = FD;
+        pSock->Clients[c].Serial = ++pSock->Serial;
+        pSock->Clients[c].Len    = 0;
     }
+}
 
 
-    ret = InvokeBorgCommand (args);
+void SockComplete (SOCK_SERVER *pSock, const SOCK_RESULT *pResult)
+{
+    SOCK_REQUEST *pReq = &pSock->Current;
 
-Done:
+    if (false == pSock->bCurrent)
+        return;
 
-    if (ret)
-        printf ("ERROR deleting archive\n");
-    else
-        printf ("\nBackup OK: Delete successful\n\n");
+    pSock->bCurrent     = false;
+    pReq->bManifest     = pResult->bManifest;
+    pReq->ManifestIndex = pResult->ManifestIndex;
 
-    return ret;
+    /* The database is still streamed. SockReserve made room for it */
+    if (pResult->bInFlight)
+    {
+        pSock->pFlight[pSock->FlightCount++] = *pReq;
+        pReq->pszFileName = NULL;
+        pReq->pDone = NULL;
+        return;
+    }
+
+    SockFinish (pSock, pReq, pResult->ret, pResult->Bytes, pResult->ret ? pResult->szError : (pResult->pszStatus ? pResult->pszStatus : "backed up"));
 }
 
 
-bool IsBorgBackupPassthruCommand (int argc, char *argv[])
+bool SockNext (SOCK_SERVER *pSock, SOCK_RESULT *pResult, PREFETCH *pPrefetch, char *retpszFileName, size_t Size, time_t *retptRequest)
 {
-    size_t i = 0;
+    /* Answers the request backed up last and takes the next one in arrival order */
+    SockComplete (pSock, pResult);
+    SockPoll (pSock, 0, pPrefetch);
 
-    if (argc < 2)
+    if (0 == SockQueued (pSock))
         return false;
 
-    for (i=0; i<g_PassthruCommandCount; i++)
+    pSock->Current = pSock->pQueue[pSock->First++];
+
+    if (pSock->First == pSock->Count)
     {
-        if (0 == strcmp (argv[1], g_szPassthruCommands[i]))
-            return true;
+        pSock->First = 0;
+        pSock->Count = 0;
     }
 
-    return false;
+    pSock->Current.tStart = GetOSTimer();
+    pSock->bCurrent = true;
+
+    snprintf (retpszFileName, Size, "%s", pSock->Current.pszFileName);
+    *retptRequest = pSock->Current.tQueued;
+
+    memset (pResult, 0, sizeof (SOCK_RESULT));
+    snprintf (pResult->szError, sizeof (pResult->szError), "Backup failed");
+
+    return true;
 }
 
 
-int BorgBackupPassthru (int argc, char *argv[])
+void SockServerStop (SOCK_SERVER *pSock, const char *pszResult)
 {
-    int    i         =  0;
-    int    ret       =  0;
-    int    ArgCount  =  argc+1;
-    size_t ArgSize   =  ArgCount * sizeof (char *);
-    const char **ppArgs = NULL;
-
-    /* Allocate variable argument list pointer */
-    ppArgs = (const char **) malloc (ArgSize);
+    /* The client of the end marker gets the result of the whole backup. Requests after it are not backed up */
+    int  c = 0;
+    bool bQuit = false;
+    SOCK_REQUEST *pReq = NULL;
 
-    if (NULL == ppArgs)
+    if (pSock->bCurrent)
     {
-        printf ("\nBackup ERROR: Cannot allocate memory for argument list\n\n");
-        ret = -1;
-        goto Done;
+        pReq  = &pSock->Current;
+        bQuit = (0 == strcmp (pReq->pszFileName, g_szBackupEndMarker));
+
+        SockReply (pSock, pReq, bQuit, 0, GetOSTimer() - pReq->tStart, bQuit ? pszResult : "Backup ended");
+
+        free (pReq->pszFileName);
+        free (pReq->pDone);
+        pReq->pszFileName = NULL;
+        pReq->pDone = NULL;
+        pSock->bCurrent = false;
     }
 
-    memset (ppArgs, 0, ArgSize);
+    /* The streams are stopped before, so requests still streaming only remain when the backup failed */
+    while (pSock->FlightCount)
+    {
+        pReq = &pSock->pFlight[--pSock->FlightCount];
+        SockReply (pSock, pReq, false, 0, GetOSTimer() - pReq->tStart, "Backup ended");
+        free (pReq->pszFileName);
+        free (pReq->pDone);
+    }
 
-    /* Replace the program name with Borg Backup binary */
-    ppArgs[0] = g_szBorgBackupBinary;
+    free (pSock->pFlight);
+    pSock->pFlight     = NULL;
+    pSock->FlightAlloc = 0;
 
-    /* Copy all parameters beside the first one (which is the program name) */
-    for (i=1; i<argc; i++)
+    while (SockQueued (pSock))
     {
-        ppArgs[i] = argv[i];
+        pReq = &pSock->pQueue[pSock->First++];
+        SockReply (pSock, pReq, false, 0, 0, "Backup ended");
+        free (pReq->pszFileName);
     }
 
-    ret = InvokeBorgCommand ((const char **) ppArgs);
+    free (pSock->pQueue);
+    pSock->pQueue = NULL;
+    pSock->First  = 0;
+    pSock->Count  = 0;
+    pSock->Alloc  = 0;
 
-Done:
+    for (c=0; c < SOCK_MAX_CLIENTS; c++)
+        SockClientClose (pSock, c);
 
-    if (ppArgs)
+    if (-1 != pSock->ListenFD)
     {
-        free (ppArgs);
-        ppArgs = NULL;
+        close (pSock->ListenFD);
+        pSock->ListenFD = -1;
+        unlink (pSock->szSocketFile);
     }
-
-    return ret;
 }
 
 
-int BorgBackupStart (const char *pszReqFilename, const char *pszArchiv)
+int BorgBackupStart (const char *pszReqFilename, const char *pszArchiv, bool bFileList, bool bTranslog)
 {
+    /* Runs as a daemon processing request files. With a file list all listed files are backed up in the foreground.
+       In translog mode archived transaction log extents are committed in small archive parts within seconds */
     int   ret       = 0;
+    int   i         = 0;
+    int   ProcessCount = 0;
     long  CountOK   = 0;
     long  CountErr  = 0;
+    long  CountRef  = 0;
+    bool  bIncremental = false;
+    bool  bId       = false;
+    bool  bBorgFailed = false;
+    bool  bDaosDedup = false;
+    bool  bArchived = false;
+    bool  bResume   = false;
+    bool  bResumed  = false;
+    bool  bSketch   = false;
 
     FILE  *fpReq    = NULL;
     FILE *fpLog     = NULL;
 
     pid_t CheckPID  = 0;
-    pid_t pid       =  0;
-    int   InputFD   = -1;
-    int   OutputFD  = -1;
-    int   ErrorFD   = -1;
 
     ssize_t BytesRead = 0;
+    size_t  BytesManifest = 0;
+    size_t  ManifestIndex = 0;
+    time_t  tRequest  = 0;
+    bool    bEndMarker = false;
+
+    char   szFileName[MAX_PATH+1]    = {0};
+    char   *p = NULL;
+
+    struct stat ReqStat = {0};
+
+    BACKUP_STATS Stats;
+    MANIFEST     Manifest;
+    STATE        State;
+    NLO_INDEX    NloIndex;
+    JOURNAL      Journal;
+    FILE_ID      Id;
+    SPOOL        Spool;
+    SPOOL_DONE   *pDone = NULL;
+    TEE          Tee;
+    PREFETCH     Prefetch;
+    RATE_LIMIT   RateLimit;
+    TRANSLOG     Translog;
+    SKETCH_STORE Sketch;
+    SOCK_SERVER  Sock;
+    SOCK_RESULT  Result;
+    BORG_STREAM  *pStream = NULL;
+    BORG_STREAM  *pRefStream = NULL;
+    BORG_PART    *pPart = NULL;
+    STATE_ENTRY  *pRef = NULL;
+
+    memset (&Manifest, 0, sizeof (Manifest));
+    memset (&State, 0, sizeof (State));
+    memset (&NloIndex, 0, sizeof (NloIndex));
+    memset (&Journal, 0, sizeof (Journal));
+    Journal.FD = -1;
+    memset (&Spool, 0, sizeof (Spool));
+    pthread_mutex_init (&Spool.Mutex, NULL);
+    pthread_cond_init (&Spool.Cond, NULL);
+
+    memset (&Tee, 0, sizeof (Tee));
+    pthread_mutex_init (&Tee.Mutex, NULL);
+    pthread_cond_init (&Tee.Cond, NULL);
+    Tee.PipeFD[READ]  = -1;
+    Tee.PipeFD[WRITE] = -1;
+
+    memset (&Prefetch, 0, sizeof (Prefetch));
+    pthread_mutex_init (&Prefetch.Mutex, NULL);
+    pthread_cond_init (&Prefetch.Cond, NULL);
+
+    memset (&RateLimit, 0, sizeof (RateLimit));
+    pthread_mutex_init (&RateLimit.Mutex, NULL);
+
+    memset (&Translog, 0, sizeof (Translog));
+
+    memset (&Sketch, 0, sizeof (Sketch));
+    pthread_mutex_init (&Sketch.Mutex, NULL);
+
+    SockServerInit (&Sock);
+    Sock.pMutex    = &Spool.Mutex;
+    Sock.pManifest = &Manifest;
+    memset (&Result, 0, sizeof (Result));
+
+    for (i=0; i <= MAX_BORG_STREAMS; i++)
+    {
+        Spool.Streams[i].pSpool   = &Spool;
+        Spool.Streams[i].Index    = i;
+        Spool.Streams[i].InputFD  = -1;
+        Spool.Streams[i].OutputFD = -1;
+        Spool.Streams[i].ErrorFD  = -1;
+        Spool.Streams[i].WriteFD  = -1;
+    }
+
+    if (IsNullStr (pszReqFilename))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    if (IsNullStr (pszArchiv))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    CheckPID = CheckProcessRunning();
+
+    if (CheckPID)
+    {
+        printf ("Backup ERROR: Backup process already running with PID %u\n", CheckPID);
+        return 1;
+    }
+
+    /* Extents go into one repository in request order. Database backup features don't apply */
+    if (bTranslog)
+    {
+        printf ("Translog mode: archive parts are committed %ld sec after their first extent\n", g_TranslogCommitSec);
+
+        *g_szParallelRepos = '\0';
+        *g_szTeeRepo       = '\0';
+        *g_szSpoolDir      = '\0';
+        g_Incremental      = 0;
+        g_DaosDedup        = 0;
+        g_Resume           = 0;
+        g_PrefetchFiles    = 0;
+        g_ShardMaxSize     = 0;
+        g_ShardMaxFiles    = 0;
+        g_Sketch           = 0;
+    }
+
+    /* Each repository gets its own archive with the same name */
+    Spool.StreamCount = GetBorgStreamCount();
+
+    for (i=0; i < Spool.StreamCount; i++)
+    {
+        if (GetBorgStreamArchiv (i, pszArchiv, Spool.Streams[i].szRepo, sizeof (Spool.Streams[i].szRepo), Spool.Streams[i].szArchiv, sizeof (Spool.Streams[i].szArchiv)))
+        {
+            printf ("Backup ERROR: Invalid PARALLEL_REPOS: %s\n", g_szParallelRepos);
+            ret = 1;
+            goto Done;
+        }
 
-    char   szFileName[MAX_PATH+1]    = {0};
-    char   *p = NULL;
+        printf ("Backup Archiv : %s\n", Spool.Streams[i].szArchiv);
+    }
 
-    const char *args[] = { g_szBorgBackupBinary, "import-tar", "--ignore-zeros", "--stats",  pszArchiv, "-", NULL };
+    ProcessCount = Spool.StreamCount;
 
-    if (IsNullStr (pszReqFilename))
+    /* Tee mode feeds a second repository from the same read. The secondary follows the streams */
+    if (*g_szTeeRepo)
     {
-        ret = 1;
-        goto Done;
+        if (Spool.StreamCount > 1)
+        {
+            printf ("Info: Tee mode cannot be combined with parallel repositories. Tee disabled\n");
+        }
+        else if (TAR_MODE_EXTERNAL == g_TarMode)
+        {
+            printf ("Info: Tee mode requires native tar mode. Tee disabled\n");
+        }
+        else
+        {
+            pStream = &Spool.Streams[ProcessCount++];
+            p = strstr ((char *) pszArchiv, "::");
+
+            snprintf (pStream->szRepo, sizeof (pStream->szRepo), "%s", g_szTeeRepo);
+            snprintf (pStream->szArchiv, sizeof (pStream->szArchiv), "%.*s::%s", (int) strlen (g_szTeeRepo), g_szTeeRepo, p ? p+2 : pszArchiv);
+
+            printf ("Backup Archiv : %s (tee)\n", pStream->szArchiv);
+        }
     }
 
-    if (IsNullStr (pszArchiv))
+    /* Parts are rolled over by the thread writing the stream. Tee mode has two writers */
+    if ((g_ShardMaxSize || g_ShardMaxFiles) && (ProcessCount > Spool.StreamCount))
+        printf ("Info: Archive parts cannot be combined with tee mode. Archive parts disabled\n");
+    else if (g_ShardMaxSize || g_ShardMaxFiles || bTranslog)
+        Spool.bShard = true;
+
+    if (bFileList)
     {
-        ret = 1;
-        goto Done;
+        printf ("Backup FileList: %s\n", pszReqFilename);
     }
+    else
+    {
+        printf ("Backup ReqFile: %s\n", pszReqFilename);
 
-    CheckPID = CheckProcessRunning();
+        /* Remove file if present */
+        remove (pszReqFilename);
+    }
 
-    if (CheckPID)
+    /* Archives of an interrupted backup are checked before borg locks the repository */
+    if (g_Resume && (0 == g_Manifest))
     {
-        printf ("Backup ERROR: Backup process already running with PID %u\n", CheckPID);
-        return 1;
+        printf ("Info: Resume requires the manifest. Resume disabled\n");
     }
+    else if (g_Resume)
+    {
+        bResume = true;
 
-    printf ("Backup Archiv : %s\n", pszArchiv);
-    printf ("Backup ReqFile: %s\n", pszReqFilename);
+        if ((0 == JournalLoad (&Journal, g_szJournalFile)) && Journal.Done.Count)
+        {
+            printf ("Resuming interrupted backup: %s, files completed: %zu\n", Journal.szArchiv, Journal.Done.Count);
+            JournalVerify (&Journal);
+        }
 
-    /* Remove file if present */
-    remove (pszReqFilename);
+        /* Without a journal the backup still runs, it just cannot be resumed */
+        if (JournalStart (&Journal, g_szJournalFile, pszArchiv))
+            printf ("Info: Cannot create backup journal: %s\n", g_szJournalFile);
+    }
 
-    printf ("\nStarting Borg process ...\n\n");
+    /* A borg process which ended must not kill the daemon. Writes into its pipe fail with EPIPE and only its stream fails */
+    signal (SIGPIPE, SIG_IGN);
 
-    PushToSSHAgent();
-    SetEnvironmentVars();
-    pid = popen3 (&InputFD, &OutputFD, &ErrorFD, 1, args);
-    UnsetEnvironmentVars();
+    printf ("\nStarting Borg process ...\n\n");
 
-    if (pid < 1)
+    for (i=0; i < ProcessCount; i++)
     {
-        printf ("\nBackup ERROR: Cannot start Borg process\n\n");
-        perror ("Backup ERROR: Cannot start Borg process");
-        ret = 1;
-        goto Done;
+        /* The translog daemon starts borg with the first extent of each part */
+        if (bTranslog)
+            snprintf (Spool.Streams[i].szBaseArchiv, sizeof (Spool.Streams[i].szBaseArchiv), "%s", Spool.Streams[i].szArchiv);
+        else if (BorgStreamStart (&Spool.Streams[i]))
+        {
+            ret = 1;
+            goto Done;
+        }
     }
 
-    printf ("Borg PID: %u\n", pid);
-
-    sleep (2);
+    if (false == bTranslog)
+        sleep (2);
 
     /* check if Borg process signaled an error */
-    if (-1 != ErrorFD)
+    for (i=0; i < ProcessCount; i++)
     {
-        BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1);
+        pStream = &Spool.Streams[i];
+
+        if (-1 == pStream->ErrorFD)
+            continue;
+
+        BytesRead = read (pStream->ErrorFD, g_Buffer, sizeof (g_Buffer)-1);
         if (BytesRead > 0)
         {
             g_Buffer[BytesRead] = '\0';
@@ -1610,36 +11599,149 @@ int BorgBackupStart (const char *pszReqFilename, const char *pszArchiv)
 
     printf ("Backup OK: BorgBackup started: %s\n", pszArchiv);
 
-    /* Flush stdout before making the process a daemon */
-    fflush(stdout);
+    /* The snapshot command of Domino waits for the whole file list. Results go directly to Domino */
+    if (false == bFileList)
+    {
+        /* Flush stdout before making the process a daemon */
+        fflush(stdout);
+
+        /* Switch process to a daemon process which isn't depending on calling process */
+        CheckPID = daemon (1, 0);
+
+        if (-1 == CheckPID)
+        {
+            ret = 1;
+            printf ("\nBackup ERROR: Failed to turn process into a daemon!\n\n");
+            perror ("Backup ERROR: Failed to turn process into a daemon!");
+            goto Done;
+        }
+
+        /* Per file results of the daemon go into the log file, which is returned when the backup ends.
+           Opened in append mode, because the summary at the end is written to the same file */
+        remove (g_szBorgLogFile);
+
+        if (freopen (g_szBorgLogFile, "a", stdout))
+            setvbuf (stdout, NULL, _IOLBF, 0);
+
+        printf ("Daemon process has PID: %u\n", getpid());
+    }
+
+    WriteFilePID (g_szFilePID);
 
-    /* Switch process to a daemon process which isn't depending on calling process */
-    CheckPID = daemon (1, 0);
+    printf ("Compression: %s\n", *g_szBorgCompression ? g_szBorgCompression : "borg default (lz4)");
+    printf ("Chunker params: %s\n", *g_szChunkerParams ? g_szChunkerParams : "borg default (" CHUNKER_DEFAULT ")");
 
-    printf ("Daemon process has PID: %u\n", CheckPID);
+    Manifest.tStart = GetOSTimer();
 
-    if (-1 == CheckPID)
+    /* The manifest tells restore which archive holds an unchanged database */
+    if (g_Incremental && (0 == g_Manifest))
     {
-        ret = 1;
-        printf ("\nBackup ERROR: Failed to turn process into a daemon!\n\n");
-        perror ("Backup ERROR: Failed to turn process into a daemon!");
+        printf ("Info: Incremental backups require the manifest. Incremental disabled\n");
+    }
+    else if (g_Incremental)
+    {
+        bIncremental = true;
+        /* Databases not backed up for INCREMENTAL_FULL_DAYS get a new full backup */
+        StateLoad (&State, g_szStateFile, GetOSTimer() - g_IncrementalFullDays * 86400LL * 1000LL);
+        printf ("Incremental state: %zu databases, full backup after %ld days\n", State.Count, g_IncrementalFullDays);
+    }
+
+    if (g_DaosDedup)
+    {
+        bDaosDedup = true;
+        NloIndexLoad (&NloIndex, g_szNloIndexFile, GetOSTimer() - g_DaosFullDays * 86400LL * 1000LL);
+        printf ("DAOS NLO index: %zu NLOs in %zu archives, archived again after %ld days\n", NloIndex.Count, NloIndex.ArchivCount, g_DaosFullDays);
+    }
+
+    /* Databases read through nshborg's buffers update their sketch. Splice is not used */
+    if (g_Sketch)
+    {
+        bSketch = true;
+        BuzhashInitTable();
+        SketchStoreLoad (&Sketch, g_szSketchFile, GetOSTimer() - SKETCH_MAX_DAYS * 86400LL * 1000LL);
+        g_pSketchStore = &Sketch;
+        printf ("Sketch: %zu databases, %d samples each\n", Sketch.Count, g_SketchSamples);
+    }
+
+    /* Threads are started after daemon(), which only keeps the calling thread */
+    if ((ProcessCount > Spool.StreamCount) && TeeStart (&Tee, &Spool.Streams[0], &Spool.Streams[1]))
+        goto Done;
+
+    if (SpoolStart (&Spool, g_Manifest ? &Manifest : NULL, bIncremental ? &State : NULL, bDaosDedup ? &NloIndex : NULL, bResume ? &Journal : NULL))
         goto Done;
+
+    /* Started by the daemon, which has to wait for them */
+    for (i=0; Spool.bShard && (false == bTranslog) && (i < Spool.StreamCount); i++)
+    {
+        if (ShardStartSpare (&Spool.Streams[i]))
+            printf ("Info: Cannot start next archive part ahead: %s\n", Spool.Streams[i].szArchiv);
     }
 
-    WriteFilePID (g_szFilePID);
+    /* Without a prefetch thread the databases are still backed up, only without reading ahead */
+    if (g_PrefetchFiles && PrefetchStart (&Prefetch, bFileList ? pszReqFilename : NULL, bDaosDedup ? &NloIndex : NULL, &Spool.Mutex))
+        printf ("Info: Cannot prefetch databases of: %s\n", pszReqFilename);
+
+    /* An invalid schedule is reported and the backup runs with RATE_LIMIT only */
+    RateLimitStart (&RateLimit);
+
+    /* Clients get the result on the socket as soon as their database is backed up. Request files are still processed */
+    if (false == bFileList)
+    {
+        if (SockServerStart (&Sock, pszReqFilename, pszArchiv))
+            printf ("Info: Cannot listen on request socket: %s\n", Sock.szSocketFile);
+        else
+            printf ("Request socket: %s\n", Sock.szSocketFile);
+    }
 
     while (1)
     {
-        fpReq = fopen (pszReqFilename, "r");
+        /* Queued socket requests come first, so the read ahead sees the databases in backup order */
+        fpReq = SockQueued (&Sock) ? NULL : fopen (pszReqFilename, "r");
+
+        if (bFileList && (NULL == fpReq))
+        {
+            perror ("Backup ERROR: Cannot open file list");
+            printf ("Backup ERROR: Cannot open file list: %s\n", pszReqFilename);
+            ret = 1;
+            goto Done;
+        }
 
-        if (fpReq)
+        if (fpReq || SockQueued (&Sock))
         {
-            while ( fgets (szFileName, sizeof (szFileName)-1, fpReq) )
+            /* Domino puts the databases into backup mode right before writing the request file */
+            if (NULL == fpReq)
+                tRequest = 0;
+            else if (0 == fstat (fileno (fpReq), &ReqStat))
+                tRequest = ReqStat.st_mtim.tv_sec * 1000 + ReqStat.st_mtim.tv_nsec / 1000000;
+            else
+                tRequest = 0;
+
+            /* The lines of a batched request file are queued for read ahead before the first database is streamed */
+            if (fpReq && Prefetch.bThread && (false == bFileList))
+            {
+                while (fgets (szFileName, sizeof (szFileName)-1, fpReq))
+                {
+                    p = strpbrk (szFileName, "\r\n");
+
+                    if (p)
+                        *p = '\0';
+
+                    PrefetchAdd (&Prefetch, szFileName);
+
+                    if (('\0' == *szFileName) || (0 == strcmp (szFileName, g_szBackupEndMarker)))
+                        break;
+                }
+
+                rewind (fpReq);
+            }
+
+            /* Socket requests carry the time they were received */
+            while (fpReq ? (NULL != fgets (szFileName, sizeof (szFileName)-1, fpReq)) : SockNext (&Sock, &Result, &Prefetch, szFileName, sizeof (szFileName)-1, &tRequest))
             {
                 p = szFileName;
                 while (*p)
                 {
-                    if ('\n' == *p)
+                    if (('\n' == *p) || ('\r' == *p))
                     {
                         *p = '\0';
                         break;
@@ -1647,33 +11749,209 @@ int BorgBackupStart (const char *pszReqFilename, const char *pszArchiv)
                     p++;
                 }
 
+                PrefetchNext (&Prefetch);
+
+                if (bFileList && ('\0' == *szFileName))
+                    continue;
+
                 if ('\0' == *szFileName)
                     break;
 
                 if (0 == strcmp (szFileName, g_szBackupEndMarker))
                 {
                     printf ("Backup EndMarker found\n");
+                    bEndMarker = true;
                     goto Done;
                 }
 
-                ret = BackupFile (InputFD, szFileName);
+                /* NLOs are immutable and named by their content. An NLO in the index is in an earlier archive */
+                if (bDaosDedup && IsNloFile (szFileName))
+                {
+                    pthread_mutex_lock (&Spool.Mutex);
+
+                    bArchived = (NULL != NloIndexLookup (&NloIndex, szFileName));
+
+                    if (bArchived)
+                        NloIndex.Skipped++;
+
+                    pthread_mutex_unlock (&Spool.Mutex);
+
+                    if (bArchived)
+                    {
+                        Result.pszStatus = "already archived";
+                        continue;
+                    }
+                }
+
+                /* The identity decides about unchanged databases and about files completed by the interrupted backup */
+                bId = (bIncremental || bResume) && (0 == FileIdGet (szFileName, &Id));
+                pRefStream = NULL;
+
+                /* Completed by the interrupted backup. The journal of the interrupted backup is not changed by the streams */
+                pRef = bResume ? JournalFind (&Journal, szFileName, bId ? &Id : NULL) : NULL;
+                bResumed = (NULL != pRef);
+
+                pthread_mutex_lock (&Spool.Mutex);
+
+                if (bIncremental && bId && (NULL == pRef))
+                    pRef = StateFindUnchanged (&State, szFileName, &Id);
+
+                if (g_Manifest && ManifestAdd (&Manifest, szFileName, tRequest, &ManifestIndex))
+                {
+                    printf ("Backup ERROR: Cannot add file to manifest: %s\n", szFileName);
+                }
+                else
+                {
+                    Result.bManifest     = (0 != g_Manifest);
+                    Result.ManifestIndex = ManifestIndex;
+
+                    /* Only archives in the repositories of this backup are referenced */
+                    for (i=0; pRef && (i < Spool.StreamCount); i++)
+                    {
+                        if (0 == strcmp (Spool.Streams[i].szRepo, pRef->pszRepo))
+                            pRefStream = &Spool.Streams[i];
+                    }
+
+                    if (pRefStream)
+                        ManifestSetRef (&Manifest, ManifestIndex, pRef, pRefStream->szRepo);
+                }
+
+                pthread_mutex_unlock (&Spool.Mutex);
+
+                /* Unchanged since the last full backup or completed by the interrupted backup. Only the manifest of the new archive references it */
+                if (pRefStream && bResumed)
+                {
+                    printf ("Backup OK: [%s] completed by interrupted backup, referenced: %s::%s\n", szFileName, pRefStream->szRepo, Manifest.pEntries[ManifestIndex].pszRef);
+                    Journal.Resumed++;
+                    Result.pszStatus = "completed by interrupted backup";
+                    continue;
+                }
+
+                if (pRefStream)
+                {
+                    printf ("Backup OK: [%s] unchanged, referenced: %s::%s\n", szFileName, pRefStream->szRepo, Manifest.pEntries[ManifestIndex].pszRef);
+                    CountRef++;
+                    Result.pszStatus = "unchanged";
+                    continue;
+                }
+
+                /* Stream threads stream the database and record the result. A socket request is answered when its stream is done */
+                if (Spool.bThreads)
+                {
+                    pDone = fpReq ? NULL : SockReserve (&Sock);
+
+                    if ((NULL == fpReq) && (NULL == pDone))
+                    {
+                        CountErr++;
+                        Result.ret = 1;
+                        snprintf (Result.szError, sizeof (Result.szError), "Cannot queue request");
+                    }
+                    else if (SpoolAdd (&Spool, szFileName, ManifestIndex, bId ? &Id : NULL, pDone))
+                    {
+                        CountErr++;
+                        Result.ret = 1;
+                    }
+                    else if (pDone && pDone->bSpooled)
+                    {
+                        Result.pszStatus = "spooled";
+                    }
+                    else
+                    {
+                        Result.pszStatus = "queued";
+                        Result.bInFlight = (NULL != pDone);
+                    }
+
+                    continue;
+                }
+
+                if (bTranslog)
+                    TranslogCommit (&Spool.Streams[0], g_Manifest ? &Manifest : NULL);
+
+                if (bTranslog && TranslogStartPart (&Spool.Streams[0]))
+                {
+                    printf ("Backup ERROR: Cannot start archive part for: %s\n", szFileName);
+                    CountErr++;
+                    Result.ret = 1;
+                    continue;
+                }
+
+                if (Spool.bShard)
+                    ShardRollover (&Spool.Streams[0]);
+
+                if (0 == Spool.Streams[0].PartFiles)
+                {
+                    Spool.Streams[0].PartFirst  = ManifestIndex;
+                    Spool.Streams[0].tPartFirst = tRequest ? tRequest : GetOSTimer();
+                }
+
+                ret = BackupFile (Spool.Streams[0].WriteFD, szFileName, &Stats);
+
+                Spool.Streams[0].PartBytes += Stats.BytesTotal;
+                Spool.Streams[0].PartFiles++;
+
                 if (ret)
                 {
                     CountErr++;
+
+                    if (access (szFileName, R_OK))
+                        snprintf (Result.szError, sizeof (Result.szError), "%s", strerror (errno));
                 }
                 else
                 {
                     CountOK++;
+                    LogBackupResult (szFileName, &Stats);
                 }
+
+                Result.ret   = ret;
+                Result.Bytes = Stats.BytesData;
+
+                if (Spool.Streams[0].pTee)
+                    TeePrintLag (Spool.Streams[0].pTee);
+
+                if (g_Manifest)
+                    ManifestSetResult (&Manifest, ManifestIndex, ret, &Stats, Spool.Streams[0].szRepo, ShardPartName (&Spool.Streams[0]));
+
+                if (bIncremental && bId && (0 == ret))
+                    StateRecord (&State, szFileName, &Id, &Stats, Spool.Streams[0].szRepo, Spool.Streams[0].szArchiv);
+
+                if (bDaosDedup && (0 == ret) && IsNloFile (szFileName))
+                    NloIndexAdd (&NloIndex, szFileName, Spool.Streams[0].szArchiv, Stats.tStart);
+
+                if (bResume && (0 == ret))
+                    JournalRecord (&Journal, szFileName, bId ? &Id : NULL, &Stats, Spool.Streams[0].szRepo, Spool.Streams[0].szArchiv);
             }
 
-            fclose (fpReq);
-            fpReq = NULL;
+            if (fpReq)
+            {
+                fclose (fpReq);
+                fpReq = NULL;
+
+                /* A file list is complete when all files are read. It is neither removed nor acknowledged */
+                if (bFileList)
+                {
+                    bEndMarker = true;
+                    goto Done;
+                }
+
+                /* Databases streamed directly stay in backup mode until their streams are done */
+                SpoolWaitDirect (&Spool);
+                remove (pszReqFilename);
+
+                pthread_mutex_lock (&Spool.Mutex);
+                ManifestAck (&Manifest, GetOSTimer());
+                pthread_mutex_unlock (&Spool.Mutex);
+            }
+        }
 
-            remove (pszReqFilename);
+        /* Extents are committed in time also when no other extent follows */
+        if (bTranslog)
+        {
+            TranslogCommit (&Spool.Streams[0], g_Manifest ? &Manifest : NULL);
+            TranslogReap (&Spool.Streams[0], &Manifest, &Translog);
         }
 
-        usleep (10*1000);
+        /* Wakes up as soon as a client sends a request */
+        SockPoll (&Sock, 10, &Prefetch);
 
     } /* while */
 
@@ -1681,10 +11959,64 @@ Done:
 
     printf ("Done\n");
 
-    if (-1 != InputFD)
+    /* Spooled databases are already out of backup mode. The archives are complete when all queues are empty */
+    SpoolStop (&Spool);
+    SockReap (&Sock);
+
+    PrefetchStop (&Prefetch);
+    RateLimitStop (&RateLimit);
+    g_pSketchStore = NULL;
+
+    for (i=0; i < Spool.StreamCount; i++)
     {
-        close (InputFD);
-        InputFD = -1;
+        CountOK  += Spool.Streams[i].CountOK;
+        CountErr += Spool.Streams[i].CountErr;
+
+        ShardStopSpare (&Spool.Streams[i]);
+    }
+
+    /* Only a complete backup gets a manifest. Files of the last request file are acknowledged when the backup ends */
+    if (bEndMarker && g_Manifest)
+        ManifestAck (&Manifest, GetOSTimer());
+
+    for (i=0; i < Spool.StreamCount; i++)
+    {
+        pStream = &Spool.Streams[i];
+
+        if (-1 == pStream->WriteFD)
+            continue;
+
+        /* Every archive gets the full manifest, which also tells the repository of each database */
+        BytesManifest = 0;
+
+        if (bEndMarker && g_Manifest)
+        {
+            if (TarWriteManifest (pStream->WriteFD, &Manifest, pStream->szArchiv, &BytesManifest))
+                printf ("Backup ERROR: Cannot write manifest\n");
+            else
+                printf ("Backup OK: [%s] %zu files, %1.1f KB\n", TAR_MANIFEST_NAME, Manifest.Count, BytesManifest/1024.0);
+        }
+
+        /* External tar writes its own end blocks. They are skipped by borg, so the manifest needs new ones */
+        if ((TAR_MODE_NATIVE == g_TarMode) || BytesManifest)
+            TarWriteEnd (pStream->WriteFD);
+
+        /* The tee pipe is closed by the tee, which writes the remaining buffered data to both destinations first */
+        if (pStream->pTee)
+            CountErr += TeeStop (pStream->pTee);
+        else
+            close (pStream->WriteFD);
+
+        pStream->WriteFD = -1;
+    }
+
+    for (i=0; i < ProcessCount; i++)
+    {
+        if (-1 != Spool.Streams[i].InputFD)
+        {
+            close (Spool.Streams[i].InputFD);
+            Spool.Streams[i].InputFD = -1;
+        }
     }
 
     if (fpReq)
@@ -1695,7 +12027,8 @@ Done:
 
     sleep (1);
 
-    fpLog = fopen (g_szBorgLogFile, "w");
+    fflush (stdout);
+    fpLog = bFileList ? stdout : fopen (g_szBorgLogFile, "a");
 
     if (NULL == fpLog)
     {
@@ -1703,83 +12036,201 @@ Done:
         goto Cleanup;
     }
 
-    printf ("Created file: %s\n", g_szBorgLogFile);
+    if (false == bFileList)
+        printf ("Created file: %s\n", g_szBorgLogFile);
 
-    if (-1 != ErrorFD)
+    for (i=0; i < ProcessCount; i++)
     {
-        while (1)
+        pStream = &Spool.Streams[i];
+
+        for (pPart = pStream->pParts; pPart; pPart = pPart->pNext)
         {
-            BytesRead = read (ErrorFD, g_Buffer, sizeof (g_Buffer)-1);
-            if (BytesRead < 1)
-                break;
+            /* Translog parts already logged when reaped */
+            if (-1 == pPart->ErrorFD)
+                continue;
 
-            g_Buffer[BytesRead] = '\0';
-            fprintf (fpLog, "%s", g_Buffer);
+            fprintf (fpLog, "\n[%s]\n", pPart->szArchiv);
+            LogBorgOutput (fpLog, pPart->ErrorFD, pPart->OutputFD);
         }
+
+        if ((ProcessCount > 1) || pStream->pParts)
+            fprintf (fpLog, "\n[%s]\n", pStream->szArchiv);
+
+        LogBorgOutput (fpLog, pStream->ErrorFD, pStream->OutputFD);
     }
 
-    if (-1 != OutputFD)
+    fprintf (fpLog, "\n");
+    if (CountErr)
+        fprintf (fpLog, "Backup ERROR: BorgBackup completed with errors\n");
+    else
+        fprintf (fpLog, "Backup OK: BorgBackup completed\n");
+
+    fprintf (fpLog, "-------------------------------\n");
+    fprintf (fpLog, "Success: %4lu\n", CountOK);
+    fprintf (fpLog, "Failure: %4lu\n", CountErr);
+
+    if (bIncremental)
+        fprintf (fpLog, "Unchanged: %4lu\n", CountRef);
+
+    if (bDaosDedup)
+        fprintf (fpLog, "NLOs already archived: %4lu\n", NloIndex.Skipped);
+
+    if (bResume && Journal.Done.Count)
+        fprintf (fpLog, "Resumed: %4lu\n", Journal.Resumed);
+
+    fprintf (fpLog, "\n");
+
+Cleanup:
+
+    printf ("Cleanup\n");
+
+    if (fpLog && (stdout != fpLog))
     {
-        while (1)
+        fclose (fpLog);
+        fpLog = NULL;
+    }
+
+    for (i=0; i < ProcessCount; i++)
+    {
+        pStream = &Spool.Streams[i];
+
+        if (-1 != pStream->InputFD)
         {
-            BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer)-1);
-            if (BytesRead < 1)
-                break;
+            close (pStream->InputFD);
+            pStream->InputFD = -1;
+        }
 
-            g_Buffer[BytesRead] = '\0';
-            fprintf (fpLog, "%s", g_Buffer);
+        if (-1 != pStream->OutputFD)
+        {
+            close (pStream->OutputFD);
+            pStream->OutputFD = -1;
         }
-    }
 
-    fprintf (fpLog, "\n");
-    if (CountErr)
-        fprintf (fpLog, "Backup ERROR: BorgBackup completed with errors\n");
-    else
-        fprintf (fpLog, "Backup OK: BorgBackup completed\n");
+        if (-1 != pStream->ErrorFD)
+        {
+            close (pStream->ErrorFD);
+            pStream->ErrorFD = -1;
+        }
+
+        while (pStream->pParts)
+        {
+            pPart = pStream->pParts;
+            pStream->pParts = pPart->pNext;
+
+            /* Parts of the translog mode are closed when borg completed them */
+            if (-1 != pPart->OutputFD)
+                close (pPart->OutputFD);
+
+            if (-1 != pPart->ErrorFD)
+                close (pPart->ErrorFD);
+
+            if ((pPart->pid > 0) && pclose3 (pPart->pid))
+                bBorgFailed = true;
+            else if ((pPart->pid > 0) && bTranslog)
+                TranslogReport (&Translog, &Manifest, pPart->ManifestFirst, pPart->ManifestEnd, pPart->szArchiv, GetOSTimer());
 
-    fprintf (fpLog, "-------------------------------\n");
-    fprintf (fpLog, "Success: %4lu\n", CountOK);
-    fprintf (fpLog, "Failure: %4lu\n", CountErr);
-    fprintf (fpLog, "\n");
+            free (pPart);
+        }
 
-Cleanup:
+        if (pStream->pid > 0)
+        {
+            if (pclose3 (pStream->pid))
+                bBorgFailed = true;
+            else if (bTranslog)
+                TranslogReport (&Translog, &Manifest, pStream->PartFirst, pStream->PartFirst + pStream->PartFiles, pStream->szArchiv, GetOSTimer());
 
-    printf ("Cleanup\n");
+            pStream->pid = 0;
+        }
+    }
 
-    if (fpLog)
+    if (bTranslog)
     {
-        fclose (fpLog);
-        fpLog = NULL;
+        if (Translog.Failed || Translog.Unknown)
+            bBorgFailed = true;
+
+        printf ("Translog: archive parts committed: %ld, extents: %ld, failed: %ld, unknown: %ld, latency avg: %1.1f sec, max: %1.1f sec\n",
+                Translog.Commits, Translog.Files, Translog.Failed, Translog.Unknown, Translog.Files ? Translog.LatencySum / 1000.0 / Translog.Files : 0.0, Translog.LatencyMax / 1000.0);
     }
 
-    if (-1 != InputFD)
+    /* Later backups reference archives from the state. Only archives borg completed without errors qualify */
+    if (bIncremental)
     {
-        close (InputFD);
-        InputFD = -1;
+        if (bEndMarker && (0 == CountErr) && (false == bBorgFailed))
+        {
+            if (0 == StateSave (&State, g_szStateFile, NULL))
+                printf ("Backup OK: Incremental state saved: %zu databases, updated: %ld, unchanged: %ld\n", State.Count, State.Updated, CountRef);
+        }
+        else
+        {
+            printf ("Info: Incremental state not updated. Backup not completed successfully\n");
+        }
     }
 
-    if (-1 != OutputFD)
+    /* NLOs of a failed backup are archived again next time */
+    if (bDaosDedup)
     {
-        close (OutputFD);
-        OutputFD = -1;
+        if (bEndMarker && (0 == CountErr) && (false == bBorgFailed))
+        {
+            if (0 == NloIndexSave (&NloIndex, g_szNloIndexFile))
+                printf ("Backup OK: DAOS NLO index saved: %zu NLOs, added: %ld, skipped: %ld, lookup: %1.3f usec\n", NloIndex.Count, NloIndex.Added, NloIndex.Skipped,
+                        NloIndex.Lookups ? NloIndex.LookupNsec / 1000.0 / NloIndex.Lookups : 0.0);
+        }
+        else
+        {
+            printf ("Info: DAOS NLO index not updated. Backup not completed successfully\n");
+        }
     }
 
-    if (-1 != ErrorFD)
+    /* The journal of an incomplete backup is resumed by the next backup */
+    if (bResume)
     {
-        close (ErrorFD);
-        ErrorFD = -1;
+        if (bEndMarker && (0 == CountErr) && (false == bBorgFailed))
+        {
+            JournalFree (&Journal);
+            remove (g_szJournalFile);
+        }
+        else
+        {
+            printf ("Info: Backup not completed successfully. Journal kept to resume the next backup: %s\n", g_szJournalFile);
+        }
     }
 
-    if (pid > 0)
+    /* Sketches describe the data read, not the archive. They are also saved when borg failed */
+    if (bSketch)
     {
-        pclose3 (pid);
-        pid = 0;
+        if (Sketch.BusyMsec)
+            Sketch.Rate = Sketch.Bytes * 1000.0 / Sketch.BusyMsec;
+
+        if (Sketch.Updated && (0 == SketchStoreSave (&Sketch, g_szSketchFile)))
+            printf ("Backup OK: Sketch saved: %zu databases, updated: %ld, data read: %1.1f MB, new data: %1.1f MB (%1.0f%%)\n", Sketch.Count, Sketch.Updated,
+                    Sketch.Bytes/1024.0/1024.0, Sketch.NewBytes/1024.0/1024.0, Sketch.Bytes ? 100.0 * Sketch.NewBytes / Sketch.Bytes : 0.0);
     }
 
+    SketchStoreFree (&Sketch);
+    JournalFree (&Journal);
+    NloIndexFree (&NloIndex);
+    StateFree (&State);
+    ManifestFree (&Manifest);
+    pthread_mutex_destroy (&Spool.Mutex);
+    pthread_cond_destroy (&Spool.Cond);
+    pthread_mutex_destroy (&Tee.Mutex);
+    pthread_cond_destroy (&Tee.Cond);
+    pthread_mutex_destroy (&Prefetch.Mutex);
+    pthread_cond_destroy (&Prefetch.Cond);
+    pthread_mutex_destroy (&Sketch.Mutex);
+
+    /* Domino checks the result of the snapshot command */
+    if (bFileList && (CountErr || (false == bEndMarker)))
+        ret = 1;
+
     /* Finally remove request and PID file */
-    remove (pszReqFilename);
+    if (false == bFileList)
+        remove (pszReqFilename);
+
     remove (g_szFilePID);
 
+    SockServerStop (&Sock, (CountErr || bBorgFailed) ? "Backup completed with errors" : "Backup completed");
+
     return ret;
 }
 
@@ -1828,6 +12279,154 @@ Done:
 }
 
 
+int SockRequest (const char *pszReqFile, const char *pszCommand, const char *pszArg, long TimeoutSec, SOCK_REPLY *pReply)
+{
+    /* Sends one request to the daemon and waits for its reply. Returns -1 without a socket to use the request file instead */
+    int     ret    = 0;
+    int     FD     = -1;
+    int     Wait   = 0;
+    int     Ready  = 0;
+    size_t  Len    = 0;
+    ssize_t BytesRead = 0;
+    time_t  tDeadline = 0;
+    unsigned long Id = getpid();
+    char    *p     = NULL;
+    char    szSocketFile[MAX_PATH+1] = {0};
+    char    szLine[SOCK_LINE_SIZE+1] = {0};
+    struct sockaddr_un Addr;
+    struct pollfd Pfd = {0};
+
+    memset (pReply, 0, sizeof (SOCK_REPLY));
+
+    if (GetSocketFile (pszReqFile, szSocketFile, sizeof (szSocketFile)))
+        return -1;
+
+    memset (&Addr, 0, sizeof (Addr));
+    Addr.sun_family = AF_UNIX;
+    memcpy (Addr.sun_path, szSocketFile, strlen (szSocketFile) + 1);
+
+    FD = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (-1 == FD)
+        return -1;
+
+    if (connect (FD, (struct sockaddr *) &Addr, sizeof (Addr)))
+    {
+        ret = -1;
+        goto Done;
+    }
+
+    if (pszArg)
+        snprintf (szLine, sizeof (szLine), "%lu %s %s\n", Id, pszCommand, pszArg);
+    else
+        snprintf (szLine, sizeof (szLine), "%lu %s\n", Id, pszCommand);
+
+    if (SockSend (FD, szLine))
+    {
+        ret = 1;
+        printf ("Backup ERROR: Cannot send request to %s\n", szSocketFile);
+        goto Done;
+    }
+
+    Pfd.fd     = FD;
+    Pfd.events = POLLIN;
+    tDeadline  = GetOSTimer() + TimeoutSec * 1000;
+
+    while (NULL == (p = (char *) memchr (szLine, '\n', Len)))
+    {
+        /* A signal does not extend the timeout */
+        Wait = TimeoutSec ? (int) (tDeadline > GetOSTimer() ? tDeadline - GetOSTimer() : 0) : -1;
+        Ready = poll (&Pfd, 1, Wait);
+
+        if ((Ready < 0) && (EINTR == errno))
+            continue;
+
+        if (0 == Ready)
+        {
+            ret = 1;
+            printf ("Timeout after %lu seconds\n", TimeoutSec);
+            goto Done;
+        }
+
+        if (Ready < 0)
+        {
+            ret = 1;
+            perror ("Backup ERROR: Cannot wait for the backup process");
+            goto Done;
+        }
+
+        BytesRead = read (FD, szLine + Len, sizeof (szLine) - 1 - Len);
+
+        if ((BytesRead < 0) && (EINTR == errno))
+            continue;
+
+        if (BytesRead <= 0)
+        {
+            ret = 1;
+            printf ("Backup ERROR: Backup process closed the request socket\n");
+            goto Done;
+        }
+
+        Len += BytesRead;
+    }
+
+    /* Frame: <id> OK|ERROR <bytes> <msec> <text> */
+    *p = '\0';
+
+    if (Id != strtoul (szLine, &p, 10))
+    {
+        ret = 1;
+        printf ("Backup ERROR: Invalid reply: %s\n", szLine);
+        goto Done;
+    }
+
+    p++;
+    pReply->bOK = (0 == strncmp (p, "OK ", 3));
+    p = strchr (p, ' ');
+
+    if (p)
+    {
+        pReply->Bytes = strtoull (p, &p, 10);
+        pReply->Msec  = strtoll (p, &p, 10);
+    }
+
+    snprintf (pReply->szText, sizeof (pReply->szText), "%s", (p && *p) ? p+1 : "");
+
+Done:
+
+    close (FD);
+
+    return ret;
+}
+
+
+int BackupStatus (const char *pszReqFile)
+{
+    int ret = 0;
+    SOCK_REPLY Reply;
+
+    if (0 == CheckProcessRunning())
+    {
+        printf ("Info: No backup process running\n");
+        return 1;
+    }
+
+    ret = SockRequest (pszReqFile, "STATUS", NULL, 10, &Reply);
+
+    if (ret < 0)
+    {
+        printf ("Info: Backup process does not listen on a request socket\n");
+        return 1;
+    }
+
+    if (ret)
+        return ret;
+
+    printf ("Backup status: %s\n", Reply.szText);
+    return 0;
+}
+
+
 int BackupFileToBorg (const char *pszFilename, const char *pszReqFile, long TimeoutSec)
 {
     int ret = 0;
@@ -1838,6 +12437,8 @@ int BackupFileToBorg (const char *pszFilename, const char *pszReqFile, long Time
     time_t tEnd    = {0};
     double sec     = 0.0;
     double mb      = 0.0;
+    char   szTmpFile[MAX_PATH+1] = {0};
+    SOCK_REPLY Reply;
 
     if (IsNullStr (pszFilename))
     {
@@ -1878,12 +12479,40 @@ int BackupFileToBorg (const char *pszFilename, const char *pszReqFile, long Time
         goto Done;
     }
 
-    fpReq = fopen (pszReqFile, "w");
+    /* The socket returns the result right when the daemon is done. Without the socket the request file is used */
+    ret = SockRequest (pszReqFile, bQuit ? "QUIT" : "BACKUP", bQuit ? NULL : pszFilename, TimeoutSec, &Reply);
+
+    if (ret > 0)
+    {
+        printf ("Backup ERROR: %s\n", pszFilename);
+        goto Done;
+    }
+
+    if ((0 == ret) && (false == Reply.bOK))
+    {
+        ret = 1;
+        printf ("Backup ERROR: %s: %s\n", pszFilename, Reply.szText);
+        goto Done;
+    }
+
+    if (0 == ret)
+    {
+        tEnd = Reply.Msec;
+        goto Completed;
+    }
+
+    ret = 0;
+
+    /* Written under a temporary name and renamed, so the daemon never sees an empty request file and acknowledges it */
+    snprintf (szTmpFile, sizeof (szTmpFile), "%s.tmp", pszReqFile);
+
+    fpReq = fopen (szTmpFile, "w");
 
     if (NULL == fpReq)
     {
         ret = 1;
         printf ("Backup ERROR: Cannot create request file: %s\n", pszReqFile);
+        goto Done;
     }
 
     fprintf (fpReq, "%s", pszFilename);
@@ -1891,6 +12520,14 @@ int BackupFileToBorg (const char *pszFilename, const char *pszReqFile, long Time
     fclose (fpReq);
     fpReq = NULL;
 
+    if (rename (szTmpFile, pszReqFile))
+    {
+        ret = 1;
+        perror ("Backup ERROR: Cannot create request file");
+        remove (szTmpFile);
+        goto Done;
+    }
+
     tStart = GetOSTimer();
 
     ret = WaitForFileDelete (pszReqFile, TimeoutSec);
@@ -1903,6 +12540,8 @@ int BackupFileToBorg (const char *pszFilename, const char *pszReqFile, long Time
 
     tEnd = GetOSTimer();
 
+Completed:
+
     if (bQuit)
     {
         DumpLogFile (g_szBorgLogFile, true);
@@ -1913,29 +12552,156 @@ int BackupFileToBorg (const char *pszFilename, const char *pszReqFile, long Time
     sec = (tEnd-tStart)/1000.0;
     mb  = sb.st_size/1024.0/1024.0;
 
-    if (sec)
-        printf ("Backup OK: %s, %1.1f MB (%1.1f MB/sec)\n", pszFilename, mb, mb/sec);
-    else
-        printf ("Backup OK: %s, %1.1f MB\n", pszFilename, mb);
+    if (sec)
+        printf ("Backup OK: %s, %1.1f MB (%1.1f MB/sec)\n", pszFilename, mb, mb/sec);
+    else
+        printf ("Backup OK: %s, %1.1f MB\n", pszFilename, mb);
+
+Done:
+
+    if (fpReq)
+    {
+        fclose (fpReq);
+        fpReq = NULL;
+    }
+
+    return ret;
+}
+
+
+int TranslogDaemonStart (const char *pszReqFile, const char *pszArchiv, long TimeoutSec)
+{
+    /* The translog command of Domino starts the translog daemon for its archive.
+       A daemon still running for the archive of an earlier backup run is ended first */
+    int    i      = 0;
+    int    Status = 0;
+    size_t Len    = strlen (pszArchiv);
+    pid_t  pid    = 0;
+    const char *pszRunning = NULL;
+    SOCK_REPLY Reply;
+
+    if (CheckProcessRunning())
+    {
+        /* Without a status the running daemon is used */
+        if (SockRequest (pszReqFile, "STATUS", NULL, 10, &Reply) || (false == Reply.bOK))
+            return 0;
+
+        pszRunning = strstr (Reply.szText, "archive: ");
+
+        if ((NULL == pszRunning) || ((0 == strncmp (pszRunning+9, pszArchiv, Len)) && (',' == pszRunning[9+Len])))
+            return 0;
+
+        printf ("Info: Ending translog daemon of an earlier backup run\n");
+
+        if (BackupFileToBorg (g_szBackupEndMarker, pszReqFile, TimeoutSec))
+            return 1;
+
+        for (i=0; (i < 100) && CheckProcessRunning(); i++)
+            usleep (100*1000);
+    }
+
+    fflush (stdout);
+    pid = fork();
+
+    if (-1 == pid)
+    {
+        perror ("Backup ERROR: Cannot start translog daemon");
+        return 1;
+    }
+
+    /* The child returns from daemon() only in the daemon. It ends when the daemon detached */
+    if (0 == pid)
+        _exit (BorgBackupStart (pszReqFile, pszArchiv, false, true));
+
+    if ((pid != waitpid (pid, &Status, 0)) || !WIFEXITED (Status) || WEXITSTATUS (Status))
+    {
+        printf ("Backup ERROR: Cannot start translog daemon: %s\n", pszArchiv);
+        return 1;
+    }
+
+    /* The daemon writes its PID file after it detached */
+    for (i=0; (i < 100) && (0 == CheckProcessRunning()); i++)
+        usleep (100*1000);
+
+    return 0;
+}
+
+
+int BorgBackupInitRepo (const char *pszRepository)
+{
+    int ret = 0;
+    const char *args[] = { g_szBorgBackupBinary, "init", "--encryption", g_szBorgEncryptionMode, pszRepository, NULL };
+
+    if (IsNullStr (pszRepository))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    ret = InvokeBorgCommand (args);
+
+Done:
+
+    if (ret)
+    {
+        printf ("ERROR initializing repo\n");
+    }
+
+    return ret;
+}
+
+
+
+int BorgBackupList (const char *pszArchiv)
+{
+    int ret = 0;
+
+    const char *args[] = { g_szBorgBackupBinary, "list", pszArchiv, NULL };
+
+    if (IsNullStr (pszArchiv))
+    {
+        ret = 1;
+        goto Done;
+    }
+
+    ret = InvokeBorgCommand (args);
+
+Done:
+
+    if (ret)
+    {
+        printf ("ERROR listing archive\n");
+    }
+
+    return ret;
+}
+
+
+int BorgBackupInfo (const char *pszArchiv)
+{
+    int ret = 0;
+
+    const char *args[] = { g_szBorgBackupBinary, "info", pszArchiv, NULL };
 
-Done:
+    ret = InvokeBorgCommand (args);
 
-    if (fpReq)
+    if (ret)
     {
-        fclose (fpReq);
-        fpReq = NULL;
+        printf ("ERROR borg info\n");
     }
 
     return ret;
 }
 
 
-int BorgBackupInitRepo (const char *pszRepository)
+int BorgBackupManifest (const char *pszArchiv)
 {
+    /* Print the manifest written at the end of the backup instead of listing all archive items */
     int ret = 0;
-    const char *args[] = { g_szBorgBackupBinary, "init", "--encryption", g_szBorgEncryptionMode, pszRepository, NULL };
 
-    if (IsNullStr (pszRepository))
+    const char *args[] = { g_szBorgBackupBinary, "extract", "--stdout", pszArchiv, TAR_MANIFEST_NAME, NULL };
+
+    if (IsNullStr (pszArchiv))
     {
         ret = 1;
         goto Done;
@@ -1947,53 +12713,212 @@ Done:
 
     if (ret)
     {
-        printf ("ERROR initializing repo\n");
+        printf ("ERROR reading manifest\n");
     }
 
     return ret;
 }
 
 
+char *BorgReadArchiveFile (const char *pszArchiv, const char *pszFileName)
+{
+    /* Returns a small file from an archive */
+    const char *args[] = { g_szBorgBackupBinary, "extract", "--stdout", pszArchiv, pszFileName, NULL };
+
+    return BorgReadOutput (args);
+}
+
 
-int BorgBackupList (const char *pszArchiv)
+int BorgFindLastPart (const char *pszArchiv, char *retpszArchiv, size_t ArchivSize)
 {
-    int ret = 0;
+    /* Only the last part of an archive split into parts has the manifest. Listing the archive names does not read any archive */
+    char   *pszList = NULL;
+    char   *pLine   = NULL;
+    char   *pNext   = NULL;
+    char   *pLast   = NULL;
+    char   *p       = NULL;
+    const char *pszName = strstr (pszArchiv, "::");
+    char   szRepo[MAX_PATH+1]    = {0};
+    char   szPattern[MAX_PATH+1] = {0};
 
-    const char *args[] = { g_szBorgBackupBinary, "list", pszArchiv, NULL };
+    const char *args[] = { g_szBorgBackupBinary, "list", "--short", "--glob-archives", szPattern, szRepo, NULL };
 
-    if (IsNullStr (pszArchiv))
+    snprintf (retpszArchiv, ArchivSize, "%s", pszArchiv);
+
+    /* Without a repository borg uses BORG_REPO */
+    if (pszName)
+        snprintf (szRepo, sizeof (szRepo), "%.*s", (int) (pszName-pszArchiv), pszArchiv);
+
+    if ('\0' == *szRepo)
+        args[5] = NULL;
+
+    snprintf (szPattern, sizeof (szPattern), "%s.part-*", pszName ? pszName+2 : pszArchiv);
+
+    pszList = BorgReadOutput (args);
+
+    for (pLine = pszList; pLine && *pLine; pLine = pNext)
     {
-        ret = 1;
-        goto Done;
-    }
+        pNext = strchr (pLine, '\n');
 
-    ret = InvokeBorgCommand (args);
+        if (pNext)
+            *pNext++ = '\0';
 
-Done:
+        p = pLine + strlen (pLine);
 
-    if (ret)
+        while ((p > pLine) && ((' ' == p[-1]) || ('\r' == p[-1])))
+            *--p = '\0';
+
+        /* Part numbers have at least four digits. A longer number is a higher part */
+        if (strstr (pLine, ".part-") && ((NULL == pLast) || (strlen (pLine) > strlen (pLast)) || ((strlen (pLine) == strlen (pLast)) && (strcmp (pLine, pLast) > 0))))
+            pLast = pLine;
+    }
+
+    if (pLast)
     {
-        printf ("ERROR listing archive\n");
+        snprintf (retpszArchiv, ArchivSize, "%s::%s", szRepo, pLast);
+        printf ("Restore manifest from last archive part: %s\n", retpszArchiv);
     }
 
-    return ret;
+    free (pszList);
+
+    return 0;
 }
 
 
-int BorgBackupInfo (const char *pszArchiv)
+int BorgFindRestoreArchiv (const char *pszArchiv, const char *pszFileName, char *retpszArchiv, size_t ArchivSize)
 {
-    int ret = 0;
+    /* The manifest tells which repository holds the database with parallel repositories and which archive holds an unchanged database.
+       Without a manifest entry the path hash routing is used */
+    int    Index = 0;
+    int    StreamCount = GetBorgStreamCount();
+    bool   bRefColumn = false;
+    char   *pszManifest = NULL;
+    char   *pLine = NULL;
+    char   *pNext = NULL;
+    char   *pName = NULL;
+    char   *pRef  = NULL;
+    char   *pRepo = NULL;
+    const char *pszName = strstr (pszArchiv, "::");
+    char   szRepo[MAX_PATH+1] = {0};
+    char   szManifestArchiv[MAX_PATH+1] = {0};
+    const NLO_ARCHIV *pNloArchiv = NULL;
+
+    NLO_INDEX NloIndex;
+
+    snprintf (retpszArchiv, ArchivSize, "%s", pszArchiv);
+
+    /* References in the manifest are followed whatever the current configuration. The backup may have used other settings */
+    if (g_ShardMaxSize || g_ShardMaxFiles)
+        BorgFindLastPart (pszArchiv, szManifestArchiv, sizeof (szManifestArchiv));
+    else
+        snprintf (szManifestArchiv, sizeof (szManifestArchiv), "%s", pszArchiv);
 
-    const char *args[] = { g_szBorgBackupBinary, "info", pszArchiv, NULL };
+    pszManifest = BorgReadArchiveFile (szManifestArchiv, TAR_MANIFEST_NAME);
 
-    ret = InvokeBorgCommand (args);
+    /* An archive split into parts without archive parts configured now */
+    if ((NULL == pszManifest) && (0 == g_ShardMaxSize) && (0 == g_ShardMaxFiles))
+    {
+        BorgFindLastPart (pszArchiv, szManifestArchiv, sizeof (szManifestArchiv));
 
-    if (ret)
+        if (strcmp (szManifestArchiv, pszArchiv))
+            pszManifest = BorgReadArchiveFile (szManifestArchiv, TAR_MANIFEST_NAME);
+    }
+
+    for (pLine = pszManifest; pLine && *pLine; pLine = pNext)
     {
-        printf ("ERROR borg info\n");
+        pNext = strchr (pLine, '\n');
+
+        if (pNext)
+            *pNext++ = '\0';
+
+        /* Manifests written before incremental backups have no ref column */
+        if ('#' == *pLine)
+        {
+            if (strstr (pLine, "\tref\tname"))
+                bRefColumn = true;
+
+            continue;
+        }
+
+        /* Repository, reference and name are the last columns */
+        pName = strrchr (pLine, '\t');
+
+        if (NULL == pName)
+            continue;
+
+        *pName++ = '\0';
+
+        if (strcmp (pName, pszFileName))
+            continue;
+
+        pRef = NULL;
+
+        if (bRefColumn && (pRef = strrchr (pLine, '\t')))
+            *pRef++ = '\0';
+
+        pRepo = strrchr (pLine, '\t');
+
+        if (pRepo)
+            pRepo++;
+
+        /* The repository of the backup is used even if parallel repositories are not configured anymore */
+        if (pRepo && (0 == strcmp (pRepo, "-")))
+            pRepo = NULL;
+
+        if (pRepo && pszName && (strlen (pRepo) == (size_t) (pszName - pszArchiv)) && (0 == strncmp (pRepo, pszArchiv, pszName - pszArchiv)))
+            pRepo = NULL;
+
+        if (pRef && (0 == strcmp (pRef, "-")))
+            pRef = NULL;
+
+        if (pRepo || pRef)
+        {
+            snprintf (retpszArchiv, ArchivSize, "%.*s::%s",
+                      pRepo ? (int) strlen (pRepo) : (pszName ? (int) (pszName - pszArchiv) : 0),
+                      pRepo ? pRepo : pszArchiv,
+                      pRef ? pRef : (pszName ? pszName+2 : pszArchiv));
+        }
+
+        printf ("Restore archive from manifest: %s\n", retpszArchiv);
+        free (pszManifest);
+        return 0;
     }
 
-    return ret;
+    free (pszManifest);
+
+    /* Archived NLOs are only in the archive which got them first */
+    if (g_DaosDedup && IsNloFile (pszFileName))
+    {
+        memset (&NloIndex, 0, sizeof (NloIndex));
+        NloIndexLoad (&NloIndex, g_szNloIndexFile, 0);
+        pNloArchiv = NloIndexLookup (&NloIndex, pszFileName);
+
+        if (pNloArchiv)
+        {
+            snprintf (retpszArchiv, ArchivSize, "%s", pNloArchiv->pszArchiv);
+            printf ("Restore archive from NLO index: %s\n", retpszArchiv);
+        }
+
+        NloIndexFree (&NloIndex);
+
+        if (pNloArchiv)
+            return 0;
+    }
+
+    if (StreamCount < 2)
+        return 0;
+
+    if (ROUTING_SIZE == g_Routing)
+        printf ("Restore Warning: Database not found in manifest, trying the repository of the path hash\n");
+
+    Index = RouteByHash (pszFileName, StreamCount);
+
+    if (GetBorgStreamArchiv (Index, pszArchiv, szRepo, sizeof (szRepo), retpszArchiv, ArchivSize))
+        return 1;
+
+    printf ("Restore archive from path hash: %s\n", retpszArchiv);
+
+    return 0;
 }
 
 
@@ -2001,10 +12926,9 @@ int BorgBackupRestore (const char *pszArchiv, const char *pszSource, const char
 {
     int ret = 0;
     pid_t pid      =  0;
-    FILE *fpOutput = NULL;
+    bool bOutputOpen = false;
 
     ssize_t BytesRead  = 0;
-    ssize_t BytesWrite = 0;
     size_t  BytesTotal = 0;
 
     time_t tStart   = {0};
@@ -2015,7 +12939,12 @@ int BorgBackupRestore (const char *pszArchiv, const char *pszSource, const char
     int    OutputFD = -1;
     int    ErrorFD  = -1;
 
-    const char *args[] = { g_szBorgBackupBinary, "extract", "--stdout", pszArchiv, pszSource , NULL };
+    char   szArchiv[MAX_PATH+1] = {0};
+
+    RING_STATS RingStats = {0};
+    IO_FILE    Output;
+
+    const char *args[] = { g_szBorgBackupBinary, "extract", "--stdout", szArchiv, pszSource , NULL };
 
     if (IsNullStr (pszArchiv))
     {
@@ -2041,23 +12970,31 @@ int BorgBackupRestore (const char *pszArchiv, const char *pszSource, const char
         return 1;
     }
 
-    ret = CreateFileDir (pszTarget, 0);
+    /* With parallel repositories each database is only in one of the archives. Unchanged databases are in an earlier archive */
+    if (BorgFindRestoreArchiv (pszArchiv, pszSource, szArchiv, sizeof (szArchiv)))
+    {
+        printf ("Restore ERROR: Cannot find repository for database [%s]\n", pszSource);
+        return 1;
+    }
 
-    fpOutput = fopen (pszTarget, "wb");
+    ret = CreateFileDir (pszTarget, 0);
 
-    if (NULL == fpOutput)
+    if (IoOpen (&Output, pszTarget, g_IoEngine, true))
     {
         perror ("Restore ERROR: Cannot create target file");
+        IoClose (&Output);
         ret = 1;
         goto Done;
     }
 
+    bOutputOpen = true;
+
+    /* Zero blocks from borg are written as holes */
+    Output.bSparse = (0 != g_Sparse);
+
     tStart = GetOSTimer();
 
-    PushToSSHAgent();
-    SetEnvironmentVars();
-    pid = popen3 (&InputFD, &OutputFD, &ErrorFD, 0, args);
-    UnsetEnvironmentVars();
+    pid = BorgPopen3 (&InputFD, &OutputFD, &ErrorFD, 0, args);
 
     if (pid < 1)
     {
@@ -2066,21 +13003,27 @@ int BorgBackupRestore (const char *pszArchiv, const char *pszSource, const char
         goto Done;
     }
 
-    while ((BytesRead = read (OutputFD, g_Buffer, sizeof (g_Buffer))))
+    /* Reader thread reads from borg while this thread writes the target file */
+    ret = RingPipeline (RingReadPipe, &OutputFD, RingWriteIo, &Output, &RingStats);
+
+    /* Flushes the last aligned block for O_DIRECT */
+    if (IoClose (&Output))
     {
-        BytesWrite = fwrite (g_Buffer, 1, BytesRead, fpOutput);
+        perror ("Restore ERROR: Cannot write target file");
+        ret = 1;
+    }
 
-        if (BytesRead != BytesWrite)
-        {
-            printf ("Restore ERROR: Cannot write buffer, Read: %lu, Written: %lu\n", BytesRead, BytesWrite);
-            ret = 1;
-            goto Done;
-        }
+    bOutputOpen = false;
 
-        BytesTotal += BytesWrite;
+    BytesTotal = RingStats.BytesWritten;
+
+    if (ret)
+    {
+        printf ("Restore ERROR: Cannot write restored data\n");
+        goto Done;
     }
 
-    if (0 == BytesWrite)
+    if (0 == BytesTotal)
     {
         ret = 1;
         goto Done;
@@ -2091,10 +13034,16 @@ int BorgBackupRestore (const char *pszArchiv, const char *pszSource, const char
     sec = (tEnd-tStart)/1000.0;
     mb  = BytesTotal/1024.0/1024.0;
 
+    printf ("Restore OK: %s -> %s, %1.1f MB", pszSource, pszTarget, mb);
+
     if (sec)
-        printf ("Restore OK: %s -> %s, %1.1f MB (%1.1f MB/sec)\n", pszSource, pszTarget, mb, mb/sec);
-    else
-        printf ("Restore OK: %s -> %s, %1.1f MB\n", pszSource, pszTarget, mb);
+        printf (" (%1.1f MB/sec)", mb/sec);
+
+    if (Output.BytesHoles)
+        printf (", holes: %1.1f MB", Output.BytesHoles/1024.0/1024.0);
+
+    PrintRingStats (&RingStats);
+    printf ("\n");
 
 Done:
 
@@ -2130,10 +13079,10 @@ Done:
         pid = 0;
     }
 
-    if (fpOutput)
+    if (bOutputOpen)
     {
-        fclose (fpOutput);
-        fpOutput = NULL;
+        IoClose (&Output);
+        bOutputOpen = false;
     }
 
     if (ret)
@@ -2163,46 +13112,275 @@ int LogGetPassword (const pid_t pid, const char *pszExe, const char *pszStatus)
 
     fprintf (fp, "%s,%d,%s\n", (NULL == pszStatus) ? "Unknown Status" : pszStatus, pid, (NULL == pszExe) ? "Unknown" : pszExe);
 
-Done:
+Done:
+
+    if (fp)
+    {
+        fclose (fp);
+        fp = NULL;
+    }
+
+    return ret;
+}
+
+
+int GetPassword()
+{
+    pid_t   ppid = getppid();
+    ssize_t ret_size = 0;
+
+    char szExe[2048]     = {0};
+    char szProcess[2048] = {0};
+
+    snprintf (szProcess, sizeof (szProcess), "/proc/%d/exe", ppid);
+
+    ret_size = readlink (szProcess, szExe, sizeof (szExe));
+    if (ret_size <= 0)
+        goto Done;
+
+    if (strcmp (szExe, g_szBorgBackupBinary))
+    {
+        LogGetPassword (ppid, szExe, "Unauthorized");
+        goto Done;
+    }
+
+    if (g_Verbose)
+        LogGetPassword (ppid, szExe, "OK");
+
+    printf ("%s\n", g_szPassphrase);
+
+Done:
+
+    return 0;
+}
+
+
+int IoPrioParse (const char *pszValue, CHILD_PROFILE *pProfile)
+{
+    /* idle, be[:0-7], rt[:0-7] or none. Lower levels have higher priority */
+    int    Level = 4;
+    size_t Len   = 0;
+    const char *p = strchr (pszValue, ':');
+
+    if (p)
+    {
+        if (!isdigit (p[1]) || p[2])
+            return 1;
+
+        Level = atoi (p+1);
+
+        if (Level > 7)
+            return 1;
+    }
+
+    /* The class name ends at the level */
+    Len = p ? (size_t) (p - pszValue) : strlen (pszValue);
+
+    if ((4 == Len) && (0 == strncmp (pszValue, "idle", 4)))
+    {
+        pProfile->IoClass = IOPRIO_CLASS_IDLE;
+        Level = 0;
+    }
+    else if ((2 == Len) && (0 == strncmp (pszValue, "be", 2)))
+        pProfile->IoClass = IOPRIO_CLASS_BE;
+    else if ((2 == Len) && (0 == strncmp (pszValue, "rt", 2)))
+        pProfile->IoClass = IOPRIO_CLASS_RT;
+    else if ((4 == Len) && (0 == strncmp (pszValue, "none", 4)))
+        pProfile->IoClass = 0;
+    else
+        return 1;
+
+    pProfile->IoLevel = Level;
+    return 0;
+}
+
+
+int CpuListParse (const char *pszList, cpu_set_t *retpCpus)
+{
+    /* CPU list like 0-3,6 */
+    long First = 0;
+    long Last  = 0;
+    char *pEnd = NULL;
+    const char *p = pszList;
+
+    CPU_ZERO (retpCpus);
+
+    while (*p)
+    {
+        First = strtol (p, &pEnd, 10);
+
+        if ((pEnd == p) || (First < 0))
+            return 1;
+
+        Last = First;
+        p = pEnd;
+
+        if ('-' == *p)
+        {
+            p++;
+            Last = strtol (p, &pEnd, 10);
+
+            if ((pEnd == p) || (Last < First))
+                return 1;
+
+            p = pEnd;
+        }
+
+        if (Last >= CPU_SETSIZE)
+            return 1;
+
+        for (; First <= Last; First++)
+            CPU_SET (First, retpCpus);
+
+        if (',' == *p)
+            p++;
+        else if (*p)
+            return 1;
+    }
+
+    return CPU_COUNT (retpCpus) ? 0 : 1;
+}
+
+
+int GetProfileParam (const char *pszPrefix, const char *pszName, const char *pszValue, CHILD_PROFILE *pProfile, int *pErrors)
+{
+    /* <prefix>IOPRIO, NICE, CPUS, CPU_MAX and IO_MAX of a child process profile */
+    size_t len = strlen (pszPrefix);
+
+    if (IsNullStr (pszName) || (NULL == pszValue))
+        return 0;
+
+    if (strncmp (pszName, pszPrefix, len))
+        return 0;
+
+    pszName += len;
+
+    if (0 == strcmp (pszName, "IOPRIO"))
+    {
+        if (IoPrioParse (pszValue, pProfile))
+        {
+            fprintf (stdout, "Warning - Invalid %sIOPRIO: [%s]\n", pszPrefix, pszValue);
+            (*pErrors)++;
+        }
+    }
+    else if (0 == strcmp (pszName, "NICE"))
+    {
+        pProfile->Nice  = atoi (pszValue);
+        pProfile->bNice = true;
+    }
+    else if (0 == strcmp (pszName, "CPUS"))
+    {
+        strdncpy (pProfile->szCpus, pszValue, sizeof (pProfile->szCpus));
+        pProfile->bCpus = (0 == CpuListParse (pszValue, &pProfile->Cpus));
+
+        if (false == pProfile->bCpus)
+        {
+            fprintf (stdout, "Warning - Invalid %sCPUS: [%s]\n", pszPrefix, pszValue);
+            (*pErrors)++;
+        }
+    }
+    else if (0 == strcmp (pszName, "CPU_MAX"))
+    {
+        strdncpy (pProfile->szCpuMax, pszValue, sizeof (pProfile->szCpuMax));
+    }
+    else if (0 == strcmp (pszName, "IO_MAX"))
+    {
+        strdncpy (pProfile->szIoMax, pszValue, sizeof (pProfile->szIoMax));
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int CgroupWriteFile (const char *pszDir, const char *pszFile, const char *pszValue)
+{
+    int    ret = 0;
+    int    fd  = -1;
+    size_t len = strlen (pszValue);
+
+    char szFile[MAX_PATH+100] = {0};
+
+    snprintf (szFile, sizeof (szFile), "%s/%s", pszDir, pszFile);
+
+    fd = open (szFile, O_WRONLY | O_CLOEXEC);
+
+    if (-1 == fd)
+        return 1;
 
-    if (fp)
-    {
-        fclose (fp);
-        fp = NULL;
-    }
+    if ((ssize_t) len != write (fd, pszValue, len))
+        ret = 1;
 
+    close (fd);
     return ret;
 }
 
 
-int GetPassword()
+int ChildProfileSetup (CHILD_PROFILE *pProfile, const char *pszName)
 {
-    pid_t   ppid = getppid();
-    ssize_t ret_size = 0;
-
-    char szExe[2048]     = {0};
-    char szProcess[2048] = {0};
+    /* Creates the cgroup <CGROUP_DIR>/<name> with the CPU and I/O limits of the profile.
+       CGROUP_DIR has to be delegated to the user running nshborg, e.g. with systemd Delegate=yes */
+    int ret = 0;
 
-    snprintf (szProcess, sizeof (szProcess), "/proc/%d/exe", ppid);
+    char szDir[MAX_PATH+20] = {0};
 
-    ret_size = readlink (szProcess, szExe, sizeof (szExe));
-    if (ret_size <= 0)
-        goto Done;
+    *pProfile->szCgroupProcs = '\0';
 
-    if (strcmp (szExe, g_szBorgBackupBinary))
+    if (*g_szCgroupDir)
     {
-        LogGetPassword (ppid, szExe, "Unauthorized");
-        goto Done;
-    }
+        snprintf (szDir, sizeof (szDir), "%s/%s", g_szCgroupDir, pszName);
 
-    if (g_Verbose)
-        LogGetPassword (ppid, szExe, "OK");
+        if (mkdir (g_szCgroupDir, 0755) && (EEXIST != errno))
+        {
+            printf ("Info: Cannot create cgroup: %s (%s)\n", g_szCgroupDir, strerror (errno));
+            ret = 1;
+            goto Done;
+        }
 
-    printf ("%s\n", g_szPassphrase);
+        /* Limits in the sub-tree need the controllers enabled in the parent */
+        if (*pProfile->szCpuMax && CgroupWriteFile (g_szCgroupDir, "cgroup.subtree_control", "+cpu"))
+            printf ("Info: Cannot enable the cpu controller in: %s\n", g_szCgroupDir);
+
+        if (*pProfile->szIoMax && CgroupWriteFile (g_szCgroupDir, "cgroup.subtree_control", "+io"))
+            printf ("Info: Cannot enable the io controller in: %s\n", g_szCgroupDir);
+
+        if (mkdir (szDir, 0755) && (EEXIST != errno))
+        {
+            printf ("Info: Cannot create cgroup: %s (%s)\n", szDir, strerror (errno));
+            ret = 1;
+            goto Done;
+        }
+
+        /* Written every time, so changed limits apply to the next run */
+        if (*pProfile->szCpuMax && CgroupWriteFile (szDir, "cpu.max", pProfile->szCpuMax))
+        {
+            printf ("Info: Cannot set cpu.max of %s: %s\n", szDir, pProfile->szCpuMax);
+            ret = 1;
+        }
+
+        if (*pProfile->szIoMax && CgroupWriteFile (szDir, "io.max", pProfile->szIoMax))
+        {
+            printf ("Info: Cannot set io.max of %s: %s\n", szDir, pProfile->szIoMax);
+            ret = 1;
+        }
+
+        snprintf (pProfile->szCgroupProcs, sizeof (pProfile->szCgroupProcs), "%s/cgroup.procs", szDir);
+    }
 
 Done:
 
-    return 0;
+    if (pProfile->IoClass || pProfile->bNice || pProfile->bCpus || *pProfile->szCgroupProcs)
+    {
+        printf ("Info: Process profile %s: ioprio: %s:%d, nice: %s%d, cpus: %s, cgroup: %s\n", pszName,
+                (IOPRIO_CLASS_IDLE == pProfile->IoClass) ? "idle" : (IOPRIO_CLASS_BE == pProfile->IoClass) ? "be" : (IOPRIO_CLASS_RT == pProfile->IoClass) ? "rt" : "none",
+                pProfile->IoLevel, pProfile->bNice ? "" : "unchanged ", pProfile->Nice,
+                pProfile->bCpus ? pProfile->szCpus : "all", *pProfile->szCgroupProcs ? szDir : "none");
+    }
+
+    return ret;
 }
 
 
@@ -2236,6 +13414,7 @@ int ReadConfig (const char *pszConfigFile)
     char *pszValue = NULL;
     char szBuffer[4096] = {0};
     char szNum[20] = {0};
+    CHUNKER Chunker;
 
     if (IsNullStr (pszConfigFile))
     {
@@ -2323,6 +13502,257 @@ int ReadConfig (const char *pszConfigFile)
         {
             g_BorgPassthruAllowed = atoi (szNum);
         }
+        else if ( GetParam ("SPLICE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_Splice = atoi (szNum);
+        }
+        else if ( GetParam ("PIPE_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_PipeSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("RING_SLOTS", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_RingSlots = atoi (szNum);
+        }
+        else if ( GetParam ("RING_SLOT_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_RingSlotSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("IO_ENGINE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            if (GetIoEngine (szNum) < 0)
+            {
+                fprintf (stdout, "Warning - Invalid IO_ENGINE: [%s]\n", szNum);
+                ret++;
+            }
+            else
+            {
+                g_IoEngine = GetIoEngine (szNum);
+            }
+        }
+        else if ( GetParam ("IO_URING_DEPTH", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_IoUringDepth = atoi (szNum);
+
+            if (g_IoUringDepth < 1)
+                g_IoUringDepth = 1;
+
+            if (g_IoUringDepth > IO_URING_MAX_DEPTH)
+                g_IoUringDepth = IO_URING_MAX_DEPTH;
+        }
+        else if ( GetParam ("CACHE_DROP", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_CacheDrop = atoi (szNum);
+        }
+        else if ( GetParam ("READAHEAD_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ReadAheadSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("PREFETCH_FILES", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_PrefetchFiles = atoi (szNum);
+
+            if (g_PrefetchFiles < 0)
+            {
+                fprintf (stdout, "Warning - Invalid PREFETCH_FILES: [%s]\n", szNum);
+                g_PrefetchFiles = 0;
+                ret++;
+            }
+
+            if (g_PrefetchFiles > PREFETCH_MAX_FILES)
+                g_PrefetchFiles = PREFETCH_MAX_FILES;
+        }
+        else if ( GetParam ("PREFETCH_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_PrefetchSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("PREFETCH_MAX_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_PrefetchMaxSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("RATE_LIMIT", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_RateLimit = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("RATE_LIMIT_SCHEDULE", szBuffer, pszValue, sizeof (g_szRateLimitSchedule), g_szRateLimitSchedule));
+        else if ( GetParam ("THROTTLE_LATENCY", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ThrottleLatency = atol (szNum);
+        }
+        else if ( GetParam ("THROTTLE_PRESSURE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ThrottlePressure = atol (szNum);
+        }
+        else if ( GetParam ("THROTTLE_DIR", szBuffer, pszValue, sizeof (g_szThrottleDir), g_szThrottleDir));
+        else if ( GetParam ("THROTTLE_PRESSURE_FILE", szBuffer, pszValue, sizeof (g_szThrottlePressureFile), g_szThrottlePressureFile));
+        else if ( GetParam ("THROTTLE_MIN_RATE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ThrottleMinRate = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("THROTTLE_STEP", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ThrottleStep = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("BORG_COMPRESSION", szBuffer, pszValue, sizeof (g_szBorgCompression), g_szBorgCompression))
+        {
+            if (false == CompressionSpecValid (g_szBorgCompression))
+            {
+                fprintf (stdout, "Warning - Invalid BORG_COMPRESSION: [%s]\n", g_szBorgCompression);
+                *g_szBorgCompression = '\0';
+                ret++;
+            }
+        }
+        else if ( GetParam ("CHUNKER_PARAMS", szBuffer, pszValue, sizeof (g_szChunkerParams), g_szChunkerParams))
+        {
+            if (ChunkerParse (g_szChunkerParams, &Chunker))
+            {
+                fprintf (stdout, "Warning - Invalid CHUNKER_PARAMS: [%s]\n", g_szChunkerParams);
+                *g_szChunkerParams = '\0';
+                ret++;
+            }
+        }
+        else if ( GetParam ("SKETCH", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_Sketch = atoi (szNum);
+        }
+        else if ( GetParam ("SKETCH_SAMPLES", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_SketchSamples = atoi (szNum);
+
+            if ((g_SketchSamples < 16) || (g_SketchSamples > SKETCH_MAX_SAMPLES))
+            {
+                fprintf (stdout, "Warning - Invalid SKETCH_SAMPLES: [%s]\n", szNum);
+                g_SketchSamples = 256;
+                ret++;
+            }
+        }
+        else if ( GetParam ("CHUNKER_PROBE_CANDIDATES", szBuffer, pszValue, sizeof (g_szChunkerProbeCandidates), g_szChunkerProbeCandidates));
+        else if ( GetParam ("COMPRESSION_PROBE_DIR", szBuffer, pszValue, sizeof (g_szProbeDir), g_szProbeDir));
+        else if ( GetParam ("COMPRESSION_PROBE_BIN_DIR", szBuffer, pszValue, sizeof (g_szProbeBinDir), g_szProbeBinDir));
+        else if ( GetParam ("COMPRESSION_PROBE_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ProbeSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("COMPRESSION_PROBE_MIN_RATE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ProbeMinRate = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("SPARSE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_Sparse = atoi (szNum);
+        }
+        else if ( GetParam ("SPOOL_DIR", szBuffer, pszValue, sizeof (g_szSpoolDir), g_szSpoolDir));
+        else if ( GetParam ("SPOOL_MAX_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_SpoolMaxSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("SPOOL_MAX_FILES", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_SpoolMaxFiles = atoi (szNum);
+        }
+        else if ( GetParam ("PARALLEL_REPOS", szBuffer, pszValue, sizeof (g_szParallelRepos), g_szParallelRepos));
+        else if ( GetParam ("PARALLEL_ROUTING", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            if (0 == strcmp (szNum, "hash"))
+                g_Routing = ROUTING_HASH;
+            else if (0 == strcmp (szNum, "size"))
+                g_Routing = ROUTING_SIZE;
+            else
+            {
+                fprintf (stdout, "Warning - Invalid PARALLEL_ROUTING: [%s]\n", szNum);
+                ret++;
+            }
+        }
+        else if ( GetParam ("TEE_REPO", szBuffer, pszValue, sizeof (g_szTeeRepo), g_szTeeRepo));
+        else if ( GetParam ("TEE_MAX_LAG", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_TeeMaxLag = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("INCREMENTAL", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_Incremental = atoi (szNum);
+        }
+        else if ( GetParam ("INCREMENTAL_FULL_DAYS", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_IncrementalFullDays = atol (szNum);
+        }
+        else if ( GetParam ("DAOS_DEDUP", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_DaosDedup = atoi (szNum);
+        }
+        else if ( GetParam ("DAOS_FULL_DAYS", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_DaosFullDays = atol (szNum);
+        }
+        else if ( GetParam ("RESUME", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_Resume = atoi (szNum);
+        }
+        else if ( GetParam ("RESUME_MAX_HOURS", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ResumeMaxHours = atol (szNum);
+        }
+        else if ( GetParam ("TRANSLOG_COMMIT_SEC", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_TranslogCommitSec = atol (szNum);
+        }
+        else if ( GetParam ("TRANSLOG_REPO", szBuffer, pszValue, sizeof (g_szTranslogRepo), g_szTranslogRepo));
+        else if ( GetParam ("CHECKPOINT_INTERVAL", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_CheckpointInterval = atol (szNum);
+        }
+        else if ( GetParam ("SHARD_MAX_SIZE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ShardMaxSize = GetSizeValue (szNum);
+        }
+        else if ( GetParam ("SHARD_MAX_FILES", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_ShardMaxFiles = atol (szNum);
+        }
+        else if ( GetParam ("MANIFEST", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            g_Manifest = atoi (szNum);
+        }
+        else if ( GetParam ("HASH", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            if (0 == strcmp (szNum, "xxh3"))
+                g_HashType = HASH_TYPE_XXH3;
+            else if (0 == strcmp (szNum, "none"))
+                g_HashType = HASH_TYPE_NONE;
+            else
+            {
+                fprintf (stdout, "Warning - Invalid HASH: [%s]\n", szNum);
+                ret++;
+            }
+        }
+        else if ( GetParam ("HASH_IMPL", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            if (GetHashImpl (szNum) < -1)
+            {
+                fprintf (stdout, "Warning - Invalid HASH_IMPL: [%s]\n", szNum);
+                ret++;
+            }
+            else if (HashSetImpl (GetHashImpl (szNum)))
+            {
+                fprintf (stdout, "Warning - HASH_IMPL not supported by this CPU: [%s]\n", szNum);
+                ret++;
+            }
+        }
+        else if ( GetParam ("CGROUP_DIR", szBuffer, pszValue, sizeof (g_szCgroupDir), g_szCgroupDir));
+        else if ( GetProfileParam ("CHILD_", szBuffer, pszValue, &g_BackupProfile, &ret));
+        else if ( GetProfileParam ("PASSTHRU_", szBuffer, pszValue, &g_PassthruProfile, &ret));
+        else if ( GetParam ("TAR_MODE", szBuffer, pszValue, sizeof (szNum), szNum))
+        {
+            if (0 == strcmp (szNum, "native"))
+                g_TarMode = TAR_MODE_NATIVE;
+            else if (0 == strcmp (szNum, "tar"))
+                g_TarMode = TAR_MODE_EXTERNAL;
+            else
+            {
+                fprintf (stdout, "Warning - Invalid TAR_MODE: [%s]\n", szNum);
+                ret++;
+            }
+        }
 
         else
         {
@@ -2466,6 +13896,7 @@ int WriteDefaultConfig (const char *pszConfigFile)
     fprintf(fp, "# BORG_BASE_DIR=/local/backup/borg\n");
     fprintf(fp, "# BORG_RSH=ssh -p 123\n");
     fprintf(fp, "# SSH_KEYFILE=/home/borg/.ssh/id_ed25519\n");
+    fprintf(fp, "# TAR_MODE=native\n");
     fclose(fp);
 
     printf ("[OK] Configuration file created: %s\n", pszConfigFile);
@@ -2597,16 +14028,26 @@ void Usage()
 
     printf ("-i <name>        Info about a repository or archive (-info)\n");
     printf ("-l <archiv>      Lists a repository or archive (-list)\n");
+    printf ("-manifest <archiv> Prints the manifest of all files backed up into an archive\n");
     printf ("-b <archiv>      Start a backup specifying an archive\n");
+    printf ("-snapshot <list> Back up all files of a Domino snapshot file list into the archive specified with -b\n");
+    printf ("-translog        Transaction log mode for -b, file names and -q. Extents are committed in small archive parts within seconds\n");
+    printf ("                 -translog -b <archiv> <file> starts the translog daemon for the archive if needed and backs up the extent\n");
     printf ("-r <name>        Restore database\n");
     printf ("-t <name>        Specify restore target\n");
     printf ("-a <name>        Specify an archive\n");
     printf ("-o <name>        Specify a Borg repository\n");
     printf ("-w <minutes>     Timeout for waiting for backup completion (default: 60 minutes)\n");
     printf ("-q               Terminate a running backup sending an end marker file\n");
+    printf ("-status          Query the state of the running backup on its request socket (with -translog the translog daemon)\n");
     printf ("-prune <days>    Prunes archives older than specified number of days\n");
+    printf ("-ratelimit <rate> Change the rate limit of the running backup (e.g. 20M, 0 = unlimited, schedule = back to the configured schedule)\n");
     printf ("-delete          Deletes an archive\n");
     printf ("-GETPW           Used when invoking the binary as a password helper to get the password\n");
+    printf ("-bench <files>   Benchmark native tar stream against the tar binary and the I/O engines for the specified files\n");
+    printf ("-compression-probe [files] Sample the databases (default: COMPRESSION_PROBE_DIR) and recommend a BORG_COMPRESSION setting\n");
+    printf ("-estimate [files] Predict the new data and duration of the next backup from the chunk sketches of the last backups\n");
+    printf ("-chunker-probe <old> <new> Replay two versions of databases or directories through the CHUNKER_PROBE_CANDIDATES chunker params\n");
     printf ("-version         Print the version\n");
 
     printf ("\n[Borg passthru commands directly if enabled]\n");
@@ -2622,8 +14063,12 @@ int main (int argc, char *argv[])
     long TimeoutSec = 60*60;
     long PruneDays  = 0;
     bool bInitRepo  = false;
+    bool bTranslog  = false;
+    bool bStatus    = false;
 
     char szDefaultReqFile[MAX_PATH+1] = {0};
+    char szTranslogBackup[MAX_PATH+1] = {0};
+    char szTranslogArchiv[MAX_PATH+1] = {0};
 
     const char *pszFilename = NULL;
     const char *pszArchiv   = NULL;
@@ -2631,12 +14076,21 @@ int main (int argc, char *argv[])
     const char *pszRestore  = NULL;
     const char *pszTarget   = NULL;
     const char *pszDelete   = NULL;
+    const char *pszFileList = NULL;
+    const char *pszRateLimit = NULL;
     const char *pszReqFile  = szDefaultReqFile;
 
     struct passwd *pPasswdEntry = NULL;
 
+    pthread_mutexattr_t MutexAttr;
+
     umask (077);
 
+    pthread_mutexattr_init (&MutexAttr);
+    pthread_mutexattr_settype (&MutexAttr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init (&g_ChildMutex, &MutexAttr);
+    pthread_mutexattr_destroy (&MutexAttr);
+
     /* Get onw binary name in a secure way. Never trust arg[0] */
     len = readlink("/proc/self/exe", g_szExe, sizeof(g_szExe)-1);
 
@@ -2733,6 +14187,11 @@ int main (int argc, char *argv[])
 
     snprintf (g_szFilePID,      sizeof (g_szFilePID),      "%s/nshborg.pid",     g_szNshBorgDir);
     snprintf (g_szBorgLogFile,  sizeof (g_szBorgLogFile),  "%s/nshborg.log",     g_szNshBorgDir);
+    snprintf (g_szStateFile,    sizeof (g_szStateFile),    "%s/nshborg.state",   g_szNshBorgDir);
+    snprintf (g_szNloIndexFile, sizeof (g_szNloIndexFile), "%s/nshborg.nlo",     g_szNshBorgDir);
+    snprintf (g_szJournalFile,  sizeof (g_szJournalFile),  "%s/nshborg.journal", g_szNshBorgDir);
+    snprintf (g_szRateFile,     sizeof (g_szRateFile),     "%s/nshborg.rate",    g_szNshBorgDir);
+    snprintf (g_szSketchFile,   sizeof (g_szSketchFile),   "%s/nshborg.sketch",  g_szNshBorgDir);
     snprintf (g_szGetPwdFile,   sizeof (g_szGetPwdFile),   "%s/nshborg_pwd.log", g_szNshBorgDir);
     snprintf (szDefaultReqFile, sizeof (szDefaultReqFile), "%s/.nshborg.reg",    g_szNshBorgDir);
 
@@ -2742,6 +14201,9 @@ int main (int argc, char *argv[])
     {
         if (g_BorgPassthruAllowed)
         {
+            g_pChildProfile = &g_PassthruProfile;
+            ChildProfileSetup (&g_PassthruProfile, "passthru");
+
             printf ("Info: Running passthru command: %s\n", argv[1]);
             BorgBackupPassthru (argc, argv);
         }
@@ -2803,6 +14265,18 @@ int main (int argc, char *argv[])
             goto Done;
         }
 
+        else if (0 == strcmp (argv[consumed], "-manifest"))
+        {
+            consumed++;
+            if (consumed >= argc)
+                goto InvalidSyntax;
+            if (argv[consumed][0] == '-')
+                goto InvalidSyntax;
+
+            ret = BorgBackupManifest (argv[consumed]);
+            goto Done;
+        }
+
         else if (0 == strcmp (argv[consumed], "-z"))
         {
             consumed++;
@@ -2836,6 +14310,27 @@ int main (int argc, char *argv[])
             pszBackup = argv[consumed];
         }
 
+        else if (0 == strcmp (argv[consumed], "-translog"))
+        {
+            bTranslog = true;
+        }
+
+        else if (0 == strcmp (argv[consumed], "-status"))
+        {
+            bStatus = true;
+        }
+
+        else if (0 == strcmp (argv[consumed], "-snapshot"))
+        {
+            consumed++;
+            if (consumed >= argc)
+                goto InvalidSyntax;
+            if (argv[consumed][0] == '-')
+                goto InvalidSyntax;
+
+            pszFileList = argv[consumed];
+        }
+
         else if (0 == strcmp (argv[consumed], "-r"))
         {
             consumed++;
@@ -2896,6 +14391,45 @@ int main (int argc, char *argv[])
             goto Done;
         }
 
+        else if (0 == strcmp (argv[consumed], "-bench"))
+        {
+            consumed++;
+            ret = BenchmarkBackup (argc-consumed, argv+consumed);
+            goto Done;
+        }
+
+        else if (0 == strcmp (argv[consumed], "-compression-probe"))
+        {
+            consumed++;
+            ret = CompressionProbe (argc-consumed, argv+consumed);
+            goto Done;
+        }
+
+        else if (0 == strcmp (argv[consumed], "-estimate"))
+        {
+            consumed++;
+            ret = SketchEstimate (argc-consumed, argv+consumed);
+            goto Done;
+        }
+
+        else if (0 == strcmp (argv[consumed], "-chunker-probe"))
+        {
+            consumed++;
+            ret = ChunkerProbe (argc-consumed, argv+consumed);
+            goto Done;
+        }
+
+        else if (0 == strcmp (argv[consumed], "-ratelimit"))
+        {
+            consumed++;
+            if (consumed >= argc)
+                goto InvalidSyntax;
+            if (argv[consumed][0] == '-')
+                goto InvalidSyntax;
+
+            pszRateLimit = argv[consumed];
+        }
+
         else if (0 == strcmp (argv[consumed], "-delete"))
         {
             consumed++;
@@ -2935,17 +14469,66 @@ int main (int argc, char *argv[])
         consumed++;
     } /* while */
 
-    if (pszFilename)
+    /* The translog daemon runs next to the database backup with its own PID, log and request file */
+    if (bTranslog)
+    {
+        snprintf (g_szFilePID,      sizeof (g_szFilePID),      "%s/nshborg-translog.pid", g_szNshBorgDir);
+        snprintf (g_szBorgLogFile,  sizeof (g_szBorgLogFile),  "%s/nshborg-translog.log", g_szNshBorgDir);
+        snprintf (szDefaultReqFile, sizeof (szDefaultReqFile), "%s/.nshborg-translog.reg", g_szNshBorgDir);
+        snprintf (g_szRateFile,     sizeof (g_szRateFile),     "%s/nshborg-translog.rate", g_szNshBorgDir);
+
+        /* Translog archives are backed up and restored from their own repository */
+        if (*g_szTranslogRepo && pszBackup)
+        {
+            TranslogArchivName (pszBackup, szTranslogBackup, sizeof (szTranslogBackup));
+            pszBackup = szTranslogBackup;
+        }
+
+        if (*g_szTranslogRepo && pszArchiv)
+        {
+            TranslogArchivName (pszArchiv, szTranslogArchiv, sizeof (szTranslogArchiv));
+            pszArchiv = szTranslogArchiv;
+        }
+    }
+
+    /* The translog daemon has its own rate file */
+    if (pszRateLimit)
+    {
+        ret = RateLimitOverride (pszRateLimit);
+        goto Done;
+    }
+
+    if (bStatus)
+    {
+        ret = BackupStatus (pszReqFile);
+        goto Done;
+    }
+
+    /* With an archive the translog command starts the translog daemon */
+    if (pszFilename && ((false == bTranslog) || (NULL == pszBackup)))
     {
         ret = BackupFileToBorg (pszFilename, pszReqFile, TimeoutSec);
         goto Done;
     }
 
+    /* Everything below can start tar or borg */
+    ChildProfileSetup (&g_BackupProfile, "backup");
+
     if (*g_szSSHKey)
     {
         ret = PushToSSHAgent();
     }
 
+    if (pszFilename)
+    {
+        ret = TranslogDaemonStart (pszReqFile, pszBackup, TimeoutSec);
+
+        if (0 == ret)
+            ret = BackupFileToBorg (pszFilename, pszReqFile, TimeoutSec);
+
+        goto Done;
+    }
+
     if (bInitRepo)
     {
         ret = BorgBackupInitRepo (g_szBorgRepo);
@@ -2958,9 +14541,22 @@ int main (int argc, char *argv[])
         goto Done;
     }
 
+    if (pszBackup && pszFileList)
+    {
+        ret = BorgBackupStart (pszFileList, pszBackup, true, false);
+        goto Done;
+    }
+
     if (pszBackup)
     {
-        ret = BorgBackupStart (pszReqFile, pszBackup);
+        ret = BorgBackupStart (pszReqFile, pszBackup, false, bTranslog);
+        goto Done;
+    }
+
+    if (pszFileList)
+    {
+        printf ("Backup ERROR: A file list requires an archive (-b <archiv>)\n");
+        ret = 1;
         goto Done;
     }
 